@@ -204,6 +204,7 @@
         pthread_t thread;
         int is_thread;
         sem_t semaphore;
+        int is_continuous;          // the server sends updates without requests
     };
 #endif //ENABLE_RFB
 
@@ -27,6 +27,15 @@
 
 #define RFB_SECURITY_NONE 1
 
+// the fence asks for the reply, the client handles messages in order, so it keeps flags
+// of blocking and clears SyncNext
+#define RFB_FENCE_BLOCK_BEFORE 1
+#define RFB_FENCE_BLOCK_AFTER 2
+#define RFB_FENCE_REQUEST 0x80000000
+#define RFB_FENCE_PAYLOAD_BYTES 64
+// the update has the rectangle per slice of the frame
+#define RFB_MAX_RECTANGLES 256
+
 extern struct app_state_t app;
 extern struct filter_t filters[MAX_FILTERS];
 extern int is_aborted;
@@ -37,14 +46,18 @@ enum rfb_request_enum {
     RFBFramebufferUpdateRequest = 3,
     RFBKeyEvent = 4,
     RFBPointerEvent = 5,
-    RFBClientCutText = 6
+    RFBClientCutText = 6,
+    RFBEnableContinuousUpdates = 150,
+    RFBClientFence = 248
 };
 
 enum rfb_response_enum {
     RFBFramebufferUpdateResponse = 0,
     RFBSetColorMapEntries = 1,
     RFBBell = 2,
-    RFBServerCutText = 3
+    RFBServerCutText = 3,
+    RFBEndOfContinuousUpdates = 150,
+    RFBServerFence = 248
 };
 
 enum rfb_encoding_enum {
@@ -56,6 +69,8 @@ enum rfb_encoding_enum {
     RFBZRLE = 16,
     RFBCursorPseudoEncoding = -239,
     RFBDesktopSizePseudoEncoding = -223,
+    RFBFencePseudoEncoding = -312,
+    RFBContinuousUpdatesPseudoEncoding = -313,
     RFBEncodingH264 = 0x48323634
 };
 
@@ -88,6 +103,13 @@ struct rfb_server_init_message_t {
 };
 
 // RFB requests messages
+struct rfb_set_encodings_request_message_t {
+    uint8_t type;
+    uint8_t padding;
+    uint16_t count;
+    int32_t encodings[3];
+};
+
 struct rfb_buffer_update_request_message_t {
     uint8_t type;
     uint8_t temp;
@@ -102,6 +124,10 @@ struct rfb_buffer_update_response_message_t {
     uint8_t message_type;
     uint8_t padding;
     uint16_t number_of_rectangles;
+};
+
+// the server sends every slice of the frame as own rectangle as soon as it's encoded
+struct rfb_rectangle_message_t {
     uint16_t x;
     uint16_t y;
     uint16_t width;
@@ -109,13 +135,83 @@ struct rfb_buffer_update_response_message_t {
     uint32_t encoding_type;
 };
 
-static void *rfb_function(void* data)
+// receives NAL units of the rectangle and decodes them before the rest of the frame comes
+static int rfb_receive_rectangle()
 {
-    DEBUG_MSG("INFO: RFB thread has been started\n");
+    struct rfb_rectangle_message_t rectangle;
+    NETWORK_IO_CALL(
+        recv(app.rfb.socket, (char *)&rectangle, sizeof(rectangle), MSG_WAITALL),
+        error);
 
-    //wait frame from network
-    CALL(sem_wait(&app.rfb.semaphore), error);
+    // validate
+    if (ntohs(rectangle.x) != 0
+        || ntohs(rectangle.y) + ntohs(rectangle.height) > app.server_height
+        || ntohs(rectangle.width) != app.server_width
+        || ntohl(rectangle.encoding_type) != RFBEncodingH264) {
+
+        DEBUG_MSG("ERROR: rectangle isn't valid: x: %d, y: %d,"
+            " width: %d, height: %d, encoding_type: %lx\n",
+            ntohs(rectangle.x),
+            ntohs(rectangle.y),
+            ntohs(rectangle.width),
+            ntohs(rectangle.height),
+            ntohl(rectangle.encoding_type));
+
+        goto error;
+    }
 
+    uint32_t length;
+    NETWORK_IO_CALL(
+        recv(app.rfb.socket, (char *)&length, sizeof(length), MSG_WAITALL),
+        error);
+
+    // validate
+    if (ntohl(length) >= app.server_width * app.server_height) {
+        fprintf(stderr,
+            "ERROR: H264 buffer is too big: length: %ld\n",
+            ntohl(length));
+
+        goto error;
+    }
+
+    // the slice which the server hasn't encoded
+    app.enc_buf_length = ntohl(length);
+    if (app.enc_buf_length == 0)
+        return 0;
+
+    NETWORK_IO_CALL(
+        recv(app.rfb.socket, (char *)app.enc_buf, app.enc_buf_length, MSG_WAITALL),
+        error);
+
+    uint8_t *buffer = app.enc_buf;
+    int len = app.enc_buf_length;
+    for (int i = 0; i < MAX_FILTERS && filters[i].context != NULL; i++) {
+        struct filter_t *filter = filters + i;
+        if (!filter->is_started())
+            CALL(filter->start(VIDEO_FORMAT_H264, VIDEO_FORMAT_GRAYSCALE), error);
+        CALL(filter->process(buffer, len), error);
+        buffer = filter->get_buffer(NULL, &len);
+        if (len == 0) {
+            DEBUG_MSG("The filter[%s] doesn't have buffer yet", filter->name);
+            break;
+        }
+        else {
+            DEBUG_MSG("buffer has been received from filter[%s], length: %d!!!", filter->name, len);
+        }
+        break;
+    }
+#ifdef ENABLE_H264
+    CALL(h264_decode(), error);
+#endif //ENABLE_H264
+
+    return 0;
+
+error:
+    return -1;
+}
+
+static int rfb_send_update_request()
+{
     struct rfb_buffer_update_request_message_t update_request = {
         .type = RFBFramebufferUpdateRequest,
         .temp = 0,
@@ -124,97 +220,164 @@ static void *rfb_function(void* data)
         .width = htons(app.server_width),
         .height = htons(app.server_height)
     };
+    NETWORK_IO_CALL(
+        send(app.rfb.socket, (char *)&update_request, sizeof(update_request), 0),
+        error);
+    return 0;
+
+error:
+    return -1;
+}
+
+// the server which supports continuous updates sends frames without requests, it replies
+// by fences to measure the round trip
+static int rfb_send_encodings()
+{
+    struct rfb_set_encodings_request_message_t encodings = {
+        .type = RFBSetEncodings,
+        .padding = 0,
+        .count = htons(3),
+        .encodings = {
+            htonl(RFBEncodingH264),
+            htonl(RFBContinuousUpdatesPseudoEncoding),
+            htonl(RFBFencePseudoEncoding)
+        }
+    };
+    NETWORK_IO_CALL(
+        send(app.rfb.socket, (char *)&encodings, sizeof(encodings), 0),
+        error);
+    return 0;
 
+error:
+    return -1;
+}
+
+// receives all rectangles of the update and renders the picture, the type of the message
+// has been received already
+static int rfb_receive_update()
+{
     struct rfb_buffer_update_response_message_t update_response;
-    
-    while (!is_aborted) {
-        // DEBUG_MSG("new slice has been requiested: %d:%d",
-        //     ntohs(update_request.width), ntohs(update_request.height));
+    NETWORK_IO_CALL(
+        recv(app.rfb.socket, (char *)&update_response + 1, sizeof(update_response) - 1,
+            MSG_WAITALL),
+        error);
 
-        NETWORK_IO_CALL(
-            send(app.rfb.socket, (char *)&update_request, sizeof(update_request), 0),
-            error);
+    // validate
+    if (ntohs(update_response.number_of_rectangles) < 1
+        || ntohs(update_response.number_of_rectangles) > RFB_MAX_RECTANGLES) {
 
-        NETWORK_IO_CALL(
-            recv(app.rfb.socket, (char *)&update_response, sizeof(update_response), 0),
-            error);
+        DEBUG_MSG("ERROR: RFBFramebufferUpdate response isn't valid: number_of_rectangles: %d\n",
+            ntohs(update_response.number_of_rectangles));
 
-        // validate
-        if (update_response.message_type != RFBFramebufferUpdateResponse
-            || ntohs(update_response.number_of_rectangles) != 1
-            || ntohs(update_response.x) != 0
-            || ntohs(update_response.y) != 0
-            || ntohs(update_response.width) != app.server_width
-            || ntohs(update_response.height) != app.server_height
-            || ntohl(update_response.encoding_type) != RFBEncodingH264) {
-
-            DEBUG_MSG("ERROR: RFBFramebufferUpdate response isn't valid: message_type: %d,"
-                " width: %d, height: %d, encoding_type: %lx\n",
-                update_response.message_type,
-                ntohs(update_response.width),
-                ntohs(update_response.height),
-                ntohl(update_response.encoding_type));
+        goto error;
+    }
 
-            goto error;
-        }
+    for (int r = 0; r < ntohs(update_response.number_of_rectangles); r++) {
+        CALL(rfb_receive_rectangle(), error);
+    }
 
-        uint32_t length;
-        NETWORK_IO_CALL(
-            recv(app.rfb.socket, (char *)&length, sizeof(length), 0),
-            error);
+#ifdef ENABLE_D3D
+    CALL(d3d_render_image(), error);
+#endif //ENABLE_D3D
 
-        // validate
-        if (ntohl(length) >= app.server_width * app.server_height) {
-            fprintf(stderr,
-                "ERROR: H264 buffer is too big: length: %ld\n",
-                ntohl(length));
+    return 0;
 
-            goto error;
-        }
+error:
+    return -1;
+}
+
+// the server announces continuous updates by the end of them, the next end means that
+// the server doesn't send them anymore
+static int rfb_receive_end_of_continuous_updates()
+{
+    if (app.rfb.is_continuous) {
+        DEBUG_MSG("INFO: continuous updates have been stopped by the server\n");
+        app.rfb.is_continuous = 0;
+        return rfb_send_update_request();
+    }
+
+    uint8_t enable_message[10] = { RFBEnableContinuousUpdates, 1 };
+    uint16_t width = htons(app.server_width), height = htons(app.server_height);
+    memcpy(enable_message + 6, &width, sizeof(width));
+    memcpy(enable_message + 8, &height, sizeof(height));
+    NETWORK_IO_CALL(
+        send(app.rfb.socket, (char *)enable_message, sizeof(enable_message), 0),
+        error);
+    app.rfb.is_continuous = 1;
+    if (app.verbose) {
+        DEBUG_MSG("INFO: continuous updates have been enabled\n");
+    }
+    return 0;
+
+error:
+    return -1;
+}
+
+// the fence of the server is returned with the same payload
+static int rfb_receive_fence()
+{
+    uint8_t message[8 + RFB_FENCE_PAYLOAD_BYTES];
+    NETWORK_IO_CALL(recv(app.rfb.socket, (char *)message, 8, MSG_WAITALL), error);
+    uint32_t flags;
+    memcpy(&flags, message + 3, sizeof(flags));
+    flags = ntohl(flags);
+    int length = message[7];
+    if (length > RFB_FENCE_PAYLOAD_BYTES) {
+        DEBUG_MSG("ERROR: fence payload is too big: length: %d\n", length);
+        goto error;
+    }
+    if (length > 0) {
+        NETWORK_IO_CALL(recv(app.rfb.socket, (char *)message + 8, length, MSG_WAITALL), error);
+    }
+    if (!(flags & RFB_FENCE_REQUEST))
+        return 0;
+
+    uint8_t reply[9 + RFB_FENCE_PAYLOAD_BYTES] = { RFBClientFence };
+    uint32_t reply_flags = htonl(flags & (RFB_FENCE_BLOCK_BEFORE | RFB_FENCE_BLOCK_AFTER));
+    memcpy(reply + 4, &reply_flags, sizeof(reply_flags));
+    reply[8] = length;
+    memcpy(reply + 9, message + 8, length);
+    NETWORK_IO_CALL(send(app.rfb.socket, (char *)reply, 9 + length, 0), error);
+    return 0;
+
+error:
+    return -1;
+}
+
+static void *rfb_function(void* data)
+{
+    DEBUG_MSG("INFO: RFB thread has been started\n");
 
-        app.enc_buf_length = ntohl(length);
+    //wait frame from network
+    CALL(sem_wait(&app.rfb.semaphore), error);
 
-        int res = 0;
+    app.rfb.is_continuous = 0;
+    CALL(rfb_send_encodings(), error);
+    CALL(rfb_send_update_request(), error);
+
+    while (!is_aborted) {
+        uint8_t message_type;
         NETWORK_IO_CALL(
-            res = recv(app.rfb.socket, (char *)app.enc_buf, app.enc_buf_length, MSG_WAITALL),
+            recv(app.rfb.socket, (char *)&message_type, sizeof(message_type), MSG_WAITALL),
             error);
 
-        // uint8_t * t = app.enc_buf;
-        // uint8_t t1 = t[0];
-        // uint8_t t2 = t[1];
-        // uint8_t t3 = t[2];
-        // uint8_t t4 = t[3];
-        // DEBUG_MSG("Bytes received: %d, %x %x %x %x ...",
-        //     res,
-        //     t1,
-        //     t2,
-        //     t3,
-        //     t4);
-
-        uint8_t *buffer = app.enc_buf;
-        int len = app.enc_buf_length;
-        for (int i = 0; i < MAX_FILTERS && filters[i].context != NULL; i++) {
-            struct filter_t *filter = filters + i;
-            if (!filter->is_started())
-                CALL(filter->start(VIDEO_FORMAT_H264, VIDEO_FORMAT_GRAYSCALE), error);
-            CALL(filter->process(buffer, len), error);
-            buffer = filter->get_buffer(NULL, &len);
-            if (len == 0) {
-                DEBUG_MSG("The filter[%s] doesn't have buffer yet", filter->name);
-                break;
+        if (message_type == RFBFramebufferUpdateResponse) {
+            CALL(rfb_receive_update(), error);
+            // the server sends the next update without the request
+            if (!app.rfb.is_continuous) {
+                CALL(rfb_send_update_request(), error);
             }
-            else {
-                DEBUG_MSG("buffer has been received from filter[%s], length: %d!!!", filter->name, len);
-            }
-            break;
         }
-#ifdef ENABLE_H264
-        CALL(h264_decode(), error);
-#endif //ENABLE_H264
-
-#ifdef ENABLE_D3D
-        CALL(d3d_render_image(), error);
-#endif //ENABLE_D3D
+        else if (message_type == RFBEndOfContinuousUpdates) {
+            CALL(rfb_receive_end_of_continuous_updates(), error);
+        }
+        else if (message_type == RFBServerFence) {
+            CALL(rfb_receive_fence(), error);
+        }
+        else {
+            DEBUG_MSG("ERROR: message isn't supported: message_type: %d\n", message_type);
+            goto error;
+        }
     }
 
     DEBUG_MSG("INFO: rfb_function is_aborted: %d\n", is_aborted);
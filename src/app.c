@@ -17,22 +17,28 @@
 // Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "klist.h"
+#include "kthread.h"
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
+#include "calibration.h"
 
 extern struct app_state_t app;
 extern struct input_t input;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 extern struct output_t outputs[MAX_OUTPUTS];
 extern struct extension_t extensions[MAX_EXTENSIONS];
+extern int is_aborted;
 
 const char *video_formats[] = {
     VIDEO_FORMAT_UNKNOWN_STR,
     VIDEO_FORMAT_YUYV_STR,
     VIDEO_FORMAT_YUV422_STR,
     VIDEO_FORMAT_YUV444_STR,
-    VIDEO_FORMAT_H264_STR
+    VIDEO_FORMAT_H264_STR,
+    VIDEO_FORMAT_I420_STR,
+    VIDEO_FORMAT_NV12_STR
 };
 
 const char *video_outputs[] = {
@@ -70,6 +76,19 @@ error:
     return NULL;
 }
 
+int app_get_video_format_int(const char* format)
+{
+    ASSERT_PTR(format, !=, NULL, error);
+    for (int i = 1; i < ARRAY_SIZE(video_formats); i++)
+        if (strcmp(video_formats[i], format) == 0)
+            return i;
+    return 0;
+
+error:
+    errno = EINVAL;
+    return -1;
+}
+
 int app_get_video_output_int(const char* output)
 {
     ASSERT_PTR(output, !=, NULL, error);
@@ -105,8 +124,17 @@ void app_set_default_state()
 {
     app.video_width = utils_read_int_value(VIDEO_WIDTH, VIDEO_WIDTH_DEF);
     app.video_height = utils_read_int_value(VIDEO_HEIGHT, VIDEO_HEIGHT_DEF);
+    app.video_input = utils_read_str_value(VIDEO_INPUT, VIDEO_INPUT_DEF);
     const char *output = utils_read_str_value(VIDEO_OUTPUT, VIDEO_OUTPUT_DEF);
     app.video_output = app_get_video_output_int(output);
+    app.video_buffers = utils_read_int_value(VIDEO_BUFFERS, VIDEO_BUFFERS_DEF);
+    app.pipeline_threads = utils_read_int_value(PIPELINE_THREADS, PIPELINE_THREADS_DEF);
+    app.bands = utils_read_int_value(BANDS, BANDS_DEF);
+    app.band_threads = utils_read_int_value(BAND_THREADS, BAND_THREADS_DEF);
+    app.calibration = utils_read_int_value(CALIBRATION, CALIBRATION_DEF);
+    app.calibration_path = utils_read_str_value(CALIBRATION_PATH, CALIBRATION_PATH_DEF);
+    app.h264_bitrate = utils_read_int_value(H264_BITRATE, H264_BITRATE_DEF);
+    app.h264_slices = utils_read_int_value(H264_SLICES, H264_SLICES_DEF);
     app.port = utils_read_int_value(PORT, PORT_DEF);
     app.worker_width = utils_read_int_value(WORKER_WIDTH, WORKER_WIDTH_DEF);
     app.worker_height = utils_read_int_value(WORKER_HEIGHT, WORKER_HEIGHT_DEF);
@@ -123,8 +151,17 @@ void app_set_default_state()
 
 void app_construct()
 {
+    int is_mmal_camera = 0;
+#ifdef MMAL_ENCODER
+    // the camera of Raspberry Pi feeds the encoder by the GPU
+    is_mmal_camera = strcmp(app.video_input, VIDEO_INPUT_MMAL_STR) == 0;
+    if (is_mmal_camera)
+        mmal_camera_construct();
+#endif //MMAL_ENCODER
+
 #ifdef V4L
-    v4l_construct();
+    if (!is_mmal_camera)
+        v4l_construct();
 #endif //V4L
 
     yuv_converter_construct();
@@ -134,6 +171,10 @@ void app_construct()
 #elif MMAL_ENCODER
     mmal_encoder_construct();
 #endif
+#ifdef SOFTWARE_ENCODER
+    // hardware encoders are cheaper, so the software one is chosen only without them
+    h264_encoder_construct();
+#endif //SOFTWARE_ENCODER
 
     if ((app.video_output & VIDEO_OUTPUT_FILE) == VIDEO_OUTPUT_FILE)
         file_construct();
@@ -153,6 +194,64 @@ void app_construct()
 #endif //CONTROL
 }
 
+struct app_job_t {
+    int ready[MAX_OUTPUTS];
+    int ready_count;
+    int idle[MAX_OUTPUTS];
+    int start_format;
+    int res;
+    int is_pipelined;       // steps of the job run on threads of the pipeline
+    // every stage holds a reference to its frame until all outputs are processed, the output
+    // has the stage of the input and a stage for every filter of its path
+    struct frame_t **stages[MAX_OUTPUTS];
+};
+
+// the job which is used by sequential processing
+static struct app_job_t app_job;
+
+static void app_release_stages(struct app_job_t *job)
+{
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
+        if (!job->stages[i])
+            continue;
+        for (int k = 0; k <= kv_size(outputs[i].filters); k++)
+            if (job->stages[i][k]) {
+                CALL(frame_unref(job->stages[i][k]));
+                job->stages[i][k] = NULL;
+            }
+    }
+}
+
+static void app_destroy_job(struct app_job_t *job)
+{
+    app_release_stages(job);
+    for (int i = 0; i < MAX_OUTPUTS; i++)
+        if (job->stages[i]) {
+            free(job->stages[i]);
+            job->stages[i] = NULL;
+        }
+}
+
+static int app_init_job(struct app_job_t *job)
+{
+    memset(job, 0, sizeof(*job));
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
+        int len = kv_size(outputs[i].filters) + 1;
+        job->stages[i] = calloc(len, sizeof(struct frame_t *));
+        if (job->stages[i] == NULL) {
+            CALL_MESSAGE(calloc(len, sizeof(struct frame_t *)));
+            goto cleanup;
+        }
+    }
+    return 0;
+
+cleanup:
+    app_destroy_job(job);
+    if (errno == 0)
+        errno = ENOMEM;
+    return -1;
+}
+
 void app_cleanup()
 {
     for (int i = 0; i < MAX_EXTENSIONS && extensions[i].context != NULL; i++) {
@@ -161,200 +260,172 @@ void app_cleanup()
     for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
         outputs[i].cleanup();
     }
-    for (int i = 0; i < MAX_FILTERS && filters[i].context != NULL; i++) {
-        if (filters[i].is_started()) {
-            CALL(filters[i].stop())
+    // the input can feed filters by itself, so it's stopped first
+    if (input.is_started()) CALL(input.stop());
+    for (int i = 0; i < kv_size(filters); i++) {
+        struct filter_t *filter = kv_A(filters, i);
+        if (filter->is_started()) {
+            CALL(filter->stop())
         }
-        filters[i].cleanup();
+        filter->cleanup();
     }
-    if (input.is_started()) CALL(input.stop());
     input.cleanup();
+
+    app_destroy_job(&app_job);
+    calibration_cleanup();
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
+        kv_destroy(outputs[i].filters);
+        kv_init(outputs[i].filters);
+        outputs[i].start_format = 0;
+    }
 }
 
-#define BFS_NODE_FREE(x)
-struct bfs_node_t {
-    int index;
-    int distance;
+struct path_node_t {
+    int cost;           // cost of the cheapest known path to the node, -1 if it isn't reached
+    int prev;           // previous node of the path
+    int is_visited;
 };
-KLIST_INIT(bfs_qeue_t, struct bfs_node_t, BFS_NODE_FREE)
 
-static int find_path(
-    const struct format_mapping_t* in_f,
-    const struct format_mapping_t* out_f,
-    struct output_t* output)
+// the node is a frame with the format produced by the input (0) or the filter (index + 1)
+#define PATH_NODE(producer, format) ((producer) * formats_len + (format))
+
+static int app_get_filter_cost(struct filter_t *filter, int in_format, int out_format)
+{
+    int cost = calibration_get_cost(filter, in_format, out_format);
+    if (cost >= 0)
+        return cost;
+    if (filter->get_cost)
+        return filter->get_cost(in_format, out_format);
+    return app.video_width * app.video_height * FILTER_COST_PIXEL * FILTER_COST_BYTE;
+}
+
+static int app_is_format_supported(const struct format_mapping_t* fs, int fs_len, int format)
 {
-    int matrix_len = MAX_FILTERS + 2;
-    int bfs_adjacency_matrix[MAX_FILTERS + 2][MAX_FILTERS + 2];
-    memset(*bfs_adjacency_matrix, 0, sizeof(bfs_adjacency_matrix));
-    //DEBUG("bfs_adjacency_matrix: %lu", sizeof(bfs_adjacency_matrix));
+    for (int i = 0; i < fs_len; i++)
+        if (fs[i].is_supported && fs[i].format == format)
+            return 1;
+    return 0;
+}
 
-    if (in_f->format == out_f->format) {
-        bfs_adjacency_matrix[0][matrix_len - 1] = in_f->format;
+// filters keep a state of one conversion, so a filter can appear only once in a path
+static int app_is_on_path(struct path_node_t *nodes, int node, int producer, int formats_len)
+{
+    while (node != -1) {
+        if (node / formats_len == producer)
+            return 1;
+        node = nodes[node].prev;
     }
+    return 0;
+}
 
-    for (int i = 0; i < MAX_FILTERS && filters[i].context != NULL; i++) {
-        const struct format_mapping_t* fin_fs = NULL;
-        int fin_fs_len = filters[i].get_in_formats(&fin_fs);
-        const struct format_mapping_t* fout_fs = NULL;
-        int fout_fs_len = filters[i].get_out_formats(&fout_fs);
+// looks for the cheapest chain of filters from any format of the input to any format
+// of the output by Dijkstra's algorithm, the output doesn't have start format if
+// the chain doesn't exist
+static int find_path(
+    const struct format_mapping_t* in_fs,
+    int in_fs_len,
+    const struct format_mapping_t* out_fs,
+    int out_fs_len,
+    struct output_t* output)
+{
+    int formats_len = ARRAY_SIZE(video_formats);
+    int filters_len = kv_size(filters);
+    int nodes_len = (filters_len + 1) * formats_len;
+    struct path_node_t *nodes = malloc(nodes_len * sizeof(struct path_node_t));
+    if (nodes == NULL) {
+        CALL_MESSAGE(malloc(nodes_len * sizeof(struct path_node_t)));
+        goto cleanup;
+    }
+    for (int i = 0; i < nodes_len; i++) {
+        nodes[i].cost = -1;
+        nodes[i].prev = -1;
+        nodes[i].is_visited = 0;
+    }
+    for (int i = 0; i < in_fs_len; i++) {
+        ASSERT_INT(in_fs[i].format, <, formats_len, cleanup);
+        if (in_fs[i].is_supported)
+            nodes[PATH_NODE(0, in_fs[i].format)].cost = 0;
+    }
 
-        for (int ii = 0; ii < fin_fs_len; ii++) {
-            const struct format_mapping_t* fin_f = fin_fs + ii;
-            if (!fin_f->is_supported)
-                continue;
-            if (fin_f->format == in_f->format) {
-                bfs_adjacency_matrix[0][i + 1] = in_f->format;
-            }
+    int target = -1;
+    while (target == -1) {
+        // graphs are small, so the closest node is found by linear search
+        int node = -1;
+        for (int i = 0; i < nodes_len; i++)
+            if (!nodes[i].is_visited && nodes[i].cost != -1 &&
+                (node == -1 || nodes[i].cost < nodes[node].cost))
+                node = i;
+        if (node == -1)
+            break;
 
-            //try to connect another output format of filter(j) to current input format of filter(i)
-            for (int j = 0; j < MAX_FILTERS && filters[j].context; j++) {
-                if (j == i)
-                    continue; //skip current filter
-                const struct format_mapping_t* ffout_fs = NULL;
-                int ffout_fs_len = filters[j].get_out_formats(&ffout_fs);
-                for (int jj = 0; jj < ffout_fs_len; jj++) {
-                    const struct format_mapping_t* ffout_f = ffout_fs + jj;
-                    if (!ffout_f->is_supported)
-                        continue;
-
-                    // if (i == 1) {
-                    //     DEBUG("%s in[%s], other out[%s]",
-                    //         filters[i].name,
-                    //         app_get_video_format_str(fin_f->format),
-                    //         app_get_video_format_str(ffout_f->format));
-                    // }
-
-                    if (fin_f->format == ffout_f->format) {
-                        bfs_adjacency_matrix[j + 1][i + 1] = ffout_f->format;
-                    }
-                }
-            }
+        nodes[node].is_visited = 1;
+        int format = node % formats_len;
+        if (app_is_format_supported(out_fs, out_fs_len, format)) {
+            target = node;
+            break;
         }
 
-        for (int ii = 0; ii < fout_fs_len; ii++) {
-            const struct format_mapping_t* fout_f = fout_fs + ii;
-            if (!fout_f->is_supported)
+        for (int j = 0; j < filters_len; j++) {
+            struct filter_t *filter = kv_A(filters, j);
+            if (app_is_on_path(nodes, node, j + 1, formats_len))
                 continue;
-            if (out_f->format == fout_f->format) {
-                bfs_adjacency_matrix[i + 1][matrix_len - 1] = out_f->format;
-            }
 
-            //try to connect current output format of filter(i) to another input format of filter(j)
-            for (int j = 0; j < MAX_FILTERS && filters[j].context != NULL; j++) {
-                if (j == i)
-                    continue; //skip current filter
-
-                const struct format_mapping_t* ffin_fs = NULL;
-                int ffin_fs_len = filters[j].get_in_formats(&ffin_fs);
-                for (int jj = 0; jj < ffin_fs_len; jj++) {
-                    const struct format_mapping_t* ffin_f = ffin_fs + jj;
-                    if (!ffin_fs->is_supported)
-                        continue;
-
-                    // if (i == 1) {
-                    //     DEBUG("%s out[%s], other in[%s]",
-                    //         filters[i].name,
-                    //         app_get_video_format_str(fout_f->format),
-                    //         app_get_video_format_str(ffin_f->format));
-                    // }
-                    if (fout_f->format == ffin_f->format) {
-                        bfs_adjacency_matrix[i + 1][j + 1] = fout_f->format;
-                    }
-                }
-            }
-        }
-    }
+            const struct format_mapping_t* fin_fs = NULL;
+            int fin_fs_len = filter->get_in_formats(&fin_fs);
+            if (!app_is_format_supported(fin_fs, fin_fs_len, format))
+                continue;
 
-    // if (app.verbose) {
-    //     char buffer[MAX_STRING], tmp[MAX_STRING];;
-
-    //     DEBUG("adjacency matrix for input(%s) and output(%s)",
-    //         app_get_video_format_str(in_f->format),
-    //         app_get_video_format_str(out_f->format)
-    //     );
-    //     for (int i = 0; i < MAX_FILTERS + 2; i++) {
-    //         if (i == 0) {
-    //             strcpy(buffer, "in:\t\t|");
-    //         }
-    //         else if (i == MAX_FILTERS + 1) {
-    //             strcpy(buffer, "out:\t\t|");
-    //         }
-    //         else {
-    //             if (i - 1 < MAX_FILTERS && filters[i - 1].context != NULL) {
-    //                 strcpy(buffer, filters[i - 1].name);
-    //                 strcat(buffer, "\t|");
-    //             } else {
-    //                 strcpy(buffer, "\t\t\t|");
-    //             }
-    //         }
-    //         for (int j = 0; j < MAX_FILTERS + 2; j++) {
-    //             if (bfs_adjacency_matrix[i][j] > 0) {
-    //                 sprintf(tmp, "%s\t|", app_get_video_format_str(bfs_adjacency_matrix[i][j]));
-    //                 strcat(buffer, tmp);
-    //             }
-    //             else
-    //                 strcat(buffer, "\t|");
-                
-    //         }
-    //         DEBUG("%s", buffer);
-    //     }
-    // }
-
-    //Breadth-First-Search (BFS)
-    int distance = -1;
-    KLIST_T(bfs_qeue_t) *bfs_qeue = KL_INIT(bfs_qeue_t);
-    struct bfs_node_t node = {
-        .index = 0,
-        .distance = 0
-    };
-    *KL_PUSHP(bfs_qeue_t, bfs_qeue) = node;
-    int bfs_path[MAX_FILTERS + 2];
-    memset(bfs_path, 0, sizeof(bfs_path));
-    bfs_path[node.index] = distance;
-
-    while (bfs_qeue->size > 0 && distance < 0) {
-        KL_SHIFT(bfs_qeue_t, bfs_qeue, &node);
-        for (int i = 0; i < matrix_len; i++) {
-            if (bfs_adjacency_matrix[node.index][i] > 0) {
-                if (bfs_path[i])
+            const struct format_mapping_t* fout_fs = NULL;
+            int fout_fs_len = filter->get_out_formats(&fout_fs);
+            for (int jj = 0; jj < fout_fs_len; jj++) {
+                const struct format_mapping_t* fout_f = fout_fs + jj;
+                if (!fout_f->is_supported)
                     continue;
+                ASSERT_INT(fout_f->format, <, formats_len, cleanup);
 
-                if (i == matrix_len - 1) {
-                    int d = distance = node.distance;
-                    if (d > 0) {
-                        d--;
-                        output->filters[d].out_format = bfs_adjacency_matrix[node.index][i];
-                        output->filters[d].index = node.index - 1;
-                    }
-                    while (d > 0) {
-                        // find previous filter
-                        for (int j = 1; j < ARRAY_SIZE(bfs_path); j++) {
-                            if (bfs_path[j] == d) {
-                                output->filters[d - 1].out_format
-                                    = bfs_adjacency_matrix[j][output->filters[d].index + 1];
-                                output->filters[d - 1].index = j - 1;
-                                break;
-                            }
-                        }
-                        d--;
-                    }
-                    output->start_format = in_f->format;
-                    break;
-                }
+                int next = PATH_NODE(j + 1, fout_f->format);
+                int cost = app_get_filter_cost(filter, format, fout_f->format);
+                if (nodes[next].is_visited || cost < 0)
+                    continue; // the filter doesn't support the conversion
 
-                struct bfs_node_t next = {
-                    .index = i,
-                    .distance = node.distance + 1
-                };
-                *KL_PUSHP(bfs_qeue_t, bfs_qeue) = next;
-                bfs_path[i] = next.distance;
+                cost += nodes[node].cost;
+                if (nodes[next].cost == -1 || cost < nodes[next].cost) {
+                    nodes[next].cost = cost;
+                    nodes[next].prev = node;
+                }
             }
         }
     }
 
-    //DEBUG("distance: %d", distance);
-    KL_DESTROY(bfs_qeue_t, bfs_qeue);
-    return distance;
+    kv_size(output->filters) = 0;
+    output->start_format = 0;
+    output->cost = -1;
+    if (target != -1) {
+        int len = 0;
+        for (int node = target; nodes[node].prev != -1; node = nodes[node].prev)
+            len++;
+        kv_resize(struct filter_reference_t, output->filters, len);
+        ASSERT_PTR(output->filters.a, !=, NULL, cleanup);
+        kv_size(output->filters) = len;
+
+        int node = target;
+        for (int k = len - 1; k >= 0; k--) {
+            kv_A(output->filters, k).out_format = node % formats_len;
+            kv_A(output->filters, k).index = node / formats_len - 1;
+            node = nodes[node].prev;
+        }
+        output->start_format = node % formats_len;
+        output->cost = nodes[target].cost;
+    }
+    free(nodes);
+    return 0;
+
+cleanup:
+    if (nodes)
+        free(nodes);
+    if (errno == 0)
+        errno = ENOMEM;
+    return -1;
 }
 
 int app_init()
@@ -367,9 +438,9 @@ int app_init()
         CALL(outputs[i].init(), error);
     }
         
-    for (int i = 0; i < MAX_FILTERS && filters[i].context != NULL; i++) {
-        //DEBUG("filters[%s].init...", filters[i].name);
-        CALL(filters[i].init(), error);
+    for (int i = 0; i < kv_size(filters); i++) {
+        //DEBUG("filters[%s].init...", kv_A(filters, i)->name);
+        CALL(kv_A(filters, i)->init(), error);
     }
 
     for (int i = 0; i < MAX_EXTENSIONS && extensions[i].context != NULL; i++) {
@@ -377,6 +448,9 @@ int app_init()
         CALL(extensions[i].init(), error);
     }
 
+    if (app.calibration)
+        CALL(calibration_init(), error);
+
     const struct format_mapping_t* in_fs = NULL;
     int in_fs_len = input.get_formats(&in_fs);
     if (app.verbose) {
@@ -394,10 +468,11 @@ int app_init()
         }
         DEBUG("input[%s]: %s", input.name, buffer1);
 
-        for (int i = 0; i < MAX_FILTERS && filters[i].context != NULL; i++) {
+        for (int i = 0; i < kv_size(filters); i++) {
+            struct filter_t *filter = kv_A(filters, i);
             buffer1[0] = '\0';
             const struct format_mapping_t* fin_fs = NULL;
-            int fin_fs_len = filters[i].get_in_formats(&fin_fs);
+            int fin_fs_len = filter->get_in_formats(&fin_fs);
             for (int j = 0, k = 0; j < fin_fs_len; j++) {
                 if (fin_fs[j].is_supported) {
                     if (k > 0)
@@ -408,7 +483,7 @@ int app_init()
             }
             buffer2[0] = '\0';
             const struct format_mapping_t* fout_fs = NULL;
-            int fout_fs_len = filters[i].get_out_formats(&fout_fs);
+            int fout_fs_len = filter->get_out_formats(&fout_fs);
             for (int j = 0, k = 0; j < fout_fs_len; j++) {
                 if (fout_fs[j].is_supported) {
                     if (k > 0)
@@ -418,7 +493,7 @@ int app_init()
                 }
             }
             DEBUG("filter[%s]: %s -> %s",
-                filters[i].name,
+                filter->name,
                 buffer1,
                 buffer2);
         }
@@ -442,21 +517,7 @@ int app_init()
     for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
         const struct format_mapping_t* out_fs = NULL;
         int out_fs_len = outputs[i].get_formats(&out_fs);
-
-        for (int ii = 0; ii < out_fs_len; ii++) {
-            const struct format_mapping_t* out_f = out_fs + ii;
-            if (!out_f->is_supported)
-                continue;
-
-            for (int jj = 0; jj < in_fs_len; jj++) {
-                const struct format_mapping_t* in_f = in_fs + jj;
-
-                if (!out_f->is_supported)
-                    continue;
-
-                find_path(in_f, out_f, outputs + i);
-            }
-        }
+        CALL(find_path(in_fs, in_fs_len, out_fs, out_fs_len, outputs + i), error);
     }
     if (app.verbose) {
         char buffer[MAX_STRING];
@@ -464,22 +525,23 @@ int app_init()
             if (outputs[i].start_format != 0) {
                 buffer[0] = '\0';
                 int last_filter = -1;
-                for (int k = 0; k < MAX_FILTERS && outputs[i].filters[k].out_format; k++) {
-                    int index = outputs[i].filters[k].index;
+                for (int k = 0; k < kv_size(outputs[i].filters); k++) {
+                    struct filter_reference_t *ref = &kv_A(outputs[i].filters, k);
                     strcat(buffer, " -> ");
-                    strcat(buffer, filters[index].name);
+                    strcat(buffer, kv_A(filters, ref->index)->name);
                     strcat(buffer, "[");
-                    strcat(buffer, app_get_video_format_str(outputs[i].filters[k].out_format));
+                    strcat(buffer, app_get_video_format_str(ref->out_format));
                     strcat(buffer, "]");
                     last_filter = k;
                 }
                 if (last_filter >= 0) {
-                    DEBUG("path for %s[%s]: %s[%s]%s",
+                    DEBUG("path for %s[%s]: %s[%s]%s, cost: %d ns",
                         outputs[i].name,
-                        app_get_video_format_str(outputs[i].filters[last_filter].out_format),
+                        app_get_video_format_str(kv_A(outputs[i].filters, last_filter).out_format),
                         input.name,
                         app_get_video_format_str(outputs[i].start_format),
-                        buffer);
+                        buffer,
+                        outputs[i].cost);
                 }
                 else {
                     DEBUG("path for %s[%s]: %s[%s]",
@@ -502,3 +564,377 @@ error:
         errno = EAGAIN;
     return -1;
 }
+
+// returns amount of leading filters which are shared by paths of both outputs
+static int app_shared_prefix(struct output_t *a, struct output_t *b)
+{
+    if (a->start_format != b->start_format)
+        return -1;
+
+    int k = 0;
+    while (k < kv_size(a->filters) && k < kv_size(b->filters) &&
+        kv_A(a->filters, k).out_format == kv_A(b->filters, k).out_format &&
+        kv_A(a->filters, k).index == kv_A(b->filters, k).index
+    ) {
+        k++;
+    }
+    return k;
+}
+
+// returns 1 if another output which is started and isn't idle uses the filter with
+// the index, or the input if the index is -1
+static int app_is_used(struct app_job_t *job, int i, int index)
+{
+    for (int j = 0; j < MAX_OUTPUTS && outputs[j].context != NULL; j++) {
+        struct output_t *output = outputs + j;
+        if (j == i || job->idle[j] || output->start_format != job->start_format)
+            continue;
+        if (index == -1)
+            return 1;
+        for (int k = 0; k < kv_size(output->filters); k++)
+            if (kv_A(output->filters, k).index == index)
+                return 1;
+    }
+    return 0;
+}
+
+// stops the input which only idle outputs use, it's called by the thread which captures
+static int app_stop_idle_input(struct app_job_t *job)
+{
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+        if (!job->idle[i] || !input.is_started() || app_is_used(job, i, -1))
+            continue;
+        // the input whose frames are still in flight keeps capturing until the next consumer
+        if (input.stop() == -1 && errno != EBUSY) {
+            CALL_MESSAGE(input.stop());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// stops filters with the given position in paths of idle outputs unless other outputs
+// use them, it's called by the thread which runs filters of the position
+static int app_stop_idle_filters(struct app_job_t *job, int k)
+{
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+        struct output_t *output = outputs + i;
+        if (!job->idle[i] || k >= kv_size(output->filters))
+            continue;
+        int index = kv_A(output->filters, k).index;
+        struct filter_t *filter = kv_A(filters, index);
+        if (filter->is_started() && !app_is_used(job, i, index))
+            CALL(filter->stop(), cleanup);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// returns the length of the longest path
+static int app_get_filters_depth()
+{
+    int depth = 0;
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++)
+        depth = MAX(depth, kv_size(outputs[i].filters));
+    return depth;
+}
+
+// polls outputs and captures one frame from the input if any of them is ready, the input
+// and filters which only idle outputs use are stopped before
+static int app_capture_frame(struct app_job_t *job)
+{
+    int res = 0;
+    memset(job->ready, 0, sizeof(job->ready));
+    memset(job->idle, 0, sizeof(job->idle));
+    job->ready_count = 0;
+    job->start_format = 0;
+
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
+        struct output_t *output = outputs + i;
+        if (output->start_format == 0)
+            continue; // path for the output doesn't exist
+
+        if (job->start_format == 0)
+            job->start_format = output->start_format;
+        else if (output->start_format != job->start_format) {
+            DEBUG("output[%s] requires input format %s, but input is started with %s",
+                output->name,
+                app_get_video_format_str(output->start_format),
+                app_get_video_format_str(job->start_format));
+            continue;
+        }
+
+        if (!output->is_started()) CALL(output->start(), cleanup);
+        if (output->is_idle) {
+            CALL(res = output->is_idle(), cleanup);
+            job->idle[i] = res;
+        }
+        if (output->is_ready) {
+            CALL(res = output->is_ready(), cleanup);
+            job->ready[i] = res;
+        }
+        else
+            job->ready[i] = 1;
+        job->ready_count += job->ready[i];
+    }
+
+    CALL(app_stop_idle_input(job), cleanup);
+    // steps of the pipeline stop filters of their positions
+    for (int k = 0; k < app_get_filters_depth() && !job->is_pipelined; k++)
+        CALL(app_stop_idle_filters(job, k), cleanup);
+
+    if (job->ready_count == 0) {
+        struct timespec idle = {
+            .tv_sec = 0,
+            .tv_nsec = IDLE_TIME
+        };
+        nanosleep(&idle, NULL);
+        errno = ETIME;
+        return -1;
+    }
+
+    if (!input.is_started()) CALL(input.start(job->start_format), cleanup);
+    CALL(input.process_frame(), cleanup);
+    CALL(input.get_frame(&job->stages[0][0]), cleanup);
+
+    for (int i = 1; i < MAX_OUTPUTS; i++)
+        if (job->ready[i])
+            job->stages[i][0] = frame_ref(job->stages[0][0]);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// asks the next filter of the path for its input buffer, so the filter writes the frame
+// right there instead of own buffer, the frame isn't provided if the path of another
+// output leaves the path after the filter, because the buffer can be reused by the next
+// filter while the other output still reads the frame, the pipeline doesn't provide it,
+// because the next filter processes the previous frame on another thread at the same time
+static int app_provide_out_frame(struct app_job_t *job, int i, int k, struct filter_t *filter)
+{
+    struct output_t *output = outputs + i;
+    if (job->is_pipelined || !filter->set_out_frame || k + 1 >= kv_size(output->filters))
+        return 0;
+
+    struct filter_t *next = kv_A(filters, kv_A(output->filters, k + 1).index);
+    if (!next->get_in_frame)
+        return 0;
+    for (int j = 0; j < MAX_OUTPUTS; j++)
+        if (j != i && job->ready[j] && app_shared_prefix(output, outputs + j) == k + 1)
+            return 0;
+
+    int in_format = kv_A(output->filters, k).out_format;
+    int out_format = kv_A(output->filters, k + 1).out_format;
+    if (!next->is_started()) CALL(next->start(in_format, out_format), cleanup);
+
+    struct frame_t *frame = NULL;
+    CALL(next->get_in_frame(in_format, &frame), cleanup);
+    if (frame) {
+        int res = filter->set_out_frame(frame);
+        CALL(frame_unref(frame), cleanup);
+        CALL(res, cleanup);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// the last filter of the path passes slices of the frame to the ready output which accepts
+// them, the filter shared with other paths streams to the first such output
+static int app_provide_slice_output(struct app_job_t *job, int i, int k, struct filter_t *filter)
+{
+    if (!filter->set_slice_output)
+        return 0;
+
+    struct output_t *slice_output = NULL;
+    for (int j = i; j < MAX_OUTPUTS && slice_output == NULL; j++) {
+        struct output_t *output = outputs + j;
+        if (!job->ready[j] || !output->process_slice || kv_size(output->filters) != k + 1)
+            continue;
+        if (j == i || app_shared_prefix(outputs + i, output) == k + 1)
+            slice_output = output;
+    }
+    return filter->set_slice_output(slice_output);
+}
+
+// runs filters with the given position in paths of ready outputs, the filter shared
+// with a path of the previous output isn't run twice
+static int app_process_filters(struct app_job_t *job, int k)
+{
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+        struct output_t *output = outputs + i;
+        if (!job->ready[i] || k >= kv_size(output->filters) || !job->stages[i][k])
+            continue;
+
+        int j = 0;
+        while (j < i && (!job->ready[j] || app_shared_prefix(output, outputs + j) <= k))
+            j++;
+        if (j < i) {
+            if (job->stages[j][k + 1])
+                job->stages[i][k + 1] = frame_ref(job->stages[j][k + 1]);
+            continue;
+        }
+
+        struct filter_t *filter = kv_A(filters, kv_A(output->filters, k).index);
+        int in_format = k > 0? kv_A(output->filters, k - 1).out_format: output->start_format;
+        int out_format = kv_A(output->filters, k).out_format;
+        if (!filter->is_started()) CALL(filter->start(in_format, out_format), cleanup);
+        CALL(app_provide_out_frame(job, i, k, filter), cleanup);
+        CALL(app_provide_slice_output(job, i, k, filter), cleanup);
+        CALL(filter->process_frame(job->stages[i][k]), cleanup);
+        CALL(filter->get_frame(&job->stages[i][k + 1]), cleanup);
+        if (!job->stages[i][k + 1])
+            DEBUG("The filter[%s] doesn't have frame yet", filter->name);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int app_process_outputs(struct app_job_t *job)
+{
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+        if (!job->ready[i])
+            continue;
+        struct output_t *output = outputs + i;
+        int k = 0;
+        while (k < kv_size(output->filters) && job->stages[i][k])
+            k++;
+        // NULL frame means that the chain was interrupted by a filter without frame
+        CALL(output->process_frame(job->stages[i][k]), cleanup);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// captures one frame from the input, runs every shared filter prefix once and
+// passes the result to each output which is ready to receive it
+int app_process_frame()
+{
+    struct app_job_t *job = &app_job;
+    if (job->stages[0] == NULL)
+        CALL(app_init_job(job), cleanup);
+
+    CALL(app_capture_frame(job), cleanup);
+    for (int k = 0; k < app_get_filters_depth(); k++)
+        CALL(app_process_filters(job, k), release);
+    CALL(app_process_outputs(job), release);
+    app_release_stages(job);
+    return 0;
+
+release:
+    app_release_stages(job);
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+struct app_pipeline_t {
+    int filters_len;    // the longest path of filters
+    void (*processed)();
+};
+
+// the step of the pipeline: 0 - capture, 1..filters_len - filters with the same
+// position in paths, filters_len + 1 - outputs
+static void *app_pipeline_step(void *shared, int step, void *in)
+{
+    struct app_pipeline_t *pipeline = shared;
+    struct app_job_t *job = in;
+
+    if (step == 0) {
+        if (is_aborted)
+            return NULL;
+
+        job = malloc(sizeof(struct app_job_t));
+        if (job == NULL) {
+            CALL_MESSAGE(malloc(sizeof(struct app_job_t)));
+            is_aborted = 1;
+            return NULL;
+        }
+        if (app_init_job(job) == -1) {
+            CALL_MESSAGE(app_init_job(job));
+            free(job);
+            is_aborted = 1;
+            return NULL;
+        }
+        job->is_pipelined = 1;
+        job->res = app_capture_frame(job);
+        if (job->res == -1 && errno != ETIME)
+            CALL_MESSAGE(app_capture_frame(job));
+    }
+    else if (step <= pipeline->filters_len) {
+        if (app_stop_idle_filters(job, step - 1) == -1)
+            CALL_MESSAGE(app_stop_idle_filters(job, step - 1));
+        if (job->res != -1) {
+            job->res = app_process_filters(job, step - 1);
+            if (job->res == -1)
+                CALL_MESSAGE(app_process_filters(job, step - 1));
+        }
+    }
+    else {
+        if (job->res != -1) {
+            job->res = app_process_outputs(job);
+            if (job->res == -1)
+                CALL_MESSAGE(app_process_outputs(job));
+        }
+        int is_processed = job->res != -1;
+        app_destroy_job(job);
+        free(job);
+        if (pipeline->processed && is_processed)
+            pipeline->processed();
+        job = NULL;
+    }
+    return job;
+}
+
+// runs capture, filters and outputs concurrently until the application is aborted,
+// the amount of frames in flight is limited by the amount of threads
+int app_process_pipeline(int threads, void (*processed)())
+{
+    struct app_pipeline_t pipeline = {
+        .filters_len = 0,
+        .processed = processed
+    };
+
+    // the step runs filters one after another, so a filter can't be shared between steps
+    int filters_len = kv_size(filters);
+    int depth[filters_len + 1];
+    for (int i = 0; i < filters_len; i++)
+        depth[i] = -1;
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
+        for (int k = 0; k < kv_size(outputs[i].filters); k++) {
+            int index = kv_A(outputs[i].filters, k).index;
+            if (depth[index] != -1 && depth[index] != k) {
+                ERROR("filter[%s] is used by different steps of the pipeline",
+                    kv_A(filters, index)->name);
+                errno = EINVAL;
+                return -1;
+            }
+            depth[index] = k;
+        }
+    }
+    pipeline.filters_len = app_get_filters_depth();
+
+    DEBUG("pipeline with %d steps and %d threads has been started",
+        pipeline.filters_len + 2, threads);
+    kt_pipeline(threads, app_pipeline_step, &pipeline, pipeline.filters_len + 2);
+    return 0;
+}
@@ -5,11 +5,14 @@
 
 const char* app_get_video_format_str(int format);
 const char* app_get_video_output_str(int format);
+int app_get_video_format_int(const char* format);
 int app_get_video_output_int(const char* format);
 
 void app_set_default_state();
 void app_construct();
 void app_cleanup();
 int app_init();
+int app_process_frame();
+int app_process_pipeline(int threads, void (*processed)());
 
 #endif //app_h
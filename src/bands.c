@@ -0,0 +1,144 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "kthread.h"
+
+#include "main.h"
+#include "utils.h"
+#include "bands.h"
+
+extern struct app_state_t app;
+
+int bands_init(struct bands_t *bands, int count, int threads)
+{
+    ASSERT_INT(count, >, 0, cleanup);
+    ASSERT_INT(threads, >, 0, cleanup);
+    memset(bands, 0, sizeof(*bands));
+    bands->count = count;
+    bands->threads = MIN(threads, count);
+
+    bands->last_ns = calloc(count, sizeof(int64_t));
+    bands->total_ns = calloc(count, sizeof(int64_t));
+    if (bands->last_ns == NULL || bands->total_ns == NULL) {
+        CALL_MESSAGE(calloc(count, sizeof(int64_t)));
+        goto cleanup;
+    }
+
+    // the caller is blocked while the pool processes the frame, so one thread is enough
+    // to process bands sequentially without the pool
+    if (bands->threads > 1) {
+        bands->pool = kt_forpool_init(bands->threads);
+        if (bands->pool == NULL) {
+            CALL_MESSAGE(kt_forpool_init(bands->threads));
+            goto cleanup;
+        }
+    }
+    return 0;
+
+cleanup:
+    bands_cleanup(bands);
+    if (errno == 0)
+        errno = EINVAL;
+    return -1;
+}
+
+void bands_cleanup(struct bands_t *bands)
+{
+    if (bands->pool) {
+        kt_forpool_destroy(bands->pool);
+        bands->pool = NULL;
+    }
+    if (bands->last_ns) {
+        free(bands->last_ns);
+        bands->last_ns = NULL;
+    }
+    if (bands->total_ns) {
+        free(bands->total_ns);
+        bands->total_ns = NULL;
+    }
+}
+
+static void bands_process_band(void *data, long band, int thread)
+{
+    struct bands_t *bands = data;
+    struct timespec t1, t2;
+
+    // rows are distributed evenly, so bands differ by one aligned group of rows at most
+    int y_start = bands->height * band / bands->count / bands->align * bands->align;
+    int y_end = band + 1 < bands->count?
+        bands->height * (band + 1) / bands->count / bands->align * bands->align:
+        bands->height;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (y_start < y_end && bands->process(bands->data, y_start, y_end) == -1) {
+        CALL_MESSAGE(bands->process(bands->data, y_start, y_end));
+        __sync_fetch_and_add(&bands->errors, 1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    int64_t ns = (t2.tv_sec - t1.tv_sec) * 1000000000LL + t2.tv_nsec - t1.tv_nsec;
+    bands->last_ns[band] = ns;
+    bands->total_ns[band] += ns;
+}
+
+// runs the process function for every band and returns after all of them are processed,
+// the pool isn't reentrant, so every filter has own bands
+int bands_process(
+    struct bands_t *bands,
+    int height,
+    int align,
+    int (*process)(void *data, int y_start, int y_end),
+    void *data)
+{
+    ASSERT_PTR(bands->last_ns, !=, NULL, cleanup);
+    ASSERT_INT(align, >, 0, cleanup);
+    bands->height = height;
+    bands->align = align;
+    bands->process = process;
+    bands->data = data;
+    bands->errors = 0;
+
+    kt_forpool(bands->pool, bands_process_band, bands, bands->count);
+    bands->runs++;
+    ASSERT_INT(bands->errors, ==, 0, cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+void bands_print_stats(struct bands_t *bands, const char *name)
+{
+    if (!app.verbose || bands->runs == 0)
+        return;
+
+    char buffer[MAX_STRING];
+    int len = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < bands->count && len < sizeof(buffer); i++)
+        len += snprintf(buffer + len, sizeof(buffer) - len, "%s%lld",
+            i > 0? COMMA: "", (long long)(bands->total_ns[i] / bands->runs));
+    DEBUG("%s: %d bands, %d threads, %d frames, average ns per band: %s",
+        name,
+        bands->count,
+        bands->threads,
+        bands->runs,
+        buffer);
+}
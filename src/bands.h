@@ -0,0 +1,51 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef bands_h
+#define bands_h
+
+// splits processing of a frame into bands of rows which are run on a persistent pool of threads
+struct bands_t {
+    int count;
+    int threads;
+    void *pool;             // kt_forpool, NULL if the bands are processed by the caller
+
+    // the current run
+    int height;
+    int align;              // the first row of every band is a multiple of it
+    int (*process)(void *data, int y_start, int y_end);
+    void *data;
+    int errors;
+
+    // timing of every band to tune amount of bands and threads
+    int64_t *last_ns;
+    int64_t *total_ns;
+    int runs;
+};
+
+int bands_init(struct bands_t *bands, int count, int threads);
+void bands_cleanup(struct bands_t *bands);
+int bands_process(
+    struct bands_t *bands,
+    int height,
+    int align,
+    int (*process)(void *data, int y_start, int y_end),
+    void *data);
+void bands_print_stats(struct bands_t *bands, const char *name);
+
+#endif //bands_h
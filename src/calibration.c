@@ -0,0 +1,289 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "main.h"
+#include "utils.h"
+#include "app.h"
+#include "frame.h"
+#include "calibration.h"
+
+#define CALIBRATION_FIELDS 6
+#define CALIBRATION_SEPARATOR ';'
+
+extern struct app_state_t app;
+extern filters_t filters;
+
+static struct calibration_state_t calibration;
+
+void calibration_cleanup()
+{
+    kv_destroy(calibration.costs);
+    kv_init(calibration.costs);
+}
+
+// returns measured nanoseconds per frame or -1 if the conversion isn't measured
+int calibration_get_cost(struct filter_t *filter, int in_format, int out_format)
+{
+    for (int i = 0; i < kv_size(calibration.costs); i++) {
+        struct calibration_cost_t *cost = &kv_A(calibration.costs, i);
+        if (cost->in_format == in_format &&
+            cost->out_format == out_format &&
+            strcmp(cost->filter, filter->name) == 0)
+            return cost->cost;
+    }
+    return -1;
+}
+
+static void calibration_set_cost(struct filter_t *filter, int in_format, int out_format, int cost)
+{
+    for (int i = 0; i < kv_size(calibration.costs); i++) {
+        struct calibration_cost_t *c = &kv_A(calibration.costs, i);
+        if (c->in_format == in_format &&
+            c->out_format == out_format &&
+            strcmp(c->filter, filter->name) == 0) {
+            c->cost = cost;
+            return;
+        }
+    }
+    struct calibration_cost_t c = {
+        .filter = filter->name,
+        .in_format = in_format,
+        .out_format = out_format,
+        .cost = cost
+    };
+    kv_push(struct calibration_cost_t, calibration.costs, c);
+}
+
+static struct filter_t *calibration_find_filter(const char *name)
+{
+    for (int i = 0; i < kv_size(filters); i++)
+        if (strcmp(kv_A(filters, i)->name, name) == 0)
+            return kv_A(filters, i);
+    return NULL;
+}
+
+// splits the line of the cache into fields, returns amount of fields
+static int calibration_split(char *line, char *fields[CALIBRATION_FIELDS])
+{
+    line[strcspn(line, "\r\n")] = '\0';
+    int len = 0;
+    while (len < CALIBRATION_FIELDS) {
+        fields[len++] = line;
+        line = strchr(line, CALIBRATION_SEPARATOR);
+        if (line == NULL)
+            break;
+        *line++ = '\0';
+    }
+    return line == NULL? len: -1;
+}
+
+// the cache contains lines: cpu model;resolution;filter;input format;output format;ns per frame,
+// only lines of the current cpu and resolution are loaded
+static int calibration_load(const char *resolution)
+{
+    char line[MAX_DATA];
+    FILE *fstream = fopen(app.calibration_path, "r");
+    if (fstream == NULL) {
+        if (errno == ENOENT) {
+            errno = 0;
+            return 0; // nothing has been measured yet
+        }
+        CALL_MESSAGE(fopen(app.calibration_path, "r"));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fstream)) {
+        char *fields[CALIBRATION_FIELDS];
+        if (calibration_split(line, fields) != CALIBRATION_FIELDS)
+            continue; // the line is broken
+        if (strcmp(fields[0], calibration.cpu_model) != 0 || strcmp(fields[1], resolution) != 0)
+            continue;
+
+        struct filter_t *filter = calibration_find_filter(fields[2]);
+        int in_format = app_get_video_format_int(fields[3]);
+        int out_format = app_get_video_format_int(fields[4]);
+        if (filter == NULL || in_format <= 0 || out_format <= 0)
+            continue; // the filter or the format isn't built in
+        calibration_set_cost(filter, in_format, out_format, atoi(fields[5]));
+    }
+    fclose(fstream);
+    errno = 0;
+    return 0;
+}
+
+static int calibration_save(
+    const char *resolution,
+    struct filter_t *filter,
+    int in_format,
+    int out_format,
+    int cost)
+{
+    char line[MAX_DATA];
+    int len = snprintf(line, sizeof(line), "%s%c%s%c%s%c%s%c%s%c%d\n",
+        calibration.cpu_model, CALIBRATION_SEPARATOR,
+        resolution, CALIBRATION_SEPARATOR,
+        filter->name, CALIBRATION_SEPARATOR,
+        app_get_video_format_str(in_format), CALIBRATION_SEPARATOR,
+        app_get_video_format_str(out_format), CALIBRATION_SEPARATOR,
+        cost);
+    ASSERT_INT(len, <, (int)sizeof(line), error);
+    CALL(utils_write_file(app.calibration_path, (uint8_t *)line, len), error);
+    return 0;
+
+error:
+    if (errno == 0)
+        errno = EOVERFLOW;
+    return -1;
+}
+
+// the synthetic frame has gradients, so filters don't take shortcuts on flat data
+static void calibration_fill_frame(struct frame_t *frame)
+{
+    for (int p = 0; p < frame->planes_count; p++) {
+        for (int y = 0; y < frame_get_plane_rows(frame, p); y++) {
+            uint8_t *line = frame->planes[p] + y * frame->strides[p];
+            for (int x = 0; x < frame->strides[p]; x++)
+                line[x] = (uint8_t)(x + y + p * 64);
+        }
+    }
+}
+
+// runs the conversion on the synthetic frame, the first frame warms up caches and
+// lazy allocations of the filter, so it isn't measured
+static int calibration_measure(
+    struct filter_t *filter,
+    int in_format,
+    int out_format,
+    struct frame_t *frame,
+    int *cost)
+{
+    struct frame_t *out_frame = NULL;
+    struct timespec t1, t2;
+
+    CALL(filter->start(in_format, out_format), error);
+    for (int i = 0; i <= CALIBRATION_FRAMES; i++) {
+        if (i == 1)
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+        frame->sequence = i;
+        CALL(filter->process_frame(frame), stop);
+        CALL(filter->get_frame(&out_frame), stop);
+        if (out_frame) {
+            CALL(frame_unref(out_frame));
+            out_frame = NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    CALL(filter->stop(), error);
+
+    *cost = ((t2.tv_sec - t1.tv_sec) * 1000000000LL + t2.tv_nsec - t1.tv_nsec) / CALIBRATION_FRAMES;
+    return 0;
+
+stop:
+    CALL(filter->stop());
+error:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// measures every conversion of registered filters which isn't in the cache yet
+static int calibration_measure_filters(const char *resolution)
+{
+    struct frame_pool_t pool = { .frames = NULL, .frames_count = 0, .data = NULL };
+    CALL(frame_pool_init(&pool, 1, app.video_width * app.video_height * 3), error);
+
+    for (int i = 0; i < kv_size(filters); i++) {
+        struct filter_t *filter = kv_A(filters, i);
+        const struct format_mapping_t* fin_fs = NULL;
+        int fin_fs_len = filter->get_in_formats(&fin_fs);
+        const struct format_mapping_t* fout_fs = NULL;
+        int fout_fs_len = filter->get_out_formats(&fout_fs);
+
+        for (int j = 0; j < fin_fs_len; j++) {
+            for (int k = 0; k < fout_fs_len; k++) {
+                int in_format = fin_fs[j].format;
+                int out_format = fout_fs[k].format;
+                if (!fin_fs[j].is_supported || !fout_fs[k].is_supported ||
+                    calibration_get_cost(filter, in_format, out_format) >= 0)
+                    continue;
+
+                struct frame_t *frame = frame_pool_get(&pool);
+                ASSERT_PTR(frame, !=, NULL, cleanup);
+                frame_set_planes(frame, in_format, app.video_width, app.video_height);
+                if (frame->length == 0) {
+                    // compressed frames can't be synthesized
+                    CALL(frame_unref(frame), cleanup);
+                    continue;
+                }
+                calibration_fill_frame(frame);
+
+                int cost = 0;
+                int res = calibration_measure(filter, in_format, out_format, frame, &cost);
+                CALL(frame_unref(frame), cleanup);
+                if (res == -1) {
+                    DEBUG("filter[%s]: %s -> %s can't be measured",
+                        filter->name,
+                        app_get_video_format_str(in_format),
+                        app_get_video_format_str(out_format));
+                    errno = 0;
+                    continue;
+                }
+
+                DEBUG("filter[%s]: %s -> %s, measured cost: %d ns",
+                    filter->name,
+                    app_get_video_format_str(in_format),
+                    app_get_video_format_str(out_format),
+                    cost);
+                calibration_set_cost(filter, in_format, out_format, cost);
+                CALL(calibration_save(resolution, filter, in_format, out_format, cost), cleanup);
+            }
+        }
+    }
+    frame_pool_cleanup(&pool);
+    return 0;
+
+cleanup:
+    frame_pool_cleanup(&pool);
+error:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// loads costs of filters measured on the same cpu and resolution from the cache and
+// measures the rest of them, the planner prefers measured costs to estimated ones
+int calibration_init()
+{
+    char resolution[MAX_STRING];
+    snprintf(resolution, sizeof(resolution), "%dx%d", app.video_width, app.video_height);
+
+    CALL(utils_get_cpu_model(calibration.cpu_model, sizeof(calibration.cpu_model)), error);
+    for (char *c = strchr(calibration.cpu_model, CALIBRATION_SEPARATOR); c != NULL;
+        c = strchr(c, CALIBRATION_SEPARATOR))
+        *c = ' ';
+    DEBUG("calibration of %s, %s", calibration.cpu_model, resolution);
+
+    CALL(calibration_load(resolution), error);
+    CALL(calibration_measure_filters(resolution), error);
+    return 0;
+
+error:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
@@ -0,0 +1,39 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef calibration_h
+#define calibration_h
+
+// the measured cost of one conversion of the filter on the current CPU and resolution
+struct calibration_cost_t {
+    const char *filter;
+    int in_format;
+    int out_format;
+    int cost;           // nanoseconds per frame
+};
+
+struct calibration_state_t {
+    char cpu_model[MAX_STRING];
+    kvec_t(struct calibration_cost_t) costs;
+};
+
+int calibration_init();
+void calibration_cleanup();
+int calibration_get_cost(struct filter_t *filter, int in_format, int out_format);
+
+#endif //calibration_h
@@ -18,6 +18,7 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 
 #include "file.h"
 
@@ -35,8 +36,6 @@ struct file_state_t file = {
 };
 
 extern struct app_state_t app;
-extern struct input_t input;
-extern struct filter_t filters[MAX_FILTERS];
 extern struct output_t outputs[MAX_OUTPUTS];
 extern int is_aborted;
 
@@ -80,32 +79,11 @@ cleanup:
     return -1;
 }
 
-static int file_process_frame()
+static int file_process_frame(struct frame_t *frame)
 {
-    int res = 0;
-
-    struct output_t *output = file.output;
-    if (!output->is_started()) CALL(output->start(), cleanup);
-
-    int in_format = output->start_format;
-    int out_format = output->start_format;
-    if (!input.is_started()) CALL(input.start(in_format), cleanup);
-    CALL(res = input.process_frame(), cleanup);
-    int length = 0;
-    uint8_t *buffer = input.get_buffer(NULL, &length);
-    for (int k = 0; k < MAX_FILTERS && output->filters[k].out_format; k++) {
-        struct filter_t *filter = filters + output->filters[k].index;
-        in_format = out_format;
-        out_format = output->filters[k].out_format;
-        if (!filter->is_started())
-            CALL(filter->start(in_format, out_format), cleanup);
-        CALL(filter->process_frame(buffer), cleanup);
-        buffer = filter->get_buffer(NULL, &length);
-        if (!length)
-            break;
-    }
-    if (length) {
-        return utils_write_file(app.output_path, buffer, length);
+    if (frame && frame->length) {
+        for (int i = 0; i < frame->planes_count; i++)
+            CALL(utils_write_file(app.output_path, frame->planes[i], frame->strides[i]), cleanup);
     }
     return 0;
 
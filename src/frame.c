@@ -0,0 +1,277 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "main.h"
+#include "utils.h"
+#include "frame.h"
+
+extern struct app_state_t app;
+
+int frame_pool_init(struct frame_pool_t *pool, int frames_count, int length)
+{
+    ASSERT_PTR(pool->frames, ==, NULL, cleanup);
+    ASSERT_INT(frames_count, >, 0, cleanup);
+
+    pool->frames = calloc(frames_count, sizeof(struct frame_t));
+    if (pool->frames == NULL) {
+        CALL_MESSAGE(calloc(frames_count, sizeof(struct frame_t)));
+        goto cleanup;
+    }
+    pool->frames_count = frames_count;
+
+    // frames of the pool can also wrap memory of the producer, e.g. mmaped buffers
+    if (length > 0) {
+        pool->data = malloc(frames_count * length);
+        if (pool->data == NULL) {
+            CALL_MESSAGE(malloc(frames_count * length));
+            goto cleanup;
+        }
+    }
+
+    for (int i = 0; i < frames_count; i++) {
+        struct frame_t *frame = pool->frames + i;
+        frame->index = i;
+        frame->pool = pool;
+        if (pool->data) {
+            frame->planes[0] = pool->data + i * length;
+            frame->planes_count = 1;
+        }
+    }
+    return 0;
+
+cleanup:
+    frame_pool_cleanup(pool);
+    if (errno == 0)
+        errno = ENOMEM;
+    return -1;
+}
+
+// frees memory of the orphan pool when its last frame is released
+static void frame_release_orphan(struct frame_pool_t *pool)
+{
+    if (__atomic_sub_fetch(&pool->orphans, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free(pool->frames);
+    free(pool->data);
+    free(pool);
+}
+
+// frames which are still referenced move with the memory to the orphan pool, so the pool
+// can be initialized again while consumers still read them
+static void frame_pool_orphan(struct frame_pool_t *pool, int referenced)
+{
+    struct frame_pool_t *orphan = malloc(sizeof(struct frame_pool_t));
+    if (orphan == NULL) {
+        CALL_MESSAGE(malloc(sizeof(struct frame_pool_t)));
+        ERROR("memory of the pool is leaked, frames are still referenced: %d", referenced);
+        return;
+    }
+    DEBUG("memory of the pool is kept, frames are still referenced: %d", referenced);
+    *orphan = *pool;
+    orphan->release = NULL;
+    orphan->is_orphan = 1;
+    orphan->orphans = pool->frames_count;
+    // the frame which is released while it moves doesn't reach the producer
+    struct frame_t *frames = pool->frames;
+    int frames_count = pool->frames_count;
+    for (int i = 0; i < frames_count; i++) {
+        frame_ref(frames + i);
+        __atomic_store_n(&frames[i].pool, orphan, __ATOMIC_RELEASE);
+    }
+    for (int i = 0; i < frames_count; i++)
+        CALL(frame_unref(frames + i));
+}
+
+void frame_pool_cleanup(struct frame_pool_t *pool)
+{
+    if (pool->frames) {
+        int referenced = 0;
+        for (int i = 0; i < pool->frames_count; i++)
+            referenced += __atomic_load_n(&pool->frames[i].refs, __ATOMIC_ACQUIRE) > 0;
+        if (referenced > 0) {
+            frame_pool_orphan(pool, referenced);
+            pool->data = NULL;
+        }
+        else
+            free(pool->frames);
+        pool->frames = NULL;
+    }
+    if (pool->data) {
+        free(pool->data);
+        pool->data = NULL;
+    }
+    pool->frames_count = 0;
+}
+
+// returns the first frame which isn't referenced, the caller owns the only reference
+struct frame_t *frame_pool_get(struct frame_pool_t *pool)
+{
+    for (int i = 0; i < pool->frames_count; i++) {
+        int refs = 0;
+        if (__atomic_compare_exchange_n(&pool->frames[i].refs, &refs, 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+        ) {
+            return pool->frames + i;
+        }
+    }
+    errno = ENOBUFS;
+    return NULL;
+}
+
+// returns the frame which wraps the buffer of the producer with the given index
+struct frame_t *frame_pool_get_index(struct frame_pool_t *pool, int index)
+{
+    ASSERT_INT(index, >=, 0, cleanup);
+    ASSERT_INT(index, <, pool->frames_count, cleanup);
+
+    int refs = 0;
+    if (!__atomic_compare_exchange_n(&pool->frames[index].refs, &refs, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+    ) {
+        ERROR("frame[%d] is still referenced by %d consumers", index, refs);
+        errno = EBUSY;
+        return NULL;
+    }
+    return pool->frames + index;
+
+cleanup:
+    errno = EINVAL;
+    return NULL;
+}
+
+// lays out planes of the raw format one after another starting from the first plane
+void frame_set_planes(struct frame_t *frame, int format, int width, int height)
+{
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+
+    int plane = width * height;
+    switch (format) {
+        case VIDEO_FORMAT_YUYV:
+            frame->planes_count = 1;
+            frame->strides[0] = width << 1;
+            frame->length = plane << 1;
+            break;
+        case VIDEO_FORMAT_YUV422:
+            frame->planes_count = 3;
+            frame->strides[0] = width;
+            frame->strides[1] = width >> 1;
+            frame->strides[2] = width >> 1;
+            frame->planes[1] = frame->planes[0] + plane;
+            frame->planes[2] = frame->planes[1] + (plane >> 1);
+            frame->length = plane << 1;
+            break;
+        case VIDEO_FORMAT_YUV444:
+            frame->planes_count = 3;
+            frame->strides[0] = width;
+            frame->strides[1] = width;
+            frame->strides[2] = width;
+            frame->planes[1] = frame->planes[0] + plane;
+            frame->planes[2] = frame->planes[1] + plane;
+            frame->length = plane * 3;
+            break;
+        case VIDEO_FORMAT_I420:
+            frame->planes_count = 3;
+            frame->strides[0] = width;
+            frame->strides[1] = width >> 1;
+            frame->strides[2] = width >> 1;
+            frame->planes[1] = frame->planes[0] + plane;
+            frame->planes[2] = frame->planes[1] + (plane >> 2);
+            frame->length = plane + (plane >> 1);
+            break;
+        case VIDEO_FORMAT_NV12:
+            // U and V are interleaved in the second plane
+            frame->planes_count = 2;
+            frame->strides[0] = width;
+            frame->strides[1] = width;
+            frame->planes[1] = frame->planes[0] + plane;
+            frame->length = plane + (plane >> 1);
+            break;
+        default:
+            // compressed formats have one chunk until the producer sets it
+            frame->planes_count = 1;
+            frame->strides[0] = 0;
+            frame->length = 0;
+    }
+}
+
+// returns amount of rows of the plane, chroma of 4:2:0 formats has half of rows
+int frame_get_plane_rows(struct frame_t *frame, int plane)
+{
+    if (plane > 0 && (frame->format == VIDEO_FORMAT_I420 || frame->format == VIDEO_FORMAT_NV12))
+        return frame->height >> 1;
+    return frame->height;
+}
+
+// copies planes of the raw frame to the frame of the same format with other strides
+int frame_copy_planes(struct frame_t *dest, struct frame_t *src)
+{
+    ASSERT_INT(dest->format, ==, src->format, cleanup);
+    ASSERT_INT(dest->width, ==, src->width, cleanup);
+    ASSERT_INT(dest->height, ==, src->height, cleanup);
+    ASSERT_INT(dest->planes_count, ==, src->planes_count, cleanup);
+
+    for (int p = 0; p < src->planes_count; p++) {
+        int len = MIN(dest->strides[p], src->strides[p]);
+        int rows = frame_get_plane_rows(src, p);
+        if (dest->strides[p] == src->strides[p])
+            memcpy(dest->planes[p], src->planes[p], src->strides[p] * rows);
+        else
+            for (int y = 0; y < rows; y++)
+                memcpy(dest->planes[p] + dest->strides[p] * y,
+                    src->planes[p] + src->strides[p] * y,
+                    len);
+    }
+    return 0;
+
+cleanup:
+    errno = EINVAL;
+    return -1;
+}
+
+// the output of a filter inherits the capture properties of its input
+void frame_copy_props(struct frame_t *dest, struct frame_t *src)
+{
+    dest->sequence = src->sequence;
+    dest->timestamp = src->timestamp;
+}
+
+struct frame_t *frame_ref(struct frame_t *frame)
+{
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+int frame_unref(struct frame_t *frame)
+{
+    int refs = __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL);
+    ASSERT_INT(refs, >=, 0, cleanup);
+    struct frame_pool_t *pool = __atomic_load_n(&frame->pool, __ATOMIC_ACQUIRE);
+    if (refs > 0 || pool == NULL)
+        return 0;
+    if (pool->is_orphan)
+        frame_release_orphan(pool);
+    else if (pool->release)
+        return pool->release(frame);
+    return 0;
+
+cleanup:
+    errno = EINVAL;
+    return -1;
+}
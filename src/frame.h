@@ -0,0 +1,80 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef frame_h
+#define frame_h
+
+#define FRAME_MAX_PLANES 3
+// compressed formats can be split to more chunks than raw ones have planes, e.g. buffers of
+// the encoder of the big IDR frame
+#define FRAME_MAX_CHUNKS 16
+
+struct frame_pool_t;
+
+// a descriptor of an image or encoded data, the data is owned by the stage which has
+// produced it and stays valid while the frame is referenced
+struct frame_t {
+    int format;
+    int width;
+    int height;
+
+    // compressed formats keep chunks of the bitstream in planes and lengths of chunks
+    // in strides, e.g. buffers of the encoder which has split the frame
+    uint8_t *planes[FRAME_MAX_CHUNKS];
+    int strides[FRAME_MAX_CHUNKS];
+    int planes_count;
+    int length;             // bytes used in all planes
+
+    uint32_t sequence;      // sequence number of the captured frame
+    struct timeval timestamp; // time of the capture
+
+    int refs;
+    int index;              // position of the frame in the pool
+    struct frame_pool_t *pool;
+};
+
+struct frame_pool_t {
+    struct frame_t *frames;
+    int frames_count;
+    uint8_t *data;
+
+    // optional, called when the last reference to the frame is dropped
+    int (*release)(struct frame_t *frame);
+    void *context;
+
+    // the pool which has been cleaned up while its frames were referenced keeps the memory
+    // until the last of them is released
+    int is_orphan;
+    int orphans;            // frames which haven't been released yet
+};
+
+int frame_pool_init(struct frame_pool_t *pool, int frames_count, int length);
+void frame_pool_cleanup(struct frame_pool_t *pool);
+
+struct frame_t *frame_pool_get(struct frame_pool_t *pool);
+struct frame_t *frame_pool_get_index(struct frame_pool_t *pool, int index);
+
+void frame_set_planes(struct frame_t *frame, int format, int width, int height);
+int frame_get_plane_rows(struct frame_t *frame, int plane);
+int frame_copy_planes(struct frame_t *dest, struct frame_t *src);
+void frame_copy_props(struct frame_t *dest, struct frame_t *src);
+
+struct frame_t *frame_ref(struct frame_t *frame);
+int frame_unref(struct frame_t *frame);
+
+#endif //frame_h
@@ -0,0 +1,358 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "main.h"
+#include "utils.h"
+
+#include "h264_bitstream.h"
+
+// tables of CAVLC from the clause 9.2 of ITU-T H.264, they are indexed by
+// TotalCoeff * 4 + TrailingOnes
+static const uint8_t h264_chroma_dc_token_len[4 * 5] = {
+     2, 0, 0, 0,
+     6, 1, 0, 0,
+     6, 6, 3, 0,
+     6, 7, 7, 6,
+     6, 8, 8, 7
+};
+
+static const uint8_t h264_chroma_dc_token_bits[4 * 5] = {
+     1, 0, 0, 0,
+     7, 1, 0, 0,
+     4, 6, 1, 0,
+     3, 3, 2, 5,
+     2, 3, 2, 0
+};
+
+// the table is selected by the predicted amount of coefficients: 0..1, 2..3, 4..7 and 8..
+static const uint8_t h264_token_len[4][4 * 17] = {
+    {
+         1, 0, 0, 0,
+         6, 2, 0, 0,     8, 6, 3, 0,     9, 8, 7, 5,    10, 9, 8, 6,
+        11,10, 9, 7,    13,11,10, 8,    13,13,11, 9,    13,13,13,10,
+        14,14,13,11,    14,14,14,13,    15,15,14,14,    15,15,15,14,
+        16,15,15,15,    16,16,16,15,    16,16,16,16,    16,16,16,16
+    },
+    {
+         2, 0, 0, 0,
+         6, 2, 0, 0,     6, 5, 3, 0,     7, 6, 6, 4,     8, 6, 6, 4,
+         8, 7, 7, 5,     9, 8, 8, 6,    11, 9, 9, 6,    11,11,11, 7,
+        12,11,11, 9,    12,12,12,11,    12,12,12,11,    13,13,13,12,
+        13,13,13,13,    13,14,13,13,    14,14,14,13,    14,14,14,14
+    },
+    {
+         4, 0, 0, 0,
+         6, 4, 0, 0,     6, 5, 4, 0,     6, 5, 5, 4,     7, 5, 5, 4,
+         7, 5, 5, 4,     7, 6, 6, 4,     7, 6, 6, 4,     8, 7, 7, 5,
+         8, 8, 7, 6,     9, 8, 8, 7,     9, 9, 8, 8,     9, 9, 9, 8,
+        10, 9, 9, 9,    10,10,10,10,    10,10,10,10,    10,10,10,10
+    },
+    {
+         6, 0, 0, 0,
+         6, 6, 0, 0,     6, 6, 6, 0,     6, 6, 6, 6,     6, 6, 6, 6,
+         6, 6, 6, 6,     6, 6, 6, 6,     6, 6, 6, 6,     6, 6, 6, 6,
+         6, 6, 6, 6,     6, 6, 6, 6,     6, 6, 6, 6,     6, 6, 6, 6,
+         6, 6, 6, 6,     6, 6, 6, 6,     6, 6, 6, 6,     6, 6, 6, 6
+    }
+};
+
+static const uint8_t h264_token_bits[4][4 * 17] = {
+    {
+         1, 0, 0, 0,
+         5, 1, 0, 0,     7, 4, 1, 0,     7, 6, 5, 3,     7, 6, 5, 3,
+         7, 6, 5, 4,    15, 6, 5, 4,    11,14, 5, 4,     8,10,13, 4,
+        15,14, 9, 4,    11,10,13,12,    15,14, 9,12,    11,10,13, 8,
+        15, 1, 9,12,    11,14,13, 8,     7,10, 9,12,     4, 6, 5, 8
+    },
+    {
+         3, 0, 0, 0,
+        11, 2, 0, 0,     7, 7, 3, 0,     7,10, 9, 5,     7, 6, 5, 4,
+         4, 6, 5, 6,     7, 6, 5, 8,    15, 6, 5, 4,    11,14,13, 4,
+        15,10, 9, 4,    11,14,13,12,     8,10, 9, 8,    15,14,13,12,
+        11,10, 9,12,     7,11, 6, 8,     9, 8,10, 1,     7, 6, 5, 4
+    },
+    {
+        15, 0, 0, 0,
+        15,14, 0, 0,    11,15,13, 0,     8,12,14,12,    15,10,11,11,
+        11, 8, 9,10,     9,14,13, 9,     8,10, 9, 8,    15,14,13,13,
+        11,14,10,12,    15,10,13,12,    11,14, 9,12,     8,10,13, 8,
+        13, 7, 9,12,     9,12,11,10,     5, 8, 7, 6,     1, 4, 3, 2
+    },
+    {
+         3, 0, 0, 0,
+         0, 1, 0, 0,     4, 5, 6, 0,     8, 9,10,11,    12,13,14,15,
+        16,17,18,19,    20,21,22,23,    24,25,26,27,    28,29,30,31,
+        32,33,34,35,    36,37,38,39,    40,41,42,43,    44,45,46,47,
+        48,49,50,51,    52,53,54,55,    56,57,58,59,    60,61,62,63
+    }
+};
+
+// indexed by TotalCoeff - 1 and total_zeros
+static const uint8_t h264_total_zeros_len[15][16] = {
+    { 1, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 9 },
+    { 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6 },
+    { 4, 3, 3, 3, 4, 4, 3, 3, 4, 5, 5, 6, 5, 6 },
+    { 5, 3, 4, 4, 3, 3, 3, 4, 3, 4, 5, 5, 5 },
+    { 4, 4, 4, 3, 3, 3, 3, 3, 4, 5, 4, 5 },
+    { 6, 5, 3, 3, 3, 3, 3, 3, 4, 3, 6 },
+    { 6, 5, 3, 3, 3, 2, 3, 4, 3, 6 },
+    { 6, 4, 5, 3, 2, 2, 3, 3, 6 },
+    { 6, 6, 4, 2, 2, 3, 2, 5 },
+    { 5, 5, 3, 2, 2, 2, 4 },
+    { 4, 4, 3, 3, 1, 3 },
+    { 4, 4, 2, 1, 3 },
+    { 3, 3, 1, 2 },
+    { 2, 2, 1 },
+    { 1, 1 }
+};
+
+static const uint8_t h264_total_zeros_bits[15][16] = {
+    { 1, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 1 },
+    { 7, 6, 5, 4, 3, 5, 4, 3, 2, 3, 2, 3, 2, 1, 0 },
+    { 5, 7, 6, 5, 4, 3, 4, 3, 2, 3, 2, 1, 1, 0 },
+    { 3, 7, 5, 4, 6, 5, 4, 3, 3, 2, 2, 1, 0 },
+    { 5, 4, 3, 7, 6, 5, 4, 3, 2, 1, 1, 0 },
+    { 1, 1, 7, 6, 5, 4, 3, 2, 1, 1, 0 },
+    { 1, 1, 5, 4, 3, 3, 2, 1, 1, 0 },
+    { 1, 1, 1, 3, 3, 2, 2, 1, 0 },
+    { 1, 0, 1, 3, 2, 1, 1, 1 },
+    { 1, 0, 1, 3, 2, 1, 1 },
+    { 0, 1, 1, 2, 1, 3 },
+    { 0, 1, 1, 1, 1 },
+    { 0, 1, 1, 1 },
+    { 0, 1, 1 },
+    { 0, 1 }
+};
+
+static const uint8_t h264_chroma_dc_total_zeros_len[3][4] = {
+    { 1, 2, 3, 3 },
+    { 1, 2, 2 },
+    { 1, 1 }
+};
+
+static const uint8_t h264_chroma_dc_total_zeros_bits[3][4] = {
+    { 1, 1, 1, 0 },
+    { 1, 1, 0 },
+    { 1, 0 }
+};
+
+// indexed by zerosLeft - 1, zerosLeft above 6 share the last row, and run_before
+static const uint8_t h264_run_len[7][15] = {
+    { 1, 1 },
+    { 1, 2, 2 },
+    { 2, 2, 2, 2 },
+    { 2, 2, 2, 3, 3 },
+    { 2, 2, 3, 3, 3, 3 },
+    { 2, 3, 3, 3, 3, 3, 3 },
+    { 3, 3, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9, 10, 11 }
+};
+
+static const uint8_t h264_run_bits[7][15] = {
+    { 1, 0 },
+    { 1, 1, 0 },
+    { 3, 2, 1, 0 },
+    { 3, 2, 1, 1, 0 },
+    { 3, 2, 3, 2, 1, 0 },
+    { 3, 0, 1, 3, 2, 5, 4 },
+    { 7, 6, 5, 4, 3, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1 }
+};
+
+void h264_writer_init(struct h264_writer_t *writer, uint8_t *data, int size)
+{
+    writer->data = data;
+    writer->size = size;
+    writer->length = 0;
+    writer->bits = 0;
+    writer->bits_count = 0;
+    writer->is_overflow = 0;
+}
+
+void h264_write_bits(struct h264_writer_t *writer, uint32_t value, int count)
+{
+    if (count == 0)
+        return;
+    writer->bits = (writer->bits << count) | (value & (0xffffffffu >> (32 - count)));
+    writer->bits_count += count;
+    while (writer->bits_count >= 8) {
+        writer->bits_count -= 8;
+        if (writer->length < writer->size)
+            writer->data[writer->length++] = writer->bits >> writer->bits_count;
+        else
+            writer->is_overflow = 1;
+    }
+}
+
+int h264_ue_size(uint32_t value)
+{
+    return ((31 - __builtin_clz(value + 1)) << 1) + 1;
+}
+
+int h264_se_size(int value)
+{
+    return h264_ue_size(value > 0? (value << 1) - 1: -value << 1);
+}
+
+void h264_write_ue(struct h264_writer_t *writer, uint32_t value)
+{
+    int count = 32 - __builtin_clz(value + 1);
+    h264_write_bits(writer, 0, count - 1);
+    h264_write_bits(writer, value + 1, count);
+}
+
+void h264_write_se(struct h264_writer_t *writer, int value)
+{
+    h264_write_ue(writer, value > 0? (value << 1) - 1: -value << 1);
+}
+
+void h264_write_trailing_bits(struct h264_writer_t *writer)
+{
+    h264_write_bits(writer, 1, 1);
+    if (writer->bits_count > 0)
+        h264_write_bits(writer, 0, 8 - writer->bits_count);
+}
+
+static void h264_write_level(struct h264_writer_t *writer, int code, int suffix_length)
+{
+    // level_prefix is limited by 15 in the baseline profile, so levels are clipped by
+    // the quantization to fit 12 bits of the suffix
+    if (suffix_length == 0) {
+        if (code < 14) {
+            h264_write_bits(writer, 1, code + 1);
+        }
+        else if (code < 30) {
+            h264_write_bits(writer, 1, 15);
+            h264_write_bits(writer, code - 14, 4);
+        }
+        else {
+            h264_write_bits(writer, 1, 16);
+            h264_write_bits(writer, code - 30, 12);
+        }
+    }
+    else if (code < (15 << suffix_length)) {
+        h264_write_bits(writer, 1, (code >> suffix_length) + 1);
+        h264_write_bits(writer, code, suffix_length);
+    }
+    else {
+        h264_write_bits(writer, 1, 16);
+        h264_write_bits(writer, code - (15 << suffix_length), 12);
+    }
+}
+
+int h264_write_residual(struct h264_writer_t *writer, const int16_t *levels, int max_count,
+    int nc)
+{
+    // coefficients are coded from the highest frequency
+    int16_t coeffs[16];
+    int runs[16];
+    int total = 0;
+    int last = max_count - 1;
+    while (last >= 0 && levels[last] == 0)
+        last--;
+    for (int i = last; i >= 0; i--) {
+        if (levels[i]) {
+            coeffs[total] = levels[i];
+            runs[total++] = 0;
+        }
+        else {
+            runs[total - 1]++;
+        }
+    }
+
+    int trailing = 0;
+    while (trailing < total && trailing < 3 && abs(coeffs[trailing]) == 1)
+        trailing++;
+
+    int token = total * 4 + trailing;
+    if (nc == -1) {
+        h264_write_bits(writer, h264_chroma_dc_token_bits[token],
+            h264_chroma_dc_token_len[token]);
+    }
+    else {
+        int table = nc < 2? 0: nc < 4? 1: nc < 8? 2: 3;
+        h264_write_bits(writer, h264_token_bits[table][token], h264_token_len[table][token]);
+    }
+    if (total == 0)
+        return 0;
+
+    for (int i = 0; i < trailing; i++)
+        h264_write_bits(writer, coeffs[i] < 0, 1);
+
+    int suffix_length = total > 10 && trailing < 3? 1: 0;
+    for (int i = trailing; i < total; i++) {
+        int level = coeffs[i];
+        int code = level > 0? (level << 1) - 2: -(level << 1) - 1;
+        // the first level after less than 3 trailing ones can't be 1
+        if (i == trailing && trailing < 3)
+            code -= 2;
+        h264_write_level(writer, code, suffix_length);
+
+        if (suffix_length == 0)
+            suffix_length = 1;
+        if (abs(level) > (3 << (suffix_length - 1)) && suffix_length < 6)
+            suffix_length++;
+    }
+
+    int zeros = last + 1 - total;
+    if (total < max_count) {
+        if (nc == -1) {
+            h264_write_bits(writer, h264_chroma_dc_total_zeros_bits[total - 1][zeros],
+                h264_chroma_dc_total_zeros_len[total - 1][zeros]);
+        }
+        else {
+            h264_write_bits(writer, h264_total_zeros_bits[total - 1][zeros],
+                h264_total_zeros_len[total - 1][zeros]);
+        }
+    }
+
+    for (int i = 0; i < total - 1 && zeros > 0; i++) {
+        int table = MIN(zeros, 7) - 1;
+        h264_write_bits(writer, h264_run_bits[table][runs[i]], h264_run_len[table][runs[i]]);
+        zeros -= runs[i];
+    }
+    return total;
+}
+
+int h264_write_nal(uint8_t *data, int size, int ref_idc, int type, const uint8_t *rbsp,
+    int length)
+{
+    ASSERT_INT(size, >, H264_START_CODE_SIZE, cleanup);
+    data[0] = 0;
+    data[1] = 0;
+    data[2] = 0;
+    data[3] = 1;
+    data[4] = (ref_idc << 5) | type;
+
+    // a start code can't appear in the payload, so 0x03 is inserted after two zero bytes
+    int pos = H264_START_CODE_SIZE + 1;
+    int zeros = 0;
+    for (int i = 0; i < length; i++) {
+        if (pos + 2 > size)
+            goto cleanup;
+        if (zeros == 2 && rbsp[i] <= 3) {
+            data[pos++] = 3;
+            zeros = 0;
+        }
+        data[pos++] = rbsp[i];
+        zeros = rbsp[i] == 0? zeros + 1: 0;
+    }
+    return pos;
+
+cleanup:
+    errno = ENOBUFS;
+    return -1;
+}
@@ -0,0 +1,61 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef h264_bitstream_h
+#define h264_bitstream_h
+
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR 5
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+
+#define H264_START_CODE_SIZE 4
+
+// collects bits of RBSP of a NAL unit, the overflow is reported once the unit is written
+struct h264_writer_t {
+    uint8_t *data;
+    int size;
+    int length;             // whole bytes written to data
+    uint64_t bits;          // bits which don't make a byte yet
+    int bits_count;
+    int is_overflow;
+};
+
+void h264_writer_init(struct h264_writer_t *writer, uint8_t *data, int size);
+// the count is 32 bits at most
+void h264_write_bits(struct h264_writer_t *writer, uint32_t value, int count);
+void h264_write_ue(struct h264_writer_t *writer, uint32_t value);
+void h264_write_se(struct h264_writer_t *writer, int value);
+// writes the stop bit and aligns RBSP by the byte
+void h264_write_trailing_bits(struct h264_writer_t *writer);
+
+// sizes of Exp-Golomb codes in bits
+int h264_ue_size(uint32_t value);
+int h264_se_size(int value);
+
+// writes residual_block_cavlc of coefficients in the order of the scan, nc is the predicted
+// amount of coefficients or -1 for the chroma DC, returns TotalCoeff of the block
+int h264_write_residual(struct h264_writer_t *writer, const int16_t *levels, int max_count,
+    int nc);
+
+// writes the NAL unit with the start code and emulation prevention bytes, returns the length
+// or -1 if the unit doesn't fit to the buffer
+int h264_write_nal(uint8_t *data, int size, int ref_idc, int type, const uint8_t *rbsp,
+    int length);
+
+#endif //h264_bitstream_h
@@ -0,0 +1,1410 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <limits.h>
+
+#include "main.h"
+#include "utils.h"
+#include "frame.h"
+#include "yuv_kernels.h"
+
+#include "h264_encoder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define H264_ENCODER_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define H264_ENCODER_NEON
+#endif
+
+#define H264_MB_I16 0
+#define H264_MB_P16 1
+#define H264_MB_SKIP 2
+
+#define H264_PRED_V 0
+#define H264_PRED_H 1
+#define H264_PRED_DC 2
+
+// level_prefix of CAVLC is limited in the baseline profile
+#define H264_LEVEL_MAX 2047
+// inter 8x8 blocks of few single levels cost more bits than they give quality
+#define H264_DECIMATE_LEVELS 2
+// intra macroblocks in P slices cost more bits for the same SAD
+#define H264_INTRA_PENALTY 24
+#define H264_SKIP_BIAS 4
+
+typedef int (*h264_sad_t)(const uint8_t *src, int src_stride, const uint8_t *ref,
+    int ref_stride);
+
+static struct format_mapping_t h264_input_formats[] = {
+    {
+        .format = VIDEO_FORMAT_I420,
+        .internal_format = VIDEO_FORMAT_I420,
+        .is_supported = 1
+    },
+    {
+        .format = VIDEO_FORMAT_YUYV,
+        .internal_format = VIDEO_FORMAT_YUYV,
+        .is_supported = 1
+    }
+};
+static struct format_mapping_t h264_output_formats[] = {
+    {
+        .format = VIDEO_FORMAT_H264,
+        .internal_format = VIDEO_FORMAT_H264,
+        .is_supported = 1
+    }
+};
+
+static const uint8_t h264_zigzag[16] = { 0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15 };
+// positions of 4x4 luma blocks in the order of coding
+static const uint8_t h264_block_x[16] = { 0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3 };
+static const uint8_t h264_block_y[16] = { 0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 3, 3, 2, 2, 3, 3 };
+
+// scaling of the transform depends on the position class of the coefficient: both
+// coordinates are even, both are odd or others
+static const uint8_t h264_class[16] = { 0, 2, 0, 2, 2, 1, 2, 1, 0, 2, 0, 2, 2, 1, 2, 1 };
+static const int h264_quant_mf[6][3] = {
+    { 13107, 5243, 8066 },
+    { 11916, 4660, 7490 },
+    { 10082, 4194, 6554 },
+    { 9362, 3647, 5825 },
+    { 8192, 3355, 5243 },
+    { 7282, 2893, 4559 }
+};
+static const int h264_dequant_v[6][3] = {
+    { 10, 16, 13 },
+    { 11, 18, 14 },
+    { 13, 20, 16 },
+    { 14, 23, 18 },
+    { 16, 25, 20 },
+    { 18, 29, 23 }
+};
+
+static const uint8_t h264_chroma_qp[52] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 29, 30,
+    31, 32, 32, 33, 34, 34, 35, 35, 36, 36, 37, 37, 37, 38, 38, 38,
+    39, 39, 39, 39
+};
+
+// weight of bits of motion vectors against SAD
+static const uint8_t h264_lambda[52] = {
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+     2,  2,  2,  2,  3,  3,  3,  4,  4,  4,  5,  6,  6,  7,  8,  9,
+    10, 11, 13, 14, 16, 18, 20, 23, 25, 29, 32, 36, 40, 45, 51, 57,
+    64, 72, 81, 91
+};
+
+// codeNum of coded_block_pattern of inter macroblocks
+static const uint8_t h264_inter_cbp[48] = {
+     0,  2,  3,  7,  4,  8, 17, 13,  5, 18,  9, 14, 10, 15, 16, 11,
+     1, 32, 33, 36, 34, 37, 44, 40, 35, 45, 38, 41, 39, 42, 43, 19,
+     6, 24, 25, 20, 26, 21, 46, 28, 27, 47, 22, 29, 23, 30, 31, 12
+};
+
+// the macroblock which is being encoded by the slice
+struct h264_mb_context_t {
+    struct h264_slice_t *slice;
+    struct h264_writer_t *writer;
+    int mb_x;
+    int mb_y;
+    int is_left;
+    int is_top;
+    int is_top_left;
+    int is_top_right;
+    int skip_run;
+
+    int type;
+    int intra_mode;
+    int16_t mv[2];
+    int16_t mvp[2];
+    int16_t skip_mv[2];
+
+    uint8_t pred[256];
+    uint8_t pred_chroma[2][64];
+    int16_t dc[16];
+    int16_t luma[16][16];
+    int16_t chroma_dc[2][4];
+    int16_t chroma_ac[2][4][15];
+    int cbp_luma;
+    int cbp_chroma;
+};
+
+static struct h264_encoder_state_t enc = {
+    .in_format = VIDEO_FORMAT_UNKNOWN,
+    .out_format = VIDEO_FORMAT_UNKNOWN,
+    .pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .in_pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .frame = NULL,
+    .recon = NULL,
+    .ref = NULL,
+    .mbs = NULL,
+    .nz = NULL,
+    .nz_chroma = { NULL, NULL },
+    .slices = NULL,
+    .qp = H264_ENCODER_QP_DEF
+};
+
+static struct filter_t h264_filter;
+static h264_sad_t h264_sad;
+static uint8_t *h264_slices_data;
+
+extern struct app_state_t app;
+extern filters_t filters;
+
+static int h264_scalar_sad16x16(const uint8_t *src, int src_stride, const uint8_t *ref,
+    int ref_stride)
+{
+    int sad = 0;
+    for (int y = 0; y < 16; y++, src += src_stride, ref += ref_stride)
+        for (int x = 0; x < 16; x++)
+            sad += abs(src[x] - ref[x]);
+    return sad;
+}
+
+#ifdef H264_ENCODER_X86
+__attribute__((target("sse2")))
+static int h264_sse2_sad16x16(const uint8_t *src, int src_stride, const uint8_t *ref,
+    int ref_stride)
+{
+    __m128i sum = _mm_setzero_si128();
+    for (int y = 0; y < 16; y++, src += src_stride, ref += ref_stride) {
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        __m128i r = _mm_loadu_si128((const __m128i *)ref);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(s, r));
+    }
+    return _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+}
+#endif //H264_ENCODER_X86
+
+#ifdef H264_ENCODER_NEON
+static int h264_neon_sad16x16(const uint8_t *src, int src_stride, const uint8_t *ref,
+    int ref_stride)
+{
+    uint16x8_t sum = vdupq_n_u16(0);
+    for (int y = 0; y < 16; y++, src += src_stride, ref += ref_stride) {
+        uint8x16_t s = vld1q_u8(src);
+        uint8x16_t r = vld1q_u8(ref);
+        sum = vabal_u8(sum, vget_low_u8(s), vget_low_u8(r));
+        sum = vabal_u8(sum, vget_high_u8(s), vget_high_u8(r));
+    }
+    uint64x2_t total = vpaddlq_u32(vpaddlq_u16(sum));
+    return vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+}
+#endif //H264_ENCODER_NEON
+
+static const char *h264_set_sad()
+{
+    h264_sad = h264_scalar_sad16x16;
+#ifdef H264_ENCODER_X86
+    if (__builtin_cpu_supports("sse2")) {
+        h264_sad = h264_sse2_sad16x16;
+        return "sse2";
+    }
+#elif defined(H264_ENCODER_NEON)
+    h264_sad = h264_neon_sad16x16;
+    return "neon";
+#endif
+    return "scalar";
+}
+
+// the frame is aligned by macroblocks, planes of chroma follow the plane of luma
+static uint8_t *h264_get_plane(uint8_t *data, int plane)
+{
+    int luma = enc.stride * enc.mb_height * 16;
+    return plane == 0? data: data + luma + (plane - 1) * (luma >> 2);
+}
+
+static int h264_get_frame_length()
+{
+    // motion compensation of chroma reads one row after the block with the zero weight
+    return enc.stride * enc.mb_height * 16 * 3 / 2 + enc.stride;
+}
+
+static void h264_set_planes(struct frame_t *frame, uint8_t *data)
+{
+    frame->format = VIDEO_FORMAT_I420;
+    frame->width = app.video_width;
+    frame->height = app.video_height;
+    frame->planes_count = 3;
+    for (int i = 0; i < 3; i++) {
+        frame->planes[i] = h264_get_plane(data, i);
+        frame->strides[i] = i == 0? enc.stride: enc.stride >> 1;
+    }
+    frame->length = enc.stride * enc.mb_height * 16 * 3 / 2;
+}
+
+static void h264_cleanup()
+{
+    if (enc.frame) {
+        CALL(frame_unref(enc.frame));
+        enc.frame = NULL;
+    }
+    frame_pool_cleanup(&enc.pool);
+    frame_pool_cleanup(&enc.in_pool);
+    bands_cleanup(&enc.bands);
+    if (enc.is_mutex) {
+        CALL(pthread_mutex_destroy(&enc.mutex));
+        enc.is_mutex = 0;
+    }
+    if (enc.recon) {
+        free(enc.recon);
+        enc.recon = NULL;
+    }
+    if (enc.ref) {
+        free(enc.ref);
+        enc.ref = NULL;
+    }
+    if (enc.mbs) {
+        free(enc.mbs);
+        enc.mbs = NULL;
+    }
+    if (enc.nz) {
+        free(enc.nz);
+        enc.nz = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (enc.nz_chroma[i]) {
+            free(enc.nz_chroma[i]);
+            enc.nz_chroma[i] = NULL;
+        }
+    }
+    if (enc.slices) {
+        free(enc.slices);
+        enc.slices = NULL;
+    }
+    if (h264_slices_data) {
+        free(h264_slices_data);
+        h264_slices_data = NULL;
+    }
+}
+
+static void h264_write_sps()
+{
+    struct h264_writer_t writer;
+    h264_writer_init(&writer, enc.sps, sizeof(enc.sps));
+
+    int mbs = enc.mb_width * enc.mb_height;
+    int level = mbs <= 1620? 30: mbs <= 3600? 31: mbs <= 8192? 40: 51;
+    h264_write_bits(&writer, H264_ENCODER_PROFILE, 8);
+    // constraint_set0_flag and constraint_set1_flag, the stream is constrained baseline
+    h264_write_bits(&writer, 0xc0, 8);
+    h264_write_bits(&writer, level, 8);
+    h264_write_ue(&writer, 0);                      // seq_parameter_set_id
+    h264_write_ue(&writer, 0);                      // log2_max_frame_num_minus4
+    h264_write_ue(&writer, 2);                      // pic_order_cnt_type, the order of decoding
+    h264_write_ue(&writer, 1);                      // max_num_ref_frames
+    h264_write_bits(&writer, 0, 1);                 // gaps_in_frame_num_value_allowed_flag
+    h264_write_ue(&writer, enc.mb_width - 1);
+    h264_write_ue(&writer, enc.mb_height - 1);
+    h264_write_bits(&writer, 1, 1);                 // frame_mbs_only_flag
+    h264_write_bits(&writer, 1, 1);                 // direct_8x8_inference_flag
+
+    // the frame is cropped by pairs of pixels of 4:2:0 formats
+    int crop_right = (enc.mb_width * 16 - app.video_width) >> 1;
+    int crop_bottom = (enc.mb_height * 16 - app.video_height) >> 1;
+    int is_cropped = crop_right > 0 || crop_bottom > 0;
+    h264_write_bits(&writer, is_cropped, 1);
+    if (is_cropped) {
+        h264_write_ue(&writer, 0);
+        h264_write_ue(&writer, crop_right);
+        h264_write_ue(&writer, 0);
+        h264_write_ue(&writer, crop_bottom);
+    }
+    h264_write_bits(&writer, 0, 1);                 // vui_parameters_present_flag
+    h264_write_trailing_bits(&writer);
+    enc.sps_length = writer.length;
+}
+
+static void h264_write_pps()
+{
+    struct h264_writer_t writer;
+    h264_writer_init(&writer, enc.pps, sizeof(enc.pps));
+    h264_write_ue(&writer, 0);                      // pic_parameter_set_id
+    h264_write_ue(&writer, 0);                      // seq_parameter_set_id
+    h264_write_bits(&writer, 0, 1);                 // entropy_coding_mode_flag, CAVLC
+    h264_write_bits(&writer, 0, 1);                 // bottom_field_pic_order_in_frame_present_flag
+    h264_write_ue(&writer, 0);                      // num_slice_groups_minus1
+    h264_write_ue(&writer, 0);                      // num_ref_idx_l0_default_active_minus1
+    h264_write_ue(&writer, 0);                      // num_ref_idx_l1_default_active_minus1
+    h264_write_bits(&writer, 0, 1);                 // weighted_pred_flag
+    h264_write_bits(&writer, 0, 2);                 // weighted_bipred_idc
+    h264_write_se(&writer, 0);                      // pic_init_qp_minus26
+    h264_write_se(&writer, 0);                      // pic_init_qs_minus26
+    h264_write_se(&writer, 0);                      // chroma_qp_index_offset
+    h264_write_bits(&writer, 1, 1);                 // deblocking_filter_control_present_flag
+    h264_write_bits(&writer, 0, 1);                 // constrained_intra_pred_flag
+    h264_write_bits(&writer, 0, 1);                 // redundant_pic_cnt_present_flag
+    h264_write_trailing_bits(&writer);
+    enc.pps_length = writer.length;
+}
+
+static int h264_init()
+{
+    ASSERT_PTR(enc.pool.frames, ==, NULL, cleanup);
+
+    enc.mb_width = (app.video_width + 15) >> 4;
+    enc.mb_height = (app.video_height + 15) >> 4;
+    enc.stride = enc.mb_width << 4;
+    int mbs = enc.mb_width * enc.mb_height;
+
+    // encoded frames can be held by slow consumers, so the pool has as many frames as
+    // the input, the encoded frame doesn't exceed uncompressed one
+    int len = h264_get_frame_length() + H264_ENCODER_HEADER_BYTES * 2;
+    CALL(frame_pool_init(&enc.pool, MAX(app.video_buffers, 2), len), cleanup);
+    // the previous filter writes the next frame while the current one is being encoded
+    CALL(frame_pool_init(&enc.in_pool, 3, h264_get_frame_length()), cleanup);
+
+    enc.recon = malloc(h264_get_frame_length());
+    enc.ref = malloc(h264_get_frame_length());
+    enc.mbs = calloc(mbs, sizeof(struct h264_mb_t));
+    enc.nz = calloc(mbs * 16, 1);
+    enc.nz_chroma[0] = calloc(mbs * 4, 1);
+    enc.nz_chroma[1] = calloc(mbs * 4, 1);
+    enc.slices = calloc(enc.mb_height, sizeof(struct h264_slice_t));
+    h264_slices_data = malloc(mbs * H264_ENCODER_MB_BYTES);
+    if (!enc.recon || !enc.ref || !enc.mbs || !enc.nz || !enc.nz_chroma[0] ||
+        !enc.nz_chroma[1] || !enc.slices || !h264_slices_data
+    ) {
+        errno = ENOMEM;
+        CALL_MESSAGE(malloc(h264_get_frame_length()));
+        goto cleanup;
+    }
+
+    int res = pthread_mutex_init(&enc.mutex, NULL);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_init(&enc.mutex, NULL), res);
+        goto cleanup;
+    }
+    enc.is_mutex = 1;
+
+    CALL(yuv_kernels_init(), cleanup);
+    CALL(bands_init(&enc.bands, MIN(app.h264_slices, enc.mb_height), app.band_threads),
+        cleanup);
+    const char *kernel = h264_set_sad();
+    DEBUG("h264_encoder: %dx%d macroblocks, %d slices, %s SAD", enc.mb_width, enc.mb_height,
+        enc.bands.count, kernel);
+
+    h264_write_sps();
+    h264_write_pps();
+    return 0;
+
+cleanup:
+    h264_cleanup();
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int h264_start(int input_format, int output_format)
+{
+    ASSERT_INT(output_format, ==, VIDEO_FORMAT_H264, cleanup);
+    for (int i = 0; i < ARRAY_SIZE(h264_input_formats); i++) {
+        if (h264_input_formats[i].format == input_format) {
+            enc.in_format = input_format;
+            enc.out_format = output_format;
+            // the stream starts from the IDR frame
+            enc.frames = 0;
+            enc.bitrate = app.h264_bitrate;
+            enc.qp = H264_ENCODER_QP_DEF;
+            enc.fullness = 0;
+            enc.frame_us = 1000000 / H264_ENCODER_FPS;
+            enc.timestamp.tv_sec = 0;
+            enc.timestamp.tv_usec = 0;
+            return 0;
+        }
+    }
+
+cleanup:
+    errno = EINVAL;
+    return -1;
+}
+
+static int h264_is_started()
+{
+    return enc.out_format != VIDEO_FORMAT_UNKNOWN? 1: 0;
+}
+
+static int h264_stop()
+{
+    if (enc.frame) {
+        CALL(frame_unref(enc.frame));
+        enc.frame = NULL;
+    }
+    enc.in_format = VIDEO_FORMAT_UNKNOWN;
+    enc.out_format = VIDEO_FORMAT_UNKNOWN;
+    enc.slice_output = NULL;
+    bands_print_stats(&enc.bands, h264_filter.name);
+    return 0;
+}
+
+// hands out the next source buffer, so the previous filter writes the frame right there
+static int h264_get_in_frame(int format, struct frame_t **frame)
+{
+    *frame = NULL;
+    if (format != VIDEO_FORMAT_I420 || enc.in_format != VIDEO_FORMAT_I420)
+        return 0;
+
+    struct frame_t *in = frame_pool_get(&enc.in_pool);
+    if (in == NULL)
+        return 0;
+    h264_set_planes(in, in->planes[0]);
+    *frame = in;
+    return 0;
+}
+
+// replicates the last column and the last row of the frame to whole macroblocks
+static void h264_pad_plane(uint8_t *plane, int stride, int width, int height, int rows)
+{
+    if (width < stride)
+        for (int y = 0; y < height; y++)
+            memset(plane + y * stride + width, plane[y * stride + width - 1], stride - width);
+    for (int y = height; y < rows; y++)
+        memcpy(plane + y * stride, plane + (height - 1) * stride, stride);
+}
+
+// returns the source buffer with the frame, the caller drops the reference
+static struct frame_t *h264_load_frame(struct frame_t *frame)
+{
+    struct frame_t *source = NULL;
+    if (frame->pool == &enc.in_pool) {
+        // the previous filter has already written the frame to the source buffer
+        source = frame_ref(frame);
+    }
+    else {
+        source = frame_pool_get(&enc.in_pool);
+        if (source == NULL) {
+            CALL_MESSAGE(frame_pool_get(&enc.in_pool));
+            goto cleanup;
+        }
+        h264_set_planes(source, source->planes[0]);
+        int res = frame->format == VIDEO_FORMAT_YUYV?
+            yuv_kernels_convert(frame, source): frame_copy_planes(source, frame);
+        if (res == -1) {
+            CALL_MESSAGE(h264_load_frame(frame));
+            goto cleanup;
+        }
+    }
+
+    int rows = enc.mb_height * 16;
+    h264_pad_plane(source->planes[0], enc.stride, app.video_width, app.video_height, rows);
+    for (int i = 1; i < 3; i++)
+        h264_pad_plane(source->planes[i], enc.stride >> 1, (app.video_width + 1) >> 1,
+            (app.video_height + 1) >> 1, rows >> 1);
+    return source;
+
+cleanup:
+    if (source)
+        CALL(frame_unref(source));
+    if (errno == 0)
+        errno = EAGAIN;
+    return NULL;
+}
+
+static uint8_t h264_clip(int value)
+{
+    return value < 0? 0: value > 255? 255: value;
+}
+
+// the forward core transform of the residual, coefficients are in the raster order
+static void h264_fdct4x4(int *coeffs, const uint8_t *src, int src_stride, const uint8_t *pred,
+    int pred_stride)
+{
+    int tmp[16];
+    for (int y = 0; y < 4; y++, src += src_stride, pred += pred_stride) {
+        int s03 = (src[0] - pred[0]) + (src[3] - pred[3]);
+        int d03 = (src[0] - pred[0]) - (src[3] - pred[3]);
+        int s12 = (src[1] - pred[1]) + (src[2] - pred[2]);
+        int d12 = (src[1] - pred[1]) - (src[2] - pred[2]);
+        tmp[y * 4] = s03 + s12;
+        tmp[y * 4 + 1] = (d03 << 1) + d12;
+        tmp[y * 4 + 2] = s03 - s12;
+        tmp[y * 4 + 3] = d03 - (d12 << 1);
+    }
+    for (int x = 0; x < 4; x++) {
+        int s03 = tmp[x] + tmp[12 + x];
+        int d03 = tmp[x] - tmp[12 + x];
+        int s12 = tmp[4 + x] + tmp[8 + x];
+        int d12 = tmp[4 + x] - tmp[8 + x];
+        coeffs[x] = s03 + s12;
+        coeffs[4 + x] = (d03 << 1) + d12;
+        coeffs[8 + x] = s03 - s12;
+        coeffs[12 + x] = d03 - (d12 << 1);
+    }
+}
+
+// the inverse transform of the clause 8.5.12 which adds the residual to the prediction
+static void h264_idct4x4_add(uint8_t *dst, int stride, const uint8_t *pred, int pred_stride,
+    const int *coeffs)
+{
+    int tmp[16];
+    for (int y = 0; y < 4; y++) {
+        const int *d = coeffs + y * 4;
+        int e = d[0] + d[2];
+        int f = d[0] - d[2];
+        int g = (d[1] >> 1) - d[3];
+        int h = d[1] + (d[3] >> 1);
+        tmp[y * 4] = e + h;
+        tmp[y * 4 + 1] = f + g;
+        tmp[y * 4 + 2] = f - g;
+        tmp[y * 4 + 3] = e - h;
+    }
+    for (int x = 0; x < 4; x++) {
+        int e = tmp[x] + tmp[8 + x];
+        int f = tmp[x] - tmp[8 + x];
+        int g = (tmp[4 + x] >> 1) - tmp[12 + x];
+        int h = tmp[4 + x] + (tmp[12 + x] >> 1);
+        dst[x] = h264_clip(pred[x] + ((e + h + 32) >> 6));
+        dst[stride + x] = h264_clip(pred[pred_stride + x] + ((f + g + 32) >> 6));
+        dst[stride * 2 + x] = h264_clip(pred[pred_stride * 2 + x] + ((f - g + 32) >> 6));
+        dst[stride * 3 + x] = h264_clip(pred[pred_stride * 3 + x] + ((e - h + 32) >> 6));
+    }
+}
+
+static int h264_quant_level(int coeff, int mf, int bias, int shift)
+{
+    int level = (abs(coeff) * mf + bias) >> shift;
+    if (level > H264_LEVEL_MAX)
+        level = H264_LEVEL_MAX;
+    return coeff < 0? -level: level;
+}
+
+// quantizes coefficients from the start of the scan, returns the amount of levels
+static int h264_quant4x4(const int *coeffs, int16_t *levels, int qp, int is_intra, int start)
+{
+    int shift = 15 + qp / 6;
+    int bias = (1 << shift) / (is_intra? 3: 6);
+    const int *mf = h264_quant_mf[qp % 6];
+    int count = 0;
+    for (int i = start; i < 16; i++) {
+        int pos = h264_zigzag[i];
+        levels[i - start] = h264_quant_level(coeffs[pos], mf[h264_class[pos]], bias, shift);
+        count += levels[i - start] != 0;
+    }
+    return count;
+}
+
+static void h264_dequant4x4(int *coeffs, const int16_t *levels, int qp, int start)
+{
+    const int *v = h264_dequant_v[qp % 6];
+    int shift = qp / 6;
+    for (int i = start; i < 16; i++) {
+        int pos = h264_zigzag[i];
+        coeffs[pos] = (levels[i - start] * v[h264_class[pos]]) << shift;
+    }
+}
+
+// the Hadamard transform of DC coefficients of the 16x16 luma prediction, in place
+static void h264_hadamard4x4(int *d)
+{
+    int tmp[16];
+    for (int y = 0; y < 4; y++) {
+        int *r = d + y * 4;
+        tmp[y * 4] = r[0] + r[1] + r[2] + r[3];
+        tmp[y * 4 + 1] = r[0] + r[1] - r[2] - r[3];
+        tmp[y * 4 + 2] = r[0] - r[1] - r[2] + r[3];
+        tmp[y * 4 + 3] = r[0] - r[1] + r[2] - r[3];
+    }
+    for (int x = 0; x < 4; x++) {
+        d[x] = tmp[x] + tmp[4 + x] + tmp[8 + x] + tmp[12 + x];
+        d[4 + x] = tmp[x] + tmp[4 + x] - tmp[8 + x] - tmp[12 + x];
+        d[8 + x] = tmp[x] - tmp[4 + x] - tmp[8 + x] + tmp[12 + x];
+        d[12 + x] = tmp[x] - tmp[4 + x] + tmp[8 + x] - tmp[12 + x];
+    }
+}
+
+static void h264_hadamard2x2(int *d)
+{
+    int d0 = d[0] + d[1] + d[2] + d[3];
+    int d1 = d[0] - d[1] + d[2] - d[3];
+    int d2 = d[0] + d[1] - d[2] - d[3];
+    int d3 = d[0] - d[1] - d[2] + d[3];
+    d[0] = d0;
+    d[1] = d1;
+    d[2] = d2;
+    d[3] = d3;
+}
+
+static void h264_get_mb_context(struct h264_mb_context_t *ctx, int mb_x, int mb_y)
+{
+    ctx->mb_x = mb_x;
+    ctx->mb_y = mb_y;
+    // slices are independent, so the macroblock can't be predicted by other slices
+    ctx->is_left = mb_x > 0;
+    ctx->is_top = mb_y > ctx->slice->mb_y_start;
+    ctx->is_top_left = ctx->is_top && mb_x > 0;
+    ctx->is_top_right = ctx->is_top && mb_x + 1 < enc.mb_width;
+}
+
+// chooses the mode of the 16x16 luma prediction by SAD, DC is always available
+static int h264_predict_intra16(struct h264_mb_context_t *ctx, const uint8_t *src)
+{
+    uint8_t *recon = enc.recon + (ctx->mb_y * enc.stride + ctx->mb_x) * 16;
+    const uint8_t *top = recon - enc.stride;
+    uint8_t pred[256];
+    int sum = 0;
+    for (int i = 0; i < 16; i++) {
+        sum += ctx->is_top? top[i]: 0;
+        sum += ctx->is_left? recon[i * enc.stride - 1]: 0;
+    }
+    int dc = ctx->is_top && ctx->is_left? (sum + 16) >> 5:
+        ctx->is_top || ctx->is_left? (sum + 8) >> 4: 128;
+    memset(ctx->pred, dc, sizeof(ctx->pred));
+    ctx->intra_mode = H264_PRED_DC;
+    int best = h264_sad(src, enc.stride, ctx->pred, 16);
+
+    if (ctx->is_top) {
+        for (int y = 0; y < 16; y++)
+            memcpy(pred + y * 16, top, 16);
+        int sad = h264_sad(src, enc.stride, pred, 16);
+        if (sad < best) {
+            best = sad;
+            ctx->intra_mode = H264_PRED_V;
+            memcpy(ctx->pred, pred, sizeof(pred));
+        }
+    }
+    if (ctx->is_left) {
+        for (int y = 0; y < 16; y++)
+            memset(pred + y * 16, recon[y * enc.stride - 1], 16);
+        int sad = h264_sad(src, enc.stride, pred, 16);
+        if (sad < best) {
+            best = sad;
+            ctx->intra_mode = H264_PRED_H;
+            memcpy(ctx->pred, pred, sizeof(pred));
+        }
+    }
+    return best;
+}
+
+// the DC prediction of chroma is done for every 4x4 block of the clause 8.3.4.1
+static void h264_predict_intra_chroma(struct h264_mb_context_t *ctx)
+{
+    int stride = enc.stride >> 1;
+    for (int c = 0; c < 2; c++) {
+        uint8_t *recon = h264_get_plane(enc.recon, c + 1) + (ctx->mb_y * stride + ctx->mb_x) * 8;
+        for (int b = 0; b < 4; b++) {
+            int bx = (b & 1) * 4, by = (b >> 1) * 4;
+            int top = 0, left = 0;
+            for (int i = 0; i < 4; i++) {
+                top += ctx->is_top? recon[bx + i - stride]: 0;
+                left += ctx->is_left? recon[(by + i) * stride - 1]: 0;
+            }
+            // the top right block prefers the top neighbours, other blocks prefer the left ones
+            int dc = 128;
+            if ((b == 0 || b == 3) && ctx->is_top && ctx->is_left)
+                dc = (top + left + 4) >> 3;
+            else if (b == 1)
+                dc = ctx->is_top? (top + 2) >> 2: ctx->is_left? (left + 2) >> 2: 128;
+            else
+                dc = ctx->is_left? (left + 2) >> 2: ctx->is_top? (top + 2) >> 2: 128;
+            for (int y = 0; y < 4; y++)
+                memset(ctx->pred_chroma[c] + (by + y) * 8 + bx, dc, 4);
+        }
+    }
+}
+
+// transforms and quantizes the luma residual of the 16x16 prediction, the macroblock is
+// reconstructed as decoders do it
+static void h264_encode_intra16(struct h264_mb_context_t *ctx, const uint8_t *src)
+{
+    int qp = enc.qp;
+    int coeffs[16][16];
+    int dc[16];
+    ctx->cbp_luma = 0;
+    for (int i = 0; i < 16; i++) {
+        int x = h264_block_x[i] * 4, y = h264_block_y[i] * 4;
+        h264_fdct4x4(coeffs[i], src + y * enc.stride + x, enc.stride, ctx->pred + y * 16 + x, 16);
+        dc[h264_block_y[i] * 4 + h264_block_x[i]] = coeffs[i][0];
+        if (h264_quant4x4(coeffs[i], ctx->luma[i], qp, 1, 1))
+            ctx->cbp_luma = 15;
+    }
+
+    // DC coefficients are transformed once more and quantized with the double precision
+    h264_hadamard4x4(dc);
+    int shift = 16 + qp / 6;
+    int bias = (1 << shift) / 3;
+    int mf = h264_quant_mf[qp % 6][0];
+    for (int i = 0; i < 16; i++)
+        ctx->dc[i] = h264_quant_level((dc[h264_zigzag[i]] + 1) >> 1, mf, bias, shift);
+
+    for (int i = 0; i < 16; i++)
+        dc[h264_zigzag[i]] = ctx->dc[i];
+    h264_hadamard4x4(dc);
+    int scale = h264_dequant_v[qp % 6][0] << 4;
+    for (int i = 0; i < 16; i++)
+        dc[i] = qp >= 36? (dc[i] * scale) << (qp / 6 - 6):
+            (dc[i] * scale + (1 << (5 - qp / 6))) >> (6 - qp / 6);
+
+    uint8_t *recon = enc.recon + (ctx->mb_y * enc.stride + ctx->mb_x) * 16;
+    for (int i = 0; i < 16; i++) {
+        int x = h264_block_x[i] * 4, y = h264_block_y[i] * 4;
+        h264_dequant4x4(coeffs[i], ctx->luma[i], qp, 1);
+        coeffs[i][0] = dc[h264_block_y[i] * 4 + h264_block_x[i]];
+        h264_idct4x4_add(recon + y * enc.stride + x, enc.stride, ctx->pred + y * 16 + x, 16,
+            coeffs[i]);
+    }
+}
+
+static void h264_encode_inter16(struct h264_mb_context_t *ctx, const uint8_t *src)
+{
+    int qp = enc.qp;
+    int coeffs[16][16];
+    int counts[16];
+    ctx->cbp_luma = 0;
+    for (int i = 0; i < 16; i++) {
+        int x = h264_block_x[i] * 4, y = h264_block_y[i] * 4;
+        h264_fdct4x4(coeffs[i], src + y * enc.stride + x, enc.stride, ctx->pred + y * 16 + x, 16);
+        counts[i] = h264_quant4x4(coeffs[i], ctx->luma[i], qp, 0, 0);
+    }
+
+    // 8x8 blocks of few single levels are dropped, so the macroblock is more likely skipped
+    for (int b = 0; b < 4; b++) {
+        int count = 0, max = 0;
+        for (int i = b * 4; i < b * 4 + 4; i++) {
+            count += counts[i];
+            for (int j = 0; j < 16; j++)
+                max = MAX(max, abs(ctx->luma[i][j]));
+        }
+        if (count > H264_DECIMATE_LEVELS || max > 1)
+            ctx->cbp_luma |= 1 << b;
+        else if (count > 0)
+            memset(ctx->luma[b * 4], 0, sizeof(ctx->luma[0]) * 4);
+    }
+
+    uint8_t *recon = enc.recon + (ctx->mb_y * enc.stride + ctx->mb_x) * 16;
+    for (int i = 0; i < 16; i++) {
+        int x = h264_block_x[i] * 4, y = h264_block_y[i] * 4;
+        h264_dequant4x4(coeffs[i], ctx->luma[i], qp, 0);
+        h264_idct4x4_add(recon + y * enc.stride + x, enc.stride, ctx->pred + y * 16 + x, 16,
+            coeffs[i]);
+    }
+}
+
+static void h264_encode_chroma(struct h264_mb_context_t *ctx, int is_intra)
+{
+    int qp = h264_chroma_qp[enc.qp];
+    int stride = enc.stride >> 1;
+    int coeffs[2][4][16];
+    int dc[2][4];
+    int ac_count = 0, dc_count = 0;
+    int shift = 16 + qp / 6;
+    int bias = (1 << shift) / (is_intra? 3: 6);
+    int mf = h264_quant_mf[qp % 6][0];
+    for (int c = 0; c < 2; c++) {
+        const uint8_t *src = h264_get_plane(enc.source, c + 1) +
+            (ctx->mb_y * stride + ctx->mb_x) * 8;
+        for (int b = 0; b < 4; b++) {
+            int x = (b & 1) * 4, y = (b >> 1) * 4;
+            h264_fdct4x4(coeffs[c][b], src + y * stride + x, stride,
+                ctx->pred_chroma[c] + y * 8 + x, 8);
+            dc[c][b] = coeffs[c][b][0];
+            ac_count += h264_quant4x4(coeffs[c][b], ctx->chroma_ac[c][b], qp, is_intra, 1);
+        }
+        h264_hadamard2x2(dc[c]);
+        for (int b = 0; b < 4; b++) {
+            ctx->chroma_dc[c][b] = h264_quant_level(dc[c][b], mf, bias, shift);
+            dc_count += ctx->chroma_dc[c][b] != 0;
+        }
+    }
+    ctx->cbp_chroma = ac_count? 2: dc_count? 1: 0;
+
+    int scale = h264_dequant_v[qp % 6][0] << 4;
+    for (int c = 0; c < 2; c++) {
+        uint8_t *recon = h264_get_plane(enc.recon, c + 1) + (ctx->mb_y * stride + ctx->mb_x) * 8;
+        for (int b = 0; b < 4; b++)
+            dc[c][b] = ctx->chroma_dc[c][b];
+        h264_hadamard2x2(dc[c]);
+        for (int b = 0; b < 4; b++) {
+            int x = (b & 1) * 4, y = (b >> 1) * 4;
+            h264_dequant4x4(coeffs[c][b], ctx->chroma_ac[c][b], qp, 1);
+            coeffs[c][b][0] = ((dc[c][b] * scale) << (qp / 6)) >> 5;
+            h264_idct4x4_add(recon + y * stride + x, stride, ctx->pred_chroma[c] + y * 8 + x, 8,
+                coeffs[c][b]);
+        }
+    }
+}
+
+static int h264_median(int a, int b, int c)
+{
+    return MAX(MIN(a, b), MIN(MAX(a, b), c));
+}
+
+// predicts the motion vector of the 16x16 partition and the vector of P_Skip by neighbours
+// of the clause 8.4.1
+static void h264_predict_mv(struct h264_mb_context_t *ctx)
+{
+    static const struct h264_mb_t none = { .mv = { 0, 0 }, .ref = -1 };
+    const struct h264_mb_t *mb = enc.mbs + ctx->mb_y * enc.mb_width + ctx->mb_x;
+    const struct h264_mb_t *a = ctx->is_left? mb - 1: &none;
+    const struct h264_mb_t *b = ctx->is_top? mb - enc.mb_width: &none;
+    // the top left neighbour replaces the top right one which isn't available
+    const struct h264_mb_t *c = ctx->is_top_right? mb - enc.mb_width + 1:
+        ctx->is_top_left? mb - enc.mb_width - 1: &none;
+
+    int refs = (a->ref == 0) + (b->ref == 0) + (c->ref == 0);
+    for (int i = 0; i < 2; i++) {
+        if (!ctx->is_top && ctx->is_left)
+            ctx->mvp[i] = a->mv[i];
+        else if (refs == 1)
+            ctx->mvp[i] = a->ref == 0? a->mv[i]: b->ref == 0? b->mv[i]: c->mv[i];
+        else
+            ctx->mvp[i] = h264_median(a->mv[i], b->mv[i], c->mv[i]);
+    }
+
+    int is_zero = !ctx->is_left || !ctx->is_top ||
+        (a->ref == 0 && a->mv[0] == 0 && a->mv[1] == 0) ||
+        (b->ref == 0 && b->mv[0] == 0 && b->mv[1] == 0);
+    ctx->skip_mv[0] = is_zero? 0: ctx->mvp[0];
+    ctx->skip_mv[1] = is_zero? 0: ctx->mvp[1];
+}
+
+struct h264_search_t {
+    const uint8_t *src;
+    const uint8_t *ref;
+    int min_x;
+    int max_x;
+    int min_y;
+    int max_y;
+    int lambda;
+    const int16_t *mvp;
+
+    int cost;
+    int sad;
+    int x;
+    int y;
+};
+
+// returns SAD of the vector in pixels or -1 if the vector is out of the window
+static int h264_check_mv(struct h264_search_t *search, int x, int y)
+{
+    if (x < search->min_x || x > search->max_x || y < search->min_y || y > search->max_y)
+        return -1;
+    int sad = h264_sad(search->src, enc.stride, search->ref + y * enc.stride + x, enc.stride);
+    int cost = sad + search->lambda *
+        (h264_se_size((x << 2) - search->mvp[0]) + h264_se_size((y << 2) - search->mvp[1]));
+    if (cost < search->cost) {
+        search->cost = cost;
+        search->sad = sad;
+        search->x = x;
+        search->y = y;
+    }
+    return sad;
+}
+
+// the search starts from predicted vectors and refines the best one by diamonds of
+// decreasing steps, vectors stay in the frame, so the reference isn't extended, returns
+// the cost of the chosen vector
+static int h264_search(struct h264_mb_context_t *ctx, const uint8_t *src)
+{
+    static const int8_t diamond[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+    int x = ctx->mb_x * 16, y = ctx->mb_y * 16;
+    int mvp_x = ctx->mvp[0] >> 2, mvp_y = ctx->mvp[1] >> 2;
+    struct h264_search_t search = {
+        .src = src,
+        .ref = enc.ref + y * enc.stride + x,
+        .min_x = MAX(-x, mvp_x - H264_ENCODER_SEARCH),
+        .max_x = MIN(enc.stride - 16 - x, mvp_x + H264_ENCODER_SEARCH),
+        .min_y = MAX(-y, mvp_y - H264_ENCODER_SEARCH),
+        .max_y = MIN(enc.mb_height * 16 - 16 - y, mvp_y + H264_ENCODER_SEARCH),
+        .lambda = h264_lambda[enc.qp],
+        .mvp = ctx->mvp,
+        .cost = INT_MAX
+    };
+
+    int skip_sad = h264_check_mv(&search, ctx->skip_mv[0] >> 2, ctx->skip_mv[1] >> 2);
+    h264_check_mv(&search, mvp_x, mvp_y);
+    h264_check_mv(&search, 0, 0);
+    const struct h264_mb_t *mb = enc.mbs + ctx->mb_y * enc.mb_width + ctx->mb_x;
+    if (ctx->is_left && mb[-1].ref == 0)
+        h264_check_mv(&search, mb[-1].mv[0] >> 2, mb[-1].mv[1] >> 2);
+    if (ctx->is_top && mb[-enc.mb_width].ref == 0)
+        h264_check_mv(&search, mb[-enc.mb_width].mv[0] >> 2, mb[-enc.mb_width].mv[1] >> 2);
+
+    for (int step = 4; step > 0 && search.cost < INT_MAX; step >>= 1) {
+        for (int i = 0; i < H264_ENCODER_SEARCH; i++) {
+            int center_x = search.x, center_y = search.y;
+            for (int d = 0; d < 4; d++)
+                h264_check_mv(&search, center_x + diamond[d][0] * step,
+                    center_y + diamond[d][1] * step);
+            if (search.x == center_x && search.y == center_y)
+                break;
+        }
+    }
+
+    // the skipped macroblock doesn't have the vector and the residual in the bitstream
+    if (skip_sad >= 0 && skip_sad <= search.sad + search.lambda * H264_SKIP_BIAS) {
+        ctx->mv[0] = ctx->skip_mv[0];
+        ctx->mv[1] = ctx->skip_mv[1];
+        return skip_sad;
+    }
+    ctx->mv[0] = search.x << 2;
+    ctx->mv[1] = search.y << 2;
+    return search.cost;
+}
+
+// the bilinear interpolation of chroma by eighths of the pixel
+static void h264_predict_chroma(uint8_t *pred, const uint8_t *ref, int stride, int mv_x,
+    int mv_y)
+{
+    ref += (mv_y >> 3) * stride + (mv_x >> 3);
+    int fx = mv_x & 7, fy = mv_y & 7;
+    int w00 = (8 - fx) * (8 - fy), w01 = fx * (8 - fy), w10 = (8 - fx) * fy, w11 = fx * fy;
+    for (int y = 0; y < 8; y++, ref += stride, pred += 8)
+        for (int x = 0; x < 8; x++)
+            pred[x] = (w00 * ref[x] + w01 * ref[x + 1] + w10 * ref[x + stride] +
+                w11 * ref[x + stride + 1] + 32) >> 6;
+}
+
+static void h264_predict_inter(struct h264_mb_context_t *ctx)
+{
+    const uint8_t *ref = enc.ref + (ctx->mb_y * 16 + (ctx->mv[1] >> 2)) * enc.stride +
+        ctx->mb_x * 16 + (ctx->mv[0] >> 2);
+    for (int y = 0; y < 16; y++)
+        memcpy(ctx->pred + y * 16, ref + y * enc.stride, 16);
+
+    int stride = enc.stride >> 1;
+    for (int c = 0; c < 2; c++)
+        h264_predict_chroma(ctx->pred_chroma[c],
+            h264_get_plane(enc.ref, c + 1) + (ctx->mb_y * stride + ctx->mb_x) * 8,
+            stride, ctx->mv[0], ctx->mv[1]);
+}
+
+static void h264_analyse_mb(struct h264_mb_context_t *ctx)
+{
+    const uint8_t *src = enc.source + (ctx->mb_y * enc.stride + ctx->mb_x) * 16;
+    struct h264_mb_t *mb = enc.mbs + ctx->mb_y * enc.mb_width + ctx->mb_x;
+    int inter_cost = INT_MAX;
+    if (!enc.is_idr) {
+        h264_predict_mv(ctx);
+        inter_cost = h264_search(ctx, src);
+    }
+
+    int intra_sad = h264_predict_intra16(ctx, src);
+    if (enc.is_idr || intra_sad + h264_lambda[enc.qp] * H264_INTRA_PENALTY < inter_cost) {
+        ctx->type = H264_MB_I16;
+        mb->mv[0] = 0;
+        mb->mv[1] = 0;
+        mb->ref = -1;
+        h264_predict_intra_chroma(ctx);
+        h264_encode_intra16(ctx, src);
+        h264_encode_chroma(ctx, 1);
+        return;
+    }
+
+    ctx->type = H264_MB_P16;
+    mb->mv[0] = ctx->mv[0];
+    mb->mv[1] = ctx->mv[1];
+    mb->ref = 0;
+    h264_predict_inter(ctx);
+    h264_encode_inter16(ctx, src);
+    h264_encode_chroma(ctx, 0);
+    if (ctx->cbp_luma == 0 && ctx->cbp_chroma == 0 &&
+        ctx->mv[0] == ctx->skip_mv[0] && ctx->mv[1] == ctx->skip_mv[1]
+    ) {
+        ctx->type = H264_MB_SKIP;
+    }
+}
+
+// predicts the amount of coefficients of the block by the left and the top neighbours
+static int h264_get_nc(struct h264_mb_context_t *ctx, const uint8_t *nz, int stride, int x,
+    int y)
+{
+    int is_left = x > 0 || ctx->is_left, is_top = y > 0 || ctx->is_top;
+    if (is_left && is_top)
+        return (nz[-1] + nz[-stride] + 1) >> 1;
+    return is_left? nz[-1]: is_top? nz[-stride]: 0;
+}
+
+static void h264_write_luma(struct h264_mb_context_t *ctx, int i, int max_count)
+{
+    int stride = enc.mb_width * 4;
+    int x = h264_block_x[i], y = h264_block_y[i];
+    uint8_t *nz = enc.nz + (ctx->mb_y * 4 + y) * stride + ctx->mb_x * 4 + x;
+    *nz = h264_write_residual(ctx->writer, ctx->luma[i], max_count,
+        h264_get_nc(ctx, nz, stride, x, y));
+}
+
+static void h264_write_chroma(struct h264_mb_context_t *ctx)
+{
+    if (ctx->cbp_chroma == 0)
+        return;
+    for (int c = 0; c < 2; c++)
+        h264_write_residual(ctx->writer, ctx->chroma_dc[c], 4, -1);
+    if (ctx->cbp_chroma < 2)
+        return;
+
+    int stride = enc.mb_width * 2;
+    for (int c = 0; c < 2; c++) {
+        for (int b = 0; b < 4; b++) {
+            int x = b & 1, y = b >> 1;
+            uint8_t *nz = enc.nz_chroma[c] + (ctx->mb_y * 2 + y) * stride + ctx->mb_x * 2 + x;
+            *nz = h264_write_residual(ctx->writer, ctx->chroma_ac[c][b], 15,
+                h264_get_nc(ctx, nz, stride, x, y));
+        }
+    }
+}
+
+static void h264_write_mb(struct h264_mb_context_t *ctx)
+{
+    struct h264_writer_t *writer = ctx->writer;
+    // blocks which aren't coded don't have coefficients for neighbours
+    for (int y = 0; y < 4; y++)
+        memset(enc.nz + (ctx->mb_y * 4 + y) * enc.mb_width * 4 + ctx->mb_x * 4, 0, 4);
+    for (int c = 0; c < 2; c++)
+        for (int y = 0; y < 2; y++)
+            memset(enc.nz_chroma[c] + (ctx->mb_y * 2 + y) * enc.mb_width * 2 + ctx->mb_x * 2,
+                0, 2);
+
+    if (ctx->type == H264_MB_SKIP) {
+        ctx->skip_run++;
+        return;
+    }
+    if (!enc.is_idr) {
+        h264_write_ue(writer, ctx->skip_run);
+        ctx->skip_run = 0;
+    }
+
+    if (ctx->type == H264_MB_I16) {
+        // the type of I_16x16 includes the prediction mode and the coded block pattern,
+        // types of intra macroblocks follow inter ones in P slices
+        int type = 1 + ctx->intra_mode + ctx->cbp_chroma * 4 + (ctx->cbp_luma? 12: 0);
+        h264_write_ue(writer, enc.is_idr? type: type + 5);
+        h264_write_ue(writer, 0);                   // intra_chroma_pred_mode, DC
+        h264_write_se(writer, 0);                   // mb_qp_delta
+        h264_write_residual(writer, ctx->dc, 16, h264_get_nc(ctx,
+            enc.nz + ctx->mb_y * 4 * enc.mb_width * 4 + ctx->mb_x * 4, enc.mb_width * 4, 0, 0));
+        if (ctx->cbp_luma)
+            for (int i = 0; i < 16; i++)
+                h264_write_luma(ctx, i, 15);
+    }
+    else {
+        h264_write_ue(writer, 0);                   // P_L0_16x16
+        h264_write_se(writer, ctx->mv[0] - ctx->mvp[0]);
+        h264_write_se(writer, ctx->mv[1] - ctx->mvp[1]);
+        int cbp = ctx->cbp_luma | (ctx->cbp_chroma << 4);
+        h264_write_ue(writer, h264_inter_cbp[cbp]);
+        if (cbp)
+            h264_write_se(writer, 0);               // mb_qp_delta
+        for (int i = 0; i < 16; i++)
+            if (ctx->cbp_luma & (1 << (i >> 2)))
+                h264_write_luma(ctx, i, 16);
+    }
+    h264_write_chroma(ctx);
+}
+
+static void h264_write_slice_header(struct h264_writer_t *writer, int first_mb)
+{
+    h264_write_ue(writer, first_mb);
+    // all slices of the frame have the same type
+    h264_write_ue(writer, enc.is_idr? 7: 5);
+    h264_write_ue(writer, 0);                       // pic_parameter_set_id
+    h264_write_bits(writer, enc.frame_num, 4);
+    if (enc.is_idr) {
+        h264_write_ue(writer, enc.idr_pic_id);
+        h264_write_bits(writer, 0, 1);              // no_output_of_prior_pics_flag
+        h264_write_bits(writer, 0, 1);              // long_term_reference_flag
+    }
+    else {
+        h264_write_bits(writer, 0, 1);              // num_ref_idx_active_override_flag
+        h264_write_bits(writer, 0, 1);              // ref_pic_list_modification_flag_l0
+        h264_write_bits(writer, 0, 1);              // adaptive_ref_pic_marking_mode_flag
+    }
+    h264_write_se(writer, enc.qp - 26);             // slice_qp_delta
+    // the deblocking filter is disabled, so frames are reconstructed as decoders do it
+    // without the filter
+    h264_write_ue(writer, 1);
+}
+
+// writes slices which are finished in order of rows to the frame as NAL units of the
+// Annex B, parameter sets go before the first slice of the IDR frame
+static int h264_write_slices(struct frame_t *out)
+{
+    int size = h264_get_frame_length() + H264_ENCODER_HEADER_BYTES * 2;
+    int res = 0;
+    while (enc.next_row < enc.mb_height && enc.slices[enc.next_row].is_done) {
+        struct h264_slice_t *slice = enc.slices + enc.next_row;
+        int start = enc.out_length;
+        if (enc.is_idr && slice->mb_y_start == 0) {
+            CALL(res = h264_write_nal(out->planes[0], size, 3, H264_NAL_SPS, enc.sps,
+                enc.sps_length), cleanup);
+            enc.out_length += res;
+            CALL(res = h264_write_nal(out->planes[0] + enc.out_length, size - enc.out_length,
+                3, H264_NAL_PPS, enc.pps, enc.pps_length), cleanup);
+            enc.out_length += res;
+        }
+        CALL(res = h264_write_nal(out->planes[0] + enc.out_length, size - enc.out_length,
+            enc.is_idr? 3: 2, enc.is_idr? H264_NAL_IDR: H264_NAL_SLICE, slice->data,
+            slice->writer.length), cleanup);
+        enc.out_length += res;
+
+        if (enc.slice_output) {
+            int y = slice->mb_y_start << 4;
+            struct frame_slice_t part = {
+                .frame = out,
+                .index = enc.slice_index,
+                .count = enc.bands.count,
+                .y = y,
+                .height = MIN(slice->mb_y_end << 4, app.video_height) - y,
+                .data = out->planes[0] + start,
+                .length = enc.out_length - start
+            };
+            // the frame is still encoded for other consumers if the output has failed
+            if (enc.slice_output->process_slice(&part) == -1) {
+                CALL_MESSAGE(enc.slice_output->process_slice(&part));
+                enc.slice_output = NULL;
+            }
+        }
+        enc.slice_index++;
+        enc.next_row = slice->mb_y_end;
+    }
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+static int h264_encode_slice(void *data, int mb_y_start, int mb_y_end)
+{
+    struct frame_t *out = data;
+    struct h264_slice_t *slice = enc.slices + mb_y_start;
+    slice->mb_y_start = mb_y_start;
+    slice->mb_y_end = mb_y_end;
+    slice->size = (mb_y_end - mb_y_start) * enc.mb_width * H264_ENCODER_MB_BYTES;
+    slice->data = h264_slices_data + mb_y_start * enc.mb_width * H264_ENCODER_MB_BYTES;
+    h264_writer_init(&slice->writer, slice->data, slice->size);
+
+    struct h264_mb_context_t ctx = { .slice = slice, .writer = &slice->writer };
+    h264_write_slice_header(ctx.writer, mb_y_start * enc.mb_width);
+    for (int y = mb_y_start; y < mb_y_end; y++) {
+        for (int x = 0; x < enc.mb_width; x++) {
+            h264_get_mb_context(&ctx, x, y);
+            h264_analyse_mb(&ctx);
+            h264_write_mb(&ctx);
+        }
+    }
+    if (ctx.skip_run > 0)
+        h264_write_ue(ctx.writer, ctx.skip_run);
+    h264_write_trailing_bits(ctx.writer);
+    ASSERT_INT(slice->writer.is_overflow, ==, 0, cleanup);
+
+    int res = pthread_mutex_lock(&enc.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&enc.mutex), res);
+        goto cleanup;
+    }
+    slice->is_done = 1;
+    int write_res = h264_write_slices(out);
+    res = pthread_mutex_unlock(&enc.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&enc.mutex), res);
+        goto cleanup;
+    }
+    CALL(write_res, cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = ENOBUFS;
+    return -1;
+}
+
+// the quantizer follows the error of the frame and bits which are spent above the target,
+// IDR frames get the bigger share of bits
+static void h264_control_rate(struct frame_t *frame, int length)
+{
+    if (enc.timestamp.tv_sec > 0 || enc.timestamp.tv_usec > 0) {
+        int64_t us = (frame->timestamp.tv_sec - enc.timestamp.tv_sec) * 1000000LL +
+            frame->timestamp.tv_usec - enc.timestamp.tv_usec;
+        if (us > 0 && us < 1000000)
+            enc.frame_us = (enc.frame_us * 7 + us) >> 3;
+    }
+    enc.timestamp = frame->timestamp;
+    int bitrate = enc.bitrate;
+    if (bitrate <= 0)
+        return;
+
+    int64_t rate = bitrate * 1000LL;
+    int64_t target = rate * enc.frame_us / 1000000 * H264_ENCODER_IDR_PERIOD /
+        (H264_ENCODER_IDR_PERIOD - 1 + H264_ENCODER_IDR_RATIO);
+    if (enc.is_idr)
+        target *= H264_ENCODER_IDR_RATIO;
+    int64_t bits = length * 8LL;
+    enc.fullness += bits - target;
+    if (enc.fullness > rate)
+        enc.fullness = rate;
+    else if (enc.fullness < -rate)
+        enc.fullness = -rate;
+
+    if (bits > target * 2 || enc.fullness > rate / 2)
+        enc.qp += 2;
+    else if (bits > target * 5 / 4 && enc.fullness > 0)
+        enc.qp++;
+    else if (bits < target / 2 && enc.fullness < 0)
+        enc.qp -= 2;
+    else if (bits < target * 3 / 4 && enc.fullness < 0)
+        enc.qp--;
+    enc.qp = MAX(H264_ENCODER_QP_MIN, MIN(enc.qp, H264_ENCODER_QP_MAX));
+}
+
+static int h264_process_frame(struct frame_t *frame)
+{
+    struct frame_t *source = NULL, *out = NULL;
+    ASSERT_INT(enc.out_format, ==, VIDEO_FORMAT_H264, cleanup);
+    if (enc.frame) {
+        CALL(frame_unref(enc.frame), cleanup);
+        enc.frame = NULL;
+    }
+
+    source = h264_load_frame(frame);
+    if (source == NULL) {
+        CALL_MESSAGE(h264_load_frame(frame));
+        goto cleanup;
+    }
+    out = frame_pool_get(&enc.pool);
+    if (out == NULL) {
+        CALL_MESSAGE(frame_pool_get(&enc.pool));
+        goto cleanup;
+    }
+
+    if (enc.is_idr_requested) {
+        enc.is_idr_requested = 0;
+        enc.frames = 0;
+    }
+    enc.is_idr = enc.frames == 0 || enc.frames >= H264_ENCODER_IDR_PERIOD;
+    if (enc.is_idr) {
+        enc.frames = 0;
+        enc.frame_num = 0;
+        // consecutive IDR frames differ by the identifier
+        enc.idr_pic_id ^= 1;
+    }
+    enc.source = source->planes[0];
+    // slices can be streamed before the end of the frame, so they carry props of the frame
+    frame_copy_props(out, frame);
+    for (int y = 0; y < enc.mb_height; y++)
+        enc.slices[y].is_done = 0;
+    enc.out_length = 0;
+    enc.next_row = 0;
+    enc.slice_index = 0;
+    CALL(bands_process(&enc.bands, enc.mb_height, 1, h264_encode_slice, out), stream_cleanup);
+    ASSERT_INT(enc.next_row, ==, enc.mb_height, stream_cleanup);
+    int length = enc.out_length;
+    CALL(frame_unref(source), cleanup);
+    source = NULL;
+
+    // the decoded frame is the reference of the next one
+    uint8_t *recon = enc.recon;
+    enc.recon = enc.ref;
+    enc.ref = recon;
+    h264_control_rate(frame, length);
+    enc.frames++;
+    enc.frame_num = (enc.frame_num + 1) & 15;
+
+    out->format = VIDEO_FORMAT_H264;
+    out->width = app.video_width;
+    out->height = app.video_height;
+    out->planes_count = 1;
+    out->strides[0] = length;
+    out->length = length;
+    enc.frame = out;
+    return 0;
+
+stream_cleanup:
+    // decoders don't get the frame, so the next one starts the stream again with fewer bits
+    enc.frames = 0;
+    enc.qp = MIN(enc.qp + 6, H264_ENCODER_QP_MAX);
+cleanup:
+    if (out)
+        CALL(frame_unref(out));
+    if (source)
+        CALL(frame_unref(source));
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int h264_get_frame(struct frame_t **frame)
+{
+    // the reference of the filter is passed to the caller
+    *frame = enc.frame;
+    enc.frame = NULL;
+    return 0;
+}
+
+static int h264_set_slice_output(struct output_t *output)
+{
+    enc.slice_output = output;
+    return 0;
+}
+
+static int h264_request_key_frame()
+{
+    enc.is_idr_requested = 1;
+    return 0;
+}
+
+// the quantizer follows the new target from the next frame
+static int h264_set_bitrate(int bitrate)
+{
+    enc.bitrate = bitrate;
+    return 0;
+}
+
+static int h264_get_in_formats(const struct format_mapping_t *formats[])
+{
+    *formats = h264_input_formats;
+    return ARRAY_SIZE(h264_input_formats);
+}
+
+static int h264_get_out_formats(const struct format_mapping_t *formats[])
+{
+    *formats = h264_output_formats;
+    return ARRAY_SIZE(h264_output_formats);
+}
+
+static int h264_get_cost(int in_format, int out_format)
+{
+    // the frame is encoded by CPU, YUYV is converted to the source buffer before that
+    int cost = app.video_width * app.video_height * H264_ENCODER_COST_PIXEL * FILTER_COST_BYTE;
+    if (in_format == VIDEO_FORMAT_YUYV)
+        cost += app.video_width * app.video_height * (4 + 3) / 2 * FILTER_COST_BYTE;
+    return cost;
+}
+
+void h264_encoder_construct()
+{
+    struct filter_t *filter = &h264_filter;
+    filter->name = "h264_encoder";
+    filter->context = &enc;
+    filter->init = h264_init;
+    filter->cleanup = h264_cleanup;
+    filter->start = h264_start;
+    filter->is_started = h264_is_started;
+    filter->stop = h264_stop;
+    filter->process_frame = h264_process_frame;
+    filter->get_frame = h264_get_frame;
+    filter->get_in_formats = h264_get_in_formats;
+    filter->get_out_formats = h264_get_out_formats;
+    filter->get_cost = h264_get_cost;
+    filter->get_in_frame = h264_get_in_frame;
+    filter->set_slice_output = h264_set_slice_output;
+    filter->request_key_frame = h264_request_key_frame;
+    filter->set_bitrate = h264_set_bitrate;
+    kv_push(struct filter_t *, filters, filter);
+}
@@ -0,0 +1,108 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef h264_encoder_h
+#define h264_encoder_h
+
+#include "bands.h"
+#include "h264_bitstream.h"
+
+// the constrained baseline profile, level is chosen by the size of the frame
+#define H264_ENCODER_PROFILE 66
+#define H264_ENCODER_IDR_PERIOD 60
+#define H264_ENCODER_QP_MIN 16
+#define H264_ENCODER_QP_MAX 51
+#define H264_ENCODER_QP_DEF 28
+// the range of the motion search in pixels
+#define H264_ENCODER_SEARCH 16
+// an IDR frame gets as many bits as several P frames
+#define H264_ENCODER_IDR_RATIO 4
+// the rate of frames until timestamps of frames give it
+#define H264_ENCODER_FPS 30
+// estimated nanoseconds to encode one pixel of the frame by CPU
+#define H264_ENCODER_COST_PIXEL 40
+// the buffer of the slice is enough for macroblocks of uncompressed pixels twice
+#define H264_ENCODER_MB_BYTES 768
+#define H264_ENCODER_HEADER_BYTES 64
+
+// the state of the decoded macroblock which predicts neighbours
+struct h264_mb_t {
+    int16_t mv[2];          // in quarters of pixel
+    int8_t ref;             // -1 for intra macroblocks
+};
+
+struct h264_slice_t {
+    int mb_y_start;
+    int mb_y_end;
+    uint8_t *data;
+    int size;
+    struct h264_writer_t writer;
+    int is_done;            // the slice waits for previous ones to be written to the frame
+};
+
+struct h264_encoder_state_t {
+    int in_format;
+    int out_format;
+    struct frame_pool_t pool;
+    struct frame_pool_t in_pool;    // wraps the source buffer for the previous filter
+    struct frame_t *frame;
+
+    int mb_width;
+    int mb_height;
+    int stride;                     // of the luma plane which is aligned by macroblocks
+    uint8_t *source;                // the frame which is being encoded
+    uint8_t *recon;                 // the decoded frame
+    uint8_t *ref;                   // the decoded previous frame
+    struct h264_mb_t *mbs;
+    uint8_t *nz;                    // amount of coefficients of luma 4x4 blocks
+    uint8_t *nz_chroma[2];          // and of chroma 4x4 blocks
+
+    // slices are rows of macroblocks which are encoded by bands concurrently, they are
+    // indexed by the first row
+    struct h264_slice_t *slices;
+    struct bands_t bands;
+    // slices are written to the frame in order of rows by the thread which has finished
+    // the next one, the output streams them before the whole frame is encoded
+    pthread_mutex_t mutex;
+    int is_mutex;
+    struct output_t *slice_output;
+    int out_length;
+    int next_row;                   // the first row of the slice which is written next
+    int slice_index;
+    uint8_t sps[H264_ENCODER_HEADER_BYTES];
+    int sps_length;
+    uint8_t pps[H264_ENCODER_HEADER_BYTES];
+    int pps_length;
+
+    int is_idr;
+    int frame_num;
+    int idr_pic_id;
+    int frames;                     // since the last IDR frame
+    volatile int is_idr_requested;  // by a decoder which has joined the stream
+
+    // rate control
+    volatile int bitrate;           // kbit/s, 0 keeps the quantizer
+    int qp;
+    int64_t fullness;               // bits above the target
+    int64_t frame_us;
+    struct timeval timestamp;
+};
+
+void h264_encoder_construct();
+
+#endif //h264_encoder_h
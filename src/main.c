@@ -22,6 +22,7 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 #include "app.h"
 #include "overlay.h"
 
@@ -41,7 +42,7 @@ static int exit_code = EX_SOFTWARE;
 
 struct app_state_t app;
 struct input_t input;
-struct filter_t filters[MAX_FILTERS];
+filters_t filters;
 struct output_t outputs[MAX_OUTPUTS];
 struct extension_t extensions[MAX_EXTENSIONS];
 
@@ -69,12 +70,25 @@ void *worker_function(void *data)
     
         CALL(sem_wait(&app.worker_semaphore));
 
+        // the input keeps the latest frame, so the worker takes the fresh one every time
+        if (input.get_worker_frame) {
+            if (app.worker_frame) {
+                CALL(frame_unref(app.worker_frame));
+                app.worker_frame = NULL;
+            }
+            CALL(input.get_worker_frame(&app.worker_frame));
+        }
+
 #ifdef TENSORFLOW
         tensorflow_process();
 #elif DARKNET
         darknet_process();
 #endif
     }
+    if (app.worker_frame) {
+        CALL(frame_unref(app.worker_frame));
+        app.worker_frame = NULL;
+    }
     return NULL;
 }
 
@@ -97,10 +111,24 @@ static void print_help()
     printf("%s: help\n", HELP);
     printf("%s: video width, default: %d\n", VIDEO_WIDTH, VIDEO_WIDTH_DEF);
     printf("%s: video height, default: %d\n", VIDEO_HEIGHT, VIDEO_HEIGHT_DEF);
+    printf("%s: input, default: %s\n", VIDEO_INPUT, VIDEO_INPUT_DEF);
+    printf("\toptions: "VIDEO_INPUT_V4L_STR", "VIDEO_INPUT_MMAL_STR"\n");
     printf("%s: output, default: %s\n", VIDEO_OUTPUT, VIDEO_OUTPUT_DEF);
     printf("\toptions: "VIDEO_OUTPUT_NULL_STR", "VIDEO_OUTPUT_FILE_STR", "
         VIDEO_OUTPUT_SDL_STR", "VIDEO_OUTPUT_RFB_STR"\n");
 
+    printf("%s: amount of capture buffers, default: %d\n", VIDEO_BUFFERS, VIDEO_BUFFERS_DEF);
+    printf("%s: amount of frames processed concurrently by stages of the pipeline,"
+        " 0 - sequential processing, default: %d\n", PIPELINE_THREADS, PIPELINE_THREADS_DEF);
+    printf("%s: amount of row bands of a frame for filters, default: %d\n", BANDS, BANDS_DEF);
+    printf("%s: amount of threads which process row bands, default: %d\n", BAND_THREADS,
+        BAND_THREADS_DEF);
+    printf("%s: measure costs of filters on startup, default: %d\n", CALIBRATION, CALIBRATION_DEF);
+    printf("%s: cache of measured costs, default: %s\n", CALIBRATION_PATH, CALIBRATION_PATH_DEF);
+    printf("%s: bitrate of the H264 encoder in kbit/s, 0 keeps the quantizer, default: %d\n",
+        H264_BITRATE, H264_BITRATE_DEF);
+    printf("%s: amount of slices of the encoded frame, default: %d\n", H264_SLICES,
+        H264_SLICES_DEF);
     printf("%s: port, default: %d\n", PORT, PORT_DEF);
     printf("%s: worker_width, default: %d\n", WORKER_WIDTH, WORKER_WIDTH_DEF);
     printf("%s: worker_height, default: %d\n", WORKER_HEIGHT, WORKER_HEIGHT_DEF);
@@ -112,10 +140,62 @@ static void print_help()
     exit(0);
 }
 
+static void main_print_stats()
+{
+    char buffer[MAX_DATA];
+
+    //----- fps
+    static int frame_count = 0;
+    static struct timespec t1;
+    struct timespec t2;
+    if (frame_count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    float d = (t2.tv_sec + t2.tv_nsec / 1000000000.0) - (t1.tv_sec + t1.tv_nsec / 1000000000.0);
+    if (d > 0) {
+        app.fps = frame_count / d;
+    } else {
+        app.fps = frame_count;
+    }
+    frame_count++;
+    // -----
+
+    utils_get_cpu_load(buffer, &app.cpu);
+    utils_get_memory_load(buffer, &app.memory);
+    utils_get_temperature(buffer, &app.temperature);
+
+    // every 8th frame
+    if ((frame_count & 0b1111) == 0) {
+        fprintf(stdout, "\rFPS: %2.2f %2.2f %2.2f, CPU: %2.1f%%, Mem: %d kb, T: %.2fC, Objs: %d"
+            "          ",
+            app.fps,
+            app.rfb_fps,
+            app.worker_fps,
+            app.cpu.cpu,
+            app.memory.total_size,
+            app.temperature.temp,
+            app.worker_objects);
+        fflush(stdout);
+    }
+}
+
+// called for every processed frame, the detection worker gets the next frame if it's idle
+static void main_frame_processed()
+{
+    main_print_stats();
+
+    if (input.get_worker_frame) {
+        int value = 0;
+        CALL(sem_getvalue(&app.worker_semaphore, &value));
+        if (value == 0)
+            CALL(sem_post(&app.worker_semaphore));
+    }
+}
+
 static int main_function()
 {
     int res;
-    char buffer[MAX_DATA];
 
     app_construct();
     CALL(app_init(), error);
@@ -196,50 +276,17 @@ static int main_function()
         goto error;
     }
 
-    while (!is_aborted) {
-        for (int i = 0; outputs[i].context != NULL && i < MAX_OUTPUTS; i++) {
-            //DEBUG("process: %s", outputs[i].name);
-            CALL(res = outputs[i].process_frame());
-            if (res == -1 && errno != ETIME)
-                break;            
-            else
-                res = 0;
-        }
+    // the sequential loop below is the fallback if the pipeline can't be built
+    if (app.pipeline_threads > 0)
+        CALL(app_process_pipeline(app.pipeline_threads, main_frame_processed));
 
-        //----- fps
-        static int frame_count = 0;
-        static struct timespec t1;
-        struct timespec t2;
-        if (frame_count == 0) {
-            clock_gettime(CLOCK_MONOTONIC, &t1);
-        }
-        clock_gettime(CLOCK_MONOTONIC, &t2);
-        float d = (t2.tv_sec + t2.tv_nsec / 1000000000.0) - (t1.tv_sec + t1.tv_nsec / 1000000000.0);
-        if (d > 0) {
-            app.fps = frame_count / d;
-        } else {
-            app.fps = frame_count;
-        }
-        frame_count++;
-        // -----
-
-        utils_get_cpu_load(buffer, &app.cpu);
-        utils_get_memory_load(buffer, &app.memory);
-        utils_get_temperature(buffer, &app.temperature);
-
-        // every 8th frame
-        if ((frame_count & 0b1111) == 0) {
-            fprintf(stdout, "\rFPS: %2.2f %2.2f %2.2f, CPU: %2.1f%%, Mem: %d kb, T: %.2fC, Objs: %d"
-                "          ",
-                app.fps,
-                app.rfb_fps,
-                app.worker_fps,
-                app.cpu.cpu,
-                app.memory.total_size,
-                app.temperature.temp,
-                app.worker_objects);
-            fflush(stdout);
-        }
+    while (!is_aborted) {
+        res = app_process_frame();
+        if (res == -1 && errno != ETIME)
+            CALL_MESSAGE(app_process_frame());
+        // idle and failed iterations don't make frames
+        if (res == 0)
+            main_frame_processed();
 
 //TODO: move to open vg
 #ifdef OPENVG
@@ -332,12 +379,21 @@ error:
     // if (app.video_output == VIDEO_OUTPUT_STDOUT) {
     //    CALL(res = utils_camera_cleanup_h264_encoder(&app));
 
-    app_cleanup();
-
+    // the worker releases the frame of the input before the input is cleaned up
     DEBUG("worker_semaphore");
     CALL(sem_post(&app.worker_semaphore));
+    DEBUG("worker_thread");
+    if (!app.worker_thread_res) {
+        res = pthread_join(app.worker_thread, NULL);
+        if (res != 0) {
+            fprintf(stderr, "ERROR: Failed to close Worker thread. error: %d\n", res);
+        }
+        app.worker_thread_res = -1;
+    }
     CALL(sem_destroy(&app.worker_semaphore));
 
+    app_cleanup();
+
     DEBUG("buffer_semaphore");
     CALL(sem_post(&app.buffer_semaphore));
     CALL(sem_destroy(&app.buffer_semaphore));
@@ -348,14 +404,6 @@ error:
         CALL_MESSAGE(pthread_mutex_destroy(&app.buffer_mutex));
     }
 
-    DEBUG("worker_thread");
-    if (!app.worker_thread_res) {
-        res = pthread_join(app.worker_thread, NULL);
-        if (res != 0) {
-            fprintf(stderr, "ERROR: Failed to close Worker thread. error: %d\n", res);
-        }
-    }
-
     // if (app.worker_buffer_rgb) {
     //     free(app.worker_buffer_rgb);
     // }
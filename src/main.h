@@ -6,20 +6,26 @@
 #define VIDEO_FORMAT_YUV422_STR  "YUV422"
 #define VIDEO_FORMAT_YUV444_STR  "YUV444"
 #define VIDEO_FORMAT_H264_STR    "H264"
+#define VIDEO_FORMAT_I420_STR    "I420"
+#define VIDEO_FORMAT_NV12_STR    "NV12"
 
 #define VIDEO_FORMAT_UNKNOWN 0
 #define VIDEO_FORMAT_YUYV    1
 #define VIDEO_FORMAT_YUV422  2
 #define VIDEO_FORMAT_YUV444  3
 #define VIDEO_FORMAT_H264    4
+#define VIDEO_FORMAT_I420    5
+#define VIDEO_FORMAT_NV12    6
+
+#define VIDEO_INPUT_V4L_STR     "v4l"
+#define VIDEO_INPUT_MMAL_STR    "mmal"
 
 #define VIDEO_OUTPUT_NULL_STR   "null"
 #define VIDEO_OUTPUT_FILE_STR   "file"
 #define VIDEO_OUTPUT_SDL_STR    "sdl"
 #define VIDEO_OUTPUT_RFB_STR    "rfb"
 
-#define MAX_OUTPUTS    3
-#define MAX_FILTERS    4
+#define MAX_OUTPUTS    4
 #define MAX_EXTENSIONS 3
 
 #define VIDEO_OUTPUT_NULL   0
@@ -31,8 +37,26 @@
 #define VIDEO_WIDTH_DEF 640
 #define VIDEO_HEIGHT "-h"
 #define VIDEO_HEIGHT_DEF 480
+#define VIDEO_INPUT "-i"
+#define VIDEO_INPUT_DEF VIDEO_INPUT_V4L_STR
 #define VIDEO_OUTPUT "-o"
 #define VIDEO_OUTPUT_DEF VIDEO_OUTPUT_FILE_STR","VIDEO_OUTPUT_SDL_STR","VIDEO_OUTPUT_RFB_STR
+#define VIDEO_BUFFERS "-vb"
+#define VIDEO_BUFFERS_DEF 4
+#define PIPELINE_THREADS "-pt"
+#define PIPELINE_THREADS_DEF 0
+#define BANDS "-bn"
+#define BANDS_DEF 8
+#define BAND_THREADS "-bt"
+#define BAND_THREADS_DEF 1
+#define CALIBRATION "-cal"
+#define CALIBRATION_DEF 0
+#define CALIBRATION_PATH "-calp"
+#define CALIBRATION_PATH_DEF "./raspidetect.cal"
+#define H264_BITRATE "-br"
+#define H264_BITRATE_DEF 2000
+#define H264_SLICES "-sl"
+#define H264_SLICES_DEF 1
 
 #define PORT "-p"
 #define PORT_DEF 5901
@@ -56,10 +80,19 @@
 #define DN_CONFIG_PATH "-c"
 #define DN_CONFIG_PATH_DEF "./dn_models/yolov3-tiny.cfg"
 
+// estimated nanoseconds which CPU spends to read or write one byte of a frame, the cost of
+// filters is measured in nanoseconds per frame
+#define FILTER_COST_BYTE 1
+// cost of the filter which doesn't estimate it, as if it reads and writes 4 bytes per pixel
+#define FILTER_COST_PIXEL 4
+// amount of synthetic frames which are measured by calibration of every conversion
+#define CALIBRATION_FRAMES 5
+
 #define THRESHOLD 0.5
 #define MAX_STRING 256
 #define MAX_DATA 1024
 #define TICK_TIME 500000 //500 miliseconds
+#define IDLE_TIME 10000000 //10 miliseconds, sleep if none of outputs is ready for a frame
 #define COMMA ", "
 
 #define FONT_DIR "."
@@ -201,6 +234,7 @@
 #include <stdlib.h>    // malloc, free
 //#include <unistd.h>    // STDIN_FILENO, usleep
 #include <time.h>      // time_t
+#include <sys/time.h>  // timeval
 #include <semaphore.h>
 #include <errno.h>     // error codes
 #include <signal.h>    // SIGUSR1
@@ -209,6 +243,8 @@
 #include <sys/select.h> //select
 #include <fcntl.h>     // O_RDWR | O_NONBLOCK
 
+#include "kvec.h"
+
 struct cpu_state_t {
     float cpu;
 };
@@ -287,6 +323,8 @@ struct format_mapping_t {
     int is_supported;
 };
 
+struct frame_t;
+
 struct filter_reference_t {
     int out_format;
     int index;
@@ -303,10 +341,31 @@ struct input_t {
     int (*stop)();
     int (*process_frame)();
 
-    uint8_t* (*get_buffer)(int *format, int* length);
+    // returns a new reference to the captured frame, the caller drops it by frame_unref
+    int (*get_frame)(struct frame_t **frame);
+    // optional, returns a new reference to the latest downscaled frame for the detection
+    // worker or NULL if the input doesn't have it yet
+    int (*get_worker_frame)(struct frame_t **frame);
     int (*get_formats)(const struct format_mapping_t *formats[]);
+    // optional, the input which gives encoded frames starts the next one from the key frame
+    int (*request_key_frame)();
+    // optional, changes kbit/s of the input which gives encoded frames
+    int (*set_bitrate)(int bitrate);
+};
+
+// the NAL unit of the encoded frame which is ready before the whole frame
+struct frame_slice_t {
+    struct frame_t *frame;      // props of the frame, the bitstream isn't complete yet
+    int index;
+    int count;                  // slices of the frame
+    int y;                      // rows of the picture which are covered by the slice
+    int height;
+    uint8_t *data;
+    int length;
 };
 
+struct output_t;
+
 struct filter_t {
     char* name;
     void *context;
@@ -316,24 +375,59 @@ struct filter_t {
     int (*start)(int input_format, int output_format);
     int (*is_started)();
     int (*stop)();
-    int (*process_frame)(uint8_t *buffer);
+    int (*process_frame)(struct frame_t *frame);
 
-    uint8_t *(*get_buffer)(int *out_format, int *length);
+    // returns a new reference to the processed frame or NULL if the filter doesn't have it yet
+    int (*get_frame)(struct frame_t **frame);
     int (*get_in_formats)(const struct format_mapping_t *formats[]);
     int (*get_out_formats)(const struct format_mapping_t *formats[]);
+    // optional, returns estimated nanoseconds per frame to convert formats
+    int (*get_cost)(int in_format, int out_format);
+
+    // optional, returns a new reference to the frame which describes the next input buffer
+    // of the filter or NULL if the buffer isn't available, the frame which is written by
+    // the previous filter is passed back to process_frame without a copy
+    int (*get_in_frame)(int format, struct frame_t **frame);
+    // optional, the filter takes own reference and writes the next processed frame to
+    // the given frame instead of own buffer
+    int (*set_out_frame)(struct frame_t *frame);
+    // optional, the filter passes slices of the next frame to process_slice of the output
+    // as soon as they are encoded, NULL stops it
+    int (*set_slice_output)(struct output_t *output);
+    // optional, the next encoded frame is the key frame which decoders can start from, it's
+    // called by threads of outputs
+    int (*request_key_frame)();
+    // optional, changes kbit/s of the encoder while it's started
+    int (*set_bitrate)(int bitrate);
 };
 
+// registered filters, the storage of every filter belongs to its module
+typedef kvec_t(struct filter_t *) filters_t;
+
 struct output_t {
     char* name;
     void *context;
 
     int start_format;
-    struct filter_reference_t filters[MAX_FILTERS];
+    // the cheapest chain of filters from the input format to a format of the output
+    kvec_t(struct filter_reference_t) filters;
+    int cost;
 
     int (*init)();
     int (*start)();
     int (*is_started)();
-    int (*process_frame)();
+    // optional, returns 1 if the output expects a frame on the current tick
+    int (*is_ready)();
+    // optional, returns 1 once when the output has lost its consumers, then the input and
+    // filters which only this output uses are stopped by threads which run them
+    int (*is_idle)();
+    // the frame is NULL if a filter of the path doesn't have a frame yet,
+    // the output takes own reference to keep the frame after the call
+    int (*process_frame)(struct frame_t *frame);
+    // optional, sends the slice before the last filter of the path has finished the frame,
+    // it's called in order of slices by threads of the filter, process_frame then gets the
+    // same frame complete
+    int (*process_slice)(struct frame_slice_t *slice);
     int (*stop)();
     int (*get_formats)(const struct format_mapping_t *formats[]);
     void (*cleanup)();
@@ -373,7 +467,16 @@ struct app_state_t {
     // common properties
     int video_width;
     int video_height;
+    const char *video_input;
     int video_output;
+    int video_buffers;
+    int pipeline_threads;
+    int bands;                          // amount of row bands of a frame for filters
+    int band_threads;                   // amount of threads which process bands
+    int calibration;                    // measure costs of filters on startup
+    const char *calibration_path;       // cache of measured costs
+    int h264_bitrate;                   // kbit/s of the encoder, 0 keeps the quantizer
+    int h264_slices;                    // amount of slices of the encoded frame
 
     int port;
     char *filename;                     // name of output file
@@ -397,6 +500,7 @@ struct app_state_t {
     int worker_thread_res;
     int worker_width;
     int worker_height;
+    struct frame_t *worker_frame;       // the frame which is processed by the worker
     char *worker_buffer_565;
     char *worker_buffer_rgb;
     int worker_objects;
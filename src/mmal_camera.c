@@ -0,0 +1,464 @@
+// Raspidetect
+
+// Copyright (C) 2022 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "main.h"
+#include "utils.h"
+#include "frame.h"
+
+#include "mmal_encoder.h"
+#include "mmal_camera.h"
+
+// the camera gives encoded frames only, pixels don't leave the GPU except the frames of
+// the detection worker
+static struct format_mapping_t mmal_camera_formats[] = {
+    {
+        .format = VIDEO_FORMAT_H264,
+        .internal_format = MMAL_ENCODING_H264,
+        .is_supported = 1
+    }
+};
+
+static struct format_mapping_t *mmal_camera_format = NULL;
+static struct mmal_camera_state_t camera = {
+    .camera = NULL,
+    .splitter = NULL,
+    .resizer = NULL,
+    .splitter_connection = NULL,
+    .resizer_connection = NULL,
+    .worker_port = NULL,
+    .worker_pool = NULL,
+    .pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .worker_frame = NULL,
+    .worker_sequence = 0,
+    .is_mutex = 0
+};
+
+extern struct app_state_t app;
+extern struct input_t input;
+
+// returns the buffer which hasn't been locked to the resizer, so it can be filled again
+static int mmal_camera_send_buffer(MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_buffer_header_release(buffer);
+
+    MMAL_PORT_T *port = camera.worker_port;
+    if (camera.worker_pool && port && port->is_enabled) {
+        MMAL_QUEUE_T *queue = camera.worker_pool->queue;
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(queue);
+        if (!buffer) {
+            MMAL_MESSAGE(mmal_queue_get(queue), MMAL_EAGAIN);
+            goto cleanup;
+        }
+        MMAL_CALL(mmal_port_send_buffer(port, buffer), cleanup);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// returns the buffer to the resizer, so it can be filled again
+static int mmal_camera_requeue_buffer(MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_buffer_header_mem_unlock(buffer);
+    return mmal_camera_send_buffer(buffer);
+}
+
+// the last consumer has released the frame of the worker
+static int mmal_camera_release_worker_frame(struct frame_t *frame)
+{
+    MMAL_BUFFER_HEADER_T *buffer = camera.worker_headers[frame->index];
+    camera.worker_headers[frame->index] = NULL;
+    if (buffer)
+        return mmal_camera_requeue_buffer(buffer);
+    return 0;
+}
+
+static void mmal_camera_worker_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct frame_t *frame = NULL;
+    MMAL_CALL(mmal_buffer_header_mem_lock(buffer), release);
+    if (buffer->length == 0)
+        goto requeue;
+
+    frame = frame_pool_get(&camera.pool);
+    if (frame == NULL) {
+        CALL_MESSAGE(frame_pool_get(&camera.pool));
+        goto requeue;
+    }
+    camera.worker_headers[frame->index] = buffer;
+    mmal_set_planes(frame, buffer->data + buffer->offset, VIDEO_FORMAT_I420,
+        app.worker_width, app.worker_height);
+    frame->sequence = camera.worker_sequence++;
+    if (buffer->pts != MMAL_TIME_UNKNOWN) {
+        frame->timestamp.tv_sec = buffer->pts / 1000000;
+        frame->timestamp.tv_usec = buffer->pts % 1000000;
+    }
+
+    // the worker gets the latest frame, the previous one goes back to the resizer
+    int res = pthread_mutex_lock(&camera.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&camera.mutex), res);
+        CALL(frame_unref(frame));
+        return;
+    }
+    struct frame_t *dropped = camera.worker_frame;
+    camera.worker_frame = frame;
+    res = pthread_mutex_unlock(&camera.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&camera.mutex), res);
+    }
+    if (dropped)
+        CALL(frame_unref(dropped));
+    return;
+
+requeue:
+    mmal_camera_requeue_buffer(buffer);
+    return;
+
+release:
+    mmal_camera_send_buffer(buffer);
+}
+
+// closes tunnels and ports which have been opened, so it's used by the failed start as well
+static int mmal_camera_disconnect()
+{
+    int res = 0;
+    MMAL_PORT_T *video_port = camera.camera->output[MMAL_CAMERA_VIDEO_PORT];
+    MMAL_CALL(mmal_port_parameter_set_boolean(video_port, MMAL_PARAMETER_CAPTURE, 0), error);
+
+    CALL(mmal_encoder_disconnect(), error);
+    if (camera.resizer_connection) {
+        MMAL_CALL(mmal_connection_destroy(camera.resizer_connection), error);
+        camera.resizer_connection = NULL;
+    }
+    if (camera.worker_port) {
+        if (camera.worker_port->is_enabled)
+            MMAL_CALL(mmal_port_disable(camera.worker_port), error);
+
+        // the frame which hasn't been taken by the worker returns its buffer to the pool
+        res = pthread_mutex_lock(&camera.mutex);
+        if (res) {
+            CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&camera.mutex), res);
+            goto error;
+        }
+        struct frame_t *dropped = camera.worker_frame;
+        camera.worker_frame = NULL;
+        res = pthread_mutex_unlock(&camera.mutex);
+        if (res) {
+            CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&camera.mutex), res);
+            goto error;
+        }
+        if (dropped)
+            CALL(frame_unref(dropped), error);
+
+        if (camera.worker_pool) {
+            mmal_port_pool_destroy(camera.worker_port, camera.worker_pool);
+            camera.worker_pool = NULL;
+        }
+        camera.worker_port = NULL;
+    }
+    if (camera.splitter_connection) {
+        MMAL_CALL(mmal_connection_destroy(camera.splitter_connection), error);
+        camera.splitter_connection = NULL;
+    }
+    return 0;
+
+error:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int mmal_camera_start(int format)
+{
+    ASSERT_PTR(camera.camera, !=, NULL, cleanup);
+    ASSERT_PTR(mmal_camera_format, ==, NULL, cleanup);
+    int formats_len = ARRAY_SIZE(mmal_camera_formats);
+    for (int i = 0; i < formats_len; i++) {
+        struct format_mapping_t *f = mmal_camera_formats + i;
+        if (f->format == format && f->is_supported) {
+            mmal_camera_format = f;
+            break;
+        }
+    }
+    if (mmal_camera_format == NULL) {
+        ERROR("Format isn't supported by device or application");
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the camera captures 4:2:0 planes which are read by the encoder and the resizer
+    MMAL_PORT_T *video_port = camera.camera->output[MMAL_CAMERA_VIDEO_PORT];
+    video_port->format->encoding = MMAL_ENCODING_I420;
+    video_port->format->encoding_variant = MMAL_ENCODING_I420;
+    video_port->format->es->video.width = MMAL_PLANE_WIDTH(app.video_width);
+    video_port->format->es->video.height = MMAL_PLANE_HEIGHT(app.video_height);
+    video_port->format->es->video.crop.x = 0;
+    video_port->format->es->video.crop.y = 0;
+    video_port->format->es->video.crop.width = app.video_width;
+    video_port->format->es->video.crop.height = app.video_height;
+    video_port->format->es->video.frame_rate.num = MMAL_CAMERA_FPS;
+    video_port->format->es->video.frame_rate.den = 1;
+    MMAL_CALL(mmal_port_format_commit(video_port), error);
+
+    MMAL_CALL(mmal_connection_create(&camera.splitter_connection, video_port,
+        camera.splitter->input[0],
+        MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT), error);
+    for (int i = 0; i <= MMAL_CAMERA_RESIZER_OUTPUT; i++) {
+        MMAL_PORT_T *port = camera.splitter->output[i];
+        mmal_format_copy(port->format, camera.splitter->input[0]->format);
+        MMAL_CALL(mmal_port_format_commit(port), error);
+    }
+
+    CALL(mmal_encoder_connect(camera.splitter->output[MMAL_CAMERA_ENCODER_OUTPUT]), error);
+
+    MMAL_CALL(mmal_connection_create(&camera.resizer_connection,
+        camera.splitter->output[MMAL_CAMERA_RESIZER_OUTPUT],
+        camera.resizer->input[0],
+        MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT), error);
+
+    // the GPU scales frames down for the detection worker, the CPU reads them as is
+    camera.worker_port = camera.resizer->output[0];
+    mmal_format_copy(camera.worker_port->format, camera.resizer->input[0]->format);
+    camera.worker_port->format->es->video.width = MMAL_PLANE_WIDTH(app.worker_width);
+    camera.worker_port->format->es->video.height = MMAL_PLANE_HEIGHT(app.worker_height);
+    camera.worker_port->format->es->video.crop.x = 0;
+    camera.worker_port->format->es->video.crop.y = 0;
+    camera.worker_port->format->es->video.crop.width = app.worker_width;
+    camera.worker_port->format->es->video.crop.height = app.worker_height;
+    camera.worker_port->buffer_size = camera.worker_port->buffer_size_recommended;
+    camera.worker_port->buffer_num = MMAL_CAMERA_WORKER_BUFFERS;
+    MMAL_CALL(mmal_port_format_commit(camera.worker_port), error);
+
+    camera.worker_pool = mmal_port_pool_create(camera.worker_port,
+        camera.worker_port->buffer_num,
+        camera.worker_port->buffer_size);
+    if (!camera.worker_pool) {
+        MMAL_MESSAGE(mmal_port_pool_create(camera.worker_port, ...), MMAL_EAGAIN);
+        goto error;
+    }
+    MMAL_CALL(mmal_port_enable(camera.worker_port, mmal_camera_worker_callback), error);
+    for (int i = 0; i < camera.worker_port->buffer_num; i++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(camera.worker_pool->queue);
+        if (!buffer) {
+            MMAL_MESSAGE(mmal_queue_get(camera.worker_pool->queue), MMAL_EAGAIN);
+            goto error;
+        }
+        MMAL_CALL(mmal_port_send_buffer(camera.worker_port, buffer), error);
+    }
+
+    MMAL_CALL(mmal_connection_enable(camera.resizer_connection), error);
+    MMAL_CALL(mmal_connection_enable(camera.splitter_connection), error);
+    MMAL_CALL(mmal_port_parameter_set_boolean(video_port, MMAL_PARAMETER_CAPTURE, 1), error);
+
+    DEBUG("input[%s] has been started!!!", input.name);
+    return 0;
+
+error:
+    mmal_camera_disconnect();
+    mmal_camera_format = NULL;
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int mmal_camera_is_started()
+{
+    return mmal_camera_format != NULL? 1: 0;
+}
+
+static int mmal_camera_stop()
+{
+    ASSERT_PTR(mmal_camera_format, !=, NULL, cleanup);
+    CALL(mmal_camera_disconnect(), cleanup);
+    mmal_camera_format = NULL;
+    DEBUG("input[%s] has been stopped!!!", input.name);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static void mmal_camera_cleanup()
+{
+    if (mmal_camera_format)
+        mmal_camera_stop();
+
+    frame_pool_cleanup(&camera.pool);
+
+    if (camera.resizer) {
+        MMAL_CALL(mmal_component_destroy(camera.resizer));
+        camera.resizer = NULL;
+    }
+    if (camera.splitter) {
+        MMAL_CALL(mmal_component_destroy(camera.splitter));
+        camera.splitter = NULL;
+    }
+    if (camera.camera) {
+        MMAL_CALL(mmal_component_destroy(camera.camera));
+        camera.camera = NULL;
+    }
+
+    if (camera.is_mutex) {
+        int res = pthread_mutex_destroy(&camera.mutex);
+        if (res) {
+            errno = res;
+            CALL_MESSAGE(pthread_mutex_destroy(&camera.mutex));
+        }
+        camera.is_mutex = 0;
+    }
+}
+
+static int mmal_camera_init()
+{
+    MMAL_CALL(mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera.camera), cleanup);
+    ASSERT_INT(camera.camera->output_num, >, MMAL_CAMERA_VIDEO_PORT, cleanup);
+
+    MMAL_PARAMETER_INT32_T camera_num = {
+        { MMAL_PARAMETER_CAMERA_NUM, sizeof(camera_num) },
+        app.camera_num
+    };
+    MMAL_CALL(mmal_port_parameter_set(camera.camera->control, &camera_num.hdr), cleanup);
+
+    MMAL_PARAMETER_CAMERA_CONFIG_T config = {
+        { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(config) },
+        .max_stills_w = app.video_width,
+        .max_stills_h = app.video_height,
+        .stills_yuv422 = 0,
+        .one_shot_stills = 0,
+        .max_preview_video_w = app.video_width,
+        .max_preview_video_h = app.video_height,
+        .num_preview_video_frames = 3,
+        .stills_capture_circular_buffer_height = 0,
+        .fast_preview_resume = 0,
+        .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+    };
+    MMAL_CALL(mmal_port_parameter_set(camera.camera->control, &config.hdr), cleanup);
+    MMAL_CALL(mmal_component_enable(camera.camera), cleanup);
+
+    MMAL_CALL(mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, &camera.splitter),
+        cleanup);
+    ASSERT_INT(camera.splitter->output_num, >, MMAL_CAMERA_RESIZER_OUTPUT, cleanup);
+    MMAL_CALL(mmal_component_enable(camera.splitter), cleanup);
+
+    MMAL_CALL(mmal_component_create(MMAL_CAMERA_RESIZER, &camera.resizer), cleanup);
+    MMAL_CALL(mmal_component_enable(camera.resizer), cleanup);
+
+    ASSERT_INT(camera.is_mutex, ==, 0, cleanup)
+    int res = pthread_mutex_init(&camera.mutex, NULL);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_init(&camera.mutex), res);
+        goto cleanup;
+    }
+    camera.is_mutex = 1;
+
+    CALL(frame_pool_init(&camera.pool, MMAL_CAMERA_WORKER_BUFFERS, 0), cleanup);
+    camera.pool.release = mmal_camera_release_worker_frame;
+    return 0;
+
+cleanup:
+    mmal_camera_cleanup();
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// the camera sets the pace, the frame is ready when the encoder has finished it
+static int mmal_camera_process_frame()
+{
+    ASSERT_PTR(mmal_camera_format, !=, NULL, cleanup);
+    CALL(mmal_encoder_wait_frame(), cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int mmal_camera_get_frame(struct frame_t **frame)
+{
+    ASSERT_PTR(mmal_camera_format, !=, NULL, cleanup);
+    CALL(mmal_get_frame(frame), cleanup);
+    if (*frame == NULL) {
+        // the encoder has lost the frame, the next tick waits for another one
+        errno = ETIME;
+        goto cleanup;
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EOPNOTSUPP;
+    return -1;
+}
+
+static int mmal_camera_get_worker_frame(struct frame_t **frame)
+{
+    ASSERT_PTR(mmal_camera_format, !=, NULL, cleanup);
+    int res = pthread_mutex_lock(&camera.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&camera.mutex), res);
+        goto cleanup;
+    }
+    // the camera keeps the latest frame for the next call
+    *frame = camera.worker_frame? frame_ref(camera.worker_frame): NULL;
+    res = pthread_mutex_unlock(&camera.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&camera.mutex), res);
+        goto cleanup;
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EOPNOTSUPP;
+    return -1;
+}
+
+static int mmal_camera_get_formats(const struct format_mapping_t *formats[])
+{
+    if (formats != NULL)
+        *formats = mmal_camera_formats;
+    return ARRAY_SIZE(mmal_camera_formats);
+}
+
+void mmal_camera_construct()
+{
+    input.name = "mmal_camera";
+    input.context = &camera;
+    input.init = mmal_camera_init;
+    input.cleanup = mmal_camera_cleanup;
+    input.start = mmal_camera_start;
+    input.is_started = mmal_camera_is_started;
+    input.stop = mmal_camera_stop;
+    input.process_frame = mmal_camera_process_frame;
+
+    input.get_frame = mmal_camera_get_frame;
+    input.get_worker_frame = mmal_camera_get_worker_frame;
+    input.get_formats = mmal_camera_get_formats;
+    // frames are encoded in the tunnel, so the encoder gives key frames for the camera
+    input.request_key_frame = mmal_encoder_request_key_frame;
+    input.set_bitrate = mmal_encoder_set_bitrate;
+}
@@ -0,0 +1,37 @@
+#ifndef mmal_camera_h
+#define mmal_camera_h
+
+#define MMAL_CAMERA_RESIZER "vc.ril.resize"
+#define MMAL_CAMERA_PREVIEW_PORT 0
+#define MMAL_CAMERA_VIDEO_PORT 1
+#define MMAL_CAMERA_STILL_PORT 2
+#define MMAL_CAMERA_FPS 30
+// the splitter feeds the encoder by the first output and the resizer by the second one
+#define MMAL_CAMERA_ENCODER_OUTPUT 0
+#define MMAL_CAMERA_RESIZER_OUTPUT 1
+// the latest frame is kept for the detection worker while the resizer fills other buffers
+#define MMAL_CAMERA_WORKER_BUFFERS 3
+
+struct mmal_camera_state_t {
+    MMAL_COMPONENT_T *camera;
+    MMAL_COMPONENT_T *splitter;
+    MMAL_COMPONENT_T *resizer;
+
+    // frames go from the camera to the encoder and the resizer by tunnels of the GPU
+    MMAL_CONNECTION_T *splitter_connection;
+    MMAL_CONNECTION_T *resizer_connection;
+    MMAL_PORT_T *worker_port;
+    MMAL_POOL_T *worker_pool;
+
+    // frames of the detection worker wrap buffers of the resizer
+    struct frame_pool_t pool;
+    MMAL_BUFFER_HEADER_T *worker_headers[MMAL_CAMERA_WORKER_BUFFERS];
+    struct frame_t *worker_frame;
+    uint32_t worker_sequence;
+    pthread_mutex_t mutex;
+    int is_mutex;
+};
+
+void mmal_camera_construct();
+
+#endif //mmal_camera_h
@@ -18,10 +18,12 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
+#include "yuv_kernels.h"
 
 #include "mmal_encoder.h"
 
-static char* mmal_errors[16] = {
+char* mmal_errors[16] = {
     "MMAL_SUCCESS",
     "MMAL_ENOMEM",
     "MMAL_ENOSPC",
@@ -42,8 +44,19 @@ static char* mmal_errors[16] = {
 
 static struct format_mapping_t mmal_input_formats[] = {
     {
+        // YUYV is converted to I420 by CPU, so the encoder reads half of chroma
         .format = VIDEO_FORMAT_YUYV,
-        .internal_format = MMAL_ENCODING_I422,
+        .internal_format = MMAL_ENCODING_I420,
+        .is_supported = 1
+    },
+    {
+        .format = VIDEO_FORMAT_I420,
+        .internal_format = MMAL_ENCODING_I420,
+        .is_supported = 1
+    },
+    {
+        .format = VIDEO_FORMAT_NV12,
+        .internal_format = MMAL_ENCODING_NV12,
         .is_supported = 1
     }
 };
@@ -64,41 +77,145 @@ static struct mmal_encoder_state_t mmal = {
     .input_pool = NULL,
     .output_port = NULL,
     .output_pool = NULL,
+    .connection = NULL,
     .is_mutex = 0,
-    .in_buf = NULL,
-    .out_buf = NULL,
-    .out_mmal_buf = NULL,
-    .out_buf_used = 0
+    .pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .out_frame = NULL,
+    .is_dropping = 0,
+    .aus_head = 0,
+    .aus_count = 0,
+    .props_head = 0,
+    .props_count = 0,
+    .in_pool = { .frames = NULL, .frames_count = 0, .data = NULL }
 };
 
+static struct filter_t mmal_filter;
+
 extern struct app_state_t app;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 
 static void input_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
     mmal_buffer_header_release(buffer);
 }
 
+// returns the buffer to the encoder, so it can be filled again
+static int mmal_requeue_out_buffer(MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_buffer_header_mem_unlock(buffer);
+    mmal_buffer_header_release(buffer);
+
+    MMAL_PORT_T *port = mmal.output_port;
+    if (mmal.output_pool && port && port->is_enabled) {
+        MMAL_QUEUE_T *queue = mmal.output_pool->queue;
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(queue);
+        if (!buffer) {
+            MMAL_MESSAGE(mmal_queue_get(queue), MMAL_EAGAIN);
+            goto cleanup;
+        }
+        MMAL_CALL(mmal_port_send_buffer(port, buffer), cleanup);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// the last consumer has released the encoded frame, so buffers go back to the encoder
+static int mmal_release_out_frame(struct frame_t *frame)
+{
+    int res = 0;
+    for (int i = 0; i < frame->planes_count; i++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal.out_headers[frame->index][i];
+        mmal.out_headers[frame->index][i] = NULL;
+        if (buffer && mmal_requeue_out_buffer(buffer) == -1)
+            res = -1;
+    }
+    frame->planes_count = 0;
+    frame->length = 0;
+    return res;
+}
+
+// takes props of the oldest frame in flight, the encoder keeps the order of frames,
+// frames of the tunnel don't pass process_frame, so the encoder counts them
+static void mmal_pop_props(struct frame_t *frame, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct frame_t props;
+    memset(&props, 0, sizeof(props));
+    if (mmal.connection) {
+        props.sequence = mmal.sequence++;
+        if (buffer->pts != MMAL_TIME_UNKNOWN) {
+            props.timestamp.tv_sec = buffer->pts / 1000000;
+            props.timestamp.tv_usec = buffer->pts % 1000000;
+        }
+    }
+    else if (mmal.props_count > 0) {
+        props = mmal.in_props[mmal.props_head];
+        mmal.props_head = (mmal.props_head + 1) % MMAL_IN_BUFFERS_MAX;
+        mmal.props_count--;
+    }
+    if (frame)
+        frame_copy_props(frame, &props);
+}
+
 static void output_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
+    struct frame_t *dropped = NULL;
+    // the configuration is sent together with the next frame
+    int is_end = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
+        !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG);
     int res = pthread_mutex_lock(&mmal.mutex);
     if (res) {
         CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&mmal.mutex), res);
         goto error;
     }
     MMAL_CALL(mmal_buffer_header_mem_lock(buffer), buffer_unlock);
+    if (buffer->length == 0) {
+        mmal_requeue_out_buffer(buffer);
+        goto buffer_unlock;
+    }
 
-    ASSERT_INT(mmal.out_buf_used + buffer->length,
-        <,
-        MMAL_OUT_BUFFER_SIZE,
-        mmal_unlock);
-    
-    // DEBUG("copy buffer, source: %p, dest: %p, length: %d",
-    //     buffer->data, mmal.out_buf, buffer->length);
-    memcpy(mmal.out_mmal_buf + mmal.out_buf_used, buffer->data, buffer->length);
-    mmal.out_buf_used += buffer->length;
+    // the tail of the lost frame doesn't make the frame
+    if (mmal.is_dropping) {
+        mmal.is_dropping = !is_end;
+        goto mmal_unlock;
+    }
 
-    mmal_buffer_header_mem_unlock(buffer);
+    struct frame_t *out = mmal.out_frame;
+    if (out == NULL) {
+        out = frame_pool_get(&mmal.pool);
+        if (out == NULL) {
+            CALL_MESSAGE(frame_pool_get(&mmal.pool));
+            mmal.is_dropping = !is_end;
+            goto mmal_unlock;
+        }
+        frame_set_planes(out, mmal_output_format->format, app.video_width, app.video_height);
+        out->planes_count = 0;
+        mmal.out_frame = out;
+    }
+    if (out->planes_count == FRAME_MAX_CHUNKS) {
+        ERROR("the encoded frame is split to more than %d buffers", FRAME_MAX_CHUNKS);
+        dropped = out;
+        mmal.out_frame = NULL;
+        mmal.is_dropping = !is_end;
+        goto mmal_unlock;
+    }
+
+    // the frame refers the data of the encoder, chunks of the bitstream follow in planes
+    int chunk = out->planes_count++;
+    mmal.out_headers[out->index][chunk] = buffer;
+    out->planes[chunk] = buffer->data + buffer->offset;
+    out->strides[chunk] = buffer->length;
+    out->length += buffer->length;
+
+    if (is_end) {
+        mmal_pop_props(out, buffer);
+        mmal.aus[(mmal.aus_head + mmal.aus_count) % MMAL_OUT_BUFFERS_MAX] = out;
+        mmal.aus_count++;
+        mmal.out_frame = NULL;
+    }
 
     res = pthread_mutex_unlock(&mmal.mutex);
     if (res) {
@@ -106,31 +223,25 @@ static void output_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buff
         goto error;
     }
 
-    mmal_buffer_header_release(buffer);
-
-    if (mmal.output_pool && port->is_enabled) {
-        MMAL_QUEUE_T *queue = mmal.output_pool->queue;
-
-        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(queue);
-        if (!buffer) {
-            MMAL_MESSAGE(mmal_queue_get(queue), MMAL_EAGAIN);
-            goto error;
-        }
-        MMAL_CALL(mmal_port_send_buffer(port, buffer), error);
-    }
-
-    // unlock encoder to get new buffer;
-    CALL(sem_post(&mmal.semaphore), error);
+    // the source of the tunnel waits for the encoded frame
+    if (is_end && mmal.connection)
+        CALL(sem_post(&mmal.semaphore), error);
     return;
 
 mmal_unlock:
-    mmal_buffer_header_mem_unlock(buffer);
-
+    mmal_requeue_out_buffer(buffer);
+    if (is_end)
+        mmal_pop_props(NULL, buffer);
 buffer_unlock:
     res = pthread_mutex_unlock(&mmal.mutex);
     if (res) {
         CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&mmal.mutex), res);
     }
+    if (dropped)
+        CALL(frame_unref(dropped));
+    // the frame which has been lost unlocks the source as well
+    if (is_end && mmal.connection)
+        CALL(sem_post(&mmal.semaphore));
 error:
     return;
 }
@@ -159,18 +270,47 @@ static int mmal_stop()
     ASSERT_PTR(mmal_input_format, !=, NULL, cleanup);
     ASSERT_PTR(mmal_output_format, !=, NULL, cleanup);
 
+    // buffers which are still held by the previous filter go back to the pool
+    for (int i = 0; i < MMAL_IN_BUFFERS_MAX; i++)
+        if (mmal.in_headers[i]) {
+            mmal_buffer_header_release(mmal.in_headers[i]);
+            mmal.in_headers[i] = NULL;
+        }
+
     if (mmal_input_format) {
-        MMAL_CALL(mmal_port_disable(mmal.input_port), cleanup);
+        if (mmal.connection) {
+            // the source keeps running, so the tunnel is closed together with the port
+            MMAL_CALL(mmal_connection_destroy(mmal.connection), cleanup);
+            mmal.connection = NULL;
+        }
+        else {
+            MMAL_CALL(mmal_port_disable(mmal.input_port), cleanup);
+        }
         mmal_input_format = NULL;
         mmal.input_port = NULL;
         mmal.input_pool = NULL;
+        mmal.props_head = 0;
+        mmal.props_count = 0;
     }
 
     if (mmal_output_format) {
         MMAL_CALL(mmal_port_disable(mmal.output_port), cleanup);
-        mmal_output_format = NULL;
         mmal.output_port = NULL;
         mmal.output_pool = NULL;
+
+        // encoded frames which haven't been taken by consumers are dropped
+        for (int i = 0; i < mmal.aus_count; i++) {
+            struct frame_t *au = mmal.aus[(mmal.aus_head + i) % MMAL_OUT_BUFFERS_MAX];
+            CALL(frame_unref(au));
+        }
+        mmal.aus_head = 0;
+        mmal.aus_count = 0;
+        if (mmal.out_frame) {
+            CALL(frame_unref(mmal.out_frame));
+            mmal.out_frame = NULL;
+        }
+        mmal.is_dropping = 0;
+        mmal_output_format = NULL;
     }
 
     DEBUG("filter[%s] has been stopped", mmal.filter->name);
@@ -192,20 +332,8 @@ void mmal_cleanup()
     if (mmal_is_started())
         mmal_stop();
 
-    if (mmal.out_mmal_buf) {
-        free(mmal.out_mmal_buf);
-        mmal.out_mmal_buf = NULL;
-    }
-
-    if (mmal.out_buf) {
-        free(mmal.out_buf);
-        mmal.out_buf = NULL;
-    }
-
-    if (mmal.in_buf) {
-        free(mmal.in_buf);
-        mmal.in_buf = NULL;
-    }
+    frame_pool_cleanup(&mmal.pool);
+    frame_pool_cleanup(&mmal.in_pool);
 
     if (mmal.encoder) {
         MMAL_CALL(mmal_component_destroy(mmal.encoder));
@@ -227,10 +355,55 @@ void mmal_cleanup()
     }
 }
 
+// the output port is filled by the encoder regardless of the source of frames
+static int mmal_start_output()
+{
+    mmal.output_port = mmal.encoder->output[0];
+    mmal.output_port->format->encoding =  mmal_output_format->internal_format;
+    mmal.output_port->format->es->video.width = app.video_width;
+    mmal.output_port->format->es->video.height = app.video_height;
+    mmal.output_port->format->es->video.crop.x = 0;
+    mmal.output_port->format->es->video.crop.y = 0;
+    mmal.output_port->format->es->video.crop.width = app.video_width;
+    mmal.output_port->format->es->video.crop.height = app.video_height;
+    if (app.h264_bitrate > 0)
+        mmal.output_port->format->bitrate = app.h264_bitrate * 1000;
+    mmal.output_port->buffer_size = MAX(mmal.output_port->buffer_size_recommended,
+        MMAL_OUT_BUFFER_SIZE);
+    // consumers hold buffers until encoded frames are sent, so the encoder needs spare ones
+    mmal.output_port->buffer_num = MAX(mmal.output_port->buffer_num_recommended,
+        MMAL_OUT_BUFFERS);
+    MMAL_CALL(mmal_port_format_commit(mmal.output_port), cleanup);
+    ASSERT_INT(mmal.output_port->buffer_num, <=, MMAL_OUT_BUFFERS_MAX, cleanup);
+
+    int slices = MIN(app.h264_slices, MMAL_MAX_SLICES);
+    if (slices > 1) {
+        int mb_rows = MMAL_PLANE_HEIGHT(app.video_height) >> 4;
+        MMAL_CALL(mmal_port_parameter_set_uint32(mmal.output_port,
+            MMAL_PARAMETER_MB_ROWS_PER_SLICE, (mb_rows + slices - 1) / slices), cleanup);
+    }
+
+    mmal.output_pool = mmal_port_pool_create(mmal.output_port,
+        mmal.output_port->buffer_num,
+        mmal.output_port->buffer_size);
+    if (!mmal.output_pool) {
+        MMAL_MESSAGE(mmal_port_pool_create(mmal.output_port, ...), MMAL_EAGAIN);
+        goto cleanup;
+    }
+
+    MMAL_CALL(mmal_port_enable(mmal.output_port, output_buffer_callback), cleanup);
+    CALL(fill_port_buffer(mmal.output_port, mmal.output_pool), cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
 static int mmal_start(int input_format, int output_format)
 {
-    ASSERT_PTR(mmal.out_mmal_buf, !=, NULL, cleanup);
-    ASSERT_PTR(mmal.out_buf, !=, NULL, cleanup)
+    ASSERT_PTR(mmal.pool.frames, !=, NULL, cleanup)
     ASSERT_PTR(mmal.encoder, !=, NULL, cleanup);
     ASSERT_INT(mmal.encoder->output[0]->buffer_num, >, 0, cleanup);
     ASSERT_PTR(mmal_input_format, ==, NULL, cleanup);
@@ -266,29 +439,18 @@ static int mmal_start(int input_format, int output_format)
 
     mmal.input_port = mmal.encoder->input[0];
     mmal.input_port->format->encoding = mmal_input_format->internal_format;
-    mmal.input_port->format->es->video.width = app.video_width;
-    mmal.input_port->format->es->video.height = app.video_height;
+    mmal.input_port->format->es->video.width = MMAL_PLANE_WIDTH(app.video_width);
+    mmal.input_port->format->es->video.height = MMAL_PLANE_HEIGHT(app.video_height);
     mmal.input_port->format->es->video.crop.x = 0;
     mmal.input_port->format->es->video.crop.y = 0;
     mmal.input_port->format->es->video.crop.width = app.video_width;
     mmal.input_port->format->es->video.crop.height = app.video_height;
     mmal.input_port->buffer_size = mmal.input_port->buffer_size_recommended;
-    mmal.input_port->buffer_num = mmal.input_port->buffer_num_recommended;
+    // the encoder works on one buffer while the previous filter fills another one
+    mmal.input_port->buffer_num = MAX(mmal.input_port->buffer_num_recommended,
+        MMAL_IN_BUFFERS);
     MMAL_CALL(mmal_port_format_commit(mmal.input_port), cleanup);
-
-    mmal.output_port = mmal.encoder->output[0];
-    mmal.output_port->format->encoding =  mmal_output_format->internal_format;
-    mmal.output_port->format->es->video.width = app.video_width;
-    mmal.output_port->format->es->video.height = app.video_height;
-    mmal.output_port->format->es->video.crop.x = 0;
-    mmal.output_port->format->es->video.crop.y = 0;
-    mmal.output_port->format->es->video.crop.width = app.video_width;
-    mmal.output_port->format->es->video.crop.height = app.video_height;
-    mmal.output_port->buffer_size = mmal.output_port->buffer_size_recommended;
-    mmal.output_port->buffer_num = mmal.output_port->buffer_num_recommended;
-    MMAL_CALL(mmal_port_format_commit(mmal.output_port), cleanup);
-
-    ASSERT_INT(mmal.output_port->buffer_size, <=, MMAL_OUT_BUFFER_SIZE, cleanup);
+    ASSERT_INT(mmal.input_port->buffer_num, <=, MMAL_IN_BUFFERS_MAX, cleanup);
     //DEBUG("mmal.input_port->buffer_num: %d", mmal.input_port->buffer_num);
 
     mmal.input_pool = mmal_port_pool_create(mmal.input_port,
@@ -298,24 +460,68 @@ static int mmal_start(int input_format, int output_format)
         MMAL_MESSAGE(mmal_port_pool_create(mmal.input_port, ...), MMAL_EAGAIN);
         goto cleanup;
     }
+    MMAL_CALL(mmal_port_enable(mmal.input_port, input_buffer_callback), cleanup);
+    CALL(mmal_start_output(), cleanup);
 
-    mmal.output_pool = mmal_port_pool_create(mmal.output_port,
-        mmal.output_port->buffer_num,
-        mmal.output_port->buffer_size);
-    if (!mmal.output_port) {
-        MMAL_MESSAGE(mmal_port_pool_create(mmal.output_port, ...), MMAL_EAGAIN);
-        goto cleanup;
-    }
+    DEBUG("filter[%s] has been started", mmal.filter->name);
+    return 0;
 
-    MMAL_CALL(mmal_port_enable(mmal.input_port, input_buffer_callback), cleanup);
-    MMAL_CALL(mmal_port_enable(mmal.output_port, output_buffer_callback), cleanup);
+cleanup:
+    mmal_input_format = NULL;
+    mmal_output_format = NULL;
 
-    CALL(fill_port_buffer(mmal.output_port, mmal.output_pool), cleanup);
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
 
-    DEBUG("filter[%s] has been started", mmal.filter->name);
+// the port of another component feeds the encoder by the tunnel, so frames don't pass
+// the CPU, encoded frames are taken by mmal_get_frame as usual
+int mmal_encoder_connect(MMAL_PORT_T *port)
+{
+    ASSERT_PTR(mmal.pool.frames, !=, NULL, cleanup)
+    ASSERT_PTR(mmal.encoder, !=, NULL, cleanup);
+    ASSERT_PTR(mmal_input_format, ==, NULL, cleanup);
+    ASSERT_PTR(mmal_output_format, ==, NULL, cleanup);
+
+    int formats_len = ARRAY_SIZE(mmal_input_formats);
+    for (int i = 0; i < formats_len; i++) {
+        struct format_mapping_t *f = mmal_input_formats + i;
+        if (f->internal_format == port->format->encoding && f->format != VIDEO_FORMAT_YUYV &&
+            f->is_supported) {
+            mmal_input_format = f;
+            break;
+        }
+    }
+    if (mmal_input_format == NULL) {
+        ERROR("Format of the port isn't supported by the encoder");
+        errno = EINVAL;
+        goto cleanup;
+    }
+    mmal_output_format = mmal_output_formats;
+
+    // the connection commits the format of the port to the input of the encoder
+    mmal.input_port = mmal.encoder->input[0];
+    MMAL_CALL(mmal_connection_create(&mmal.connection, port, mmal.input_port,
+        MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT), cleanup);
+    CALL(mmal_start_output(), cleanup);
+    // posts of the previous start don't stand for frames of the tunnel
+    while (sem_trywait(&mmal.semaphore) == 0)
+        continue;
+    mmal.sequence = 0;
+    MMAL_CALL(mmal_connection_enable(mmal.connection), cleanup);
+
+    DEBUG("filter[%s] has been connected", mmal.filter->name);
     return 0;
 
 cleanup:
+    if (mmal.connection) {
+        MMAL_CALL(mmal_connection_destroy(mmal.connection));
+        mmal.connection = NULL;
+    }
+    if (mmal.output_port && mmal.output_port->is_enabled) {
+        MMAL_CALL(mmal_port_disable(mmal.output_port));
+    }
     mmal_input_format = NULL;
     mmal_output_format = NULL;
 
@@ -324,6 +530,40 @@ cleanup:
     return -1;
 }
 
+// waits for the frame which has come through the tunnel, the source sets the pace
+int mmal_encoder_wait_frame()
+{
+    ASSERT_PTR(mmal.connection, !=, NULL, cleanup);
+    struct timespec time;
+    CALL(clock_gettime(CLOCK_REALTIME, &time), cleanup);
+    time.tv_sec += MMAL_FRAME_TIMEOUT;
+    CALL(sem_timedwait(&mmal.semaphore, &time), cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+int mmal_encoder_disconnect()
+{
+    if (mmal.connection && mmal_is_started())
+        return mmal_stop();
+    return 0;
+}
+
+// returns the buffer to the encoder if the previous filter hasn't sent the frame
+static int mmal_release_in_frame(struct frame_t *frame)
+{
+    MMAL_BUFFER_HEADER_T *mmal_buffer = mmal.in_headers[frame->index];
+    if (mmal_buffer) {
+        mmal.in_headers[frame->index] = NULL;
+        mmal_buffer_header_release(mmal_buffer);
+    }
+    return 0;
+}
+
 static int mmal_init()
 {
     MMAL_CALL(mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &mmal.encoder), cleanup);
@@ -340,19 +580,13 @@ static int mmal_init()
     CALL(sem_init(&mmal.semaphore, 0, 0), cleanup);
     mmal.is_semaphore = 1;
 
-    ASSERT_PTR(mmal.out_mmal_buf, ==, NULL, cleanup)
-    mmal.out_mmal_buf = malloc(MMAL_OUT_BUFFER_SIZE);
-    if (!mmal.out_mmal_buf) {
-        CALL_MESSAGE(malloc(MMAL_OUT_BUFFER_SIZE));
-        goto cleanup;
-    }
-
-    ASSERT_PTR(mmal.out_buf, ==, NULL, cleanup)
-    mmal.out_buf = malloc(MMAL_OUT_BUFFER_SIZE);
-    if (!mmal.out_buf) {
-        CALL_MESSAGE(malloc(MMAL_OUT_BUFFER_SIZE));
-        goto cleanup;
-    }
+    // every encoded frame holds at least one buffer of the encoder
+    CALL(frame_pool_init(&mmal.pool, MMAL_OUT_BUFFERS_MAX, 0), cleanup);
+    mmal.pool.release = mmal_release_out_frame;
+    // frames of the input pool wrap buffers of the encoder
+    CALL(frame_pool_init(&mmal.in_pool, MMAL_IN_BUFFERS_MAX, 0), cleanup);
+    mmal.in_pool.release = mmal_release_in_frame;
+    CALL(yuv_kernels_init(), cleanup);
     return 0;
 
 cleanup:
@@ -362,114 +596,183 @@ cleanup:
     return -1;
 }
 
-static int mmal_process_frame(uint8_t *buffer)
+// lays out 4:2:0 planes in the buffer of the encoder or another component of the GPU
+void mmal_set_planes(struct frame_t *planes, uint8_t *data, int format, int width, int height)
+{
+    int stride = MMAL_PLANE_WIDTH(width);
+    int rows = MMAL_PLANE_HEIGHT(height);
+
+    planes->format = format;
+    planes->width = width;
+    planes->height = height;
+    planes->planes[0] = data;
+    planes->strides[0] = stride;
+    planes->planes[1] = data + stride * rows;
+    if (format == VIDEO_FORMAT_NV12) {
+        planes->planes_count = 2;
+        planes->strides[1] = stride;
+    }
+    else {
+        planes->planes_count = 3;
+        planes->strides[1] = stride >> 1;
+        planes->strides[2] = stride >> 1;
+        planes->planes[2] = planes->planes[1] + (stride >> 1) * (rows >> 1);
+    }
+    planes->length = stride * rows + ((stride * rows) >> 1);
+}
+
+// hands out the next input buffer of the encoder, so the previous filter writes the frame
+// right there, YUYV is converted by the encoder itself, so the buffer isn't provided
+static int mmal_get_in_frame(int format, struct frame_t **frame)
 {
     ASSERT_PTR(mmal_input_format, !=, NULL, cleanup);
-    ASSERT_PTR(mmal_output_format, !=, NULL, cleanup);
+    *frame = NULL;
+    if (format != mmal_input_format->format || format == VIDEO_FORMAT_YUYV)
+        return 0;
+
+    struct frame_t *in = frame_pool_get(&mmal.in_pool);
+    if (in == NULL || in->index >= mmal.input_port->buffer_num) {
+        if (in)
+            CALL(frame_unref(in), cleanup);
+        return 0;
+    }
 
-    if (!mmal.in_buf) {
-        mmal.in_buf = malloc((app.video_width * app.video_height) << 1);
-        if (!mmal.in_buf) {
-            CALL_MESSAGE(malloc());
-            goto cleanup;
-        }
+    MMAL_BUFFER_HEADER_T *mmal_buffer = mmal_queue_get(mmal.input_pool->queue);
+    if (!mmal_buffer) {
+        CALL(frame_unref(in), cleanup);
+        return 0;
     }
+    mmal.in_headers[in->index] = mmal_buffer;
+    mmal_set_planes(in, mmal_buffer->data, format, app.video_width, app.video_height);
+    *frame = in;
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
 
-    // convert YUYV to YUV422
-    int half = (app.video_width * app.video_height);
-    int quarter = half >> 1;
-    // convert Y parts
-    uint8_t* in = buffer;
-    uint8_t* out = mmal.in_buf;
-    int len = half;
-    // DEBUG("len: %d, half: %d, quarter: %d", (app.video_width * app.video_height) << 1, half,
-    //     quarter);
-    while (len > 0) {
-        *out = *in;
-        out++;
-        len--;
-        in += 2;
-    }
-    // convert U parts
-    in = buffer + 1;
-    len = quarter;
-    while (len > 0) {
-        *out = *in;
-        out++;
-        len--;
-        in += 4;
-    }
-    // convert V parts
-    in = buffer + 3;
-    len = quarter;
-    while (len > 0) {
-        *out = *in;
-        out++;
-        len--;
-        in += 4;
+// returns the input buffer of the encoder which contains the frame
+static MMAL_BUFFER_HEADER_T *mmal_fill_in_buffer(struct frame_t *frame)
+{
+    MMAL_BUFFER_HEADER_T *mmal_buffer = NULL;
+    if (frame->pool == &mmal.in_pool) {
+        // the previous filter has already written the frame to the buffer of the encoder
+        mmal_buffer = mmal.in_headers[frame->index];
+        ASSERT_PTR(mmal_buffer, !=, NULL, cleanup);
+        mmal.in_headers[frame->index] = NULL;
+        mmal_buffer->length = frame->length;
+        return mmal_buffer;
     }
 
-    MMAL_BUFFER_HEADER_T *mmal_buffer = mmal_queue_get(mmal.input_pool->queue);
+    // all buffers can be in flight, so it waits until the encoder returns one of them
+    mmal_buffer = mmal_queue_timedwait(mmal.input_pool->queue, MMAL_IN_BUFFER_TIMEOUT);
     if (!mmal_buffer) {
-        MMAL_MESSAGE(mmal_queue_get(pool->queue), MMAL_EAGAIN);
+        MMAL_MESSAGE(mmal_queue_timedwait(mmal.input_pool->queue), MMAL_EAGAIN);
         goto cleanup;
     }
 
-    mmal_buffer->length = (app.video_width * app.video_height) << 1;
-    //DEBUG("copy buffer, data: %p, length: %d", mmal_buffer->data, mmal_buffer->length);
-    memcpy(mmal_buffer->data, mmal.in_buf, mmal_buffer->length);
+    // the frame is converted or copied right to the buffer of the encoder
+    struct frame_t planes;
+    int res = 0;
+    if (frame->format == VIDEO_FORMAT_YUYV) {
+        mmal_set_planes(&planes, mmal_buffer->data, VIDEO_FORMAT_I420, app.video_width,
+            app.video_height);
+        res = yuv_kernels_convert(frame, &planes);
+    }
+    else {
+        mmal_set_planes(&planes, mmal_buffer->data, frame->format, app.video_width,
+            app.video_height);
+        res = frame_copy_planes(&planes, frame);
+    }
+    if (res == -1) {
+        CALL_MESSAGE(mmal_fill_in_buffer(frame));
+        mmal_buffer_header_release(mmal_buffer);
+        goto cleanup;
+    }
+    mmal_buffer->length = planes.length;
+    return mmal_buffer;
 
-    // wait when encoder encode buffer to process next one
-    int value = 0;
-    CALL(sem_getvalue(&mmal.semaphore, &value), cleanup);
-    while (value > 0) {
-        CALL(sem_wait(&mmal.semaphore), cleanup);
-        CALL(sem_getvalue(&mmal.semaphore, &value), cleanup);
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return NULL;
+}
+
+static int mmal_process_frame(struct frame_t *frame)
+{
+    ASSERT_PTR(mmal_input_format, !=, NULL, cleanup);
+    ASSERT_PTR(mmal_output_format, !=, NULL, cleanup);
+
+    MMAL_BUFFER_HEADER_T *mmal_buffer = mmal_fill_in_buffer(frame);
+    if (!mmal_buffer) {
+        CALL_MESSAGE(mmal_fill_in_buffer(frame));
+        goto cleanup;
     }
 
-    MMAL_CALL(mmal_port_send_buffer(mmal.input_port, mmal_buffer), cleanup);
+    // props wait for the encoded frame, the oldest one is dropped if the encoder has lost
+    // frames
+    int res = pthread_mutex_lock(&mmal.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&mmal.mutex), res);
+        goto buffer_cleanup;
+    }
+    if (mmal.props_count == MMAL_IN_BUFFERS_MAX) {
+        mmal.props_head = (mmal.props_head + 1) % MMAL_IN_BUFFERS_MAX;
+        mmal.props_count--;
+    }
+    struct frame_t *props = mmal.in_props +
+        (mmal.props_head + mmal.props_count) % MMAL_IN_BUFFERS_MAX;
+    frame_copy_props(props, frame);
+    mmal.props_count++;
+    res = pthread_mutex_unlock(&mmal.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&mmal.mutex), res);
+        goto buffer_cleanup;
+    }
 
-    CALL(sem_wait(&mmal.semaphore), cleanup);
+    // the encoder works on the frame while the previous filter prepares the next one, the
+    // encoded frame is taken by get_frame when it's ready
+    MMAL_CALL(mmal_port_send_buffer(mmal.input_port, mmal_buffer), buffer_cleanup);
     return 0;
 
+buffer_cleanup:
+    mmal_buffer_header_release(mmal_buffer);
 cleanup:
     if (errno == 0)
         errno = EAGAIN;
     return -1;
 }
 
-static uint8_t *mmal_get_buffer(int *out_format, int *length)
+int mmal_get_frame(struct frame_t **frame)
 {
     ASSERT_PTR(mmal_input_format, !=, NULL, cleanup);
     ASSERT_PTR(mmal_output_format, !=, NULL, cleanup);
 
-    if (out_format)
-        *out_format = mmal_output_format->format;
-
     int res = pthread_mutex_lock(&mmal.mutex);
     if (res) {
         CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&mmal.mutex), res);
         goto cleanup;
     }
-
-    if (length)
-        *length = mmal.out_buf_used;
-    
-    memcpy(mmal.out_buf, mmal.out_mmal_buf, mmal.out_buf_used);
-    mmal.out_buf_used = 0;
-
+    // the reference of the queue is passed to the caller, the oldest frame goes first
+    *frame = NULL;
+    if (mmal.aus_count > 0) {
+        *frame = mmal.aus[mmal.aus_head];
+        mmal.aus_head = (mmal.aus_head + 1) % MMAL_OUT_BUFFERS_MAX;
+        mmal.aus_count--;
+    }
     res = pthread_mutex_unlock(&mmal.mutex);
     if (res) {
         CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&mmal.mutex), res);
         goto cleanup;
     }
-
-    return mmal.out_buf;
+    return 0;
 
 cleanup:
     if (errno == 0)
         errno = EOPNOTSUPP;
-    return (uint8_t *)-1;
+    return -1;
 }
 
 /*int mmal_get_capabilities(int camera_num, char *camera_name, int *width, int *height )
@@ -672,6 +975,34 @@ void camera_cleanup()
     }
 }*/
 
+// the encoder isn't started yet, so the stream starts from the key frame anyway
+int mmal_encoder_request_key_frame()
+{
+    if (!mmal.output_port || !mmal.output_port->is_enabled)
+        return 0;
+    MMAL_CALL(mmal_port_parameter_set_boolean(mmal.output_port,
+        MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1), cleanup);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+// the encoder takes the new bitrate without the restart of the stream
+int mmal_encoder_set_bitrate(int bitrate)
+{
+    if (!mmal.output_port || !mmal.output_port->is_enabled)
+        return 0;
+    MMAL_CALL(mmal_port_parameter_set_uint32(mmal.output_port, MMAL_PARAMETER_VIDEO_BIT_RATE,
+        bitrate * 1000), cleanup);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
 static int mmal_get_in_formats(const struct format_mapping_t *formats[])
 {
     if (mmal_input_formats != NULL)
@@ -686,24 +1017,32 @@ static int mmal_get_out_formats(const struct format_mapping_t *formats[])
     return ARRAY_SIZE(mmal_output_formats);
 }
 
+static int mmal_get_cost(int in_format, int out_format)
+{
+    // the frame is encoded by GPU, CPU converts YUYV to I420 in the buffer of the encoder
+    // or copies 4:2:0 planes there, bytes are counted by halves
+    int bytes = in_format == VIDEO_FORMAT_YUYV? 4 + 3: 3 + 3;
+    return app.video_width * app.video_height * bytes / 2 * FILTER_COST_BYTE;
+}
+
 void mmal_encoder_construct()
 {
-    int i = 0;
-    while (i < MAX_FILTERS && filters[i].context != NULL)
-        i++;
-
-    if (i != MAX_FILTERS) {
-        mmal.filter = filters + i;
-        filters[i].name = "mmal_encoder";
-        filters[i].context = &mmal;
-        filters[i].init = mmal_init;
-        filters[i].cleanup = mmal_cleanup;
-        filters[i].start = mmal_start;
-        filters[i].stop = mmal_stop;
-        filters[i].is_started = mmal_is_started;
-        filters[i].process_frame = mmal_process_frame;
-        filters[i].get_buffer = mmal_get_buffer;
-        filters[i].get_in_formats = mmal_get_in_formats;
-        filters[i].get_out_formats = mmal_get_out_formats;
-    }
+    struct filter_t *filter = &mmal_filter;
+    mmal.filter = filter;
+    filter->name = "mmal_encoder";
+    filter->context = &mmal;
+    filter->init = mmal_init;
+    filter->cleanup = mmal_cleanup;
+    filter->start = mmal_start;
+    filter->stop = mmal_stop;
+    filter->is_started = mmal_is_started;
+    filter->process_frame = mmal_process_frame;
+    filter->get_frame = mmal_get_frame;
+    filter->get_in_formats = mmal_get_in_formats;
+    filter->get_out_formats = mmal_get_out_formats;
+    filter->get_cost = mmal_get_cost;
+    filter->get_in_frame = mmal_get_in_frame;
+    filter->request_key_frame = mmal_encoder_request_key_frame;
+    filter->set_bitrate = mmal_encoder_set_bitrate;
+    kv_push(struct filter_t *, filters, filter);
 }
@@ -6,12 +6,31 @@
     #include "interface/mmal/mmal.h"
     #include "interface/mmal/util/mmal_util.h"
     #include "interface/mmal/util/mmal_default_components.h"
+    #include "interface/mmal/util/mmal_connection.h"
+    #include "interface/mmal/util/mmal_util_params.h"
 #else
     #include "mmal_encoder_stubs.h"
 #endif
 
 #define MMAL_UNKNOWN "Unknown"
+// the minimal size of output buffers, the frame which doesn't fit is split to several buffers
 #define MMAL_OUT_BUFFER_SIZE 65536
+// encoded frames keep buffers of the encoder until consumers release them
+#define MMAL_OUT_BUFFERS 4
+#define MMAL_OUT_BUFFERS_MAX 16
+// every slice can come in own buffer, so slices leave buffers of the encoder for the next frame
+#define MMAL_MAX_SLICES 8
+// frames in flight, the encoder works on one while the CPU fills the next one
+#define MMAL_IN_BUFFERS 3
+#define MMAL_IN_BUFFERS_MAX 8
+// milliseconds to wait for the input buffer which is returned by the encoder
+#define MMAL_IN_BUFFER_TIMEOUT 2000
+// seconds to wait for the frame which comes through the tunnel
+#define MMAL_FRAME_TIMEOUT 2
+// the encoder expects planes with the width aligned to 32 and the height aligned to 16
+#define MMAL_ALIGN_UP(value, align) (((value) + (align) - 1) & ~((align) - 1))
+#define MMAL_PLANE_WIDTH(width) MMAL_ALIGN_UP(width, 32)
+#define MMAL_PLANE_HEIGHT(height) MMAL_ALIGN_UP(height, 16)
 
 #define MMAL_STR_ERROR(res) \
 ({ \
@@ -48,6 +67,8 @@
 
 #define MMAL_CALL(...) MMAL_X(__VA_ARGS__)(__VA_ARGS__)
 
+extern char* mmal_errors[16];
+
 struct mmal_encoder_state_t {
     struct filter_t* filter;
     MMAL_COMPONENT_T *encoder;
@@ -55,16 +76,41 @@ struct mmal_encoder_state_t {
     MMAL_POOL_T *input_pool;
     MMAL_PORT_T *output_port;
     MMAL_POOL_T *output_pool;
+    // the tunnel which feeds the encoder by the GPU instead of process_frame
+    MMAL_CONNECTION_T *connection;
     pthread_mutex_t mutex;
     int is_mutex;
     sem_t semaphore;
     int is_semaphore;
-    uint8_t *in_buf;
-    uint8_t *out_mmal_buf;
-    uint8_t *out_buf;
-    int out_buf_used;
+
+    // encoded frames wrap buffers of the encoder, a frame can be split to several buffers
+    struct frame_pool_t pool;
+    MMAL_BUFFER_HEADER_T *out_headers[MMAL_OUT_BUFFERS_MAX][FRAME_MAX_CHUNKS];
+    struct frame_t *out_frame;  // the frame which collects buffers until the end of frame
+    int is_dropping;            // buffers of the lost frame are requeued until its end
+    // complete frames in order of encoding
+    struct frame_t *aus[MMAL_OUT_BUFFERS_MAX];
+    int aus_head;
+    int aus_count;
+    // props of frames in flight in order of encoding
+    struct frame_t in_props[MMAL_IN_BUFFERS_MAX];
+    int props_head;
+    int props_count;
+    uint32_t sequence;          // frames which have come through the tunnel
+
+    // input buffers of the encoder handed out to the previous filter
+    struct frame_pool_t in_pool;
+    MMAL_BUFFER_HEADER_T *in_headers[MMAL_IN_BUFFERS_MAX];
 };
 
 void mmal_encoder_construct();
+void mmal_set_planes(struct frame_t *planes, uint8_t *data, int format, int width, int height);
+int mmal_get_frame(struct frame_t **frame);
+
+int mmal_encoder_connect(MMAL_PORT_T *port);
+int mmal_encoder_wait_frame();
+int mmal_encoder_disconnect();
+int mmal_encoder_request_key_frame();
+int mmal_encoder_set_bitrate(int bitrate);
 
 #endif //mmal_encoder_h
\ No newline at end of file
@@ -18,86 +18,438 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 #include "mmal_encoder_stubs.h"
 #include "mmal_encoder.h"
+#include "mmal_camera.h"
+
+#include <pthread.h> //pthread_mutex_t
 
 extern struct app_state_t app;
 extern struct input_t input;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 extern struct output_t outputs[MAX_OUTPUTS];
 extern int is_abort;
 
-static uint8_t mmal_buffer[640*480*2];
-static MMAL_ES_SPECIFIC_FORMAT_T mmal_specific_format;
-static MMAL_ES_FORMAT_T mmal_format = {
-    .es = &mmal_specific_format
+#define MMAL_STUB_HEADERS 16
+#define MMAL_STUB_IN_HEADERS 4
+#define MMAL_STUB_OUT_LENGTH 200
+#define MMAL_STUB_WORKER_HEADERS 4
+#define MMAL_STUB_WORKER_SIZE (640 * 480 * 3 / 2)
+#define MMAL_STUB_CONNECTIONS 4
+
+// ports of all components, the camera and the splitter don't have own buffers, because
+// they are connected by tunnels
+enum mmal_stub_port_e {
+    MMAL_STUB_ENCODER_IN,
+    MMAL_STUB_ENCODER_OUT,
+    MMAL_STUB_CAMERA_CONTROL,
+    MMAL_STUB_CAMERA_PREVIEW,
+    MMAL_STUB_CAMERA_VIDEO,
+    MMAL_STUB_CAMERA_STILL,
+    MMAL_STUB_SPLITTER_IN,
+    MMAL_STUB_SPLITTER_OUT0,
+    MMAL_STUB_SPLITTER_OUT1,
+    MMAL_STUB_RESIZER_IN,
+    MMAL_STUB_RESIZER_OUT,
+    MMAL_STUB_PORTS
 };
-static MMAL_PORT_T mmal_port = {
-    .buffer_num = 1,
-    .format = &mmal_format,
-    .buffer_size_recommended = MMAL_OUT_BUFFER_SIZE,
-    .buffer_num_recommended = 1
+
+// free headers of the pool, the header is returned to the queue by release
+struct MMAL_QUEUE_T {
+    MMAL_BUFFER_HEADER_T *headers[MMAL_STUB_HEADERS];
+    int length;
 };
-static MMAL_POOL_T mmal_pool;
-static MMAL_BUFFER_HEADER_T mmal_header = {
-    .data = mmal_buffer
+
+static MMAL_ES_SPECIFIC_FORMAT_T mmal_specific_formats[MMAL_STUB_PORTS];
+static MMAL_ES_FORMAT_T mmal_formats[MMAL_STUB_PORTS];
+static MMAL_PORT_T mmal_ports[MMAL_STUB_PORTS];
+static MMAL_PORT_BH_CB_T mmal_callbacks[MMAL_STUB_PORTS];
+
+static MMAL_PORT_T *mmal_encoder_inputs[] = { mmal_ports + MMAL_STUB_ENCODER_IN };
+static MMAL_PORT_T *mmal_encoder_outputs[] = { mmal_ports + MMAL_STUB_ENCODER_OUT };
+static MMAL_PORT_T *mmal_camera_outputs[] = {
+    mmal_ports + MMAL_STUB_CAMERA_PREVIEW,
+    mmal_ports + MMAL_STUB_CAMERA_VIDEO,
+    mmal_ports + MMAL_STUB_CAMERA_STILL
 };
-static MMAL_COMPONENT_T mmal_component = {
-    .input[0] = &mmal_port,
-    .output[0] = &mmal_port
+static MMAL_PORT_T *mmal_splitter_inputs[] = { mmal_ports + MMAL_STUB_SPLITTER_IN };
+static MMAL_PORT_T *mmal_splitter_outputs[] = {
+    mmal_ports + MMAL_STUB_SPLITTER_OUT0,
+    mmal_ports + MMAL_STUB_SPLITTER_OUT1
 };
-static MMAL_PORT_BH_CB_T mmal_callback;
+static MMAL_PORT_T *mmal_resizer_inputs[] = { mmal_ports + MMAL_STUB_RESIZER_IN };
+static MMAL_PORT_T *mmal_resizer_outputs[] = { mmal_ports + MMAL_STUB_RESIZER_OUT };
+
+static MMAL_COMPONENT_T mmal_components[] = {
+    {
+        .name = MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER,
+        .input_num = ARRAY_SIZE(mmal_encoder_inputs),
+        .input = mmal_encoder_inputs,
+        .output_num = ARRAY_SIZE(mmal_encoder_outputs),
+        .output = mmal_encoder_outputs
+    },
+    {
+        .name = MMAL_COMPONENT_DEFAULT_CAMERA,
+        .control = mmal_ports + MMAL_STUB_CAMERA_CONTROL,
+        .output_num = ARRAY_SIZE(mmal_camera_outputs),
+        .output = mmal_camera_outputs
+    },
+    {
+        .name = MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER,
+        .input_num = ARRAY_SIZE(mmal_splitter_inputs),
+        .input = mmal_splitter_inputs,
+        .output_num = ARRAY_SIZE(mmal_splitter_outputs),
+        .output = mmal_splitter_outputs
+    },
+    {
+        .name = MMAL_CAMERA_RESIZER,
+        .input_num = ARRAY_SIZE(mmal_resizer_inputs),
+        .input = mmal_resizer_inputs,
+        .output_num = ARRAY_SIZE(mmal_resizer_outputs),
+        .output = mmal_resizer_outputs
+    }
+};
+
+static uint8_t mmal_in_buffers[MMAL_STUB_IN_HEADERS][640*480*2];
+static uint8_t mmal_out_buffers[MMAL_STUB_HEADERS][MMAL_OUT_BUFFER_SIZE];
+static uint8_t mmal_worker_buffers[MMAL_STUB_WORKER_HEADERS][MMAL_STUB_WORKER_SIZE];
+static MMAL_QUEUE_T mmal_in_queue;
+static MMAL_QUEUE_T mmal_out_queue;
+static MMAL_QUEUE_T mmal_worker_queue;
+static MMAL_POOL_T mmal_in_pool = { .queue = &mmal_in_queue };
+static MMAL_POOL_T mmal_out_pool = { .queue = &mmal_out_queue };
+static MMAL_POOL_T mmal_worker_pool = { .queue = &mmal_worker_queue };
+static MMAL_BUFFER_HEADER_T mmal_in_headers[MMAL_STUB_IN_HEADERS];
+static MMAL_BUFFER_HEADER_T mmal_out_headers[MMAL_STUB_HEADERS];
+static MMAL_BUFFER_HEADER_T mmal_worker_headers[MMAL_STUB_WORKER_HEADERS];
+
+// output buffers which have been sent to the encoder and the resizer
+static MMAL_QUEUE_T mmal_out_port_queue;
+static MMAL_QUEUE_T mmal_worker_port_queue;
+// buffers are released by consumers on other threads
+static pthread_mutex_t mmal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static MMAL_CONNECTION_T mmal_connections[MMAL_STUB_CONNECTIONS];
+// the camera delivers frames on own thread like the firmware does
+static pthread_t mmal_capture_thread;
+static volatile int mmal_is_capturing = 0;
+static int64_t mmal_pts = 0;
+
+static MMAL_QUEUE_T *mmal_stub_port_queue(MMAL_PORT_T *port)
+{
+    if (port == mmal_ports + MMAL_STUB_ENCODER_OUT)
+        return &mmal_out_port_queue;
+    if (port == mmal_ports + MMAL_STUB_RESIZER_OUT)
+        return &mmal_worker_port_queue;
+    return NULL;
+}
+
+// takes the buffer which has been sent to the port first
+static MMAL_BUFFER_HEADER_T *mmal_stub_port_get(MMAL_PORT_T *port)
+{
+    MMAL_BUFFER_HEADER_T *buffer = NULL;
+    MMAL_QUEUE_T *queue = mmal_stub_port_queue(port);
+    pthread_mutex_lock(&mmal_mutex);
+    if (queue->length > 0) {
+        buffer = queue->headers[0];
+        queue->length--;
+        memmove(queue->headers, queue->headers + 1,
+            queue->length * sizeof(MMAL_BUFFER_HEADER_T *));
+    }
+    pthread_mutex_unlock(&mmal_mutex);
+    return buffer;
+}
+
+// buffers of the encoder which every frame is split to, e.g. the big IDR frame, and bytes
+// of every buffer
+int mmal_stub_out_chunks = 1;
+int mmal_stub_out_length = MMAL_STUB_OUT_LENGTH;
+// the stream starts from the IDR frame, the next one is IDR if it's requested, the rest
+// are P frames
+int mmal_stub_key_frames = 0;
+// bits per second which the encoder is set to last
+int mmal_stub_bitrate = 0;
+static volatile int mmal_stub_is_key_frame = 0;
+
+// the frame is encoded right away to first output buffers of the encoder
+static void mmal_stub_encode(int64_t pts)
+{
+    MMAL_PORT_T *port = mmal_ports + MMAL_STUB_ENCODER_OUT;
+    for (int i = 0; i < mmal_stub_out_chunks; i++) {
+        MMAL_BUFFER_HEADER_T *out = mmal_stub_port_get(port);
+        if (mmal_callbacks[MMAL_STUB_ENCODER_OUT] == NULL || out == NULL)
+            return;
+        memset(out->data, 0, mmal_stub_out_length);
+        out->data[3] = 1; // start code of NAL unit
+        if (i == 0) {
+            out->data[4] = mmal_stub_is_key_frame? 0x65: 0x41; // the reference IDR or P slice
+            mmal_stub_is_key_frame = 0;
+        }
+        out->offset = 0;
+        out->length = mmal_stub_out_length;
+        out->flags = i + 1 == mmal_stub_out_chunks? MMAL_BUFFER_HEADER_FLAG_FRAME_END: 0;
+        out->pts = pts;
+        mmal_callbacks[MMAL_STUB_ENCODER_OUT](port, out);
+    }
+}
+
+// the resizer fills the buffer with the grey frame of the size of the port
+static void mmal_stub_resize(int64_t pts)
+{
+    MMAL_PORT_T *port = mmal_ports + MMAL_STUB_RESIZER_OUT;
+    MMAL_BUFFER_HEADER_T *out = mmal_stub_port_get(port);
+    if (mmal_callbacks[MMAL_STUB_RESIZER_OUT] != NULL && out != NULL) {
+        MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+        uint32_t length = video->width * video->height * 3 / 2;
+        out->offset = 0;
+        out->length = length <= out->alloc_size? length: 0;
+        memset(out->data, 0x80, out->length);
+        out->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+        out->pts = pts;
+        mmal_callbacks[MMAL_STUB_RESIZER_OUT](port, out);
+    }
+}
+
+// passes the frame of the port through enabled tunnels
+static void mmal_stub_deliver(MMAL_PORT_T *port, int64_t pts)
+{
+    for (int i = 0; i < MMAL_STUB_CONNECTIONS; i++) {
+        MMAL_CONNECTION_T *connection = mmal_connections + i;
+        if (connection->out != port || !connection->is_enabled)
+            continue;
+
+        MMAL_PORT_T *in = connection->in;
+        if (in == mmal_ports + MMAL_STUB_ENCODER_IN)
+            mmal_stub_encode(pts);
+        else if (in == mmal_ports + MMAL_STUB_RESIZER_IN)
+            mmal_stub_resize(pts);
+        else if (in == mmal_ports + MMAL_STUB_SPLITTER_IN)
+            for (int k = 0; k < ARRAY_SIZE(mmal_splitter_outputs); k++)
+                mmal_stub_deliver(mmal_splitter_outputs[k], pts);
+    }
+}
+
+static void *mmal_stub_capture_function(void *data)
+{
+    MMAL_PORT_T *port = data;
+    MMAL_RATIONAL_T rate = port->format->es->video.frame_rate;
+    struct timespec period = {
+        .tv_sec = 0,
+        .tv_nsec = rate.num > 0? 1000000000ll * rate.den / rate.num: 33333333
+    };
+    while (mmal_is_capturing) {
+        nanosleep(&period, NULL);
+        mmal_pts += period.tv_nsec / 1000;
+        mmal_stub_deliver(port, mmal_pts);
+    }
+    return NULL;
+}
 
 MMAL_STATUS_T mmal_component_create(const char *name, MMAL_COMPONENT_T **component)
 {
-    if (component) {
-        *component = &mmal_component;
+    for (int i = 0; i < MMAL_STUB_PORTS; i++) {
+        if (mmal_ports[i].format)
+            continue;
+        mmal_formats[i].es = mmal_specific_formats + i;
+        mmal_ports[i].format = mmal_formats + i;
+        mmal_ports[i].buffer_num = 1;
+        mmal_ports[i].buffer_num_recommended = 1;
     }
-    return MMAL_SUCCESS;
+    mmal_ports[MMAL_STUB_ENCODER_IN].buffer_size_recommended = sizeof(mmal_in_buffers[0]);
+    mmal_ports[MMAL_STUB_ENCODER_OUT].buffer_size_recommended = MMAL_OUT_BUFFER_SIZE;
+    mmal_ports[MMAL_STUB_RESIZER_OUT].buffer_size_recommended = MMAL_STUB_WORKER_SIZE;
+
+    for (int i = 0; i < ARRAY_SIZE(mmal_components); i++)
+        if (!strcmp(mmal_components[i].name, name)) {
+            if (component)
+                *component = mmal_components + i;
+            return MMAL_SUCCESS;
+        }
+    return MMAL_ENOENT;
 }
 
 MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T* component)
 {
+    component->is_enabled = 0;
     return MMAL_SUCCESS;
 }
 
+MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component)
+{
+    component->is_enabled = 1;
+    return MMAL_SUCCESS;
+}
+
+void mmal_format_copy(MMAL_ES_FORMAT_T *format_dest, MMAL_ES_FORMAT_T *format_src)
+{
+    MMAL_ES_SPECIFIC_FORMAT_T *es = format_dest->es;
+    *format_dest = *format_src;
+    *es = *format_src->es;
+    format_dest->es = es;
+}
+
 MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port)
 {
     return MMAL_SUCCESS;
 }
 
+MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param)
+{
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value)
+{
+    if (id == MMAL_PARAMETER_VIDEO_BIT_RATE)
+        __atomic_store_n(&mmal_stub_bitrate, value, __ATOMIC_SEQ_CST);
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value)
+{
+    if (id == MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME && value) {
+        __sync_fetch_and_add(&mmal_stub_key_frames, 1);
+        mmal_stub_is_key_frame = 1;
+    }
+    if (id != MMAL_PARAMETER_CAPTURE || port != mmal_ports + MMAL_STUB_CAMERA_VIDEO)
+        return MMAL_SUCCESS;
+
+    if (value && !mmal_is_capturing) {
+        mmal_is_capturing = 1;
+        if (pthread_create(&mmal_capture_thread, NULL, mmal_stub_capture_function, port)) {
+            mmal_is_capturing = 0;
+            return MMAL_ENOMEM;
+        }
+    }
+    else if (!value && mmal_is_capturing) {
+        mmal_is_capturing = 0;
+        pthread_join(mmal_capture_thread, NULL);
+    }
+    return MMAL_SUCCESS;
+}
+
 MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb)
 {
-    mmal_callback = cb;
+    mmal_callbacks[port - mmal_ports] = cb;
+    port->is_enabled = 1;
+    if (port == mmal_ports + MMAL_STUB_ENCODER_OUT)
+        mmal_stub_is_key_frame = 1;
     return MMAL_SUCCESS;
 }
 
 MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T* port)
 {
+    port->is_enabled = 0;
+    MMAL_QUEUE_T *queue = mmal_stub_port_queue(port);
+    if (queue) {
+        // the component returns buffers which haven't been filled to the pool
+        MMAL_BUFFER_HEADER_T *header = NULL;
+        do {
+            pthread_mutex_lock(&mmal_mutex);
+            header = queue->length > 0? queue->headers[--queue->length]: NULL;
+            pthread_mutex_unlock(&mmal_mutex);
+            if (header)
+                mmal_buffer_header_release(header);
+        } while (header);
+    }
     return MMAL_SUCCESS;
 }
 
 MMAL_POOL_T *mmal_port_pool_create(MMAL_PORT_T *port, unsigned int headers, uint32_t payload_size)
 {
-    return &mmal_pool;
+    if (port == mmal_ports + MMAL_STUB_ENCODER_IN) {
+        if (headers > MMAL_STUB_IN_HEADERS || payload_size > sizeof(mmal_in_buffers[0]))
+            return NULL;
+        mmal_in_queue.length = 0;
+        for (int i = 0; i < headers; i++) {
+            MMAL_BUFFER_HEADER_T *header = mmal_in_headers + i;
+            memset(header, 0, sizeof(*header));
+            header->data = mmal_in_buffers[i];
+            header->alloc_size = payload_size;
+            header->user_data = &mmal_in_queue;
+            mmal_in_queue.headers[mmal_in_queue.length++] = header;
+        }
+        return &mmal_in_pool;
+    }
+
+    MMAL_QUEUE_T *queue = NULL;
+    MMAL_BUFFER_HEADER_T *pool_headers = NULL;
+    if (port == mmal_ports + MMAL_STUB_ENCODER_OUT) {
+        if (headers > MMAL_STUB_HEADERS || payload_size > MMAL_OUT_BUFFER_SIZE)
+            return NULL;
+        queue = &mmal_out_queue;
+        pool_headers = mmal_out_headers;
+    }
+    else if (port == mmal_ports + MMAL_STUB_RESIZER_OUT) {
+        if (headers > MMAL_STUB_WORKER_HEADERS || payload_size > MMAL_STUB_WORKER_SIZE)
+            return NULL;
+        queue = &mmal_worker_queue;
+        pool_headers = mmal_worker_headers;
+    }
+    else
+        return NULL;
+
+    queue->length = 0;
+    mmal_stub_port_queue(port)->length = 0;
+    for (int i = 0; i < headers; i++) {
+        MMAL_BUFFER_HEADER_T *header = pool_headers + i;
+        memset(header, 0, sizeof(*header));
+        header->data = queue == &mmal_out_queue? mmal_out_buffers[i]: mmal_worker_buffers[i];
+        header->alloc_size = payload_size;
+        header->user_data = queue;
+        queue->headers[queue->length++] = header;
+    }
+    return queue == &mmal_out_queue? &mmal_out_pool: &mmal_worker_pool;
+}
+
+void mmal_port_pool_destroy(MMAL_PORT_T *port, MMAL_POOL_T *pool)
+{
 }
 
 unsigned int mmal_queue_length(MMAL_QUEUE_T *queue)
 {
-    return 1;
+    return queue->length;
 }
 
 MMAL_BUFFER_HEADER_T* mmal_queue_get(MMAL_QUEUE_T* queue)
 {
-    return &mmal_header;
+    MMAL_BUFFER_HEADER_T *header = NULL;
+    pthread_mutex_lock(&mmal_mutex);
+    if (queue->length > 0)
+        header = queue->headers[--queue->length];
+    pthread_mutex_unlock(&mmal_mutex);
+    return header;
 }
 
+MMAL_BUFFER_HEADER_T *mmal_queue_timedwait(MMAL_QUEUE_T *queue, unsigned int timeout)
+{
+    struct timespec period = {
+        .tv_sec = 0,
+        .tv_nsec = 1000000
+    };
+    MMAL_BUFFER_HEADER_T *header = mmal_queue_get(queue);
+    for (int i = 0; i < timeout && header == NULL; i++) {
+        nanosleep(&period, NULL);
+        header = mmal_queue_get(queue);
+    }
+    return header;
+}
+
+// the input buffer is encoded right away, output buffers wait for frames
 MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer)
 {
-    if (mmal_callback != NULL) {
-        mmal_header.length = 200;
-        mmal_callback(&mmal_port, &mmal_header);
+    MMAL_QUEUE_T *queue = mmal_stub_port_queue(port);
+    if (queue) {
+        pthread_mutex_lock(&mmal_mutex);
+        queue->headers[queue->length++] = buffer;
+        pthread_mutex_unlock(&mmal_mutex);
+        return MMAL_SUCCESS;
     }
+
+    if (mmal_callbacks[MMAL_STUB_ENCODER_IN] != NULL)
+        mmal_callbacks[MMAL_STUB_ENCODER_IN](port, buffer);
+    mmal_stub_encode(buffer->pts);
     return MMAL_SUCCESS;
 }
 
@@ -112,4 +464,43 @@ void mmal_buffer_header_mem_unlock(MMAL_BUFFER_HEADER_T *header)
 
 void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T* header)
 {
+    MMAL_QUEUE_T *queue = header->user_data;
+    pthread_mutex_lock(&mmal_mutex);
+    queue->headers[queue->length++] = header;
+    pthread_mutex_unlock(&mmal_mutex);
+}
+
+MMAL_STATUS_T mmal_connection_create(MMAL_CONNECTION_T **connection, MMAL_PORT_T *out,
+    MMAL_PORT_T *in, uint32_t flags)
+{
+    for (int i = 0; i < MMAL_STUB_CONNECTIONS; i++) {
+        MMAL_CONNECTION_T *c = mmal_connections + i;
+        if (c->out != NULL)
+            continue;
+        // the input port follows the format of the output port
+        mmal_format_copy(in->format, out->format);
+        c->out = out;
+        c->in = in;
+        c->flags = flags;
+        c->is_enabled = 0;
+        *connection = c;
+        return MMAL_SUCCESS;
+    }
+    return MMAL_ENOSPC;
+}
+
+MMAL_STATUS_T mmal_connection_enable(MMAL_CONNECTION_T *connection)
+{
+    connection->in->is_enabled = 1;
+    connection->out->is_enabled = 1;
+    connection->is_enabled = 1;
+    return MMAL_SUCCESS;
+}
+
+MMAL_STATUS_T mmal_connection_destroy(MMAL_CONNECTION_T *connection)
+{
+    connection->in->is_enabled = 0;
+    connection->out->is_enabled = 0;
+    memset(connection, 0, sizeof(*connection));
+    return MMAL_SUCCESS;
 }
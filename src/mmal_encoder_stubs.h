@@ -5,8 +5,30 @@
 
 
 #define MMAL_ENCODING_I422 MMAL_FOURCC('I','4','2','2')
+#define MMAL_ENCODING_I420 MMAL_FOURCC('I','4','2','0')
+#define MMAL_ENCODING_NV12 MMAL_FOURCC('N','V','1','2')
 #define MMAL_ENCODING_H264 MMAL_FOURCC('H','2','6','4')
 #define MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER "avcodec.video_encode"
+#define MMAL_COMPONENT_DEFAULT_CAMERA "vc.ril.camera"
+#define MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER "vc.ril.video_splitter"
+
+#define MMAL_TIME_UNKNOWN (INT64_C(1) << 63)
+
+#define MMAL_CONNECTION_FLAG_TUNNELLING 0x1
+#define MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT 0x2
+
+#define MMAL_PARAMETER_CAMERA_CONFIG 0x10000
+#define MMAL_PARAMETER_CAMERA_NUM 0x10001
+#define MMAL_PARAMETER_CAPTURE 0x10002
+#define MMAL_PARAMETER_MB_ROWS_PER_SLICE 0x10003
+#define MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME 0x10004
+#define MMAL_PARAMETER_VIDEO_BIT_RATE 0x10005
+
+#define MMAL_BUFFER_HEADER_FLAG_EOS (1<<0)
+#define MMAL_BUFFER_HEADER_FLAG_FRAME_START (1<<1)
+#define MMAL_BUFFER_HEADER_FLAG_FRAME_END (1<<2)
+#define MMAL_BUFFER_HEADER_FLAG_KEYFRAME (1<<3)
+#define MMAL_BUFFER_HEADER_FLAG_CONFIG (1<<5)
 
 typedef enum
 {
@@ -128,26 +150,87 @@ typedef struct MMAL_PORT_T
     uint32_t buffer_size_recommended;
     uint32_t buffer_num;
     uint32_t buffer_size;
+    struct MMAL_COMPONENT_T *component;
 } MMAL_PORT_T;
 
 typedef struct MMAL_COMPONENT_T {
-    MMAL_PORT_T* input[1];
-    MMAL_PORT_T* output[1];
+    const char *name;
+    MMAL_PORT_T *control;
+    uint32_t input_num;
+    MMAL_PORT_T **input;
+    uint32_t output_num;
+    MMAL_PORT_T **output;
+    uint32_t is_enabled;
 } MMAL_COMPONENT_T;
 
+typedef struct MMAL_CONNECTION_T {
+    uint32_t flags;
+    uint32_t is_enabled;
+    MMAL_PORT_T *in;
+    MMAL_PORT_T *out;
+} MMAL_CONNECTION_T;
+
+typedef int32_t MMAL_BOOL_T;
+
+typedef struct MMAL_PARAMETER_HEADER_T {
+    uint32_t id;
+    uint32_t size;
+} MMAL_PARAMETER_HEADER_T;
+
+typedef struct MMAL_PARAMETER_INT32_T {
+    MMAL_PARAMETER_HEADER_T hdr;
+    int32_t value;
+} MMAL_PARAMETER_INT32_T;
+
+typedef enum {
+    MMAL_PARAM_TIMESTAMP_MODE_ZERO,
+    MMAL_PARAM_TIMESTAMP_MODE_RAW_STC,
+    MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+} MMAL_PARAMETER_CAMERA_CONFIG_TIMESTAMP_MODE_T;
+
+typedef struct MMAL_PARAMETER_CAMERA_CONFIG_T {
+    MMAL_PARAMETER_HEADER_T hdr;
+    uint32_t max_stills_w;
+    uint32_t max_stills_h;
+    uint32_t stills_yuv422;
+    uint32_t one_shot_stills;
+    uint32_t max_preview_video_w;
+    uint32_t max_preview_video_h;
+    uint32_t num_preview_video_frames;
+    uint32_t stills_capture_circular_buffer_height;
+    uint32_t fast_preview_resume;
+    MMAL_PARAMETER_CAMERA_CONFIG_TIMESTAMP_MODE_T use_stc_timestamp;
+} MMAL_PARAMETER_CAMERA_CONFIG_T;
+
 typedef void (*MMAL_PORT_BH_CB_T)(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 
 MMAL_STATUS_T mmal_component_create(const char *name, MMAL_COMPONENT_T **component);
 MMAL_STATUS_T mmal_component_destroy(MMAL_COMPONENT_T* component);
+MMAL_STATUS_T mmal_component_enable(MMAL_COMPONENT_T *component);
+void mmal_format_copy(MMAL_ES_FORMAT_T *format_dest, MMAL_ES_FORMAT_T *format_src);
 MMAL_STATUS_T mmal_port_format_commit(MMAL_PORT_T *port);
 MMAL_STATUS_T mmal_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb);
 MMAL_STATUS_T mmal_port_disable(MMAL_PORT_T* port);
+MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param);
+MMAL_STATUS_T mmal_port_parameter_set_boolean(MMAL_PORT_T *port, uint32_t id, MMAL_BOOL_T value);
+MMAL_STATUS_T mmal_port_parameter_set_uint32(MMAL_PORT_T *port, uint32_t id, uint32_t value);
 MMAL_POOL_T *mmal_port_pool_create(MMAL_PORT_T *port, unsigned int headers, uint32_t payload_size);
+void mmal_port_pool_destroy(MMAL_PORT_T *port, MMAL_POOL_T *pool);
 unsigned int mmal_queue_length(MMAL_QUEUE_T *queue);
 MMAL_BUFFER_HEADER_T* mmal_queue_get(MMAL_QUEUE_T *queue);
+MMAL_BUFFER_HEADER_T *mmal_queue_timedwait(MMAL_QUEUE_T *queue, unsigned int timeout);
 MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer);
 MMAL_STATUS_T mmal_buffer_header_mem_lock(MMAL_BUFFER_HEADER_T *header);
 void mmal_buffer_header_mem_unlock(MMAL_BUFFER_HEADER_T *header);
 void mmal_buffer_header_release(MMAL_BUFFER_HEADER_T* header);
+MMAL_STATUS_T mmal_connection_create(MMAL_CONNECTION_T **connection, MMAL_PORT_T *out,
+    MMAL_PORT_T *in, uint32_t flags);
+MMAL_STATUS_T mmal_connection_enable(MMAL_CONNECTION_T *connection);
+MMAL_STATUS_T mmal_connection_destroy(MMAL_CONNECTION_T *connection);
+
+extern int mmal_stub_out_chunks;
+extern int mmal_stub_out_length;
+extern int mmal_stub_key_frames;
+extern int mmal_stub_bitrate;
 
 #endif //mmal_encoder_stubs_h
\ No newline at end of file
@@ -18,29 +18,71 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 
+#include "h264_bitstream.h"
+#include "yuv_kernels.h"
 #include "rfb.h"
 
 #include <netinet/in.h> //sockaddr_in
-#include <netinet/tcp.h> //TCP_NODELAY
+#include <netinet/tcp.h> //TCP_NODELAY, TCP_NOTSENT_LOWAT
+#include <sys/ioctl.h>
+#include <linux/sockios.h> //SIOCOUTQ
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <linux/errqueue.h> //sock_extended_err
+
+// MSG_ZEROCOPY is declared by newer headers of the C library
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
 
-#define RFB_MAX_CONNECTIONS 1
 #define RFB_SECURITY_NONE 1
 
+// lengths of messages of the client, variable ones have the length of the header
+#define RFB_VERSION_LENGTH 12
+#define RFB_SET_PIXEL_FORMAT_LENGTH 20
+#define RFB_SET_ENCODINGS_LENGTH 4
+#define RFB_UPDATE_REQUEST_LENGTH 10
+#define RFB_KEY_EVENT_LENGTH 8
+#define RFB_POINTER_EVENT_LENGTH 6
+#define RFB_CUT_TEXT_LENGTH 8
+#define RFB_ENABLE_CONTINUOUS_UPDATES_LENGTH 10
+#define RFB_FENCE_LENGTH 9
+#define RFB_FENCE_PAYLOAD_BYTES 64
+
+// the fence which asks for the reply, flags of synchronization aren't supported
+#define RFB_FENCE_REQUEST 0x80000000u
+
+// epoll events of descriptors which aren't clients
+#define RFB_EVENT_SERVER RFB_MAX_CLIENTS
+#define RFB_EVENT_WAKE (RFB_MAX_CLIENTS + 1)
+
 enum rfb_request_enum {
     RFBSetPixelFormat = 0,
     RFBSetEncodings = 2,
     RFBFramebufferUpdateRequest = 3,
     RFBKeyEvent = 4,
     RFBPointerEvent = 5,
-    RFBClientCutText = 6
+    RFBClientCutText = 6,
+    RFBEnableContinuousUpdates = 150,
+    RFBClientFence = 248
 };
 
 enum rfb_response_enum {
     RFBFramebufferUpdate = 0,
     RFBSetColorMapEntries = 1,
     RFBBell = 2,
-    RFBServerCutText = 3
+    RFBServerCutText = 3,
+    RFBEndOfContinuousUpdates = 150,
+    RFBServerFence = 248
 };
 
 enum rfb_encoding_enum {
@@ -52,6 +94,8 @@ enum rfb_encoding_enum {
     RFBZRLE = 16,
     RFBCursorPseudoEncoding = -239,
     RFBDesktopSizePseudoEncoding = -223,
+    RFBFencePseudoEncoding = -312,
+    RFBContinuousUpdatesPseudoEncoding = -313,
     RFBEncodingH264 = 0x48323634
 };
 
@@ -87,6 +131,10 @@ struct rfb_buffer_update_message_t {
     uint8_t message_type;
     uint8_t padding;
     uint16_t number_of_rectangles;
+};
+
+// the header of the rectangle is followed by the length and NAL units of the H264 encoding
+struct rfb_rectangle_message_t {
     uint16_t x;
     uint16_t y;
     uint16_t width;
@@ -125,437 +173,2331 @@ static struct format_mapping_t rfb_formats[] = {
     }
 };
 
+// raw tiles are converted from the picture of the camera
+static struct format_mapping_t rfb_raw_formats[] = {
+    {
+        .format = VIDEO_FORMAT_YUYV,
+        .internal_format = VIDEO_FORMAT_YUYV,
+        .is_supported = 1
+    }
+};
+
+// the pixel format of the server, it's used until the client sets own one
+static const struct yuv_rgb_format_t rfb_pixel_format = {
+    .bpp = 16,
+    .is_big_endian = 1,
+    .red_max = 31,
+    .green_max = 63,
+    .blue_max = 31,
+    .red_shift = 11,
+    .green_shift = 5,
+    .blue_shift = 0
+};
+
 struct rfb_state_t rfb = {
     .output = NULL,
     .server_socket = -1,
-    .client_socket = -1,
+    .epoll_fd = -1,
+    .event_fd = -1,
     .thread_res = -1,
-    .client_semaphore_res = -1
+    .mutex_res = -1,
+    .clients_count = 0,
+    .is_sliced = 0,
+    .sps_length = 0,
+    .pps_length = 0,
+    .bitrate = 0,
+    .raw_output = NULL,
+    .raw_tiles = NULL,
+    .raw_tiles_count = 0,
+    .zrle_pixels = NULL,
+    .zrle_pixels_size = 0,
+    .zrle_data = NULL,
+    .zrle_data_size = 0
 };
 
 extern struct app_state_t app;
 extern struct input_t input;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 extern struct output_t outputs[MAX_OUTPUTS];
 extern int is_aborted;
 
-static struct rfb_buffer_update_message_t update_message;
 
 static int rfb_is_started()
 {
     return rfb.server_socket != -1? 1: 0;
 }
 
-static void *rfb_function(void *data)
+static int rfb_lock(pthread_mutex_t *mutex)
 {
-    int res;
-    const int one = 1;
+    int res = pthread_mutex_lock(mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(mutex), res);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
 
-    while (!is_aborted && rfb_is_started()) {
-        struct sockaddr_in client_addr;
-        int addres_len = sizeof(client_addr);
+static int rfb_unlock(pthread_mutex_t *mutex)
+{
+    int res = pthread_mutex_unlock(mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(mutex), res);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
 
-        DEBUG("Waiting for clients connection to port: %d", app.port);
-        RFB_FUNC_CALL(rfb.client_socket = accept(
-            rfb.server_socket,
-            (struct sockaddr *)&client_addr, 
-            (socklen_t *)&addres_len
-        ), fatal_error);
+// the encoder of the path gives the key frame, so the new client doesn't wait for the
+// next IDR frame of the period
+static int rfb_request_key_frame()
+{
+    struct output_t *output = rfb.output;
+    if (kv_size(output->filters) == 0 && input.request_key_frame)
+        CALL(input.request_key_frame(), cleanup);
+    for (int k = 0; k < kv_size(output->filters); k++) {
+        struct filter_t *filter = kv_A(filters, kv_A(output->filters, k).index);
+        if (filter->request_key_frame)
+            CALL(filter->request_key_frame(), cleanup);
+    }
+    DEBUG("The key frame has been requested for clients which wait for it");
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
 
-        RFB_FUNC_CALL(setsockopt(rfb.client_socket,
-            IPPROTO_TCP,
-            TCP_NODELAY,
-            (char *)&one,
-            sizeof(one)), rfb_error);
+static int rfb_set_bitrate(int bitrate)
+{
+    struct output_t *output = rfb.output;
+    if (kv_size(output->filters) == 0 && input.set_bitrate)
+        CALL(input.set_bitrate(bitrate), cleanup);
+    for (int k = 0; k < kv_size(output->filters); k++) {
+        struct filter_t *filter = kv_A(filters, kv_A(output->filters, k).index);
+        if (filter->set_bitrate)
+            CALL(filter->set_bitrate(bitrate), cleanup);
+    }
+    return 0;
 
-        char server_rfb_version[12];
-        strcpy(server_rfb_version, "RFB 003.008\0");
-        RFB_FUNC_CALL(send(rfb.client_socket, server_rfb_version, sizeof(server_rfb_version), 0),
-            rfb_error);
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
 
-        char client_rfb_version[12];
-        RFB_FUNC_CALL(recv(rfb.client_socket, client_rfb_version, sizeof(client_rfb_version), 0),
-            rfb_error);
+// the stream is encoded once for all clients, so the encoder follows the slowest uplink
+static int rfb_update_bitrate()
+{
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    int bitrate = 0;
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (client->is_streaming && client->bitrate > 0)
+            bitrate = bitrate == 0? client->bitrate: MIN(bitrate, client->bitrate);
+    }
+    int res = 0;
+    if (bitrate > 0 && bitrate != rfb.bitrate) {
+        DEBUG("The bitrate of the encoder: %d -> %d kbit/s", rfb.bitrate, bitrate);
+        rfb.bitrate = bitrate;
+        res = rfb_set_bitrate(bitrate);
+    }
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    CALL(res, cleanup);
+    return 0;
 
-        DEBUG("Client rfb version. %s", client_rfb_version);
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
 
-        struct rfb_security_message_t security = {
-            .types_count = 1,
-            .types = RFB_SECURITY_NONE
-        };
-        RFB_FUNC_CALL(send(rfb.client_socket, (char *)&security , sizeof(security), 0), rfb_error);
+static int64_t rfb_get_time_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
 
-        uint8_t client_security_type = 0;
-        RFB_FUNC_CALL(recv(
-            rfb.client_socket,
-            (char *)&client_security_type,
-            sizeof(client_security_type), 0
-        ), rfb_error);
+// returns milliseconds to send bytes which are queued by the socket at the current bitrate
+static int rfb_get_queue_ms(struct rfb_client_t *client, int *queued)
+{
+    CALL(ioctl(client->socket, SIOCOUTQ, queued), cleanup);
+    return (int64_t)*queued * 8 / client->bitrate;
 
-        DEBUG("Client rfb security type. %d", client_security_type);
-    
-        uint32_t success = 0;
-        RFB_FUNC_CALL(send(rfb.client_socket, (char *)&success, sizeof(success), 0), rfb_error);
-
-        uint8_t shared_flag;
-        RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&shared_flag, sizeof(shared_flag), 0), rfb_error);
-
-        DEBUG("Client rfb shared flag. %d", shared_flag);
-
-        struct rfb_server_init_message_t init_message = {
-            .framebuffer_width = htons(app.video_width),
-            .framebuffer_height = htons(app.video_height),
-            .pixel_format.big_endian = 1,
-            .pixel_format.true_color = 1,
-            .pixel_format.red_max = htons(31),
-            .pixel_format.green_max = htons(63),
-            .pixel_format.blue_max = htons(31),
-            .pixel_format.red_shift = 11,
-            .pixel_format.green_shift = 5,
-            .pixel_format.blue_shift = 0,
-            .name_length = htonl(sizeof(init_message.name))
-        };
-        //TODO: delete if working
-        // if (app.video_format == VIDEO_FORMAT_YUV422) {
-        //     init_message.pixel_format.bpp = 16;
-        //     init_message.pixel_format.depth = 16;
-        // }
-        // else {
-        //     DEBUG("Video format isn't supported %d", app.video_format);
-        //     errno = EINVAL;
-        //     goto rfb_error;
-        // }
-        memset(init_message.name, 0, sizeof(init_message.name));
-        memcpy(init_message.name, APP_NAME, strlen(APP_NAME));
-
-        // DEBUG("il: %d, nl: %d", sizeof(init_message.name), sizeof(init_message));
-        RFB_FUNC_CALL(send(rfb.client_socket, (char *)&init_message, sizeof(init_message), 0), rfb_error);
-
-        struct rfb_buffer_update_request_message_t buffer_update;
-        do {
-            struct rfb_type_request_message_t type;
-            RFB_FUNC_CALL(
-                res = recv(rfb.client_socket, (char *)&type, sizeof(type), 0),
-                rfb_error
-            );
-            if (type.message_type == RFBSetPixelFormat)  {
-                struct rfb_pixel_format_request_message_t format;
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&format, sizeof(format), 0),
-                    rfb_error);
-                DEBUG("RFBSetPixelFormat message.");
-                DEBUG("bpp: %d, depth: %d, big_endian: %d, true_color %d.",
-                    format.f.bpp, format.f.depth, format.f.big_endian, format.f.true_color);
-                DEBUG("red_max: %d, green_max: %d, blue_max: %d.", ntohs(format.f.red_max),
-                    ntohs(format.f.green_max), ntohs(format.f.blue_max));
-                DEBUG("red_shift: %d, green_shift: %d, blue_shift: %d.", format.f.red_shift,
-                    format.f.green_shift, format.f.blue_shift);
-            }
-            else if (type.message_type == RFBSetEncodings) {
-                DEBUG("RFBSetEncodings message.");
-                struct rfb_set_encoding_request_message_t encoding;
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&encoding, sizeof(encoding), 0), rfb_error);
-
-                DEBUG("RFBSetEncodings message, encodings: %d",
-                    ntohs(encoding.number_of_encodings));
-                int32_t e;
-                for (int i = 0; i < ntohs(encoding.number_of_encodings); i++) {
-                    RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&e, sizeof(e), 0), rfb_error);
-                    fprintf(stderr, "%d ", ntohl(e));
-                }
-                fprintf(stderr, "\n");
-            } else if (type.message_type == RFBFramebufferUpdateRequest) {
-                RFB_FUNC_CALL(
-                    recv(rfb.client_socket, (char *)&buffer_update, sizeof(buffer_update), 0),
-                    rfb_error
-                );
-
-                DEBUG("Server received message: RFBFramebufferUpdateRequest, waiting for frame");
-                CALL(sem_post(&rfb.client_semaphore), rfb_error);
-            } else if (type.message_type == RFBKeyEvent) {
-                uint8_t downFlag;
-                uint16_t padding;
-                uint32_t key;
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&downFlag, sizeof(downFlag), 0),
-                    rfb_error);
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&padding, sizeof(padding), 0),
-                    rfb_error);
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&key, sizeof(key), 0), rfb_error);
-                DEBUG("RFBKeyEvent message: down(%X), padding(%X), key(%X)",
-                    downFlag, padding, key);
-            } else if (type.message_type == RFBPointerEvent) {
-                DEBUG("RFBPointerEvent message.");
-                uint8_t buttonMask;
-                uint16_t xPos;
-                uint16_t yPos;
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&buttonMask, sizeof(buttonMask), 0),
-                    rfb_error);
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&xPos, sizeof(xPos), 0), rfb_error);
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&yPos, sizeof(yPos), 0), rfb_error);
-            } else if (type.message_type == RFBClientCutText) {
-                DEBUG("RFBClientCutText message.");
-                char padding[3];
-                uint32_t length;
-                RFB_FUNC_CALL(recv(rfb.client_socket, padding, sizeof(padding), 0), rfb_error);
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)&length, sizeof(length), 0),
-                    rfb_error);
-                uint8_t *text = (uint8_t *)malloc(length);
-                RFB_FUNC_CALL(recv(rfb.client_socket, (char *)text, length, 0), rfb_error);
-            } else {
-                fprintf(stderr, "WARNING: Unknown message %d.\n", type.message_type);
-            }
-        } while (!is_aborted && rfb_is_started());
+cleanup:
+    return -1;
+}
 
-rfb_error:
-        if (errno == 104) {
-            DEBUG("Client has closed the connection");
+// lowers the bitrate of the client when the uplink doesn't keep up with the update of
+// the given length and raises it back after frames which are delivered in time
+static int rfb_control_rate(struct rfb_client_t *client, int length)
+{
+    if (client->bitrate <= 0)
+        return 0;
+
+    // bytes of previous updates which the uplink hasn't delivered yet
+    int queued = 0, queue_ms = 0;
+    CALL(queue_ms = rfb_get_queue_ms(client, &queued), cleanup);
+    if (queued > length)
+        queue_ms -= (int64_t)length * 8 / client->bitrate;
+    else
+        queue_ms = 0;
+    // the update has waited in the write queue of the connection
+    int send_ms = (rfb_get_time_ns() - client->update_ns) / 1000000;
+
+    // the client requests the next update when the previous one is received, the time
+    // above the round trip is spent by the uplink to transfer it
+    struct tcp_info info;
+    socklen_t info_length = sizeof(info);
+    CALL(getsockopt(client->socket, IPPROTO_TCP, TCP_INFO, &info, &info_length), cleanup);
+    int transfer_ms = 0;
+    int64_t request_ns = client->request_ns;
+    if (client->sent_ns > 0 && request_ns > client->sent_ns)
+        transfer_ms = (request_ns - client->sent_ns) / 1000000 - info.tcpi_rtt / 1000;
+    client->sent_ns = rfb_get_time_ns();
+
+    int bitrate = client->bitrate;
+    if (queue_ms > RFB_QUEUE_HIGH_MS || send_ms > RFB_SEND_HIGH_MS ||
+        transfer_ms > RFB_TRANSFER_HIGH_MS
+    ) {
+        // the encoder needs a few frames to follow the previous change
+        if (client->rate_frames >= 0) {
+            bitrate = MAX(bitrate * 3 / 4, RFB_BITRATE_MIN);
+            client->rate_frames = -RFB_RATE_HOLD_FRAMES;
         }
-        // stop the input and all filters
-        CALL(input.stop(), fatal_error);
-        struct output_t *output = rfb.output;
-        for (int k = 0; k < MAX_FILTERS && output->filters[k].out_format; k++) {
-            struct filter_t *filter = filters + output->filters[k].index;
-            CALL(filter->stop(), fatal_error);
+        else
+            client->rate_frames++;
+    }
+    else if (queue_ms < RFB_QUEUE_LOW_MS && transfer_ms < RFB_TRANSFER_LOW_MS) {
+        if (++client->rate_frames >= RFB_RATE_STABLE_FRAMES) {
+            bitrate = MIN(bitrate + bitrate / 10 + 1, app.h264_bitrate);
+            client->rate_frames = 0;
         }
-        // int val = 0;
-        // CALL(sem_getvalue(&rfb.client_semaphore, &val));
-        // for (int i = 0; i < val; i++) {
-        //     CALL(sem_post(&rfb.client_semaphore), rfb_error);
-        // }
+    }
+    else
+        client->rate_frames = MIN(client->rate_frames, 0);
+
+    if (bitrate != client->bitrate) {
+        DEBUG("client[%d] bitrate: %d -> %d kbit/s, queue: %d ms, send: %d ms, transfer: %d ms",
+            (int)(client - rfb.clients), client->bitrate, bitrate, queue_ms, send_ms,
+            transfer_ms);
+        client->bitrate = bitrate;
+        CALL(rfb_update_bitrate(), cleanup);
+    }
+    return 0;
 
-        // TODO: to delete
-        // if (camera_destroy_h264_encoder(app)) {
-        //     fprintf(stderr, "ERROR: camera_destroy_h264_encoder failed\n");
-        // }
+cleanup:
+    return -1;
+}
 
-        if (rfb.client_socket > 0) {
-            CALL(close(rfb.client_socket))
-            rfb.client_socket = -1;
-        }
+// grows the queue of the client to take the given bytes more
+static int rfb_reserve(struct rfb_client_t *client, int length)
+{
+    if (client->queue_length + length <= client->queue_size)
+        return 0;
+    int size = MAX(client->queue_size * 2, client->queue_length + length);
+    uint8_t *queue = realloc(client->queue, size);
+    if (queue == NULL) {
+        CALL_MESSAGE(realloc(client->queue, size));
+        errno = ENOMEM;
+        return -1;
     }
+    client->queue = queue;
+    client->queue_size = size;
+    return 0;
+}
 
-fatal_error:    
-    return NULL;
+// appends bytes which have been written to the reserved end of the queue, announced
+// bytes go before the backlog, consecutive bytes of the same part of the stream make one
+// segment
+static void rfb_commit_bytes(struct rfb_client_t *client, int length, int is_announced)
+{
+    int index = is_announced? client->announced: kv_size(client->segments);
+    struct rfb_segment_t *last = NULL;
+    if (index > 0 && (is_announced || index > client->announced))
+        last = &kv_A(client->segments, index - 1);
+    if (last && !last->frame && last->offset + last->length == client->queue_length) {
+        last->length += length;
+    }
+    else {
+        struct rfb_segment_t segment = {
+            .frame = NULL,
+            .offset = client->queue_length,
+            .length = length
+        };
+        kv_push(struct rfb_segment_t, client->segments, segment);
+        memmove(client->segments.a + index + 1, client->segments.a + index,
+            (kv_size(client->segments) - index - 1) * sizeof(struct rfb_segment_t));
+        kv_A(client->segments, index) = segment;
+        if (is_announced)
+            client->announced++;
+    }
+    client->queue_length += length;
 }
 
-static int rfb_init()
+static int rfb_write_bytes(struct rfb_client_t *client, const void *data, int length,
+    int is_announced)
 {
-    update_message.message_type = RFBFramebufferUpdate;
-    update_message.padding = 0;
-    update_message.number_of_rectangles = htons(1);
-    update_message.x = htons(0);
-    update_message.y = htons(0);
-    update_message.width = htons(app.video_width);
-    update_message.height = htons(app.video_height);
-    update_message.encoding_type = htonl(RFBEncodingH264);
+    CALL(rfb_reserve(client, length), cleanup);
+    memcpy(client->queue + client->queue_length, data, length);
+    rfb_commit_bytes(client, length, is_announced);
     return 0;
+
+cleanup:
+    return -1;
 }
 
-static int rfb_start()
+// the handshake goes to the client before any update
+static int rfb_write_out(struct rfb_client_t *client, const void *data, int length)
 {
-    DEBUG("Port to listen: %d", app.port);
-
-    ASSERT_INT(rfb.client_socket, ==, -1, cleanup);
-    ASSERT_INT(rfb.server_socket, ==, -1, cleanup);
+    CALL(rfb_lock(&client->mutex), cleanup);
+    int res = rfb_write_bytes(client, data, length, 1);
+    CALL(rfb_unlock(&client->mutex), cleanup);
+    return res;
 
-    CALL(rfb.server_socket = socket(AF_INET, SOCK_STREAM, 0), cleanup);
+cleanup:
+    return -1;
+}
 
-    const int one = 1;
-    CALL(setsockopt(
-        rfb.server_socket,
-        SOL_SOCKET,
-        SO_REUSEADDR,
-        (char *)&one,
-        sizeof(one)
-    ), cleanup);
+// rectangles go by the update which waits for them or are queued for the next update
+static int rfb_write(struct rfb_client_t *client, const void *data, int length)
+{
+    return rfb_write_bytes(client, data, length, client->update_rects > 0);
+}
 
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(app.port);
-    serv_addr.sin_family = AF_INET;
-    CALL(bind(rfb.server_socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)), cleanup);
-    CALL(listen(rfb.server_socket, RFB_MAX_CONNECTIONS), cleanup);
+// the payload goes to the socket right from the frame if the client waits for it,
+// otherwise it's copied, so the client which falls behind doesn't hold buffers of
+// the encoder
+static int rfb_write_payload(struct rfb_client_t *client, struct frame_t *frame,
+    const uint8_t *data, int length)
+{
+    if (client->update_rects == 0 || length == 0)
+        return rfb_write(client, data, length);
+
+    struct rfb_segment_t segment = {
+        .frame = frame_ref(frame),
+        .data = data,
+        .length = length
+    };
+    kv_push(struct rfb_segment_t, client->segments, segment);
+    client->announced = kv_size(client->segments);
+    return 0;
+}
 
-    rfb.thread_res = pthread_create(&rfb.thread, NULL, rfb_function, NULL);
-    if (rfb.thread_res) {
-        CALL_CUSTOM_MESSAGE(pthread_create, rfb.thread_res);
-        goto cleanup;
+static void rfb_remove_segments(struct rfb_client_t *client, int count)
+{
+    for (int i = 0; i < count; i++) {
+        struct rfb_segment_t *segment = &kv_A(client->segments, i);
+        if (segment->frame)
+            CALL(frame_unref(segment->frame));
     }
+    client->segments.n -= count;
+    memmove(client->segments.a, client->segments.a + count,
+        client->segments.n * sizeof(struct rfb_segment_t));
+    client->announced -= count;
+}
 
-    rfb.client_semaphore_res = sem_init(&rfb.client_semaphore, 0, 0);
-    if (rfb.client_semaphore_res) {
-        CALL_CUSTOM_MESSAGE(sem_init, rfb.client_semaphore_res);
-        goto cleanup;
+// payloads which the socket hasn't taken are copied, so the encoder gets its buffers back
+// while the uplink of the client is slow, the queue drops bytes which have been sent
+static int rfb_compact_segments(struct rfb_client_t *client)
+{
+    int start = client->queue_length;
+    for (int i = 0; i < kv_size(client->segments); i++) {
+        struct rfb_segment_t *segment = &kv_A(client->segments, i);
+        if (segment->frame) {
+            int offset = i == 0? client->segment_offset: 0;
+            CALL(rfb_reserve(client, segment->length - offset), cleanup);
+            memcpy(client->queue + client->queue_length, segment->data + offset,
+                segment->length - offset);
+            CALL(frame_unref(segment->frame));
+            segment->frame = NULL;
+            // bytes which have been sent aren't copied
+            segment->offset = client->queue_length - offset;
+            client->queue_length += segment->length - offset;
+        }
+        start = MIN(start, segment->offset + (i == 0? client->segment_offset: 0));
     }
 
-    DEBUG("output[%s] has been started", rfb.output->name);
+    if (start > 0) {
+        client->queue_length -= start;
+        memmove(client->queue, client->queue + start, client->queue_length);
+        for (int i = 0; i < kv_size(client->segments); i++)
+            kv_A(client->segments, i).offset -= start;
+    }
     return 0;
 
 cleanup:
-    errno = EAGAIN;
     return -1;
 }
 
-int rfb_process_frame()
+// messages of the server go to the client between updates, the rest of the update which
+// is being queued goes before them
+static int rfb_write_message(struct rfb_client_t *client, const void *data, int length)
 {
-    int res = 0;
+    if (client->update_rects == 0)
+        return rfb_write_bytes(client, data, length, 1);
+    if (client->messages_length + length > RFB_MESSAGE_BYTES) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    memcpy(client->messages + client->messages_length, data, length);
+    client->messages_length += length;
+    return 0;
+}
 
-    struct output_t *output = rfb.output;
-    if (!output->is_started()) CALL(output->start(), cleanup);
+static int rfb_write_fence(struct rfb_client_t *client, uint32_t flags, const uint8_t *payload,
+    int length)
+{
+    uint8_t message[RFB_FENCE_LENGTH + RFB_FENCE_PAYLOAD_BYTES];
+    uint32_t flags_send = htonl(flags);
+    message[0] = RFBServerFence;
+    message[1] = message[2] = message[3] = 0;
+    memcpy(message + 4, &flags_send, sizeof(flags_send));
+    message[8] = length;
+    memcpy(message + RFB_FENCE_LENGTH, payload, length);
+    return rfb_write_message(client, message, RFB_FENCE_LENGTH + length);
+}
 
-    CALL(sem_wait(&rfb.client_semaphore), cleanup);
+// the client returns the fence with the time when it has been queued
+static int rfb_request_fence(struct rfb_client_t *client)
+{
+    int64_t fence_ns = rfb_get_time_ns();
+    CALL(rfb_write_fence(client, RFB_FENCE_REQUEST, (uint8_t *)&fence_ns, sizeof(fence_ns)),
+        cleanup);
+    client->fences_count++;
+    return 0;
 
-    int in_format = output->start_format;
-    int out_format = output->start_format;
-    if (!input.is_started()) CALL(input.start(in_format), cleanup);
-    CALL(res = input.process_frame(), cleanup);
-    int length = 0;
-    uint8_t *buffer = input.get_buffer(NULL, &length);
-    DEBUG("buffer has been received from input[%s], length: %d!!!", input.name, length);
-    for (int k = 0; k < MAX_FILTERS && output->filters[k].out_format; k++) {
-        struct filter_t *filter = filters + output->filters[k].index;
-        in_format = out_format;
-        out_format = output->filters[k].out_format;
-        if (!filter->is_started()) CALL(filter->start(in_format, out_format), cleanup);
-        CALL(filter->process_frame(buffer), cleanup);
-        buffer = filter->get_buffer(NULL, &length);
-        if (length == 0) {
-            DEBUG("The filter[%s] doesn't have buffer yet", filter->name);
-            break;
-        }
-        else {
-            DEBUG("buffer has been received from filter[%s], length: %d!!!", filter->name, length);
-        }
-    }
+cleanup:
+    return -1;
+}
 
-    // ----- fps
-    static int frame_count = 0;
-    static struct timespec t1;
-    struct timespec t2;
-    if (frame_count == 0) {
-        clock_gettime(CLOCK_MONOTONIC, &t1);
-    }
-    clock_gettime(CLOCK_MONOTONIC, &t2);
-    float d = (t2.tv_sec + t2.tv_nsec / 1000000000.0) - (t1.tv_sec + t1.tv_nsec / 1000000000.0);
-    if (d > 0) {
-        app.rfb_fps = frame_count / d;
-    } else {
-        app.rfb_fps = frame_count;
+// the last rectangle of the update has been queued, messages which have waited for it
+// follow it, the client with continuous updates confirms the update by the fence
+static int rfb_end_update(struct rfb_client_t *client)
+{
+    client->update_ns = rfb_get_time_ns();
+    if (client->messages_length > 0) {
+        CALL(rfb_write_bytes(client, client->messages, client->messages_length, 1), cleanup);
+        client->messages_length = 0;
     }
-    frame_count++;
-    // -----
+    if (client->is_continuous && client->is_fence)
+        CALL(rfb_request_fence(client), cleanup);
+    return 0;
 
-    if (length != 0) {
-        uint32_t length_send = htonl(length);
-        CALL(send(rfb.client_socket, (char *)&update_message, sizeof(update_message), 0), cleanup);
-        CALL(send(rfb.client_socket, (char *)&length_send, sizeof(length_send), 0), cleanup);
+cleanup:
+    return -1;
+}
 
-        DEBUG("Bytes to send: %d, %x %x %x %x ...",
-            length,
-            buffer[0],
-            buffer[1],
-            buffer[2],
-            buffer[3]);
-        CALL(send(rfb.client_socket, (char *)buffer, length, 0), cleanup);
+// the update announces rectangles which are queued and the rest of the frame which is
+// being encoded, the header goes before them
+static int rfb_start_update(struct rfb_client_t *client)
+{
+    int count = client->backlog_rects + client->slices_count - client->slice_index;
+    if (client->is_update || !client->is_requested || count == 0)
+        return 0;
+
+    struct rfb_buffer_update_message_t update_message = {
+        .message_type = RFBFramebufferUpdate,
+        .padding = 0,
+        .number_of_rectangles = htons(count)
+    };
+    CALL(rfb_write_bytes(client, &update_message, sizeof(update_message), 1), cleanup);
+    client->announced = kv_size(client->segments);
+    client->update_rects = count - client->backlog_rects;
+    client->backlog_rects = 0;
+    client->is_backlog_reference = 0;
+    // the client with continuous updates waits for the next one right away, without
+    // fences it doesn't tell when it falls behind
+    client->is_requested = client->is_continuous;
+    if (client->is_continuous && !client->is_fence)
+        client->frames_count = 0;
+    client->is_update = 1;
+    client->update_length = 0;
+    if (client->update_rects == 0)
+        CALL(rfb_end_update(client), cleanup);
+    return 0;
 
-        DEBUG("r: %d, x: %d, y: %d, w: %d, h: %d", ntohs(update_message.number_of_rectangles),
-            ntohs(update_message.x), ntohs(update_message.y), ntohs(update_message.width),
-            ntohs(update_message.height));
-        #if defined(ENV64BIT)
-            DEBUG("t: %d, e: %d, size: %ld, len: %d", update_message.message_type,
-                ntohl(update_message.encoding_type), sizeof(update_message), length);
-        #else
-            DEBUG("t: %d, e: %d, size: %d, len: %d", update_message.message_type,
-                ntohl(update_message.encoding_type), sizeof(update_message), length);
-        #endif
+cleanup:
+    return -1;
+}
 
-    }
-    else {
-        DEBUG("Unblock semaphore until buffer is received");
-        CALL(sem_post(&rfb.client_semaphore), cleanup);
-    }
+// the socket is polled for EPOLLOUT only while the client has bytes which it hasn't
+// taken
+static int rfb_poll_out(struct rfb_client_t *client, int is_out_polled)
+{
+    if (client->is_out_polled == is_out_polled)
+        return 0;
+    struct epoll_event event = {
+        .events = EPOLLIN | (is_out_polled? EPOLLOUT: 0),
+        .data.u32 = client - rfb.clients
+    };
+    CALL(epoll_ctl(rfb.epoll_fd, EPOLL_CTL_MOD, client->socket, &event), cleanup);
+    client->is_out_polled = is_out_polled;
     return 0;
 
 cleanup:
-    errno = EAGAIN;
     return -1;
 }
 
-static int rfb_stop()
+// gathers announced segments to one sendmsg(), the large payload of the frame goes alone
+// by MSG_ZEROCOPY, so the kernel doesn't copy it and the frame is referenced until the
+// kernel completes it, returns bytes which have been sent
+static int rfb_send_segments(struct rfb_client_t *client)
 {
-    // shutdown the server socket terminates accept call to wait incoming connections
-    if (rfb.server_socket > 0) {
-        int res = shutdown(rfb.server_socket, SHUT_RDWR);
-        if (res == -1 && errno != ENOTCONN) {
-            CALL_MESSAGE(shutdown(rfb.server_socket, SHUT_RDWR));
-            goto stop_error;
+    struct iovec iov[RFB_IOV_COUNT];
+    int count = 0, length = 0, flags = MSG_NOSIGNAL;
+    for (int i = 0; i < client->announced && count < RFB_IOV_COUNT; i++) {
+        struct rfb_segment_t *segment = &kv_A(client->segments, i);
+        int offset = i == 0? client->segment_offset: 0;
+        int is_zerocopy = client->is_zerocopy && segment->frame &&
+            segment->length - offset >= RFB_ZEROCOPY_BYTES;
+        if (is_zerocopy && count > 0)
+            break;
+        iov[count].iov_base = (segment->frame? (uint8_t *)segment->data:
+            client->queue + segment->offset) + offset;
+        iov[count].iov_len = segment->length - offset;
+        length += iov[count].iov_len;
+        count++;
+        if (is_zerocopy) {
+            flags |= MSG_ZEROCOPY;
+            break;
         }
     }
 
-    if (rfb.client_socket > 0) {
-        CALL(close(rfb.client_socket), stop_error)
-        rfb.client_socket = -1;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = count
+    };
+    int res = sendmsg(client->socket, &msg, flags);
+    if (res == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // pages of the socket for MSG_ZEROCOPY are limited, the payload is copied then
+        res = sendmsg(client->socket, &msg, flags & ~MSG_ZEROCOPY);
+        flags &= ~MSG_ZEROCOPY;
     }
-
-    if (rfb.server_socket > 0) {
-        CALL(close(rfb.server_socket), stop_error);
-        rfb.server_socket = -1;
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    CALL(res, cleanup);
+
+    if (flags & MSG_ZEROCOPY) {
+        struct rfb_zerocopy_t zerocopy = {
+            .id = client->zerocopy_id++,
+            .frame = frame_ref(kv_A(client->segments, 0).frame)
+        };
+        kv_push(struct rfb_zerocopy_t, client->zerocopies, zerocopy);
     }
 
-    if (!rfb.thread_res) {
-        int res = pthread_join(rfb.thread, NULL);
-        if (res != 0) {
-            CALL_CUSTOM_MESSAGE(pthread_join, res);
-            goto stop_error;
+    // segments which have been sent completely are dropped
+    int sent = res, segments = 0;
+    while (sent > 0) {
+        struct rfb_segment_t *segment = &kv_A(client->segments, segments);
+        int left = segment->length - client->segment_offset;
+        if (sent < left) {
+            client->segment_offset += sent;
+            break;
         }
-        else
-            rfb.thread_res = -1;
+        sent -= left;
+        client->segment_offset = 0;
+        segments++;
     }
+    rfb_remove_segments(client, segments);
+    client->update_length += res;
+    // the socket is full
+    if (res < length)
+        return 0;
+    return res;
 
-    if (!rfb.client_semaphore_res) {
-        int res = sem_destroy(&rfb.client_semaphore);
-        if (res) {
-            CALL_CUSTOM_MESSAGE(sem_destroy, res);
-            goto stop_error;
+cleanup:
+    return -1;
+}
+
+// sends announced segments until the socket is full, the update which is sent completely
+// gives the feedback to the bitrate control
+static int rfb_flush(struct rfb_client_t *client)
+{
+    int res = 0;
+    CALL(rfb_lock(&client->mutex), cleanup);
+    CALL(rfb_start_update(client), unlock);
+    do {
+        res = 0;
+        if (client->announced > 0)
+            CALL(res = rfb_send_segments(client), unlock);
+    } while (res > 0);
+    CALL(rfb_compact_segments(client), unlock);
+    CALL(rfb_poll_out(client, client->announced > 0), unlock);
+
+    int is_sent = client->is_update && client->update_rects == 0 && client->announced == 0;
+    if (is_sent)
+        client->is_update = 0;
+    // the client which has dropped the reference frame gets the IDR frame once the socket
+    // takes more
+    int is_key_frame_needed = client->announced == 0 && client->is_requested &&
+        client->is_idr_waiting && !client->is_key_frame_requested;
+    client->is_key_frame_requested |= is_key_frame_needed;
+    CALL(rfb_unlock(&client->mutex), cleanup);
+    if (is_sent)
+        CALL(rfb_control_rate(client, client->update_length), cleanup);
+    if (is_key_frame_needed)
+        CALL(rfb_request_key_frame(), cleanup);
+    return 0;
+
+unlock:
+    rfb_unlock(&client->mutex);
+cleanup:
+    return -1;
+}
+
+// releases frames which the kernel has sent by MSG_ZEROCOPY, the kernel reports them by
+// ranges of identifiers of sendmsg() calls, returns amount of notifications
+static int rfb_complete_zerocopy(struct rfb_client_t *client)
+{
+    int count = 0;
+    while (1) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+        int res = recvmsg(client->socket, &msg, MSG_ERRQUEUE);
+        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return count;
+        CALL(res, cleanup);
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                errno = err.ee_errno? err.ee_errno: EIO;
+                goto cleanup;
+            }
+
+            CALL(rfb_lock(&client->mutex), cleanup);
+            int completed = 0;
+            while (completed < kv_size(client->zerocopies) &&
+                (int32_t)(kv_A(client->zerocopies, completed).id - err.ee_data) <= 0
+            ) {
+                CALL(frame_unref(kv_A(client->zerocopies, completed).frame));
+                completed++;
+            }
+            client->zerocopies.n -= completed;
+            memmove(client->zerocopies.a, client->zerocopies.a + completed,
+                client->zerocopies.n * sizeof(struct rfb_zerocopy_t));
+            // the device can't send pages of the process, e.g. the loopback, so the kernel
+            // has copied them anyway
+            if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && client->is_zerocopy) {
+                DEBUG("client[%d] doesn't use MSG_ZEROCOPY, the kernel copies data",
+                    (int)(client - rfb.clients));
+                client->is_zerocopy = 0;
+            }
+            CALL(rfb_unlock(&client->mutex), cleanup);
+            count++;
         }
-        else
-            rfb.client_semaphore_res = -1;
     }
+
+cleanup:
+    return -1;
+}
+
+// drops bytes and frames of the closed connection, pages of MSG_ZEROCOPY which the kernel
+// may still send don't matter for it
+static int rfb_release_client(struct rfb_client_t *client)
+{
+    CALL(rfb_lock(&client->mutex), cleanup);
+    client->segment_offset = 0;
+    rfb_remove_segments(client, kv_size(client->segments));
+    client->announced = 0;
+    client->queue_length = 0;
+    client->backlog_rects = 0;
+    for (int i = 0; i < kv_size(client->zerocopies); i++)
+        CALL(frame_unref(kv_A(client->zerocopies, i).frame));
+    kv_size(client->zerocopies) = 0;
+    // the next connection starts the new stream of ZRLE
+    if (client->is_zlib) {
+        deflateEnd(&client->zlib);
+        client->is_zlib = 0;
+    }
+    CALL(rfb_unlock(&client->mutex), cleanup);
     return 0;
 
-stop_error:
-    errno = EAGAIN;
+cleanup:
     return -1;
 }
 
-static void rfb_cleanup()
+// wakes up the thread of connections to send rectangles which have been queued
+static int rfb_wake()
 {
-    rfb_stop();
+    uint64_t value = 1;
+    CALL(write(rfb.event_fd, &value, sizeof(value)), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
 }
 
-static int rfb_get_formats(const struct format_mapping_t *formats[])
+// the rectangle covers rows of the picture which are encoded by NAL units of the given
+// length, they are written by the caller right after the header
+static int rfb_write_rectangle(struct rfb_client_t *client, int y, int height, int length)
 {
-    if (formats != NULL)
-        *formats = rfb_formats;
-    return ARRAY_SIZE(rfb_formats);
+    struct rfb_rectangle_message_t rectangle = {
+        .x = htons(0),
+        .y = htons(y),
+        .width = htons(app.video_width),
+        .height = htons(height),
+        .encoding_type = htonl(RFBEncodingH264)
+    };
+    uint32_t length_send = htonl(length);
+    CALL(rfb_write(client, &rectangle, sizeof(rectangle)), cleanup);
+    CALL(rfb_write(client, &length_send, sizeof(length_send)), cleanup);
+
+    DEBUG("client[%d] x: %d, y: %d, w: %d, h: %d, e: %x, len: %d",
+        (int)(client - rfb.clients), ntohs(rectangle.x), ntohs(rectangle.y),
+        ntohs(rectangle.width), ntohs(rectangle.height), ntohl(rectangle.encoding_type),
+        length);
+    return 0;
+
+cleanup:
+    return -1;
 }
 
-void rfb_construct(struct app_state_t *app)
+// the rectangle goes by the update which waits for it or is queued for the next update
+static int rfb_end_rectangle(struct rfb_client_t *client)
 {
-    int i = 0;
-    while (i < MAX_OUTPUTS && outputs[i].context != NULL)
-        i++;
+    if (client->update_rects == 0) {
+        client->backlog_rects++;
+        return 0;
+    }
+    if (--client->update_rects == 0)
+        return rfb_end_update(client);
+    return 0;
+}
 
-    if (i != MAX_OUTPUTS) {
-        rfb.output = outputs + i;
-        outputs[i].name = "rfb";
-        outputs[i].context = &rfb;
-        outputs[i].init = rfb_init;
-        outputs[i].start = rfb_start;
-        outputs[i].is_started = rfb_is_started;
-        outputs[i].process_frame = rfb_process_frame;
-        outputs[i].stop = rfb_stop;        
-        outputs[i].get_formats = rfb_get_formats;
-        outputs[i].cleanup = rfb_cleanup;
+static int rfb_write_parameter_sets(struct rfb_client_t *client)
+{
+    if (rfb.sps_length > 0)
+        CALL(rfb_write(client, rfb.sps, rfb.sps_length), cleanup);
+    if (rfb.pps_length > 0)
+        CALL(rfb_write(client, rfb.pps, rfb.pps_length), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+static void rfb_cache_nal(uint8_t *cache, int *cache_length, const uint8_t *nal, int length)
+{
+    if (length + H264_START_CODE_SIZE > RFB_PARAMETER_SET_BYTES) {
+        DEBUG("The parameter set doesn't fit to the cache: %d", length);
+        return;
+    }
+    cache[0] = cache[1] = cache[2] = 0;
+    cache[3] = 1;
+    memcpy(cache + H264_START_CODE_SIZE, nal, length);
+    *cache_length = length + H264_START_CODE_SIZE;
+}
+
+// caches parameter sets of the Annex B stream, returns the mask of types of NAL units
+// which the buffer has, slices which other frames refer to mark the reference frame
+static int rfb_parse_nals(const uint8_t *data, int length, int *is_reference)
+{
+    int types = 0;
+    int i = 0;
+    while (i + 3 < length) {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+            i++;
+            continue;
+        }
+        int start = i + 3;
+        int end = start + 1;
+        while (end + 2 < length && (data[end] != 0 || data[end + 1] != 0 || data[end + 2] != 1))
+            end++;
+        if (end + 2 >= length)
+            end = length;
+        i = end;
+        // zero bytes of the next start code don't belong to the unit
+        while (end > start && data[end - 1] == 0)
+            end--;
+
+        int type = data[start] & 0x1f;
+        types |= 1 << type;
+        if ((type == H264_NAL_SLICE || type == H264_NAL_IDR) && (data[start] >> 5) != 0)
+            *is_reference = 1;
+        if (type == H264_NAL_SPS)
+            rfb_cache_nal(rfb.sps, &rfb.sps_length, data + start, end - start);
+        else if (type == H264_NAL_PPS)
+            rfb_cache_nal(rfb.pps, &rfb.pps_length, data + start, end - start);
+    }
+    return types;
+}
+
+// the client expects as many rectangles as the update has announced, so slices which
+// haven't been encoded are sent empty
+static int rfb_finish_frame(struct rfb_client_t *client)
+{
+    for (; client->slice_index < client->slices_count; client->slice_index++) {
+        CALL(rfb_write_rectangle(client, 0, 0, 0), cleanup);
+        CALL(rfb_end_rectangle(client), cleanup);
+    }
+    return 0;
+
+cleanup:
+    client->slice_index = client->slices_count;
+    return -1;
+}
+
+// drops frames which wait for the next update, the stream can't be decoded without
+// the reference frame until the IDR frame, which is requested once the socket drains
+static void rfb_drop_backlog(struct rfb_client_t *client)
+{
+    for (int i = client->announced; i < kv_size(client->segments); i++) {
+        struct rfb_segment_t *segment = &kv_A(client->segments, i);
+        if (segment->frame)
+            CALL(frame_unref(segment->frame));
+    }
+    kv_size(client->segments) = client->announced;
+    client->backlog_rects = 0;
+    client->frames_count = 0;
+    if (client->is_backlog_reference && !client->is_idr_waiting) {
+        client->is_idr_waiting = 1;
+        client->is_key_frame_requested = 0;
+    }
+    client->is_backlog_reference = 0;
+}
+
+// starts to queue the frame of the given NAL types for the client, returns 0 if the client
+// doesn't get the frame, the IDR frame for the new client is preceded by cached parameter
+// sets if the encoder has sent them only at the start of the stream
+static int rfb_start_frame(struct rfb_client_t *client, uint32_t sequence, int slices_count,
+    int types, int is_reference, int *sets_length)
+{
+    CALL(rfb_finish_frame(client), cleanup);
+    client->slices_count = 0;
+    client->slice_index = 0;
+    // the socket hasn't taken the previous update yet, so the newest frame replaces queued
+    // ones instead of waiting behind them
+    if (client->backlog_rects > 0 && client->announced > 0) {
+        DEBUG("client[%d] doesn't take frames in time, rectangles are dropped: %d",
+            (int)(client - rfb.clients), client->backlog_rects);
+        rfb_drop_backlog(client);
+    }
+    if (client->frames_count >= RFB_CLIENT_FRAMES) {
+        // the rest of the stream can't be decoded without the dropped frame
+        if (!client->is_idr_waiting) {
+            DEBUG("client[%d] falls behind, frames are dropped until the IDR frame",
+                (int)(client - rfb.clients));
+            client->is_idr_waiting = 1;
+            client->is_key_frame_requested = 0;
+        }
+        return 0;
+    }
+    if (client->is_idr_waiting && !(types & (1 << H264_NAL_IDR))) {
+        // the request is kept for the next frame
+        client->is_frame_requested = client->is_requested && client->backlog_rects == 0;
+        return 0;
+    }
+
+    *sets_length = 0;
+    if (client->is_idr_waiting && !(types & (1 << H264_NAL_SPS)))
+        *sets_length = rfb.sps_length + rfb.pps_length;
+    client->is_idr_waiting = 0;
+    client->sequence = sequence;
+    client->slices_count = slices_count;
+    client->frames_count++;
+    // the client which waits gets the payload right from the frame
+    CALL(rfb_start_update(client), cleanup);
+    if (client->update_rects == 0)
+        client->is_backlog_reference |= is_reference;
+    return 1;
+
+cleanup:
+    return -1;
+}
+
+// every slice of the frame goes as a rectangle of the same update as soon as it's encoded,
+// so the client decodes the top of the picture while the encoder works on the bottom
+static int rfb_queue_slice(struct rfb_client_t *client, struct frame_slice_t *slice, int types,
+    int is_reference)
+{
+    int res = 0, sets_length = 0;
+    if (slice->index == 0) {
+        CALL(res = rfb_start_frame(client, slice->frame->sequence, slice->count, types,
+            is_reference, &sets_length), cleanup);
+    }
+    else
+        res = client->slices_count > 0 && client->sequence == slice->frame->sequence &&
+            client->slice_index == slice->index;
+    if (!res)
+        return 0;
+
+    CALL(rfb_write_rectangle(client, slice->y, slice->height, sets_length + slice->length),
+        cleanup);
+    if (sets_length > 0)
+        CALL(rfb_write_parameter_sets(client), cleanup);
+    CALL(rfb_write_payload(client, slice->frame, slice->data, slice->length), cleanup);
+    CALL(rfb_end_rectangle(client), cleanup);
+    client->slice_index++;
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// chunks of the bitstream are queued as one rectangle
+static int rfb_queue_frame(struct rfb_client_t *client, struct frame_t *frame, int types,
+    int is_reference)
+{
+    int res = 0, sets_length = 0;
+    CALL(res = rfb_start_frame(client, frame->sequence, 1, types, is_reference, &sets_length),
+        cleanup);
+    if (!res)
+        return 0;
+
+    CALL(rfb_write_rectangle(client, 0, app.video_height, sets_length + frame->length),
+        cleanup);
+    if (sets_length > 0)
+        CALL(rfb_write_parameter_sets(client), cleanup);
+    for (int i = 0; i < frame->planes_count; i++)
+        CALL(rfb_write_payload(client, frame, frame->planes[i], frame->strides[i]), cleanup);
+    CALL(rfb_end_rectangle(client), cleanup);
+    client->slice_index++;
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// pixels of the rectangle are converted from the picture right to the queue of the client
+static int rfb_write_raw_rectangle(struct rfb_client_t *client, int x, int y, int width,
+    int height)
+{
+    struct rfb_rectangle_message_t rectangle = {
+        .x = htons(x),
+        .y = htons(y),
+        .width = htons(width),
+        .height = htons(height),
+        .encoding_type = htonl(RFBRaw)
+    };
+    CALL(rfb_write(client, &rectangle, sizeof(rectangle)), cleanup);
+
+    int length = width * height * (client->pixel_format.bpp >> 3);
+    CALL(rfb_reserve(client, length), cleanup);
+    CALL(yuv_kernels_convert_rgb(&rfb.raw_picture, x, y, width, height, &client->pixel_format,
+        client->queue + client->queue_length), cleanup);
+    rfb_commit_bytes(client, length, client->update_rects > 0);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// grows the buffer of the server to take the given bytes
+static int rfb_grow(uint8_t **buffer, int *size, int length)
+{
+    if (length <= *size)
+        return 0;
+    uint8_t *data = realloc(*buffer, length);
+    if (data == NULL) {
+        CALL_MESSAGE(realloc(*buffer, length));
+        errno = ENOMEM;
+        return -1;
+    }
+    *buffer = data;
+    *size = length;
+    return 0;
+}
+
+// ZRLE sends 3 bytes of 32 bit pixels if components fit to the least or the most
+// significant ones
+static void rfb_set_cpixel(struct rfb_client_t *client, int depth)
+{
+    const struct yuv_rgb_format_t *format = &client->pixel_format;
+    client->cpixel_offset = 0;
+    client->cpixel_bytes = format->bpp >> 3;
+    if (format->bpp != 32 || depth > 24)
+        return;
+    uint64_t mask = (uint64_t)format->red_max << format->red_shift |
+        (uint64_t)format->green_max << format->green_shift |
+        (uint64_t)format->blue_max << format->blue_shift;
+    if ((mask & 0xff000000) == 0) {
+        client->cpixel_offset = format->is_big_endian? 1: 0;
+        client->cpixel_bytes = 3;
+    }
+    else if ((mask & 0xff) == 0) {
+        client->cpixel_offset = format->is_big_endian? 0: 1;
+        client->cpixel_bytes = 3;
+    }
+}
+
+// the tile is solid or has the palette of few colours which pixels are indexed by bits of
+// packed rows, otherwise its pixels are sent raw, runs of the same pixel are skipped by
+// the kernel, so the raw tile is found by its first colours, returns the length of the tile
+static int rfb_write_zrle_tile(struct rfb_client_t *client, const uint8_t *pixels, int stride,
+    int width, int height, uint8_t *out)
+{
+    int bytes = client->pixel_format.bpp >> 3;
+    int cpixel_bytes = client->cpixel_bytes;
+    int cpixel_offset = client->cpixel_offset;
+    uint8_t indexes[RFB_ZRLE_TILE_SIZE * RFB_ZRLE_TILE_SIZE];
+    const uint8_t *palette[RFB_ZRLE_PALETTE_SIZE];
+    int palette_size = 0;
+    int is_raw = 0;
+    for (int y = 0; y < height && !is_raw; y++) {
+        const uint8_t *row = pixels + y * stride;
+        for (int x = 0; x < width; ) {
+            const uint8_t *pixel = row + x * bytes;
+            int index = 0;
+            while (index < palette_size && memcmp(palette[index], pixel, bytes) != 0)
+                index++;
+            if (index == RFB_ZRLE_PALETTE_SIZE) {
+                is_raw = 1;
+                break;
+            }
+            if (index == palette_size)
+                palette[palette_size++] = pixel;
+            int run = 0;
+            CALL(run = yuv_kernels_run_line(pixel, width - x, bytes), cleanup);
+            memset(indexes + y * width + x, index, run);
+            x += run;
+        }
+    }
+
+    uint8_t *data = out;
+    if (is_raw) {
+        *data++ = 0;
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row = pixels + y * stride + cpixel_offset;
+            if (cpixel_bytes == bytes) {
+                memcpy(data, row, width * bytes);
+                data += width * bytes;
+                continue;
+            }
+            for (int x = 0; x < width; x++, data += cpixel_bytes)
+                memcpy(data, row + x * bytes, cpixel_bytes);
+        }
+        return data - out;
+    }
+
+    // the solid tile is the palette of one colour without indexes
+    *data++ = palette_size;
+    for (int i = 0; i < palette_size; i++, data += cpixel_bytes)
+        memcpy(data, palette[i] + cpixel_offset, cpixel_bytes);
+    if (palette_size == 1)
+        return data - out;
+    int bits = palette_size == 2? 1: palette_size <= 4? 2: 4;
+    for (int y = 0; y < height; y++) {
+        int byte = 0, used = 0;
+        for (int x = 0; x < width; x++) {
+            byte = byte << bits | indexes[y * width + x];
+            used += bits;
+            if (used == 8) {
+                *data++ = byte;
+                byte = 0;
+                used = 0;
+            }
+        }
+        if (used > 0)
+            *data++ = byte << (8 - used);
+    }
+    return data - out;
+
+cleanup:
+    return -1;
+}
+
+// the rectangle is compressed right to the queue after its length, the stream is flushed,
+// so the client decodes the rectangle without the next one
+static int rfb_write_zlib(struct rfb_client_t *client, const uint8_t *data, int length)
+{
+    z_stream *stream = &client->zlib;
+    if (!client->is_zlib) {
+        memset(stream, 0, sizeof(*stream));
+        int res = deflateInit(stream, RFB_ZLIB_LEVEL);
+        if (res != Z_OK) {
+            CALL_CUSTOM_MESSAGE(deflateInit(stream, RFB_ZLIB_LEVEL), res);
+            errno = ENOMEM;
+            return -1;
+        }
+        client->is_zlib = 1;
+    }
+
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = length;
+    int compressed = 0;
+    do {
+        CALL(rfb_reserve(client, sizeof(uint32_t) + compressed + RFB_ZLIB_CHUNK_BYTES),
+            cleanup);
+        stream->next_out = client->queue + client->queue_length + sizeof(uint32_t) +
+            compressed;
+        stream->avail_out = RFB_ZLIB_CHUNK_BYTES;
+        int res = deflate(stream, Z_SYNC_FLUSH);
+        if (res != Z_OK && res != Z_BUF_ERROR) {
+            CALL_CUSTOM_MESSAGE(deflate(stream, Z_SYNC_FLUSH), res);
+            errno = EIO;
+            return -1;
+        }
+        compressed += RFB_ZLIB_CHUNK_BYTES - stream->avail_out;
+    } while (stream->avail_out == 0);
+
+    uint32_t size = htonl(compressed);
+    memcpy(client->queue + client->queue_length, &size, sizeof(size));
+    rfb_commit_bytes(client, sizeof(size) + compressed, client->update_rects > 0);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// pixels of the rectangle are converted from the picture and split to tiles of ZRLE from
+// the top left corner, the tiles are compressed together
+static int rfb_write_zrle_rectangle(struct rfb_client_t *client, int x, int y, int width,
+    int height)
+{
+    struct rfb_rectangle_message_t rectangle = {
+        .x = htons(x),
+        .y = htons(y),
+        .width = htons(width),
+        .height = htons(height),
+        .encoding_type = htonl(RFBZRLE)
+    };
+    CALL(rfb_write(client, &rectangle, sizeof(rectangle)), cleanup);
+
+    int bytes = client->pixel_format.bpp >> 3;
+    int tiles_count = ((width + RFB_ZRLE_TILE_SIZE - 1) / RFB_ZRLE_TILE_SIZE) *
+        ((height + RFB_ZRLE_TILE_SIZE - 1) / RFB_ZRLE_TILE_SIZE);
+    // the palette tile with its indexes can be longer than the raw one of few pixels
+    int size = width * height * bytes + tiles_count *
+        (1 + RFB_ZRLE_PALETTE_SIZE * sizeof(uint32_t) + RFB_ZRLE_TILE_SIZE);
+    CALL(rfb_grow(&rfb.zrle_pixels, &rfb.zrle_pixels_size, width * height * bytes), cleanup);
+    CALL(rfb_grow(&rfb.zrle_data, &rfb.zrle_data_size, size), cleanup);
+    CALL(yuv_kernels_convert_rgb(&rfb.raw_picture, x, y, width, height, &client->pixel_format,
+        rfb.zrle_pixels), cleanup);
+
+    int length = 0;
+    for (int ty = 0; ty < height; ty += RFB_ZRLE_TILE_SIZE) {
+        for (int tx = 0; tx < width; tx += RFB_ZRLE_TILE_SIZE) {
+            int res = 0;
+            CALL(res = rfb_write_zrle_tile(client,
+                rfb.zrle_pixels + (ty * width + tx) * bytes,
+                width * bytes,
+                MIN(RFB_ZRLE_TILE_SIZE, width - tx),
+                MIN(RFB_ZRLE_TILE_SIZE, height - ty),
+                rfb.zrle_data + length), cleanup);
+            length += res;
+        }
+    }
+    return rfb_write_zlib(client, rfb.zrle_data, length);
+
+cleanup:
+    return -1;
+}
+
+// the block of tiles has changed if any of them has, the last blocks of rows and columns
+// can have less tiles
+static int rfb_is_block_changed(struct rfb_client_t *client, int tiles_x, int scale,
+    int blocks_x, int block)
+{
+    int tiles_y = client->tiles_count / tiles_x;
+    int x_start = block % blocks_x * scale;
+    int y_start = block / blocks_x * scale;
+    for (int y = y_start; y < MIN(y_start + scale, tiles_y); y++)
+        for (int x = x_start; x < MIN(x_start + scale, tiles_x); x++)
+            if (client->tiles[y * tiles_x + x])
+                return 1;
+    return 0;
+}
+
+// tiles which have changed since the last update of the raw client go by the update which
+// it waits for, tiles of the row which follow each other make one rectangle, ZRLE clients
+// get blocks of tiles of the ZRLE size
+static int rfb_queue_tiles(struct rfb_client_t *client)
+{
+    int tiles_count = rfb.raw_tiles_count;
+    if (client->tiles_count != tiles_count) {
+        uint8_t *tiles = realloc(client->tiles, tiles_count);
+        if (tiles == NULL) {
+            CALL_MESSAGE(realloc(client->tiles, tiles_count));
+            errno = ENOMEM;
+            return -1;
+        }
+        client->tiles = tiles;
+        client->tiles_count = tiles_count;
+        client->is_full_update = 1;
+    }
+    if (client->is_full_update) {
+        memset(client->tiles, 1, tiles_count);
+        client->is_full_update = 0;
+    }
+    else {
+        for (int t = 0; t < tiles_count; t++)
+            client->tiles[t] |= rfb.raw_tiles[t];
+    }
+    // tiles keep changing until the socket takes the previous update
+    if (!client->is_requested || client->is_update)
+        return 0;
+
+    struct frame_t *picture = &rfb.raw_picture;
+    int tiles_x = (picture->width + RFB_TILE_SIZE - 1) / RFB_TILE_SIZE;
+    int scale = client->encoding == RFBZRLE? RFB_ZRLE_TILE_SIZE / RFB_TILE_SIZE: 1;
+    int size = RFB_TILE_SIZE * scale;
+    int blocks_x = (tiles_x + scale - 1) / scale;
+    int blocks_count = blocks_x * ((tiles_count / tiles_x + scale - 1) / scale);
+    int count = 0;
+    for (int b = 0; b < blocks_count; b++)
+        count += rfb_is_block_changed(client, tiles_x, scale, blocks_x, b) && (b % blocks_x == 0 ||
+            !rfb_is_block_changed(client, tiles_x, scale, blocks_x, b - 1));
+    // the request waits for changes
+    if (count == 0)
+        return 0;
+
+    client->slices_count = count;
+    client->slice_index = 0;
+    CALL(rfb_start_update(client), cleanup);
+    for (int b = 0; b < blocks_count; b++) {
+        if (!rfb_is_block_changed(client, tiles_x, scale, blocks_x, b))
+            continue;
+        int start = b;
+        while (b + 1 < blocks_count && (b + 1) % blocks_x != 0 &&
+            rfb_is_block_changed(client, tiles_x, scale, blocks_x, b + 1)
+        ) {
+            b++;
+        }
+        int x = start % blocks_x * size;
+        int y = start / blocks_x * size;
+        int width = MIN((b % blocks_x + 1) * size, picture->width) - x;
+        int height = MIN(size, picture->height - y);
+        if (client->encoding == RFBZRLE) {
+            CALL(rfb_write_zrle_rectangle(client, x, y, width, height), cleanup);
+        }
+        else {
+            CALL(rfb_write_raw_rectangle(client, x, y, width, height), cleanup);
+        }
+        CALL(rfb_end_rectangle(client), cleanup);
+        client->slice_index++;
+    }
+    memset(client->tiles, 0, tiles_count);
+    return 0;
+
+cleanup:
+    client->slice_index = client->slices_count;
+    return -1;
+}
+
+static uint16_t rfb_get_uint16(const uint8_t *data)
+{
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohs(value);
+}
+
+static uint32_t rfb_get_uint32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+// the output doesn't queue frames for the client anymore, when the last client leaves
+// the outputs become idle and the application stops what only they use
+static void rfb_close_client(struct rfb_client_t *client)
+{
+    if (errno == ECONNRESET) {
+        DEBUG("client[%d] has closed the connection", (int)(client - rfb.clients));
+    }
+    else {
+        ERROR("client[%d] has been disconnected: %s (%d)", (int)(client - rfb.clients),
+            strerror(errno), errno);
+    }
+
+    int is_last = 0;
+    if (rfb_lock(&rfb.mutex) == 0) {
+        if (client->is_streaming) {
+            client->is_streaming = 0;
+            rfb.clients_count--;
+            is_last = rfb.clients_count == 0;
+        }
+        // the descriptor leaves the epoll set when it's closed
+        CALL(close(client->socket));
+        client->socket = -1;
+        client->is_used = 0;
+        rfb_unlock(&rfb.mutex);
+    }
+    CALL(rfb_release_client(client));
+
+    if (is_last) {
+        __atomic_store_n(&rfb.is_idle, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&rfb.is_raw_idle, 1, __ATOMIC_RELEASE);
+    }
+    else {
+        CALL(rfb_update_bitrate());
+    }
+}
+
+// the flag of the output is consumed once, the client which has connected since then
+// keeps the stream
+static int rfb_consume_idle(int *is_idle)
+{
+    if (!__atomic_exchange_n(is_idle, 0, __ATOMIC_ACQ_REL))
+        return 0;
+
+    CALL(rfb_lock(&rfb.mutex), error);
+    int res = rfb.clients_count == 0;
+    CALL(rfb_unlock(&rfb.mutex), error);
+    return res;
+
+error:
+    return -1;
+}
+
+// frames are queued for the client from now on, the stream is restarted for it with
+// the configured bitrate
+static int rfb_start_streaming(struct rfb_client_t *client)
+{
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    client->bitrate = app.h264_bitrate;
+    client->is_streaming = 1;
+    rfb.clients_count++;
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    CALL(rfb_update_bitrate(), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// parses the message of the handshake, returns the length of the message or 0 if the
+// buffer doesn't have it completely
+static int rfb_parse_handshake(struct rfb_client_t *client, const uint8_t *data, int length)
+{
+    if (client->state == RFBClientVersion) {
+        if (length < RFB_VERSION_LENGTH)
+            return 0;
+        DEBUG("Client rfb version. %.11s", data);
+        struct rfb_security_message_t security = {
+            .types_count = 1,
+            .types = RFB_SECURITY_NONE
+        };
+        CALL(rfb_write_out(client, &security, sizeof(security)), cleanup);
+        client->state = RFBClientSecurity;
+        return RFB_VERSION_LENGTH;
+    }
+
+    if (length < 1)
+        return 0;
+    if (client->state == RFBClientSecurity) {
+        DEBUG("Client rfb security type. %d", data[0]);
+        uint32_t success = 0;
+        CALL(rfb_write_out(client, &success, sizeof(success)), cleanup);
+        client->state = RFBClientInit;
+        return 1;
+    }
+
+    DEBUG("Client rfb shared flag. %d", data[0]);
+    struct rfb_server_init_message_t init_message = {
+        .framebuffer_width = htons(app.video_width),
+        .framebuffer_height = htons(app.video_height),
+        .pixel_format.bpp = rfb_pixel_format.bpp,
+        .pixel_format.depth = rfb_pixel_format.bpp,
+        .pixel_format.big_endian = rfb_pixel_format.is_big_endian,
+        .pixel_format.true_color = 1,
+        .pixel_format.red_max = htons(rfb_pixel_format.red_max),
+        .pixel_format.green_max = htons(rfb_pixel_format.green_max),
+        .pixel_format.blue_max = htons(rfb_pixel_format.blue_max),
+        .pixel_format.red_shift = rfb_pixel_format.red_shift,
+        .pixel_format.green_shift = rfb_pixel_format.green_shift,
+        .pixel_format.blue_shift = rfb_pixel_format.blue_shift,
+        .name_length = htonl(sizeof(init_message.name))
+    };
+    memset(init_message.name, 0, sizeof(init_message.name));
+    memcpy(init_message.name, APP_NAME, strlen(APP_NAME));
+    CALL(rfb_write_out(client, &init_message, sizeof(init_message)), cleanup);
+    CALL(rfb_start_streaming(client), cleanup);
+    client->state = RFBClientMessages;
+    return 1;
+
+cleanup:
+    return -1;
+}
+
+// the client waits for the next update, it's requested by the message or by the reply
+// to the fence of continuous updates, the raw client gets all tiles by the request which
+// isn't incremental
+static int rfb_request_update(struct rfb_client_t *client, int is_incremental)
+{
+    client->request_ns = rfb_get_time_ns();
+    CALL(rfb_lock(&client->mutex), cleanup);
+    client->is_full_update |= !is_incremental;
+    // queued frames go by this update, the frame is captured only if there are none
+    int is_key_frame_needed = client->is_idr_waiting && !client->is_key_frame_requested;
+    client->is_key_frame_requested |= is_key_frame_needed;
+    client->is_requested = 1;
+    client->is_frame_requested = client->backlog_rects == 0 &&
+        client->slice_index == client->slices_count;
+    client->frames_count = 0;
+    CALL(rfb_unlock(&client->mutex), cleanup);
+    if (is_key_frame_needed)
+        CALL(rfb_request_key_frame(), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// the client switches between the stream of the encoder and raw tiles, the frame of
+// the stream which is being queued is finished, so the client gets all rectangles of
+// the update, the raw client doesn't limit the bitrate of the encoder
+static int rfb_set_encoding(struct rfb_client_t *client, int encoding)
+{
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    CALL(rfb_lock(&client->mutex), unlock);
+    int res = 0;
+    if (client->encoding != encoding) {
+        DEBUG("client[%d] encoding: %x", (int)(client - rfb.clients), encoding);
+        if (client->encoding == RFBEncodingH264) {
+            res = rfb_finish_frame(client);
+            if (client->backlog_rects > 0)
+                rfb_drop_backlog(client);
+        }
+        client->encoding = encoding;
+        client->is_idr_waiting = encoding == RFBEncodingH264;
+        client->is_key_frame_requested = 0;
+        client->is_full_update = 1;
+        client->bitrate = encoding == RFBEncodingH264? app.h264_bitrate: 0;
+        client->rate_frames = 0;
+    }
+    CALL(rfb_unlock(&client->mutex), unlock);
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    CALL(res, cleanup);
+    return rfb_update_bitrate();
+
+unlock:
+    rfb_unlock(&rfb.mutex);
+cleanup:
+    return -1;
+}
+
+// parses the message of the client, returns the length of the message or 0 if the buffer
+// doesn't have it completely
+static int rfb_parse_message(struct rfb_client_t *client, const uint8_t *data, int length)
+{
+    if (client->skip_length > 0) {
+        int skip = MIN(client->skip_length, length);
+        client->skip_length -= skip;
+        return skip;
+    }
+    if (client->state != RFBClientMessages)
+        return rfb_parse_handshake(client, data, length);
+
+    struct rfb_type_request_message_t type;
+    if (length < sizeof(type))
+        return 0;
+    memcpy(&type, data, sizeof(type));
+    const uint8_t *message = data + sizeof(type);
+
+    if (type.message_type == RFBSetPixelFormat) {
+        if (length < RFB_SET_PIXEL_FORMAT_LENGTH)
+            return 0;
+        struct rfb_pixel_format_request_message_t format;
+        memcpy(&format, message, sizeof(format));
+        DEBUG("RFBSetPixelFormat message.");
+        DEBUG("bpp: %d, depth: %d, big_endian: %d, true_color %d.",
+            format.f.bpp, format.f.depth, format.f.big_endian, format.f.true_color);
+        DEBUG("red_max: %d, green_max: %d, blue_max: %d.", ntohs(format.f.red_max),
+            ntohs(format.f.green_max), ntohs(format.f.blue_max));
+        DEBUG("red_shift: %d, green_shift: %d, blue_shift: %d.", format.f.red_shift,
+            format.f.green_shift, format.f.blue_shift);
+
+        // colour maps aren't supported, so the client which needs them can't be served
+        int bpp = format.f.bpp;
+        if (!format.f.true_color || (bpp != 8 && bpp != 16 && bpp != 32) ||
+            format.f.red_shift >= bpp || format.f.green_shift >= bpp ||
+            format.f.blue_shift >= bpp
+        ) {
+            ERROR("The pixel format isn't supported, bpp: %d, true_color: %d", bpp,
+                format.f.true_color);
+            errno = EPROTO;
+            return -1;
+        }
+        CALL(rfb_lock(&client->mutex), cleanup);
+        client->pixel_format.bpp = bpp;
+        client->pixel_format.is_big_endian = format.f.big_endian != 0;
+        client->pixel_format.red_max = ntohs(format.f.red_max);
+        client->pixel_format.green_max = ntohs(format.f.green_max);
+        client->pixel_format.blue_max = ntohs(format.f.blue_max);
+        client->pixel_format.red_shift = format.f.red_shift;
+        client->pixel_format.green_shift = format.f.green_shift;
+        client->pixel_format.blue_shift = format.f.blue_shift;
+        rfb_set_cpixel(client, format.f.depth);
+        // tiles which the client has are in the previous format
+        client->is_full_update = 1;
+        CALL(rfb_unlock(&client->mutex), cleanup);
+        return RFB_SET_PIXEL_FORMAT_LENGTH;
+    }
+    else if (type.message_type == RFBSetEncodings) {
+        if (length < RFB_SET_ENCODINGS_LENGTH)
+            return 0;
+        int count = rfb_get_uint16(message);
+        int message_length = RFB_SET_ENCODINGS_LENGTH + count * sizeof(int32_t);
+        if (message_length > RFB_READ_BUFFER_BYTES) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (length < message_length)
+            return 0;
+
+        // the first encoding of the list which the server supports is chosen, the raw one
+        // is supported by every client, ZRLE is the compressed fallback for clients without
+        // H264
+        int is_continuous = 0, is_fence = 0, chosen = RFBRaw, is_chosen = 0;
+        for (int i = 0; i < count; i++) {
+            int32_t encoding = rfb_get_uint32(data + RFB_SET_ENCODINGS_LENGTH +
+                i * sizeof(int32_t));
+            if (!is_chosen &&
+                (encoding == RFBEncodingH264 || encoding == RFBZRLE || encoding == RFBRaw)
+            ) {
+                chosen = encoding;
+                is_chosen = 1;
+            }
+            is_continuous |= encoding == RFBContinuousUpdatesPseudoEncoding;
+            is_fence |= encoding == RFBFencePseudoEncoding;
+        }
+        DEBUG("RFBSetEncodings message, encodings: %d, chosen: %d, continuous: %d, fence: %d",
+            count, chosen, is_continuous, is_fence);
+        CALL(rfb_set_encoding(client, chosen), cleanup);
+
+        // the client learns that the server supports continuous updates by the end of
+        // them and fences by the fence
+        CALL(rfb_lock(&client->mutex), cleanup);
+        int res = 0;
+        if (is_continuous) {
+            uint8_t end_message = RFBEndOfContinuousUpdates;
+            res = rfb_write_message(client, &end_message, sizeof(end_message));
+        }
+        if (res == 0 && is_fence && !client->is_fence) {
+            client->is_fence = 1;
+            res = rfb_request_fence(client);
+        }
+        CALL(rfb_unlock(&client->mutex), cleanup);
+        CALL(res, cleanup);
+        return message_length;
+    }
+    else if (type.message_type == RFBFramebufferUpdateRequest) {
+        if (length < RFB_UPDATE_REQUEST_LENGTH)
+            return 0;
+        DEBUG("Server received message: RFBFramebufferUpdateRequest, waiting for frame");
+        CALL(rfb_request_update(client, type.temp), cleanup);
+        return RFB_UPDATE_REQUEST_LENGTH;
+    }
+    else if (type.message_type == RFBEnableContinuousUpdates) {
+        if (length < RFB_ENABLE_CONTINUOUS_UPDATES_LENGTH)
+            return 0;
+        // the update covers the whole picture anyway
+        DEBUG("RFBEnableContinuousUpdates message: enable(%d), x(%d), y(%d), w(%d), h(%d)",
+            type.temp, rfb_get_uint16(message), rfb_get_uint16(message + 2),
+            rfb_get_uint16(message + 4), rfb_get_uint16(message + 6));
+        CALL(rfb_lock(&client->mutex), cleanup);
+        int res = 0;
+        client->is_continuous = type.temp != 0;
+        if (!client->is_continuous) {
+            // the client requests updates again after the end of continuous ones
+            uint8_t end_message = RFBEndOfContinuousUpdates;
+            client->is_requested = 0;
+            client->is_frame_requested = 0;
+            res = rfb_write_message(client, &end_message, sizeof(end_message));
+        }
+        CALL(rfb_unlock(&client->mutex), cleanup);
+        CALL(res, cleanup);
+        if (client->is_continuous)
+            CALL(rfb_request_update(client, 1), cleanup);
+        return RFB_ENABLE_CONTINUOUS_UPDATES_LENGTH;
+    }
+    else if (type.message_type == RFBClientFence) {
+        if (length < RFB_FENCE_LENGTH)
+            return 0;
+        uint32_t flags = rfb_get_uint32(data + 4);
+        int payload_length = data[8];
+        if (payload_length > RFB_FENCE_PAYLOAD_BYTES) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (length < RFB_FENCE_LENGTH + payload_length)
+            return 0;
+        const uint8_t *payload = data + RFB_FENCE_LENGTH;
+
+        if (flags & RFB_FENCE_REQUEST) {
+            // messages are handled in order, so the reply clears flags of synchronization
+            DEBUG("RFBClientFence message: flags(%X), length(%d)", flags, payload_length);
+            CALL(rfb_lock(&client->mutex), cleanup);
+            int res = rfb_write_fence(client, 0, payload, payload_length);
+            CALL(rfb_unlock(&client->mutex), cleanup);
+            CALL(res, cleanup);
+            return RFB_FENCE_LENGTH + payload_length;
+        }
+
+        // the reply to the fence which has followed the update
+        int64_t fence_ns = 0;
+        if (payload_length == sizeof(fence_ns))
+            memcpy(&fence_ns, payload, sizeof(fence_ns));
+        CALL(rfb_lock(&client->mutex), cleanup);
+        client->fences_count = MAX(client->fences_count - 1, 0);
+        int is_continuous = client->is_continuous;
+        CALL(rfb_unlock(&client->mutex), cleanup);
+        DEBUG("client[%d] fence round trip: %d ms", (int)(client - rfb.clients),
+            fence_ns > 0? (int)((rfb_get_time_ns() - fence_ns) / 1000000): -1);
+        if (is_continuous)
+            CALL(rfb_request_update(client, 1), cleanup);
+        return RFB_FENCE_LENGTH + payload_length;
+    }
+    else if (type.message_type == RFBKeyEvent) {
+        if (length < RFB_KEY_EVENT_LENGTH)
+            return 0;
+        DEBUG("RFBKeyEvent message: down(%X), key(%X)", type.temp, rfb_get_uint32(data + 4));
+        return RFB_KEY_EVENT_LENGTH;
+    }
+    else if (type.message_type == RFBPointerEvent) {
+        if (length < RFB_POINTER_EVENT_LENGTH)
+            return 0;
+        DEBUG("RFBPointerEvent message: buttons(%X), x(%d), y(%d)", type.temp,
+            rfb_get_uint16(message), rfb_get_uint16(message + 2));
+        return RFB_POINTER_EVENT_LENGTH;
+    }
+    else if (type.message_type == RFBClientCutText) {
+        if (length < RFB_CUT_TEXT_LENGTH)
+            return 0;
+        DEBUG("RFBClientCutText message.");
+        // the text can be longer than the buffer
+        client->skip_length = rfb_get_uint32(data + 4);
+        return RFB_CUT_TEXT_LENGTH;
+    }
+
+    // the length of the unknown message isn't known, so the stream can't be parsed further
+    ERROR("Unknown message %d", type.message_type);
+    errno = EPROTO;
+    return -1;
+
+cleanup:
+    return -1;
+}
+
+// receives bytes which the socket has and parses all complete messages of them
+static int rfb_read(struct rfb_client_t *client)
+{
+    int res = recv(client->socket, client->in + client->in_length,
+        RFB_READ_BUFFER_BYTES - client->in_length, 0);
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (res == -1)
+        return -1;
+    if (res == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    client->in_length += res;
+
+    int offset = 0;
+    while (offset < client->in_length) {
+        CALL(res = rfb_parse_message(client, client->in + offset, client->in_length - offset),
+            cleanup);
+        if (res == 0)
+            break;
+        offset += res;
+    }
+    client->in_length -= offset;
+    memmove(client->in, client->in + offset, client->in_length);
+    ASSERT_INT(client->in_length, <, RFB_READ_BUFFER_BYTES, cleanup);
+
+    // responses of the handshake and queued frames for the new request
+    return rfb_flush(client);
+
+cleanup:
+    return -1;
+}
+
+// connections get free slots until the server socket doesn't have more of them
+static int rfb_accept_clients()
+{
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addres_len = sizeof(client_addr);
+        int client_socket = accept(
+            rfb.server_socket,
+            (struct sockaddr *)&client_addr,
+            &addres_len);
+        if (client_socket == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        CALL(client_socket, cleanup);
+
+        int i = 0;
+        while (i < RFB_MAX_CLIENTS && rfb.clients[i].is_used)
+            i++;
+        if (i == RFB_MAX_CLIENTS) {
+            DEBUG("The connection is refused, clients: %d", RFB_MAX_CLIENTS);
+            CALL(close(client_socket), cleanup);
+            continue;
+        }
+
+        struct rfb_client_t *client = rfb.clients + i;
+        CALL(rfb_lock(&client->mutex), close_socket);
+        client->is_requested = 0;
+        client->is_frame_requested = 0;
+        client->slices_count = 0;
+        client->slice_index = 0;
+        client->frames_count = 0;
+        client->is_idr_waiting = 1;
+        client->is_key_frame_requested = 0;
+        client->is_continuous = 0;
+        client->is_fence = 0;
+        client->fences_count = 0;
+        client->messages_length = 0;
+        client->is_backlog_reference = 0;
+        // the client gets the stream of the encoder until it sets encodings
+        client->encoding = RFBEncodingH264;
+        client->pixel_format = rfb_pixel_format;
+        rfb_set_cpixel(client, 16);
+        client->is_full_update = 1;
+        CALL(rfb_unlock(&client->mutex), close_socket);
+        client->state = RFBClientVersion;
+        client->in_length = 0;
+        client->skip_length = 0;
+        client->is_out_polled = 0;
+        client->is_update = 0;
+        client->update_rects = 0;
+        client->bitrate = 0;
+        client->rate_frames = 0;
+        client->sent_ns = 0;
+
+        const int one = 1;
+        CALL(setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one)),
+            close_socket);
+        // the socket doesn't take more than the uplink sends soon, so the rest of the stream
+        // stays in the queue of the client where stale frames can be dropped
+        const int lowat = RFB_NOTSENT_LOWAT_BYTES;
+        CALL(setsockopt(client_socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)),
+            close_socket);
+        CALL(fcntl(client_socket, F_SETFL, O_NONBLOCK), close_socket);
+        // payloads of frames are sent without the copy if the kernel supports it
+        client->is_zerocopy = setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &one,
+            sizeof(one)) == 0;
+        client->zerocopy_id = 0;
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.u32 = i
+        };
+        CALL(epoll_ctl(rfb.epoll_fd, EPOLL_CTL_ADD, client_socket, &event), close_socket);
+
+        CALL(rfb_lock(&rfb.mutex), close_socket);
+        client->socket = client_socket;
+        client->is_used = 1;
+        CALL(rfb_unlock(&rfb.mutex), cleanup);
+        DEBUG("client[%d] has been connected", i);
+
+        char server_rfb_version[RFB_VERSION_LENGTH + 1];
+        strcpy(server_rfb_version, "RFB 003.008\n");
+        if (rfb_write_out(client, server_rfb_version, RFB_VERSION_LENGTH) == -1 ||
+            rfb_flush(client) == -1
+        ) {
+            rfb_close_client(client);
+        }
+        continue;
+
+close_socket:
+        close(client_socket);
+        goto cleanup;
+    }
+
+cleanup:
+    return -1;
+}
+
+// sends rectangles which the output has queued for clients
+static int rfb_send_clients()
+{
+    uint64_t value;
+    CALL(read(rfb.event_fd, &value, sizeof(value)), cleanup);
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (client->is_streaming && rfb_flush(client) == -1)
+            rfb_close_client(client);
+    }
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// serves all connections by events of their non-blocking sockets
+static void *rfb_function(void *data)
+{
+    struct epoll_event events[RFB_EPOLL_EVENTS];
+    DEBUG("Waiting for clients connection to port: %d", app.port);
+    while (!is_aborted && !rfb.is_stopping) {
+        int count = epoll_wait(rfb.epoll_fd, events, RFB_EPOLL_EVENTS, -1);
+        if (count == -1 && errno == EINTR)
+            continue;
+        CALL(count, fatal_error);
+
+        for (int i = 0; i < count; i++) {
+            uint32_t index = events[i].data.u32;
+            if (index == RFB_EVENT_SERVER) {
+                CALL(rfb_accept_clients(), fatal_error);
+                continue;
+            }
+            if (index == RFB_EVENT_WAKE) {
+                CALL(rfb_send_clients(), fatal_error);
+                continue;
+            }
+
+            // the slot can be closed by the previous event
+            struct rfb_client_t *client = rfb.clients + index;
+            if (!client->is_used)
+                continue;
+            int res = 0;
+            if (events[i].events & EPOLLHUP) {
+                errno = ECONNRESET;
+                res = -1;
+            }
+            else if (events[i].events & EPOLLERR) {
+                // the error queue has notifications of MSG_ZEROCOPY or the connection fails
+                CALL(res = rfb_complete_zerocopy(client));
+                if (res == 0) {
+                    errno = ECONNRESET;
+                    res = -1;
+                }
+                else if (res > 0)
+                    res = 0;
+            }
+            if (res == 0 && (events[i].events & EPOLLIN))
+                res = rfb_read(client);
+            if (res == 0 && (events[i].events & EPOLLOUT))
+                res = rfb_flush(client);
+            if (res == -1)
+                rfb_close_client(client);
+        }
+    }
+
+fatal_error:
+    return NULL;
+}
+
+static int rfb_init()
+{
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        memset(client, 0, sizeof(*client));
+        client->socket = -1;
+        client->mutex_res = -1;
+    }
+
+    rfb.mutex_res = pthread_mutex_init(&rfb.mutex, NULL);
+    if (rfb.mutex_res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_init(&rfb.mutex, NULL), rfb.mutex_res);
+        goto cleanup;
+    }
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        client->mutex_res = pthread_mutex_init(&client->mutex, NULL);
+        if (client->mutex_res) {
+            CALL_CUSTOM_MESSAGE(pthread_mutex_init(&client->mutex, NULL), client->mutex_res);
+            goto cleanup;
+        }
+    }
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+static int rfb_start()
+{
+    DEBUG("Port to listen: %d", app.port);
+
+    ASSERT_INT(rfb.server_socket, ==, -1, cleanup);
+
+    CALL(rfb.server_socket = socket(AF_INET, SOCK_STREAM, 0), cleanup);
+    CALL(fcntl(rfb.server_socket, F_SETFL, O_NONBLOCK), cleanup);
+
+    const int one = 1;
+    CALL(setsockopt(
+        rfb.server_socket,
+        SOL_SOCKET,
+        SO_REUSEADDR,
+        (char *)&one,
+        sizeof(one)
+    ), cleanup);
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(app.port);
+    serv_addr.sin_family = AF_INET;
+    CALL(bind(rfb.server_socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)), cleanup);
+    CALL(listen(rfb.server_socket, RFB_MAX_CLIENTS), cleanup);
+
+    CALL(rfb.epoll_fd = epoll_create1(0), cleanup);
+    CALL(rfb.event_fd = eventfd(0, EFD_NONBLOCK), cleanup);
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u32 = RFB_EVENT_SERVER
+    };
+    CALL(epoll_ctl(rfb.epoll_fd, EPOLL_CTL_ADD, rfb.server_socket, &event), cleanup);
+    event.data.u32 = RFB_EVENT_WAKE;
+    CALL(epoll_ctl(rfb.epoll_fd, EPOLL_CTL_ADD, rfb.event_fd, &event), cleanup);
+
+    rfb.is_stopping = 0;
+    rfb.thread_res = pthread_create(&rfb.thread, NULL, rfb_function, NULL);
+    if (rfb.thread_res) {
+        CALL_CUSTOM_MESSAGE(pthread_create, rfb.thread_res);
+        goto cleanup;
+    }
+
+    DEBUG("output[%s] has been started", rfb.output->name);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+// clients which don't get the stream of the encoder get tiles of the picture
+static int rfb_is_tiled(struct rfb_client_t *client)
+{
+    return client->encoding != RFBEncodingH264;
+}
+
+// the client with continuous updates gets frames until it falls behind by fences
+static int rfb_is_paced(struct rfb_client_t *client)
+{
+    return !client->is_continuous || !client->is_fence ||
+        client->fences_count < RFB_CONTINUOUS_FENCES;
+}
+
+// the frame is captured if any client of the output waits for it, it's queued for other
+// clients too, so all of them decode the same stream
+static int rfb_take_requests(int is_tiled)
+{
+    int is_ready = 0;
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->is_streaming || rfb_is_tiled(client) != is_tiled)
+            continue;
+
+        // the frame is skipped for the client until the uplink drains the socket, the
+        // request is kept
+        if (client->bitrate > 0) {
+            int queued = 0;
+            int queue_ms = rfb_get_queue_ms(client, &queued);
+            if (queue_ms == -1)
+                goto unlock;
+            if (queue_ms > RFB_QUEUE_SKIP_MS)
+                continue;
+        }
+
+        // the frame isn't captured until the socket takes the previous update, so it doesn't
+        // get stale in the queue
+        CALL(rfb_lock(&client->mutex), unlock);
+        if (client->announced == 0) {
+            // the client with continuous updates waits for every frame after the previous
+            // one, there is no request which would be kept for it
+            int is_streamed = client->is_continuous && client->is_requested &&
+                client->backlog_rects == 0 && client->slice_index == client->slices_count &&
+                rfb_is_paced(client);
+            is_ready |= client->is_frame_requested || is_streamed;
+            client->is_frame_requested = 0;
+        }
+        CALL(rfb_unlock(&client->mutex), unlock);
+    }
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    return is_ready;
+
+unlock:
+    rfb_unlock(&rfb.mutex);
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+static int rfb_is_ready()
+{
+    return rfb_take_requests(0);
+}
+
+static int rfb_is_idle()
+{
+    return rfb_consume_idle(&rfb.is_idle);
+}
+
+static int rfb_process_slice(struct frame_slice_t *slice)
+{
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    int types = 0, is_reference = 0;
+    if (slice->index == 0) {
+        types = rfb_parse_nals(slice->data, slice->length, &is_reference);
+        rfb.is_sliced = 1;
+        rfb.slice_sequence = slice->frame->sequence;
+    }
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->is_streaming || client->encoding != RFBEncodingH264)
+            continue;
+        CALL(rfb_lock(&client->mutex), unlock);
+        int res = rfb_queue_slice(client, slice, types, is_reference);
+        CALL(rfb_unlock(&client->mutex), unlock);
+        CALL(res, unlock);
+    }
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    CALL(rfb_wake(), cleanup);
+    return 0;
+
+unlock:
+    rfb_unlock(&rfb.mutex);
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+static int rfb_queue_clients(struct frame_t *frame)
+{
+    int types = 0, is_reference = 0;
+    // the frame has been streamed by slices already, the next frame can be streamed before
+    // the pipeline passes the previous one to the output
+    int is_sliced = rfb.is_sliced && (int32_t)(frame->sequence - rfb.slice_sequence) <= 0;
+    if (!is_sliced) {
+        for (int i = 0; i < frame->planes_count; i++)
+            types |= rfb_parse_nals(frame->planes[i], frame->strides[i], &is_reference);
+        uint8_t *buffer = frame->planes[0];
+        DEBUG("Bytes to send: %d, %x %x %x %x ...",
+            frame->length,
+            buffer[0],
+            buffer[1],
+            buffer[2],
+            buffer[3]);
+    }
+
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->is_streaming || client->encoding != RFBEncodingH264)
+            continue;
+        CALL(rfb_lock(&client->mutex), cleanup);
+        int res = 0;
+        // the encoder could have passed not all slices of the streamed frame
+        if (!is_sliced)
+            res = rfb_queue_frame(client, frame, types, is_reference);
+        else if (client->sequence == frame->sequence)
+            res = rfb_finish_frame(client);
+        CALL(rfb_unlock(&client->mutex), cleanup);
+        CALL(res, cleanup);
+    }
+    CALL(rfb_wake(), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// clients of the output which wait for the frame keep their requests until the buffer
+// is received
+static int rfb_keep_requests(int is_tiled)
+{
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->is_streaming || rfb_is_tiled(client) != is_tiled)
+            continue;
+        CALL(rfb_lock(&client->mutex), cleanup);
+        client->is_frame_requested = client->is_requested && client->backlog_rects == 0 &&
+            client->slice_index == client->slices_count && rfb_is_paced(client);
+        CALL(rfb_unlock(&client->mutex), cleanup);
+    }
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+static int rfb_process_frame(struct frame_t *frame)
+{
+    // ----- fps
+    static int frame_count = 0;
+    static struct timespec t1;
+    struct timespec t2;
+    if (frame_count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    float d = (t2.tv_sec + t2.tv_nsec / 1000000000.0) - (t1.tv_sec + t1.tv_nsec / 1000000000.0);
+    if (d > 0) {
+        app.rfb_fps = frame_count / d;
+    } else {
+        app.rfb_fps = frame_count;
+    }
+    frame_count++;
+    // -----
+
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    int res = 0;
+    if (frame && frame->length != 0)
+        res = rfb_queue_clients(frame);
+    else {
+        DEBUG("Keep the request until buffer is received");
+        res = rfb_keep_requests(0);
+    }
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    CALL(res, cleanup);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+// tiles of the frame which differ from the picture are copied to it, the picture of
+// the new size is copied completely
+static int rfb_raw_compare(struct frame_t *frame)
+{
+    struct frame_t *picture = &rfb.raw_picture;
+    int tiles_x = (frame->width + RFB_TILE_SIZE - 1) / RFB_TILE_SIZE;
+    int tiles_y = (frame->height + RFB_TILE_SIZE - 1) / RFB_TILE_SIZE;
+    if (picture->width != frame->width || picture->height != frame->height) {
+        int length = frame->width * frame->height * 2;
+        uint8_t *data = realloc(picture->planes[0], length);
+        if (data == NULL) {
+            CALL_MESSAGE(realloc(picture->planes[0], length));
+            goto cleanup;
+        }
+        picture->planes[0] = data;
+        frame_set_planes(picture, VIDEO_FORMAT_YUYV, frame->width, frame->height);
+
+        uint8_t *tiles = realloc(rfb.raw_tiles, tiles_x * tiles_y);
+        if (tiles == NULL) {
+            CALL_MESSAGE(realloc(rfb.raw_tiles, tiles_x * tiles_y));
+            goto cleanup;
+        }
+        rfb.raw_tiles = tiles;
+        rfb.raw_tiles_count = tiles_x * tiles_y;
+        memset(rfb.raw_tiles, 1, rfb.raw_tiles_count);
+        return frame_copy_planes(picture, frame);
+    }
+
+    CALL(yuv_kernels_compare(picture, frame, RFB_TILE_SIZE, RFB_TILE_THRESHOLD, rfb.raw_tiles),
+        cleanup);
+    for (int t = 0; t < rfb.raw_tiles_count; t++) {
+        if (!rfb.raw_tiles[t])
+            continue;
+        int x = t % tiles_x * RFB_TILE_SIZE;
+        int y = t / tiles_x * RFB_TILE_SIZE;
+        int length = (MIN(x + RFB_TILE_SIZE, frame->width) - x) << 1;
+        for (int row = y; row < MIN(y + RFB_TILE_SIZE, frame->height); row++)
+            memcpy(picture->planes[0] + picture->strides[0] * row + (x << 1),
+                frame->planes[0] + frame->strides[0] * row + (x << 1), length);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = ENOMEM;
+    return -1;
+}
+
+static int rfb_raw_queue_clients(struct frame_t *frame)
+{
+    ASSERT_INT(frame->format, ==, VIDEO_FORMAT_YUYV, cleanup);
+    CALL(rfb_raw_compare(frame), cleanup);
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->is_streaming || !rfb_is_tiled(client))
+            continue;
+        CALL(rfb_lock(&client->mutex), cleanup);
+        int res = rfb_queue_tiles(client);
+        CALL(rfb_unlock(&client->mutex), cleanup);
+        CALL(res, cleanup);
+    }
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+static int rfb_raw_init()
+{
+    memset(&rfb.raw_picture, 0, sizeof(rfb.raw_picture));
+    return 0;
+}
+
+static int rfb_raw_is_ready()
+{
+    return rfb_take_requests(1);
+}
+
+static int rfb_raw_is_idle()
+{
+    return rfb_consume_idle(&rfb.is_raw_idle);
+}
+
+// the frame is captured for raw clients which wait for the update, the client which hasn't
+// got tiles because they haven't changed keeps the request
+static int rfb_raw_process_frame(struct frame_t *frame)
+{
+    CALL(rfb_lock(&rfb.mutex), cleanup);
+    int res = 0;
+    if (frame)
+        res = rfb_raw_queue_clients(frame);
+    if (res == 0)
+        res = rfb_keep_requests(1);
+    CALL(rfb_unlock(&rfb.mutex), cleanup);
+    CALL(res, cleanup);
+    CALL(rfb_wake(), cleanup);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+static int rfb_stop()
+{
+    // the thread of connections is woken up to leave the loop
+    if (!rfb.thread_res) {
+        rfb.is_stopping = 1;
+        CALL(rfb_wake(), stop_error);
+        int res = pthread_join(rfb.thread, NULL);
+        if (res != 0) {
+            CALL_CUSTOM_MESSAGE(pthread_join, res);
+            goto stop_error;
+        }
+        else
+            rfb.thread_res = -1;
+    }
+
+    CALL(rfb_lock(&rfb.mutex), stop_error);
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->is_used)
+            continue;
+        client->is_streaming = 0;
+        client->is_used = 0;
+        CALL(close(client->socket));
+        client->socket = -1;
+    }
+    rfb.clients_count = 0;
+    CALL(rfb_unlock(&rfb.mutex), stop_error);
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++)
+        CALL(rfb_release_client(rfb.clients + i), stop_error);
+
+    if (rfb.event_fd != -1) {
+        CALL(close(rfb.event_fd), stop_error);
+        rfb.event_fd = -1;
+    }
+    if (rfb.epoll_fd != -1) {
+        CALL(close(rfb.epoll_fd), stop_error);
+        rfb.epoll_fd = -1;
+    }
+    if (rfb.server_socket != -1) {
+        CALL(close(rfb.server_socket), stop_error);
+        rfb.server_socket = -1;
+    }
+    return 0;
+
+stop_error:
+    errno = EAGAIN;
+    return -1;
+}
+
+static void rfb_cleanup()
+{
+    rfb_stop();
+
+    // clients are reset by rfb_init before the mutex of the server is created
+    for (int i = 0; i < RFB_MAX_CLIENTS && !rfb.mutex_res; i++) {
+        struct rfb_client_t *client = rfb.clients + i;
+        if (!client->mutex_res) {
+            int res = pthread_mutex_destroy(&client->mutex);
+            if (res)
+                CALL_CUSTOM_MESSAGE(pthread_mutex_destroy(&client->mutex), res);
+            client->mutex_res = -1;
+        }
+        kv_destroy(client->segments);
+        kv_init(client->segments);
+        kv_destroy(client->zerocopies);
+        kv_init(client->zerocopies);
+        free(client->queue);
+        client->queue = NULL;
+        client->queue_size = 0;
+        free(client->tiles);
+        client->tiles = NULL;
+        client->tiles_count = 0;
+    }
+
+    if (!rfb.mutex_res) {
+        int res = pthread_mutex_destroy(&rfb.mutex);
+        if (res)
+            CALL_CUSTOM_MESSAGE(pthread_mutex_destroy(&rfb.mutex), res);
+        rfb.mutex_res = -1;
+    }
+}
+
+static void rfb_raw_cleanup()
+{
+    free(rfb.raw_picture.planes[0]);
+    memset(&rfb.raw_picture, 0, sizeof(rfb.raw_picture));
+    free(rfb.raw_tiles);
+    rfb.raw_tiles = NULL;
+    rfb.raw_tiles_count = 0;
+    free(rfb.zrle_pixels);
+    rfb.zrle_pixels = NULL;
+    rfb.zrle_pixels_size = 0;
+    free(rfb.zrle_data);
+    rfb.zrle_data = NULL;
+    rfb.zrle_data_size = 0;
+}
+
+static int rfb_get_formats(const struct format_mapping_t *formats[])
+{
+    if (formats != NULL)
+        *formats = rfb_formats;
+    return ARRAY_SIZE(rfb_formats);
+}
+
+static int rfb_raw_get_formats(const struct format_mapping_t *formats[])
+{
+    if (formats != NULL)
+        *formats = rfb_raw_formats;
+    return ARRAY_SIZE(rfb_raw_formats);
+}
+
+void rfb_construct(struct app_state_t *app)
+{
+    int i = 0;
+    while (i < MAX_OUTPUTS && outputs[i].context != NULL)
+        i++;
+
+    if (i != MAX_OUTPUTS) {
+        rfb.output = outputs + i;
+        outputs[i].name = "rfb";
+        outputs[i].context = &rfb;
+        outputs[i].init = rfb_init;
+        outputs[i].start = rfb_start;
+        outputs[i].is_started = rfb_is_started;
+        outputs[i].is_ready = rfb_is_ready;
+        outputs[i].is_idle = rfb_is_idle;
+        outputs[i].process_frame = rfb_process_frame;
+        outputs[i].process_slice = rfb_process_slice;
+        outputs[i].stop = rfb_stop;
+        outputs[i].get_formats = rfb_get_formats;
+        outputs[i].cleanup = rfb_cleanup;
+        i++;
+    }
+
+    // raw clients are served by the same server from the picture of the camera
+    if (i < MAX_OUTPUTS) {
+        rfb.raw_output = outputs + i;
+        outputs[i].name = "rfb_raw";
+        outputs[i].context = &rfb;
+        outputs[i].init = rfb_raw_init;
+        outputs[i].start = rfb_start;
+        outputs[i].is_started = rfb_is_started;
+        outputs[i].is_ready = rfb_raw_is_ready;
+        outputs[i].is_idle = rfb_raw_is_idle;
+        outputs[i].process_frame = rfb_raw_process_frame;
+        outputs[i].stop = rfb_stop;
+        outputs[i].get_formats = rfb_raw_get_formats;
+        outputs[i].cleanup = rfb_raw_cleanup;
     }
 }
@@ -1,29 +1,210 @@
 #ifndef rfb_h
 #define rfb_h
 
-// doesn't show error if rfb is closed but thread is still running
-#define RFB_FUNC_CALL(call, error) \
-{ \
-    int __res = call; \
-    if (__res == -1 && (errno == 9 || errno == 104) ) { \
-        goto error; \
-    } \
-    if (__res == -1) { \
-        CALL_MESSAGE(call); \
-        goto error; \
-    } \
-}
+#include <zlib.h>
+
+// the buffer of the cached SPS or PPS with the start code
+#define RFB_PARAMETER_SET_BYTES 256
+
+// clients which watch the stream at the same time, frames are encoded once for all of them
+#define RFB_MAX_CLIENTS 8
+// frames which are queued for the client until it requests the update, the client which
+// falls further behind drops frames until the next IDR frame
+#define RFB_CLIENT_FRAMES 4
+
+// the bitrate goes down if the uplink doesn't keep up: previous updates are still queued
+// by the socket, the write queue of the client doesn't drain or the update takes longer
+// than the round trip to reach the client, it goes up after frames without that, frames
+// are skipped until the long queue drains
+#define RFB_QUEUE_HIGH_MS 100
+#define RFB_QUEUE_LOW_MS 20
+#define RFB_QUEUE_SKIP_MS 300
+#define RFB_SEND_HIGH_MS 30
+#define RFB_TRANSFER_HIGH_MS 50
+#define RFB_TRANSFER_LOW_MS 15
+#define RFB_BITRATE_MIN 100
+#define RFB_RATE_STABLE_FRAMES 30
+// frames for the encoder to follow the lower bitrate before it's lowered again
+#define RFB_RATE_HOLD_FRAMES 5
+
+// messages of the client are parsed when the buffer has them completely, the longest one
+// is SetEncodings, the text of ClientCutText is skipped
+#define RFB_READ_BUFFER_BYTES 4096
+#define RFB_EPOLL_EVENTS 16
+// segments which are gathered by one sendmsg(), payloads from this size go by MSG_ZEROCOPY,
+// smaller ones are cheaper to copy than to pin
+#define RFB_IOV_COUNT 64
+#define RFB_ZEROCOPY_BYTES 32768
+
+// unsent bytes which the socket takes, the rest waits in the queue of the client
+#define RFB_NOTSENT_LOWAT_BYTES 16384
+
+// messages of the server which wait for the end of the update, they can't go between its
+// rectangles
+#define RFB_MESSAGE_BYTES 256
+// updates which the client with continuous updates hasn't confirmed by fences yet, frames
+// aren't captured for it until it confirms them
+#define RFB_CONTINUOUS_FENCES 2
+
+// raw clients get tiles of the picture which have changed since their last update, smaller
+// differences of samples are the noise of the sensor
+#define RFB_TILE_SIZE 16
+#define RFB_TILE_THRESHOLD 6
+
+// ZRLE clients get changed tiles of its own size, which are sent as solid, palette or raw ones,
+// the fastest level of zlib keeps the cost of the frame predictable, the compressed rectangle
+// grows by chunks
+#define RFB_ZRLE_TILE_SIZE 64
+#define RFB_ZRLE_PALETTE_SIZE 16
+#define RFB_ZLIB_LEVEL Z_BEST_SPEED
+#define RFB_ZLIB_CHUNK_BYTES 16384
+
+enum rfb_client_state_enum {
+    RFBClientVersion,
+    RFBClientSecurity,
+    RFBClientInit,
+    RFBClientMessages
+};
+
+// the part of the stream for the client, the payload of the frame is referenced until
+// it's sent, other bytes are in the queue of the client
+struct rfb_segment_t {
+    struct frame_t *frame;
+    const uint8_t *data;
+    int offset;                     // of bytes in the queue
+    int length;
+};
+
+// the frame which the kernel sends by MSG_ZEROCOPY
+struct rfb_zerocopy_t {
+    uint32_t id;                    // of the sendmsg() call
+    struct frame_t *frame;
+};
+
+struct rfb_client_t {
+    int is_used;                    // the slot is taken by the connection
+    int is_streaming;               // the handshake is done, frames are queued for the client
+    int socket;
+    int state;
+
+    // bytes which have been received, but don't make the whole message yet
+    uint8_t in[RFB_READ_BUFFER_BYTES];
+    int in_length;
+    int skip_length;
+
+    // the output queues rectangles of frames, announced segments are sent when the socket
+    // takes more, the rest waits until the client requests the update
+    pthread_mutex_t mutex;
+    int mutex_res;
+    int is_requested;               // the client waits for the update
+    int is_frame_requested;         // the frame hasn't been captured for the request yet
+    uint8_t *queue;
+    int queue_length;
+    int queue_size;
+    kvec_t(struct rfb_segment_t) segments;
+    int segment_offset;             // bytes of the first segment which have been sent
+    int announced;                  // segments of updates which the client expects
+    int backlog_rects;              // rectangles which wait for the next update
+    int is_backlog_reference;       // they have the reference frame
+    int is_out_polled;              // the socket is polled for EPOLLOUT
+    // the frame which is being queued by slices
+    uint32_t sequence;
+    int slices_count;
+    int slice_index;
+    int frames_count;               // frames which haven't been requested yet
+
+    // the update which is being sent
+    int is_update;
+    int update_rects;               // rectangles which haven't been queued yet
+    int update_length;
+    int64_t update_ns;              // when the last rectangle has been queued
+
+    // the client gets updates without requests, the fence after every update tells when
+    // it has received the update
+    int is_continuous;
+    int is_fence;                   // the client replies to fences
+    int fences_count;               // fences which haven't been replied yet
+    uint8_t messages[RFB_MESSAGE_BYTES];
+    int messages_length;
+
+    // frames which the kernel sends without the copy
+    int is_zerocopy;
+    uint32_t zerocopy_id;
+    kvec_t(struct rfb_zerocopy_t) zerocopies;
+
+    // the new client can't decode frames until the IDR frame, which is requested from the
+    // encoder
+    int is_idr_waiting;
+    int is_key_frame_requested;
+
+    // the client gets the stream of the encoder or tiles in its pixel format, which are raw
+    // or compressed by ZRLE
+    int encoding;
+    struct yuv_rgb_format_t pixel_format;
+    int is_full_update;             // all tiles go by the next update
+    uint8_t *tiles;                 // tiles which have changed since the last update
+    int tiles_count;
+    // ZRLE rectangles are compressed by one stream for the whole connection, pixels are sent
+    // by their bytes which have components
+    z_stream zlib;
+    int is_zlib;                    // the stream has been initialized
+    int cpixel_offset;
+    int cpixel_bytes;
+
+    // kbit/s which the uplink of the client can take
+    int bitrate;
+    int rate_frames;
+    int64_t sent_ns;                // when the last update has been sent
+    int64_t request_ns;             // when the client has requested the next one
+};
 
 struct rfb_state_t {
     struct output_t *output;
 
+    // connections are served by one thread which waits for events of sockets, the output
+    // wakes it up by the event descriptor
     pthread_t thread;
     int thread_res;
     int server_socket;
+    int epoll_fd;
+    int event_fd;
+    volatile int is_stopping;
+
+    // the table of clients and the stream which is shared by them
+    pthread_mutex_t mutex;
+    int mutex_res;
+    struct rfb_client_t clients[RFB_MAX_CLIENTS];
+    int clients_count;
+    // the last client has left, outputs report it to the application on the thread which
+    // captures frames
+    int is_idle;
+    int is_raw_idle;
+
+    // the frame which has been streamed by slices
+    int is_sliced;
+    uint32_t slice_sequence;
+
+    // parameter sets of the stream are cached for clients which start from the IDR frame
+    // without them
+    uint8_t sps[RFB_PARAMETER_SET_BYTES];
+    int sps_length;
+    uint8_t pps[RFB_PARAMETER_SET_BYTES];
+    int pps_length;
+
+    // kbit/s of the encoder which follows the slowest client
+    int bitrate;
 
-    int client_socket;
-    sem_t client_semaphore;
-    int client_semaphore_res;
+    // the output of raw clients keeps the picture which they are sent, tiles of the frame
+    // which differ from it are copied to it
+    struct output_t *raw_output;
+    struct frame_t raw_picture;
+    uint8_t *raw_tiles;
+    int raw_tiles_count;
+    // pixels of the ZRLE rectangle and its tiles before the compression
+    uint8_t *zrle_pixels;
+    int zrle_pixels_size;
+    uint8_t *zrle_data;
+    int zrle_data_size;
 };
 
 void rfb_construct();
@@ -20,6 +20,7 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 
 #include "sdl.h"
 
@@ -41,8 +42,6 @@ struct sdl_state_t sdl = {
 };
 
 extern struct app_state_t app;
-extern struct input_t input;
-extern struct filter_t filters[MAX_FILTERS];
 extern struct output_t outputs[MAX_OUTPUTS];
 extern int is_abort;
 
@@ -226,38 +225,21 @@ cleanup:
     return -1;
 }
 
-static int sdl_process_frame()
+static int sdl_process_frame(struct frame_t *frame)
 {
-    int res = 0;
-    struct output_t *output = sdl.output;
-    if (!output->is_started()) CALL(output->start(), cleanup);
-    int in_format = output->start_format;
-    int out_format = output->start_format;
-    if (!input.is_started()) CALL(input.start(in_format), cleanup);
-    CALL(res = input.process_frame(), cleanup);
-    uint8_t *buffer = input.get_buffer(NULL, NULL);
-    for (int k = 0; k < MAX_FILTERS && output->filters[k].out_format; k++) {
-        struct filter_t *filter = filters + output->filters[k].index;
-        in_format = out_format;
-        out_format = output->filters[k].out_format;
-        if (!filter->is_started) CALL(filter->start(in_format, out_format), cleanup);
-        CALL(filter->process_frame(buffer), cleanup);
-        buffer = filter->get_buffer(NULL, NULL, NULL);
+    if (!frame)
+        return 0;
+
+    int w = frame->width;
+    int h = frame->height;
+    for (int y = 0; y < h; y++) {
+        uint8_t *buffer = frame->planes[0] + frame->strides[0] * y;
+        uint8_t *rgb = sdl.buffer + y * w * 3;
+        for (int x = 0; x < w; x += 2)
+            yuv422_to_rgb(buffer + (x << 1), rgb + x * 3);
     }
-    int w = app.video_width;
-    int h = app.video_height;
-    int size = w * h;
-    for (int i = 0; i < size; i += w)
-        for (int x = 0; x < w; x += 2) {
-            int  j = i + x;
-            yuv422_to_rgb(buffer + (j << 1), sdl.buffer + j + (j << 1));
-        }
 
     return sdl_render();
-
-cleanup:
-    if (!errno) errno = EAGAIN;
-    return -1;
 }
 
 static int sdl_get_formats(const struct format_mapping_t *formats[])
@@ -19,13 +19,17 @@
 #include "khash.h"
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 #include "app.h"
+#include "yuv_kernels.h"
+#include "bands.h"
 #include "v4l.h"
 #include "v4l_encoder.h"
 #include "test.h"
 
 #include <stdarg.h> //va_list
 #include <setjmp.h> //jmp_buf
+#include <pthread.h> //pthread_mutex_t
 #include <cmocka.h>
 
 #include "linux/videodev2.h"
@@ -36,11 +40,12 @@ KHASH_T(argvs_hash_t) *h;
 int is_aborted = 0;
 int wrap_verbose = 0;
 int test_verbose = 0;
+int input_frames = 0;
 
 struct app_state_t app;
 
 struct input_t input;
-struct filter_t filters[MAX_FILTERS];
+filters_t filters;
 struct output_t outputs[MAX_OUTPUTS];
 struct extension_t extensions[MAX_EXTENSIONS];
 
@@ -67,32 +72,1001 @@ static void test_utils_init(void **state)
     app_cleanup();
 }
 
+static int test_released = 0;
+static int test_frame_release(struct frame_t *frame)
+{
+    test_released++;
+    return 0;
+}
+
+static void test_frame_pool(void **state)
+{
+    struct frame_pool_t pool = { .frames = NULL, .frames_count = 0, .data = NULL };
+    assert_int_equal(frame_pool_init(&pool, 2, 64), 0);
+    pool.release = test_frame_release;
+    test_released = 0;
+
+    struct frame_t *f1 = frame_pool_get(&pool);
+    struct frame_t *f2 = frame_pool_get(&pool);
+    assert_ptr_not_equal(f1, NULL);
+    assert_ptr_not_equal(f2, NULL);
+    assert_ptr_not_equal(f1->planes[0], f2->planes[0]);
+    // all frames are referenced
+    assert_ptr_equal(frame_pool_get(&pool), NULL);
+    assert_int_equal(errno, ENOBUFS);
+
+    // the frame returns to the pool only after the last reference is dropped
+    frame_ref(f1);
+    assert_int_equal(frame_unref(f1), 0);
+    assert_int_equal(test_released, 0);
+    assert_ptr_equal(frame_pool_get(&pool), NULL);
+    assert_int_equal(frame_unref(f1), 0);
+    assert_int_equal(test_released, 1);
+    assert_ptr_equal(frame_pool_get(&pool), f1);
+    assert_ptr_equal(frame_pool_get_index(&pool, f2->index), NULL);
+
+    assert_int_equal(frame_unref(f1), 0);
+    assert_int_equal(frame_unref(f2), 0);
+    assert_int_equal(test_released, 3);
+    frame_pool_cleanup(&pool);
+
+    // the memory of the pool which is cleaned up stays until the last frame is released,
+    // the frame doesn't go back to the producer
+    assert_int_equal(frame_pool_init(&pool, 2, 64), 0);
+    struct frame_t *f3 = frame_pool_get(&pool);
+    frame_pool_cleanup(&pool);
+    assert_ptr_equal(pool.frames, NULL);
+    assert_ptr_equal(pool.data, NULL);
+    assert_int_equal(f3->pool->is_orphan, 1);
+    memset(f3->planes[0], 0x5a, 64);
+    assert_int_equal(frame_unref(f3), 0);
+    assert_int_equal(test_released, 3);
+}
+
+static struct format_mapping_t test_yuyv_formats[] = {
+    { .format = VIDEO_FORMAT_YUYV, .internal_format = VIDEO_FORMAT_YUYV, .is_supported = 1 }
+};
+static struct format_mapping_t test_yuv444_formats[] = {
+    { .format = VIDEO_FORMAT_YUV444, .internal_format = VIDEO_FORMAT_YUV444, .is_supported = 1 }
+};
+static struct format_mapping_t test_h264_formats[] = {
+    { .format = VIDEO_FORMAT_H264, .internal_format = VIDEO_FORMAT_H264, .is_supported = 1 }
+};
+
+static int test_filter_init() { return 0; }
+static void test_filter_cleanup() { }
+static int test_filter_is_started() { return 0; }
+static int test_filter_cost(int in_format, int out_format) { return 1; }
+static int test_yuyv_formats_get(const struct format_mapping_t *formats[])
+{
+    *formats = test_yuyv_formats;
+    return ARRAY_SIZE(test_yuyv_formats);
+}
+static int test_yuv444_formats_get(const struct format_mapping_t *formats[])
+{
+    *formats = test_yuv444_formats;
+    return ARRAY_SIZE(test_yuv444_formats);
+}
+static int test_h264_formats_get(const struct format_mapping_t *formats[])
+{
+    *formats = test_h264_formats;
+    return ARRAY_SIZE(test_h264_formats);
+}
+
+static void test_find_path(void **state)
+{
+    int res = 0;
+    int filters_len = kv_size(filters);
+    struct filter_t converter = {
+        .name = "test_converter",
+        .init = test_filter_init,
+        .cleanup = test_filter_cleanup,
+        .is_started = test_filter_is_started,
+        .get_in_formats = test_yuyv_formats_get,
+        .get_out_formats = test_yuv444_formats_get,
+        .get_cost = test_filter_cost
+    };
+    struct filter_t encoder = {
+        .name = "test_encoder",
+        .init = test_filter_init,
+        .cleanup = test_filter_cleanup,
+        .is_started = test_filter_is_started,
+        .get_in_formats = test_yuv444_formats_get,
+        .get_out_formats = test_h264_formats_get,
+        .get_cost = test_filter_cost
+    };
+    kv_push(struct filter_t *, filters, &converter);
+    kv_push(struct filter_t *, filters, &encoder);
+
+    CALL(res = app_init(), error);
+
+    // two cheap filters are preferred to one expensive encoder
+    struct output_t *output = outputs;
+    assert_int_equal(output->start_format, VIDEO_FORMAT_YUYV);
+    assert_int_equal(kv_size(output->filters), 2);
+    assert_ptr_equal(kv_A(filters, kv_A(output->filters, 0).index), &converter);
+    assert_int_equal(kv_A(output->filters, 0).out_format, VIDEO_FORMAT_YUV444);
+    assert_ptr_equal(kv_A(filters, kv_A(output->filters, 1).index), &encoder);
+    assert_int_equal(kv_A(output->filters, 1).out_format, VIDEO_FORMAT_H264);
+    assert_int_equal(output->cost, 2);
+
+error:
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+    kv_size(filters) = filters_len;
+}
+
+#define TEST_YUV_WIDTH 70
+#define TEST_YUV_HEIGHT 4
+
+// returns the expected chroma of the pixel, 4:2:0 formats average chroma of pairs of rows
+static int test_yuv_chroma(struct frame_t *yuyv, int format, int x, int y, int offset)
+{
+    uint8_t *line = yuyv->planes[0] + yuyv->strides[0] * y;
+    int pair = ((x >> 1) << 2) + offset;
+    if (format != VIDEO_FORMAT_I420 && format != VIDEO_FORMAT_NV12)
+        return line[pair];
+    uint8_t *even = yuyv->planes[0] + yuyv->strides[0] * (y & ~1);
+    return (even[pair] + even[yuyv->strides[0] + pair] + 1) >> 1;
+}
+
+// returns the chroma of the pixel in the converted frame
+static int test_yuv_plane_chroma(struct frame_t *planes, int x, int y, int plane)
+{
+    switch (planes->format) {
+        case VIDEO_FORMAT_YUV444:
+            return planes->planes[plane][planes->strides[plane] * y + x];
+        case VIDEO_FORMAT_YUV422:
+            return planes->planes[plane][planes->strides[plane] * y + (x >> 1)];
+        case VIDEO_FORMAT_I420:
+            return planes->planes[plane][planes->strides[plane] * (y >> 1) + (x >> 1)];
+        default: // NV12
+            plane = planes->strides[1] * (y >> 1) + ((x >> 1) << 1) + plane - 1;
+            return planes->planes[1][plane];
+    }
+}
+
+static void test_yuv_kernels(void **state)
+{
+    const char *names[] = { "avx2", "sse2", "neon", "scalar" };
+    int formats[] = {
+        VIDEO_FORMAT_YUV444, VIDEO_FORMAT_YUV422, VIDEO_FORMAT_I420, VIDEO_FORMAT_NV12
+    };
+    uint8_t in[TEST_YUV_WIDTH * TEST_YUV_HEIGHT * 2];
+    uint8_t out[TEST_YUV_WIDTH * TEST_YUV_HEIGHT * 3];
+    for (int i = 0; i < sizeof(in); i++)
+        in[i] = (uint8_t)(i * 7 + (i >> 3));
+
+    struct frame_t yuyv = { .planes = { in } };
+    frame_set_planes(&yuyv, VIDEO_FORMAT_YUYV, TEST_YUV_WIDTH, TEST_YUV_HEIGHT);
+    const char *current = yuv_kernels_get_name();
+
+    for (int n = 0; n < ARRAY_SIZE(names); n++) {
+        if (yuv_kernels_set(names[n]) == -1)
+            continue; // the CPU doesn't support the kernels
+        for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+            memset(out, 0, sizeof(out));
+            struct frame_t planes = { .planes = { out } };
+            frame_set_planes(&planes, formats[f], TEST_YUV_WIDTH, TEST_YUV_HEIGHT);
+            assert_int_equal(yuv_kernels_convert(&yuyv, &planes), 0);
+
+            // every pixel has Y of its own and U, V of its pair
+            for (int y = 0; y < TEST_YUV_HEIGHT; y++) {
+                uint8_t *line = in + yuyv.strides[0] * y;
+                for (int x = 0; x < TEST_YUV_WIDTH; x++) {
+                    assert_int_equal(planes.planes[0][planes.strides[0] * y + x], line[x << 1]);
+                    assert_int_equal(test_yuv_plane_chroma(&planes, x, y, 1),
+                        test_yuv_chroma(&yuyv, formats[f], x, y, 1));
+                    assert_int_equal(test_yuv_plane_chroma(&planes, x, y, 2),
+                        test_yuv_chroma(&yuyv, formats[f], x, y, 3));
+                }
+            }
+        }
+    }
+
+    if (current)
+        assert_int_equal(yuv_kernels_set(current), 0);
+}
+
+static void test_yuv_rgb_kernels(void **state)
+{
+    const char *names[] = { "avx2", "sse2", "neon", "scalar" };
+    struct yuv_rgb_format_t formats[] = {
+        { 16, 1, 31, 63, 31, 11, 5, 0 },
+        { 16, 0, 31, 63, 31, 11, 5, 0 },
+        { 32, 0, 255, 255, 255, 16, 8, 0 },
+        { 32, 1, 255, 255, 255, 0, 8, 16 },
+        { 8, 0, 7, 7, 3, 0, 3, 6 }
+    };
+    uint8_t in[TEST_YUV_WIDTH * TEST_YUV_HEIGHT * 2];
+    uint8_t changed[sizeof(in)];
+    uint8_t expected[TEST_YUV_WIDTH * TEST_YUV_HEIGHT * 4];
+    uint8_t out[sizeof(expected)];
+    for (int i = 0; i < sizeof(in); i++)
+        in[i] = (uint8_t)(i * 7 + (i >> 3));
+    // black and white pixels of the first pair
+    in[0] = 16;
+    in[1] = in[3] = 128;
+    in[2] = 235;
+
+    struct frame_t yuyv = { .planes = { in } };
+    frame_set_planes(&yuyv, VIDEO_FORMAT_YUYV, TEST_YUV_WIDTH, TEST_YUV_HEIGHT);
+    const char *current = yuv_kernels_get_name();
+
+    assert_int_equal(yuv_kernels_set("scalar"), 0);
+    for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+        int bytes = formats[f].bpp >> 3;
+        assert_int_equal(yuv_kernels_convert_rgb(&yuyv, 0, 0, TEST_YUV_WIDTH,
+            TEST_YUV_HEIGHT, formats + f, expected), 0);
+        for (int i = 0; i < bytes; i++) {
+            assert_int_equal(expected[i], 0);
+            // the padding byte of 32 bit pixels stays zero
+            int is_padding = bytes == 4 && i == (formats[f].is_big_endian? 0: 3);
+            assert_int_equal(expected[bytes + i], is_padding? 0: 0xff);
+        }
+
+        for (int n = 0; n < ARRAY_SIZE(names); n++) {
+            if (yuv_kernels_set(names[n]) == -1)
+                continue;
+            memset(out, 0, sizeof(out));
+            assert_int_equal(yuv_kernels_convert_rgb(&yuyv, 0, 0, TEST_YUV_WIDTH,
+                TEST_YUV_HEIGHT, formats + f, out), 0);
+            assert_memory_equal(out, expected, TEST_YUV_WIDTH * TEST_YUV_HEIGHT * bytes);
+
+            // the rectangle has rows of its own width
+            memset(out, 0, sizeof(out));
+            assert_int_equal(yuv_kernels_convert_rgb(&yuyv, 2, 1, 8, 2, formats + f, out), 0);
+            for (int y = 0; y < 2; y++)
+                assert_memory_equal(out + y * 8 * bytes,
+                    expected + ((y + 1) * TEST_YUV_WIDTH + 2) * bytes, 8 * bytes);
+        }
+        assert_int_equal(yuv_kernels_set("scalar"), 0);
+    }
+
+    // the difference up to the threshold doesn't change the tile
+    memcpy(changed, in, sizeof(in));
+    changed[yuyv.strides[0] * 3 + 40] += in[yuyv.strides[0] * 3 + 40] < 128? 5: -5;
+    changed[yuyv.strides[0] + 100] += in[yuyv.strides[0] + 100] < 128? 4: -4;
+    changed[138] += in[138] < 128? 6: -6;
+    struct frame_t other = { .planes = { changed } };
+    frame_set_planes(&other, VIDEO_FORMAT_YUYV, TEST_YUV_WIDTH, TEST_YUV_HEIGHT);
+    for (int n = 0; n < ARRAY_SIZE(names); n++) {
+        if (yuv_kernels_set(names[n]) == -1)
+            continue;
+        // the last tile is narrower
+        uint8_t tiles[5];
+        memset(tiles, 0xff, sizeof(tiles));
+        assert_int_equal(yuv_kernels_compare(&yuyv, &other, 16, 4, tiles), 0);
+        for (int t = 0; t < ARRAY_SIZE(tiles); t++)
+            assert_int_equal(tiles[t], t == 1 || t == 4? 1: 0);
+    }
+
+    // the run ends at the pixel which differs by the last byte, or at the end of the line
+    uint8_t line[160];
+    for (int n = 0; n < ARRAY_SIZE(names); n++) {
+        if (yuv_kernels_set(names[n]) == -1)
+            continue;
+        for (int bytes = 1; bytes <= 4; bytes <<= 1) {
+            int count = sizeof(line) / bytes;
+            for (int end = 1; end <= count; end++) {
+                for (int i = 0; i < sizeof(line); i++)
+                    line[i] = (uint8_t)(0x5a + i % bytes);
+                if (end < count)
+                    line[end * bytes + bytes - 1] ^= 1;
+                assert_int_equal(yuv_kernels_run_line(line, count, bytes), end);
+            }
+        }
+    }
+
+    if (current)
+        assert_int_equal(yuv_kernels_set(current), 0);
+}
+
+#define TEST_BANDS_HEIGHT 37
+
+static int test_band_rows[TEST_BANDS_HEIGHT];
+
+static int test_process_band(void *data, int y_start, int y_end)
+{
+    int align = *(int *)data;
+    if (y_start % align != 0)
+        return -1;
+    for (int y = y_start; y < y_end; y++)
+        __sync_fetch_and_add(test_band_rows + y, 1);
+    return 0;
+}
+
+static void test_bands(void **state)
+{
+    int threads[] = { 1, 3 };
+    for (int t = 0; t < ARRAY_SIZE(threads); t++) {
+        struct bands_t bands;
+        assert_int_equal(bands_init(&bands, 5, threads[t]), 0);
+        for (int run = 1; run <= 2; run++) {
+            memset(test_band_rows, 0, sizeof(test_band_rows));
+            int align = run;
+            assert_int_equal(
+                bands_process(&bands, TEST_BANDS_HEIGHT, align, test_process_band, &align), 0);
+
+            // every row is processed exactly once
+            for (int y = 0; y < TEST_BANDS_HEIGHT; y++)
+                assert_int_equal(test_band_rows[y], 1);
+            assert_int_equal(bands.runs, run);
+        }
+        bands_cleanup(&bands);
+    }
+}
+
+static struct filter_t *test_get_filter(const char *name)
+{
+    for (int i = 0; i < kv_size(filters); i++)
+        if (!strcmp(kv_A(filters, i)->name, name))
+            return kv_A(filters, i);
+    return NULL;
+}
+
+// returns the amount of NAL units of the type in the Annex B stream
+static int test_count_nals(struct frame_t *frame, int type)
+{
+    int count = 0;
+    for (int i = 0; i + 4 < frame->length; i++)
+        if (frame->planes[0][i] == 0 && frame->planes[0][i + 1] == 0 &&
+            frame->planes[0][i + 2] == 1 && (frame->planes[0][i + 3] & 0x1f) == type)
+            count++;
+    return count;
+}
+
+#ifdef MMAL_ENCODER
+#include "mmal_encoder.h"
+
+static void test_in_frame(void **state)
+{
+    int res = 0;
+    struct frame_t yuyv = { .refs = 1 };
+    struct frame_t *in = NULL, *out = NULL, *h264 = NULL;
+    struct filter_t *converter = test_get_filter("yuv_converter");
+    struct filter_t *encoder = test_get_filter("mmal_encoder");
+    assert_non_null(converter);
+    assert_non_null(encoder);
+
+    yuyv.planes[0] = malloc(app.video_width * app.video_height * 2);
+    assert_non_null(yuyv.planes[0]);
+    frame_set_planes(&yuyv, VIDEO_FORMAT_YUYV, app.video_width, app.video_height);
+    memset(yuyv.planes[0], 0x80, yuyv.length);
+
+    CALL(res = app_init(), error);
+    CALL(res = converter->start(VIDEO_FORMAT_YUYV, VIDEO_FORMAT_I420), error);
+    CALL(res = encoder->start(VIDEO_FORMAT_I420, VIDEO_FORMAT_H264), error);
+
+    // the converter writes the frame right to the buffer of the encoder
+    CALL(res = encoder->get_in_frame(VIDEO_FORMAT_I420, &in), error);
+    assert_non_null(in);
+    assert_int_equal(in->strides[0], MMAL_PLANE_WIDTH(app.video_width));
+    CALL(res = converter->set_out_frame(in), error);
+    CALL(res = converter->process_frame(&yuyv), error);
+    CALL(res = converter->get_frame(&out), error);
+    assert_ptr_equal(out, in);
+    assert_int_equal(out->planes[1][0], 0x80);
+
+    CALL(res = encoder->process_frame(out), error);
+    CALL(res = encoder->get_frame(&h264), error);
+    assert_non_null(h264);
+    assert_int_equal(h264->format, VIDEO_FORMAT_H264);
+    assert_int_equal(h264->strides[0], h264->length);
+
+error:
+    assert_int_not_equal(res, -1);
+    if (h264)
+        frame_unref(h264);
+    if (out)
+        frame_unref(out);
+    if (in)
+        frame_unref(in);
+    app_cleanup();
+    free(yuyv.planes[0]);
+}
+
+static void test_encoder_out_frames(void **state)
+{
+    int res = 0;
+    struct frame_t i420 = { .refs = 1 };
+    struct frame_t *h264[MMAL_OUT_BUFFERS];
+    memset(h264, 0, sizeof(h264));
+    struct filter_t *encoder = test_get_filter("mmal_encoder");
+    assert_non_null(encoder);
+
+    i420.planes[0] = calloc(app.video_width * app.video_height * 3 / 2, 1);
+    assert_non_null(i420.planes[0]);
+    frame_set_planes(&i420, VIDEO_FORMAT_I420, app.video_width, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = encoder->start(VIDEO_FORMAT_I420, VIDEO_FORMAT_H264), error);
+
+    // encoded frames hold buffers of the encoder until consumers release them
+    for (int i = 0; i < MMAL_OUT_BUFFERS; i++) {
+        i420.sequence = i;
+        CALL(res = encoder->process_frame(&i420), error);
+        CALL(res = encoder->get_frame(h264 + i), error);
+        assert_non_null(h264[i]);
+        // props follow the frame through the encoder
+        assert_int_equal(h264[i]->sequence, i);
+        if (i > 0)
+            assert_ptr_not_equal(h264[i]->planes[0], h264[i - 1]->planes[0]);
+    }
+    // the encoder fills released buffers again
+    for (int i = 0; i < MMAL_OUT_BUFFERS * 2; i++) {
+        int index = i % MMAL_OUT_BUFFERS;
+        CALL(res = frame_unref(h264[index]), error);
+        h264[index] = NULL;
+        CALL(res = encoder->process_frame(&i420), error);
+        CALL(res = encoder->get_frame(h264 + index), error);
+        assert_non_null(h264[index]);
+    }
+
+    // the frame which is split to more buffers than raw frames have planes stays whole
+    for (int i = 0; i < MMAL_OUT_BUFFERS; i++) {
+        CALL(res = frame_unref(h264[i]), error);
+        h264[i] = NULL;
+    }
+    mmal_stub_out_chunks = MMAL_OUT_BUFFERS;
+    CALL(res = encoder->process_frame(&i420), error);
+    CALL(res = encoder->get_frame(h264), error);
+    assert_non_null(h264[0]);
+    assert_int_equal(h264[0]->planes_count, MMAL_OUT_BUFFERS);
+    assert_int_equal(h264[0]->length, h264[0]->strides[0] * MMAL_OUT_BUFFERS);
+
+error:
+    mmal_stub_out_chunks = 1;
+    assert_int_not_equal(res, -1);
+    for (int i = 0; i < MMAL_OUT_BUFFERS; i++)
+        if (h264[i])
+            frame_unref(h264[i]);
+    app_cleanup();
+    free(i420.planes[0]);
+}
+
+#include "mmal_camera.h"
+static void test_mmal_camera(void **state)
+{
+    int res = 0;
+    struct frame_t *worker = NULL;
+    struct input_t v4l_input = input;
+    mmal_camera_construct();
+
+    CALL(res = app_init(), error);
+    // the camera gives encoded frames, so outputs don't need filters
+    assert_int_equal(outputs[0].start_format, VIDEO_FORMAT_H264);
+    assert_int_equal(kv_size(outputs[0].filters), 0);
+
+    for (int i = 0; i < 5; i++)
+        CALL(res = app_process_frame(), error);
+
+    // the resizer gives frames of the worker by the other branch of the splitter
+    CALL(res = input.get_worker_frame(&worker), error);
+    assert_non_null(worker);
+    assert_int_equal(worker->format, VIDEO_FORMAT_I420);
+    assert_int_equal(worker->width, app.worker_width);
+    assert_int_equal(worker->strides[0], MMAL_PLANE_WIDTH(app.worker_width));
+    assert_int_equal(worker->planes[0][0], 0x80);
+
+error:
+    assert_int_not_equal(res, -1);
+    if (worker)
+        frame_unref(worker);
+    app_cleanup();
+    input = v4l_input;
+}
+#endif //MMAL_ENCODER
+
+#ifdef V4L_ENCODER_WRAP
+#define TEST_V4L_TIMEOUT_MS 1000
+#define TEST_V4L_FRAMES 3
+#define TEST_V4L_SLICES 3
+extern int v4l_wrap_bitrate;
+extern int v4l_wrap_key_frames;
+extern int v4l_wrap_slice_mbs;
+
+// the encoder starts with the bitrate of the option, the rate control changes it on the fly
+static void test_v4l_encoder_bitrate(void **state)
+{
+    int res = 0;
+    struct filter_t *encoder = test_get_filter("v4l_encoder");
+    assert_non_null(encoder);
+
+    CALL(res = app_init(), error);
+    CALL(res = encoder->set_bitrate(app.h264_bitrate / 2), error);
+    assert_int_equal(v4l_wrap_bitrate, 0);
+    CALL(res = encoder->start(VIDEO_FORMAT_I420, VIDEO_FORMAT_H264), error);
+    assert_int_equal(v4l_wrap_bitrate, app.h264_bitrate * 1000);
+
+    CALL(res = encoder->set_bitrate(app.h264_bitrate / 2), error);
+    assert_int_equal(v4l_wrap_bitrate, app.h264_bitrate / 2 * 1000);
+
+error:
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+// the encoder dequeues frames on own thread, the test waits for the next one
+static int test_v4l_get_frame(struct filter_t *encoder, struct frame_t **frame)
+{
+    struct timespec period = { .tv_sec = 0, .tv_nsec = 1000000 };
+    for (int i = 0; i < TEST_V4L_TIMEOUT_MS; i++) {
+        CALL(encoder->get_frame(frame), cleanup);
+        if (*frame)
+            return 0;
+        nanosleep(&period, NULL);
+    }
+    errno = ETIME;
+
+cleanup:
+    return -1;
+}
+
+// the frame after the request is encoded as IDR with parameter sets
+static void test_v4l_encoder_key_frame(void **state)
+{
+    int res = 0;
+    struct frame_t i420 = { .refs = 1 };
+    struct frame_t *h264 = NULL;
+    struct filter_t *encoder = test_get_filter("v4l_encoder");
+    assert_non_null(encoder);
+
+    i420.planes[0] = calloc(app.video_width * app.video_height * 3 / 2, 1);
+    assert_non_null(i420.planes[0]);
+    frame_set_planes(&i420, VIDEO_FORMAT_I420, app.video_width, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = encoder->start(VIDEO_FORMAT_I420, VIDEO_FORMAT_H264), error);
+
+    // the stream starts from the IDR frame, P frames follow it
+    for (int i = 0; i < TEST_V4L_FRAMES; i++) {
+        CALL(res = encoder->process_frame(&i420), error);
+        CALL(res = test_v4l_get_frame(encoder, &h264), error);
+        assert_int_equal(test_count_nals(h264, 5), i == 0? 1: 0);
+        CALL(res = frame_unref(h264), error);
+        h264 = NULL;
+    }
+    assert_int_equal(v4l_wrap_key_frames, 0);
+
+    CALL(res = encoder->request_key_frame(), error);
+    assert_int_equal(v4l_wrap_key_frames, 1);
+    CALL(res = encoder->process_frame(&i420), error);
+    CALL(res = test_v4l_get_frame(encoder, &h264), error);
+    assert_int_equal(test_count_nals(h264, 7), 1);
+    assert_int_equal(test_count_nals(h264, 5), 1);
+
+error:
+    assert_int_not_equal(res, -1);
+    if (h264)
+        frame_unref(h264);
+    app_cleanup();
+    free(i420.planes[0]);
+}
+
+// slices of the option cover the frame, the pipeline runs with them
+static void test_v4l_encoder_slices(void **state)
+{
+    int res = 0;
+    int slices = app.h264_slices;
+    app.h264_slices = TEST_V4L_SLICES;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+    int ticks = 0;
+    for (int i = 0; i < TEST_V4L_FRAMES; i++) {
+        res = app_process_frame();
+        if (res == -1 && errno != ETIME)
+            break;
+        ticks += res == 0;
+        res = 0;
+    }
+    assert_int_equal(res, 0);
+    assert_true(ticks > 0);
+
+    int mbs = ((app.video_width + 15) >> 4) * ((app.video_height + 15) >> 4);
+    assert_true(v4l_wrap_slice_mbs * TEST_V4L_SLICES >= mbs);
+    assert_true(v4l_wrap_slice_mbs * (TEST_V4L_SLICES - 1) < mbs);
+
+error:
+    app.h264_slices = slices;
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+#endif //V4L_ENCODER_WRAP
+
+#ifdef SOFTWARE_ENCODER
+#define TEST_H264_FRAMES 5
+#define TEST_H264_SLICES 2
+#define TEST_H264_KEY_FRAME 3
+
+// slices which have been streamed by the encoder
+static int test_slices_count = 0;
+static int test_slices_length = 0;
+static int test_slices_y = 0;
+
+static int test_process_slice(struct frame_slice_t *slice)
+{
+    // slices come in order of rows before the frame is returned
+    assert_int_equal(slice->index, test_slices_count);
+    assert_int_equal(slice->count, TEST_H264_SLICES);
+    assert_int_equal(slice->y, test_slices_y);
+    assert_ptr_equal(slice->data, slice->frame->planes[0] + test_slices_length);
+    test_slices_count++;
+    test_slices_length += slice->length;
+    test_slices_y += slice->height;
+    return 0;
+}
+
+static void test_h264_encoder(void **state)
+{
+    int res = 0;
+    int idr_length = 0;
+    struct output_t slice_output = { .name = "test", .process_slice = test_process_slice };
+    struct frame_t i420 = { .refs = 1 };
+    struct frame_t *h264 = NULL;
+    struct filter_t *encoder = test_get_filter("h264_encoder");
+    assert_non_null(encoder);
+    int slices = app.h264_slices;
+    app.h264_slices = TEST_H264_SLICES;
+
+    i420.planes[0] = malloc(app.video_width * app.video_height * 3 / 2);
+    assert_non_null(i420.planes[0]);
+    frame_set_planes(&i420, VIDEO_FORMAT_I420, app.video_width, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = encoder->start(VIDEO_FORMAT_I420, VIDEO_FORMAT_H264), error);
+    for (int i = 0; i < TEST_H264_FRAMES; i++) {
+        // the gradient moves by a few pixels every frame
+        for (int y = 0; y < app.video_height; y++)
+            for (int x = 0; x < app.video_width; x++)
+                i420.planes[0][y * i420.strides[0] + x] = (x + y + i * 3) & 0xff;
+        memset(i420.planes[1], 0x60, i420.strides[1] * (app.video_height >> 1));
+        memset(i420.planes[2], 0xa0, i420.strides[2] * (app.video_height >> 1));
+        i420.sequence = i;
+        test_slices_count = 0;
+        test_slices_length = 0;
+        test_slices_y = 0;
+
+        // a decoder joins the stream
+        int is_key = i == 0 || i == TEST_H264_KEY_FRAME;
+        if (i == TEST_H264_KEY_FRAME)
+            CALL(res = encoder->request_key_frame(), error);
+        CALL(res = encoder->set_slice_output(i & 1? &slice_output: NULL), error);
+        CALL(res = encoder->process_frame(&i420), error);
+        CALL(res = encoder->get_frame(&h264), error);
+        assert_non_null(h264);
+        assert_int_equal(h264->format, VIDEO_FORMAT_H264);
+        assert_int_equal(h264->sequence, i);
+        assert_int_equal(h264->strides[0], h264->length);
+        // the streamed slices make up the whole frame
+        assert_int_equal(test_slices_count, i & 1? TEST_H264_SLICES: 0);
+        if (i & 1) {
+            assert_int_equal(test_slices_length, h264->length);
+            assert_int_equal(test_slices_y, app.video_height);
+        }
+
+        // the stream starts from parameter sets and the IDR frame, every slice is a NAL unit
+        assert_int_equal(test_count_nals(h264, 7), is_key? 1: 0);
+        assert_int_equal(test_count_nals(h264, 8), is_key? 1: 0);
+        assert_int_equal(test_count_nals(h264, 5), is_key? TEST_H264_SLICES: 0);
+        assert_int_equal(test_count_nals(h264, 1), is_key? 0: TEST_H264_SLICES);
+        // the motion of P frames is predicted by the previous frame
+        if (is_key)
+            idr_length = h264->length;
+        else
+            assert_true(h264->length < idr_length / 2);
+        CALL(res = frame_unref(h264), error);
+        h264 = NULL;
+    }
+
+error:
+    assert_int_not_equal(res, -1);
+    if (h264)
+        frame_unref(h264);
+    app_cleanup();
+    app.h264_slices = slices;
+    free(i420.planes[0]);
+}
+#endif //SOFTWARE_ENCODER
+
+#define TEST_CALIBRATION_PATH "/tmp/raspidetect_test.cal"
+
+static void test_calibration(void **state)
+{
+    int res = 0;
+    size_t len = 0, cached_len = 0;
+    uint8_t *data = NULL;
+    remove(TEST_CALIBRATION_PATH);
+    app.calibration = 1;
+    app.calibration_path = TEST_CALIBRATION_PATH;
+
+    // costs of filters are measured and saved to the cache
+    CALL(res = app_init(), error);
+    app_cleanup();
+    data = utils_read_file(TEST_CALIBRATION_PATH, &len);
+    assert_non_null(data);
+    free(data);
+    assert_true(len > 0);
+
+    // the next start reuses the cache instead of measuring
+    CALL(res = app_init(), error);
+    data = utils_read_file(TEST_CALIBRATION_PATH, &cached_len);
+    assert_non_null(data);
+    free(data);
+    assert_int_equal(cached_len, len);
+
+error:
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+    app.calibration = CALIBRATION_DEF;
+    remove(TEST_CALIBRATION_PATH);
+}
+
 #include "file.h"
 extern struct file_state_t file;
 static void test_file_loop(void **state)
 {
     int res = 0;
-    struct output_t *output = file.output;
 
     expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
     expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
     expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
     //will_return(__wrap_ioctl, 3);
 
+    int ticks = 0;
+    input_frames = 0;
     CALL(res = app_init(), error);
     for (int i = 0; i < 10; i++) {
-        CALL(res = output->process_frame());
+        CALL(res = app_process_frame());
         if (res == -1 && errno != ETIME)
             break;            
-        else
-            res = 0;
+        else if (res == 0)
+            ticks++;
+        res = 0;
     }
 
 error:
     TEST_DEBUG("res: %d", res);
     assert_int_not_equal(res, -1);
+    // the frame is captured once per tick regardless of amount of outputs
+    assert_int_equal(input_frames, ticks);
+
+    app_cleanup();
+}
+
+static int test_processed = 0;
+static void test_pipeline_processed()
+{
+    if (++test_processed >= 10)
+        is_aborted = 1;
+}
+
+static void test_file_pipeline(void **state)
+{
+    int res = 0;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    input_frames = 0;
+    test_processed = 0;
+    CALL(res = app_init(), error);
+    CALL(res = app_process_pipeline(3, test_pipeline_processed), error);
+
+error:
+    is_aborted = 0;
+    TEST_DEBUG("res: %d", res);
+    assert_int_not_equal(res, -1);
+    // frames in flight are finished before the pipeline stops
+    assert_int_equal(input_frames, test_processed);
+
+    app_cleanup();
+}
+
+static int test_handoffs = 0;
+static int test_handoff_start(int in_format, int out_format) { return 0; }
+static int test_handoff_process_frame(struct frame_t *frame) { return 0; }
+static int test_handoff_get_frame(struct frame_t **frame) { *frame = NULL; return 0; }
+static int test_handoff_set_out_frame(struct frame_t *frame) { return 0; }
+static int test_handoff_get_in_frame(int format, struct frame_t **frame)
+{
+    __sync_fetch_and_add(&test_handoffs, 1);
+    *frame = NULL;
+    return 0;
+}
+
+static void test_pipeline_handoff(void **state)
+{
+    int res = 0;
+    int filters_len = kv_size(filters);
+    struct filter_t converter = {
+        .name = "test_converter",
+        .init = test_filter_init,
+        .cleanup = test_filter_cleanup,
+        .start = test_handoff_start,
+        .is_started = test_filter_is_started,
+        .process_frame = test_handoff_process_frame,
+        .get_frame = test_handoff_get_frame,
+        .set_out_frame = test_handoff_set_out_frame,
+        .get_in_formats = test_yuyv_formats_get,
+        .get_out_formats = test_yuv444_formats_get,
+        .get_cost = test_filter_cost
+    };
+    struct filter_t encoder = {
+        .name = "test_encoder",
+        .init = test_filter_init,
+        .cleanup = test_filter_cleanup,
+        .start = test_handoff_start,
+        .is_started = test_filter_is_started,
+        .process_frame = test_handoff_process_frame,
+        .get_frame = test_handoff_get_frame,
+        .get_in_frame = test_handoff_get_in_frame,
+        .get_in_formats = test_yuv444_formats_get,
+        .get_out_formats = test_h264_formats_get,
+        .get_cost = test_filter_cost
+    };
+    kv_push(struct filter_t *, filters, &converter);
+    kv_push(struct filter_t *, filters, &encoder);
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+    assert_ptr_equal(kv_A(filters, kv_A(outputs[0].filters, 1).index), &encoder);
+
+    // the sequential loop writes the frame right to the buffer of the next filter
+    test_handoffs = 0;
+    int ticks = 0;
+    for (int i = 0; i < 10; i++) {
+        res = app_process_frame();
+        if (res == -1 && errno != ETIME)
+            break;
+        ticks += res == 0;
+        res = 0;
+    }
+    assert_int_equal(res, 0);
+    assert_true(ticks > 0);
+    assert_int_equal(test_handoffs, ticks);
+
+    // steps of the pipeline don't touch the next filter, it runs on another thread, frames
+    // in flight are finished after the abort
+    test_handoffs = 0;
+    test_processed = 0;
+    CALL(res = app_process_pipeline(3, test_pipeline_processed), error);
+    assert_true(test_processed >= 10);
+    assert_int_equal(test_handoffs, 0);
+
+error:
+    is_aborted = 0;
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+    kv_size(filters) = filters_len;
+}
+
+static int test_idle_started = 0;
+static int test_idle_stops = 0;
+static int test_idle_shared_stops = 0;
+static int test_idle_flag = 0;
+static int test_idle_left = 0;
+static int (*test_idle_shared_stop_next)() = NULL;
+static int test_idle_start(int in_format, int out_format) { test_idle_started = 1; return 0; }
+static int test_idle_is_started() { return test_idle_started; }
+static int test_idle_stop() { test_idle_started = 0; test_idle_stops++; return 0; }
+static int test_idle_shared_stop()
+{
+    test_idle_shared_stops++;
+    return test_idle_shared_stop_next();
+}
+static int test_idle_output_start() { return 0; }
+static int test_idle_output_is_started() { return 1; }
+static int test_idle_is_ready() { return !test_idle_left; }
+static int test_idle_is_idle()
+{
+    int is_idle = test_idle_flag;
+    test_idle_flag = 0;
+    test_idle_left |= is_idle;
+    return is_idle;
+}
+static int test_idle_process_frame(struct frame_t *frame) { return 0; }
+static void test_idle_cleanup() { }
+
+// the output which has become idle stops the filter which only it uses on the next tick,
+// the filter which the file output shares keeps running
+static void test_output_idle(void **state)
+{
+    int res = 0, output_index = -1, shared_index = -1;
+    int filters_len = kv_size(filters);
+    struct filter_t *shared = NULL;
+    struct filter_t counted;
+    struct filter_t own = {
+        .name = "test_idle_own",
+        .init = test_filter_init,
+        .cleanup = test_filter_cleanup,
+        .start = test_idle_start,
+        .is_started = test_idle_is_started,
+        .stop = test_idle_stop,
+        .process_frame = test_handoff_process_frame,
+        .get_frame = test_handoff_get_frame,
+        .get_in_formats = test_h264_formats_get,
+        .get_out_formats = test_h264_formats_get,
+        .get_cost = test_filter_cost
+    };
+    kv_push(struct filter_t *, filters, &own);
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+
+    // stops of the first filter of the file output are counted
+    shared_index = kv_A(outputs[0].filters, 0).index;
+    shared = kv_A(filters, shared_index);
+    counted = *shared;
+    counted.stop = test_idle_shared_stop;
+    test_idle_shared_stop_next = shared->stop;
+    kv_A(filters, shared_index) = &counted;
+
+    // the output shares the input and the first filter with the file output
+    output_index = 0;
+    while (output_index < MAX_OUTPUTS && outputs[output_index].context != NULL)
+        output_index++;
+    assert_true(output_index < MAX_OUTPUTS);
+    struct output_t *output = outputs + output_index;
+    *output = (struct output_t) {
+        .name = "test_idle",
+        .context = &test_idle_flag,
+        .start_format = outputs[0].start_format,
+        .start = test_idle_output_start,
+        .is_started = test_idle_output_is_started,
+        .is_ready = test_idle_is_ready,
+        .is_idle = test_idle_is_idle,
+        .process_frame = test_idle_process_frame,
+        .cleanup = test_idle_cleanup
+    };
+    kv_push(struct filter_reference_t, output->filters, kv_A(outputs[0].filters, 0));
+    struct filter_reference_t reference = {
+        .out_format = VIDEO_FORMAT_H264,
+        .index = filters_len
+    };
+    kv_push(struct filter_reference_t, output->filters, reference);
+
+    test_idle_flag = 0;
+    test_idle_left = 0;
+    test_idle_stops = 0;
+    test_idle_shared_stops = 0;
+    // the encoder can pass the first frame on later ticks
+    for (int i = 0; i < 10 && !test_idle_started; i++)
+        CALL(res = app_process_frame(), error);
+    assert_true(test_idle_started);
+
+    test_idle_flag = 1;
+    CALL(res = app_process_frame(), error);
+    assert_int_equal(test_idle_flag, 0);
+    assert_int_equal(test_idle_stops, 1);
+    assert_false(test_idle_started);
+    assert_int_equal(test_idle_shared_stops, 0);
+    assert_true(input.is_started());
+
+    // the idle output doesn't start own filter again
+    CALL(res = app_process_frame(), error);
+    assert_false(test_idle_started);
+    assert_int_equal(test_idle_shared_stops, 0);
 
+error:
+    assert_int_not_equal(res, -1);
     app_cleanup();
+    if (shared != NULL)
+        kv_A(filters, shared_index) = shared;
+    if (output_index != -1 && output_index < MAX_OUTPUTS)
+        memset(outputs + output_index, 0, sizeof(*outputs));
+    kv_size(filters) = filters_len;
 }
 
 #ifdef SDL
@@ -101,7 +1075,6 @@ extern struct sdl_state_t sdl;
 static void test_sdl_loop(void **state)
 {
     int res = 0;
-    struct output_t *output = sdl.output;
 
     expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
     expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
@@ -110,7 +1083,7 @@ static void test_sdl_loop(void **state)
 
     CALL(res = app_init(), error);
     for (int i = 0; i < 10; i++) {
-        CALL(res = output->process_frame());
+        CALL(res = app_process_frame());
         if (res == -1 && errno != ETIME)
             break;            
         else
@@ -127,11 +1100,224 @@ error:
 
 #ifdef RFB
 #include "rfb.h"
+#include <sys/socket.h>
+#include <netinet/in.h> //sockaddr_in
+#include <arpa/inet.h> //htonl
+
+// messages and encodings of the protocol which the test client uses
+#define TEST_RFB_UPDATE 0
+#define TEST_RFB_SET_ENCODINGS 2
+#define TEST_RFB_UPDATE_REQUEST 3
+#define TEST_RFB_KEY_EVENT 4
+#define TEST_RFB_CUT_TEXT 6
+#define TEST_RFB_CONTINUOUS 150
+#define TEST_RFB_FENCE 248
+#define TEST_RFB_FENCE_REQUEST 0x80000000u
+#define TEST_RFB_RAW 0
+#define TEST_RFB_ZRLE 16
+#define TEST_RFB_H264 0x48323634
+#define TEST_RFB_CONTINUOUS_ENCODING -313
+// the server handles the client on own thread, so the client waits for its messages
+#define TEST_RFB_TIMEOUT_MS 1000
+#define TEST_RFB_FRAMES 5
+
 extern struct rfb_state_t rfb;
+static int test_rfb_bpp = 0;
+// the encoding of the last rectangle of the update
+static int32_t test_rfb_encoding = 0;
+
+// reads the whole message, the socket times out if the server doesn't send it
+static int test_rfb_read(int client, void *data, int length)
+{
+    int res = 0;
+    for (int i = 0; i < length; i += res) {
+        CALL(res = recv(client, (uint8_t *)data + i, length - i, 0), cleanup);
+        if (res == 0) {
+            errno = ECONNRESET;
+            goto cleanup;
+        }
+    }
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// connects to the output by the loopback and passes the handshake, the server chooses
+// the first encoding of the list which it supports, the small receive buffer keeps
+// the socket of the server full
+static int test_rfb_connect(const int32_t *encodings, int count, int buffer_size)
+{
+    int client = -1;
+    struct timeval timeout = {
+        .tv_sec = TEST_RFB_TIMEOUT_MS / 1000,
+        .tv_usec = TEST_RFB_TIMEOUT_MS % 1000 * 1000
+    };
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(app.port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    CALL(client = socket(AF_INET, SOCK_STREAM, 0), cleanup);
+    CALL(setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)), cleanup);
+    if (buffer_size > 0) {
+        CALL(setsockopt(client, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)),
+            cleanup);
+    }
+    CALL(connect(client, (struct sockaddr *)&addr, sizeof(addr)), cleanup);
+
+    uint8_t data[RFB_READ_BUFFER_BYTES];
+    CALL(test_rfb_read(client, data, 12), cleanup); // version
+    CALL(send(client, "RFB 003.008\n", 12, 0), cleanup);
+    CALL(test_rfb_read(client, data, 2), cleanup); // security types
+    data[0] = 1; // none
+    CALL(send(client, data, 1, 0), cleanup);
+    CALL(test_rfb_read(client, data, 4), cleanup); // security result
+    data[0] = 1; // shared
+    CALL(send(client, data, 1, 0), cleanup);
+    CALL(test_rfb_read(client, data, 24), cleanup); // server init
+    test_rfb_bpp = data[4];
+    uint32_t name_length;
+    memcpy(&name_length, data + 20, sizeof(name_length));
+    CALL(test_rfb_read(client, data, ntohl(name_length)), cleanup);
+
+    data[0] = TEST_RFB_SET_ENCODINGS;
+    data[1] = 0;
+    data[2] = count >> 8;
+    data[3] = count & 0xff;
+    for (int i = 0; i < count; i++) {
+        uint32_t encoding = htonl(encodings[i]);
+        memcpy(data + 4 + i * sizeof(encoding), &encoding, sizeof(encoding));
+    }
+    CALL(send(client, data, 4 + count * sizeof(int32_t), 0), cleanup);
+    return client;
+
+cleanup:
+    if (client != -1)
+        close(client);
+    return -1;
+}
+
+// FramebufferUpdateRequest and EnableContinuousUpdates have the same layout, both cover
+// the whole picture
+static int test_rfb_send_request(int client, uint8_t type, uint8_t flag)
+{
+    uint8_t message[10] = {
+        type, flag, 0, 0, 0, 0,
+        app.video_width >> 8, app.video_width & 0xff,
+        app.video_height >> 8, app.video_height & 0xff
+    };
+    CALL(send(client, message, sizeof(message), 0), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// reads messages until the next update and replies to fences, returns rectangles of
+// the update and bytes of their payloads, which are kept if the buffer is given
+static int test_rfb_read_update(int client, int *length, uint8_t *payload, int size)
+{
+    uint8_t data[RFB_READ_BUFFER_BYTES];
+    while (1) {
+        CALL(test_rfb_read(client, data, 1), cleanup);
+        if (data[0] == TEST_RFB_CONTINUOUS)
+            continue;
+        if (data[0] == TEST_RFB_FENCE) {
+            CALL(test_rfb_read(client, data + 1, 8), cleanup);
+            uint32_t flags;
+            memcpy(&flags, data + 4, sizeof(flags));
+            CALL(test_rfb_read(client, data + 9, data[8]), cleanup);
+            if (ntohl(flags) & TEST_RFB_FENCE_REQUEST) {
+                memset(data + 4, 0, sizeof(flags));
+                CALL(send(client, data, 9 + data[8], 0), cleanup);
+            }
+            continue;
+        }
+        ASSERT_INT(data[0], ==, TEST_RFB_UPDATE, cleanup);
+
+        CALL(test_rfb_read(client, data, 3), cleanup);
+        int rects = data[1] << 8 | data[2];
+        *length = 0;
+        for (int i = 0; i < rects; i++) {
+            CALL(test_rfb_read(client, data, 12), cleanup);
+            int width = data[4] << 8 | data[5];
+            int height = data[6] << 8 | data[7];
+            uint32_t encoding;
+            memcpy(&encoding, data + 8, sizeof(encoding));
+            test_rfb_encoding = ntohl(encoding);
+            uint32_t rect_length = width * height * test_rfb_bpp / 8;
+            if (ntohl(encoding) != TEST_RFB_RAW) {
+                CALL(test_rfb_read(client, &rect_length, sizeof(rect_length)), cleanup);
+                rect_length = ntohl(rect_length);
+            }
+            for (int left = rect_length; left > 0; left -= sizeof(data)) {
+                int chunk = MIN(left, sizeof(data));
+                CALL(test_rfb_read(client, data, chunk), cleanup);
+                if (payload && *length + chunk <= size)
+                    memcpy(payload + *length, data, chunk);
+                *length += chunk;
+            }
+        }
+        return rects;
+    }
+
+cleanup:
+    return -1;
+}
+
+// messages are handled in order, so the reply to the fence tells that the server has
+// handled previous messages of the client
+static int test_rfb_sync(int client)
+{
+    uint8_t data[RFB_READ_BUFFER_BYTES] = { TEST_RFB_FENCE, 0, 0, 0, 0x80, 0, 0, 0, 0 };
+    CALL(send(client, data, 9, 0), cleanup);
+    do {
+        CALL(test_rfb_read(client, data, 1), cleanup);
+    } while (data[0] == TEST_RFB_CONTINUOUS);
+    ASSERT_INT(data[0], ==, TEST_RFB_FENCE, cleanup);
+    CALL(test_rfb_read(client, data + 1, 8), cleanup);
+    CALL(test_rfb_read(client, data + 9, data[8]), cleanup);
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+// the frame is captured if any output is ready, the loop is idle otherwise
+static int test_rfb_tick()
+{
+    int res = app_process_frame();
+    if (res == -1 && errno == ETIME)
+        return 0;
+    return res;
+}
+
+// the server changes the state of clients on own thread, the test checks it every ms
+static void test_rfb_sleep()
+{
+    struct timespec period = {
+        .tv_sec = 0,
+        .tv_nsec = 1000000
+    };
+    nanosleep(&period, NULL);
+}
+
+// the server closes connections on own thread
+static int test_rfb_wait_clients(int count)
+{
+    for (int i = 0; i < TEST_RFB_TIMEOUT_MS; i++) {
+        if (__atomic_load_n(&rfb.clients_count, __ATOMIC_SEQ_CST) == count)
+            return 0;
+        test_rfb_sleep();
+    }
+    errno = ETIME;
+    return -1;
+}
+
 static void test_rfb(void **state)
 {
     int res = 0;
-    struct output_t *output = rfb.output;
 
     expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
     expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
@@ -140,7 +1326,7 @@ static void test_rfb(void **state)
 
     CALL(res = app_init(), error);
     for (int i = 0; i < 10; i++) {
-        CALL(res = output->process_frame());
+        CALL(res = app_process_frame());
         if (res == -1 && errno != ETIME)
             break;            
         else
@@ -152,6 +1338,470 @@ error:
 
     app_cleanup();
 }
+
+// the client with continuous updates and without fences gets the update of every frame
+// without requests
+static void test_rfb_continuous(void **state)
+{
+    int res = 0, client = -1, length = 0;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    // outputs are started by the first tick
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    const int32_t encodings[] = { TEST_RFB_H264, TEST_RFB_CONTINUOUS_ENCODING };
+    CALL(res = client = test_rfb_connect(encodings, ARRAY_SIZE(encodings), 0), error);
+    CALL(res = test_rfb_send_request(client, TEST_RFB_CONTINUOUS, 1), error);
+    CALL(res = test_rfb_sync(client), error);
+
+    // the stream starts from the IDR frame which is requested for the client, every next
+    // frame goes by own update
+    for (int i = 0; i < TEST_RFB_FRAMES; i++) {
+        CALL(res = test_rfb_tick(), error);
+        CALL(res = test_rfb_read_update(client, &length, NULL, 0), error);
+        assert_int_equal(res, 1);
+        assert_true(length > 0);
+    }
+
+    CALL(res = close(client), error);
+    client = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+
+error:
+    if (client != -1)
+        close(client);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+// clients which are connected together get the same frame in own encodings and leave
+// independently
+static void test_rfb_clients(void **state)
+{
+    int res = 0, h264 = -1, zrle = -1, length = 0;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    const int32_t h264_encodings[] = { TEST_RFB_H264, TEST_RFB_ZRLE };
+    CALL(res = h264 = test_rfb_connect(h264_encodings, ARRAY_SIZE(h264_encodings), 0), error);
+    const int32_t zrle_encodings[] = { TEST_RFB_ZRLE, TEST_RFB_RAW };
+    CALL(res = zrle = test_rfb_connect(zrle_encodings, ARRAY_SIZE(zrle_encodings), 0), error);
+    CALL(res = test_rfb_wait_clients(2), error);
+    CALL(res = test_rfb_send_request(h264, TEST_RFB_UPDATE_REQUEST, 0), error);
+    CALL(res = test_rfb_sync(h264), error);
+    CALL(res = test_rfb_send_request(zrle, TEST_RFB_UPDATE_REQUEST, 0), error);
+    CALL(res = test_rfb_sync(zrle), error);
+
+    CALL(res = test_rfb_tick(), error);
+    CALL(res = test_rfb_read_update(h264, &length, NULL, 0), error);
+    assert_int_equal(res, 1);
+    assert_true(length > 0);
+    assert_int_equal(test_rfb_encoding, TEST_RFB_H264);
+    CALL(res = test_rfb_read_update(zrle, &length, NULL, 0), error);
+    assert_true(res > 0);
+    assert_true(length > 0);
+    assert_int_equal(test_rfb_encoding, TEST_RFB_ZRLE);
+
+    // the client which stays gets next frames
+    CALL(res = close(zrle), error);
+    zrle = -1;
+    CALL(res = test_rfb_wait_clients(1), error);
+    for (int i = 0; i < TEST_RFB_FRAMES; i++) {
+        CALL(res = test_rfb_send_request(h264, TEST_RFB_UPDATE_REQUEST, 1), error);
+        CALL(res = test_rfb_sync(h264), error);
+        CALL(res = test_rfb_tick(), error);
+        CALL(res = test_rfb_read_update(h264, &length, NULL, 0), error);
+        assert_int_equal(res, 1);
+        assert_int_equal(test_rfb_encoding, TEST_RFB_H264);
+    }
+
+    CALL(res = close(h264), error);
+    h264 = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+
+error:
+    if (zrle != -1)
+        close(zrle);
+    if (h264 != -1)
+        close(h264);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+// returns 1 if an output besides the rfb outputs has the filter with the index in own path
+static int test_rfb_is_shared(int index)
+{
+    for (int i = 0; i < MAX_OUTPUTS && outputs[i].context != NULL; i++) {
+        struct output_t *output = outputs + i;
+        if (output == rfb.output || output == rfb.raw_output)
+            continue;
+        for (int k = 0; k < kv_size(output->filters); k++)
+            if (kv_A(output->filters, k).index == index)
+                return 1;
+    }
+    return 0;
+}
+
+// the last client which leaves doesn't stop anything on the thread of the server, the next
+// tick stops filters which only the rfb path uses and keeps the input and filters which
+// the other outputs share
+static void test_rfb_idle(void **state)
+{
+    int res = 0, client = -1, length = 0;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    const int32_t encodings[] = { TEST_RFB_H264 };
+    CALL(res = client = test_rfb_connect(encodings, ARRAY_SIZE(encodings), 0), error);
+    CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 0), error);
+    CALL(res = test_rfb_sync(client), error);
+    CALL(res = test_rfb_tick(), error);
+    CALL(res = test_rfb_read_update(client, &length, NULL, 0), error);
+    assert_int_equal(res, 1);
+
+    struct output_t *output = rfb.output;
+    for (int k = 0; k < kv_size(output->filters); k++)
+        assert_true(kv_A(filters, kv_A(output->filters, k).index)->is_started());
+
+    CALL(res = close(client), error);
+    client = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+    assert_true(input.is_started());
+    for (int k = 0; k < kv_size(output->filters); k++)
+        assert_true(kv_A(filters, kv_A(output->filters, k).index)->is_started());
+
+    // the flag is consumed by the tick, the other outputs keep getting frames
+    for (int i = 0; i < TEST_RFB_FRAMES; i++)
+        CALL(res = test_rfb_tick(), error);
+    assert_int_equal(rfb.is_idle, 0);
+    assert_true(input.is_started());
+    for (int k = 0; k < kv_size(output->filters); k++) {
+        int index = kv_A(output->filters, k).index;
+        assert_int_equal(kv_A(filters, index)->is_started(), test_rfb_is_shared(index));
+    }
+
+error:
+    if (client != -1)
+        close(client);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+// the server waits for the rest of the message which is split by the uplink, the text of
+// ClientCutText is skipped even if it's longer than the buffer
+static void test_rfb_partial(void **state)
+{
+    int res = 0, client = -1, length = 0;
+    uint8_t data[8 + 8 + RFB_READ_BUFFER_BYTES * 2 + 10] = {
+        TEST_RFB_KEY_EVENT, 1, 0, 0, 0, 0, 0xff, 0x0d,
+        TEST_RFB_CUT_TEXT, 0, 0, 0, 0, 0, RFB_READ_BUFFER_BYTES * 2 >> 8, 0
+    };
+    int request = sizeof(data) - 10;
+    memset(data + 16, 'a', request - 16);
+    data[request] = TEST_RFB_UPDATE_REQUEST;
+    data[request + 6] = app.video_width >> 8;
+    data[request + 7] = app.video_width & 0xff;
+    data[request + 8] = app.video_height >> 8;
+    data[request + 9] = app.video_height & 0xff;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    const int32_t encodings[] = { TEST_RFB_H264 };
+    CALL(res = client = test_rfb_connect(encodings, ARRAY_SIZE(encodings), 0), error);
+    CALL(res = test_rfb_sync(client), error);
+
+    // the half of KeyEvent, the rest of it with the text and the request without the last
+    // byte, which is kept until it comes
+    struct rfb_client_t *server = rfb.clients;
+    const int parts[] = { 4, sizeof(data) - 1 };
+    const int buffered[] = { 4, 9 };
+    int offset = 0;
+    for (int i = 0; i < ARRAY_SIZE(parts); i++) {
+        CALL(res = send(client, data + offset, parts[i] - offset, 0), error);
+        offset += res;
+        int in_length = -1;
+        for (int j = 0; j < TEST_RFB_TIMEOUT_MS && in_length != buffered[i]; j++) {
+            test_rfb_sleep();
+            in_length = __atomic_load_n(&server->in_length, __ATOMIC_SEQ_CST);
+        }
+        assert_int_equal(in_length, buffered[i]);
+        assert_int_equal(__atomic_load_n(&server->skip_length, __ATOMIC_SEQ_CST), 0);
+    }
+    CALL(res = send(client, data + offset, sizeof(data) - offset, 0), error);
+    CALL(res = test_rfb_sync(client), error);
+
+    CALL(res = test_rfb_tick(), error);
+    CALL(res = test_rfb_read_update(client, &length, NULL, 0), error);
+    assert_int_equal(res, 1);
+    assert_true(length > 0);
+
+    CALL(res = close(client), error);
+    client = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+
+error:
+    if (client != -1)
+        close(client);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+#ifdef MMAL_ENCODER_WRAP
+// the large payload goes by MSG_ZEROCOPY, the kernel keeps its pages until the client
+// takes the rest of the update, which is copied to the queue when the socket is full
+static void test_rfb_zerocopy(void **state)
+{
+    int res = 0, client = -1, length = 0;
+    const int size = RFB_ZEROCOPY_BYTES * 3 / 2;
+    int out_length = mmal_stub_out_length;
+    uint8_t *payload = NULL;
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    mmal_stub_out_length = size;
+    payload = malloc(size);
+    assert_non_null(payload);
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    const int32_t encodings[] = { TEST_RFB_H264 };
+    CALL(res = client = test_rfb_connect(encodings, ARRAY_SIZE(encodings), 4096), error);
+    CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 0), error);
+    CALL(res = test_rfb_sync(client), error);
+    CALL(res = test_rfb_tick(), error);
+
+    // the server sends until the socket is full
+    struct rfb_client_t *server = rfb.clients;
+    int is_full = 0;
+    for (int i = 0; i < TEST_RFB_TIMEOUT_MS && !is_full; i++) {
+        test_rfb_sleep();
+        pthread_mutex_lock(&server->mutex);
+        is_full = server->is_out_polled;
+        pthread_mutex_unlock(&server->mutex);
+    }
+    assert_true(is_full);
+
+    // the rest of the update doesn't refer the frame, the frame which the kernel sends is
+    // referenced until the completion
+    struct frame_t *frame = NULL;
+    int payloads = 0, zerocopies = 0, refs = 0;
+    pthread_mutex_lock(&server->mutex);
+    int announced = server->announced;
+    int queue_length = server->queue_length;
+    for (int i = 0; i < kv_size(server->segments); i++)
+        payloads += kv_A(server->segments, i).frame != NULL;
+    if (server->is_zerocopy) {
+        zerocopies = kv_size(server->zerocopies);
+        frame = zerocopies > 0? kv_A(server->zerocopies, 0).frame: NULL;
+        refs = frame? __atomic_load_n(&frame->refs, __ATOMIC_SEQ_CST): 0;
+    }
+    pthread_mutex_unlock(&server->mutex);
+    assert_true(announced > 0);
+    assert_true(queue_length > 0);
+    assert_int_equal(payloads, 0);
+    if (server->is_zerocopy) {
+        assert_int_equal(zerocopies, 1);
+        assert_true(refs > 0);
+    }
+
+    // the client gets the IDR frame of the encoder as it is
+    CALL(res = test_rfb_read_update(client, &length, payload, size), error);
+    assert_int_equal(res, 1);
+    assert_int_equal(length, size);
+    assert_int_equal(payload[3], 1);
+    assert_int_equal(payload[4], 0x65);
+    int zeros = 5;
+    while (zeros < size && payload[zeros] == 0)
+        zeros++;
+    assert_int_equal(zeros, size);
+
+    // the frame is released by the completion
+    if (frame) {
+        int count = 1;
+        for (int i = 0; i < TEST_RFB_TIMEOUT_MS && count > 0; i++) {
+            test_rfb_sleep();
+            pthread_mutex_lock(&server->mutex);
+            count = kv_size(server->zerocopies);
+            pthread_mutex_unlock(&server->mutex);
+        }
+        assert_int_equal(count, 0);
+        assert_int_equal(__atomic_load_n(&frame->refs, __ATOMIC_SEQ_CST), 0);
+    }
+
+    CALL(res = close(client), error);
+    client = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+
+error:
+    mmal_stub_out_length = out_length;
+    if (client != -1)
+        close(client);
+    free(payload);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+// the client which doesn't request updates gets frames until RFB_CLIENT_FRAMES are queued
+// for it, the rest is dropped until the IDR frame, which is requested once
+static void test_rfb_congestion(void **state)
+{
+    int res = 0, streamer = -1, client = -1, length = 0;
+    uint8_t payload[RFB_READ_BUFFER_BYTES];
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    // the client with continuous updates gets the frame of every tick
+    const int32_t continuous[] = { TEST_RFB_H264, TEST_RFB_CONTINUOUS_ENCODING };
+    CALL(res = streamer = test_rfb_connect(continuous, ARRAY_SIZE(continuous), 0), error);
+    CALL(res = test_rfb_send_request(streamer, TEST_RFB_CONTINUOUS, 1), error);
+    CALL(res = test_rfb_sync(streamer), error);
+    const int32_t encodings[] = { TEST_RFB_H264 };
+    CALL(res = client = test_rfb_connect(encodings, ARRAY_SIZE(encodings), 0), error);
+    CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 1), error);
+    CALL(res = test_rfb_sync(client), error);
+    mmal_stub_key_frames = 0;
+
+    // the first frame goes by the requested update, next ones wait for the next request
+    for (int i = 0; i < RFB_CLIENT_FRAMES + 3; i++) {
+        CALL(res = test_rfb_tick(), error);
+        CALL(res = test_rfb_read_update(streamer, &length, NULL, 0), error);
+        if (i == 0) {
+            CALL(res = test_rfb_read_update(client, &length, NULL, 0), error);
+            assert_int_equal(res, 1);
+        }
+    }
+    assert_int_equal(mmal_stub_key_frames, 0);
+
+    // frames which have been queued go by the next update, the rest has been dropped
+    CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 1), error);
+    CALL(res = test_rfb_read_update(client, &length, NULL, 0), error);
+    assert_int_equal(res, RFB_CLIENT_FRAMES - 1);
+    assert_int_equal(mmal_stub_key_frames, 1);
+
+    // the client which requests again waits for the same IDR frame
+    CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 1), error);
+    CALL(res = test_rfb_sync(client), error);
+    assert_int_equal(mmal_stub_key_frames, 1);
+
+    // the stream goes on from the IDR frame
+    CALL(res = test_rfb_tick(), error);
+    CALL(res = test_rfb_read_update(streamer, &length, NULL, 0), error);
+    CALL(res = test_rfb_read_update(client, &length, payload, sizeof(payload)), error);
+    assert_int_equal(res, 1);
+    assert_int_equal(payload[4], 0x65);
+    assert_int_equal(mmal_stub_key_frames, 1);
+
+    CALL(res = close(client), error);
+    client = -1;
+    CALL(res = close(streamer), error);
+    streamer = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+
+error:
+    if (client != -1)
+        close(client);
+    if (streamer != -1)
+        close(streamer);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+
+// the update which waits for the slow client lowers the bitrate of the encoder, updates
+// which are received in time raise it back
+static void test_rfb_rate(void **state)
+{
+    int res = 0, client = -1, length = 0;
+    const int size = RFB_ZEROCOPY_BYTES * 3 / 2;
+    int out_length = mmal_stub_out_length;
+    uint8_t *payload = NULL;
+    const struct timespec delay = { .tv_nsec = RFB_SEND_HIGH_MS * 2 * 1000000 };
+
+    expect_value(__wrap_ioctl, fmt->fmt.pix.pixelformat, V4L2_PIX_FMT_YUYV);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.width, app.video_width);
+    expect_value(__wrap_ioctl, fmt->fmt.pix.height, app.video_height);
+
+    mmal_stub_out_length = size;
+    payload = malloc(size);
+    assert_non_null(payload);
+    CALL(res = app_init(), error);
+    CALL(res = test_rfb_tick(), error);
+    const int32_t encodings[] = { TEST_RFB_H264 };
+    CALL(res = client = test_rfb_connect(encodings, ARRAY_SIZE(encodings), 4096), error);
+    CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 1), error);
+    CALL(res = test_rfb_sync(client), error);
+    assert_int_equal(__atomic_load_n(&rfb.bitrate, __ATOMIC_SEQ_CST), app.h264_bitrate);
+    CALL(res = test_rfb_tick(), error);
+
+    // the client doesn't read the update which fills the socket for a while
+    struct rfb_client_t *server = rfb.clients;
+    int is_full = 0;
+    for (int i = 0; i < TEST_RFB_TIMEOUT_MS && !is_full; i++) {
+        test_rfb_sleep();
+        pthread_mutex_lock(&server->mutex);
+        is_full = server->is_out_polled;
+        pthread_mutex_unlock(&server->mutex);
+    }
+    assert_true(is_full);
+    CALL(res = nanosleep(&delay, NULL), error);
+    CALL(res = test_rfb_read_update(client, &length, payload, size), error);
+    assert_int_equal(length, size);
+
+    // the fence is answered after the update is sent and its rate is controlled
+    CALL(res = test_rfb_sync(client), error);
+    int bitrate = app.h264_bitrate * 3 / 4;
+    assert_int_equal(__atomic_load_n(&rfb.bitrate, __ATOMIC_SEQ_CST), bitrate);
+    assert_int_equal(__atomic_load_n(&mmal_stub_bitrate, __ATOMIC_SEQ_CST), bitrate * 1000);
+
+    // the bitrate is held for a few frames and raised after stable ones
+    mmal_stub_out_length = out_length;
+    int frames = 0;
+    for (; frames < 2 * (RFB_RATE_HOLD_FRAMES + RFB_RATE_STABLE_FRAMES); frames++) {
+        if (__atomic_load_n(&rfb.bitrate, __ATOMIC_SEQ_CST) != bitrate)
+            break;
+        CALL(res = test_rfb_send_request(client, TEST_RFB_UPDATE_REQUEST, 1), error);
+        CALL(res = test_rfb_sync(client), error);
+        CALL(res = test_rfb_tick(), error);
+        CALL(res = test_rfb_read_update(client, &length, NULL, 0), error);
+        CALL(res = test_rfb_sync(client), error);
+    }
+    assert_true(frames >= RFB_RATE_HOLD_FRAMES + RFB_RATE_STABLE_FRAMES);
+    bitrate = MIN(bitrate + bitrate / 10 + 1, app.h264_bitrate);
+    assert_int_equal(__atomic_load_n(&rfb.bitrate, __ATOMIC_SEQ_CST), bitrate);
+    assert_int_equal(__atomic_load_n(&mmal_stub_bitrate, __ATOMIC_SEQ_CST), bitrate * 1000);
+
+    CALL(res = close(client), error);
+    client = -1;
+    CALL(res = test_rfb_wait_clients(0), error);
+
+error:
+    mmal_stub_out_length = out_length;
+    if (client != -1)
+        close(client);
+    free(payload);
+    assert_int_not_equal(res, -1);
+    app_cleanup();
+}
+#endif //MMAL_ENCODER_WRAP
 #endif //RFB
 
 #ifdef CONTROL
@@ -236,7 +1886,16 @@ int main(int argc, char **argv)
     else if (rfb != KH_END(h)) {
         const struct CMUnitTest tests[] = {
             #ifdef RFB
-                cmocka_unit_test_setup(test_rfb, NULL)
+                cmocka_unit_test_setup(test_rfb, NULL),
+                cmocka_unit_test_setup(test_rfb_continuous, NULL),
+                cmocka_unit_test_setup(test_rfb_clients, NULL),
+                cmocka_unit_test_setup(test_rfb_partial, NULL),
+                cmocka_unit_test_setup(test_rfb_idle, NULL),
+                #ifdef MMAL_ENCODER_WRAP
+                    cmocka_unit_test_setup(test_rfb_zerocopy, NULL),
+                    cmocka_unit_test_setup(test_rfb_congestion, NULL),
+                    cmocka_unit_test_setup(test_rfb_rate, NULL),
+                #endif //MMAL_ENCODER_WRAP
             #endif //RFB
         };
         res = cmocka_run_group_tests(tests, test_setup, test_teardown);
@@ -252,7 +1911,29 @@ int main(int argc, char **argv)
     else {
         const struct CMUnitTest tests[] = {
             cmocka_unit_test_setup(test_utils_init, NULL),
+            cmocka_unit_test_setup(test_frame_pool, NULL),
+            cmocka_unit_test_setup(test_yuv_kernels, NULL),
+            cmocka_unit_test_setup(test_yuv_rgb_kernels, NULL),
+            cmocka_unit_test_setup(test_bands, NULL),
+            cmocka_unit_test_setup(test_find_path, NULL),
+            #ifdef MMAL_ENCODER
+                cmocka_unit_test_setup(test_in_frame, NULL),
+                cmocka_unit_test_setup(test_encoder_out_frames, NULL),
+                cmocka_unit_test_setup(test_mmal_camera, NULL),
+            #endif //MMAL_ENCODER
+            #ifdef V4L_ENCODER_WRAP
+                cmocka_unit_test_setup(test_v4l_encoder_bitrate, NULL),
+                cmocka_unit_test_setup(test_v4l_encoder_key_frame, NULL),
+                cmocka_unit_test_setup(test_v4l_encoder_slices, NULL),
+            #endif //V4L_ENCODER_WRAP
+            #ifdef SOFTWARE_ENCODER
+                cmocka_unit_test_setup(test_h264_encoder, NULL),
+            #endif //SOFTWARE_ENCODER
+            cmocka_unit_test_setup(test_calibration, NULL),
             cmocka_unit_test_setup(test_file_loop, NULL),
+            cmocka_unit_test_setup(test_file_pipeline, NULL),
+            cmocka_unit_test_setup(test_pipeline_handoff, NULL),
+            cmocka_unit_test_setup(test_output_idle, NULL),
             #ifdef SDL
                 cmocka_unit_test_setup(test_sdl_loop, NULL),
             #endif //SDL
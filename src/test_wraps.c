@@ -24,9 +24,15 @@ extern struct v4l_state_t v4l;
 extern struct control_state_t control;
 #endif
 
-static uint8_t *image = NULL;
+static uint8_t *images[V4L_MAX_BUFS];
 static int image_width = 0;
 static int image_height = 0;
+static int images_count = 0;
+// indexes of buffers queued to the fake driver in order of queuing
+static int images_queue[V4L_MAX_BUFS];
+static int images_queue_len = 0;
+// buffers are queued and dequeued by different stages of the pipeline
+static pthread_mutex_t images_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int __wrap___xstat(int ver, const char * filename, struct stat * stat_buf)
 {
@@ -174,17 +180,40 @@ int __wrap_ioctl(int fd, int request, void *arg)
             return __real_ioctl(fd, request, arg);
         }
         WRAP_DEBUG("request: VIDIOC_REQBUFS");
+        struct v4l2_requestbuffers *req = arg;
+        assert_int_equal(req->memory, V4L2_MEMORY_MMAP);
+        assert_in_range(req->count, 0, V4L_MAX_BUFS);
+        images_count = req->count;
+        images_queue_len = 0;
+        return 0;
+    }
+    else if (request == (int)VIDIOC_QUERYBUF) {
+        if (fd != 1) {
+            WRAP_DEBUG("real request: VIDIOC_QUERYBUF");
+            return __real_ioctl(fd, request, arg);
+        }
+        WRAP_DEBUG("request: VIDIOC_QUERYBUF");
+        struct v4l2_buffer *buf = arg;
+        assert_in_range(buf->index, 0, images_count - 1);
+        buf->length = image_width * image_height * 2;
+        buf->m.offset = buf->index * buf->length;
         return 0;
     }
     else if (request == (int)VIDIOC_QBUF) {
         if (fd != 1) {
-            WRAP_DEBUG("real request: VIDIOC_REQBUFS");
+            WRAP_DEBUG("real request: VIDIOC_QBUF");
             return __real_ioctl(fd, request, arg);
         }
-        WRAP_DEBUG("request: VIDIOC_REQBUFS");
+        WRAP_DEBUG("request: VIDIOC_QBUF, index: %d", ((struct v4l2_buffer *)arg)->index);
         struct v4l2_buffer *buf = arg;
-        assert_int_equal(buf->length, image_width * image_height * 2);
-        image = (uint8_t *)buf->m.userptr;
+        assert_int_equal(buf->memory, V4L2_MEMORY_MMAP);
+        assert_in_range(buf->index, 0, images_count - 1);
+        pthread_mutex_lock(&images_mutex);
+        assert_in_range(images_queue_len, 0, images_count - 1);
+        for (int i = 0; i < images_queue_len; i++)
+            assert_int_not_equal(images_queue[i], buf->index);
+        images_queue[images_queue_len++] = buf->index;
+        pthread_mutex_unlock(&images_mutex);
         return 0;
     }
     else if (request == (int)VIDIOC_STREAMON) {
@@ -209,7 +238,23 @@ int __wrap_ioctl(int fd, int request, void *arg)
             return __real_ioctl(fd, request, arg);
         }
         WRAP_DEBUG("request: VIDIOC_DQBUF");
-        uint8_t *index = image;
+        struct v4l2_buffer *buf = arg;
+        pthread_mutex_lock(&images_mutex);
+        if (images_queue_len == 0) {
+            pthread_mutex_unlock(&images_mutex);
+            errno = EAGAIN;
+            return -1;
+        }
+        buf->index = images_queue[0];
+        buf->bytesused = image_width * image_height * 2;
+        buf->sequence = input_frames;
+        gettimeofday(&buf->timestamp, NULL);
+        images_queue_len--;
+        memmove(images_queue, images_queue + 1, images_queue_len * sizeof(images_queue[0]));
+        pthread_mutex_unlock(&images_mutex);
+        input_frames++;
+
+        uint8_t *index = images[buf->index];
         int row_length = image_width << 1;
         for (int i = 0; i < image_height; i++)
             for (int j = 0; j < row_length; j += 2, index += 2) {
@@ -217,6 +262,11 @@ int __wrap_ioctl(int fd, int request, void *arg)
             }
         return 0;
     }
+    else if (fd != 1) {
+        // sockets of the output are real ones
+        WRAP_DEBUG("real request: %d", request);
+        return __real_ioctl(fd, request, arg);
+    }
     else {
         WRAP_DEBUG("request: %d", request);
     }
@@ -224,6 +274,54 @@ int __wrap_ioctl(int fd, int request, void *arg)
     return -1;
 }
 
+#if defined(V4L_WRAP)
+void *test_v4l_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    int index = offset / length;
+    WRAP_DEBUG("mmap, index: %d", index);
+    assert_int_equal(length, image_width * image_height * 2);
+    assert_in_range(index, 0, V4L_MAX_BUFS - 1);
+    if (images[index] == NULL)
+        images[index] = malloc(length);
+    assert_ptr_not_equal(images[index], NULL);
+    return images[index];
+}
+
+int test_v4l_munmap(void *addr, size_t length)
+{
+    for (int i = 0; i < V4L_MAX_BUFS; i++)
+        if (images[i] == addr) {
+            free(images[i]);
+            images[i] = NULL;
+            return 0;
+        }
+    errno = EINVAL;
+    return -1;
+}
+
+#if !defined(V4L_ENCODER_WRAP)
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    if (fd != 1) {
+        WRAP_DEBUG("real mmap, fd: %d", fd);
+        return __real_mmap(addr, length, prot, flags, fd, offset);
+    }
+    return test_v4l_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int __wrap_munmap(void *addr, size_t length)
+{
+    if (test_v4l_munmap(addr, length) == 0)
+        return 0;
+    WRAP_DEBUG("real munmap, addr: %p", addr);
+    return __real_munmap(addr, length);
+}
+#endif //V4L_ENCODER_WRAP
+#endif //V4L_WRAP
+
 #ifdef SDL
 #include <SDL.h>
 static SDL_Window *sdl_window = (SDL_Window *)1;
@@ -196,6 +196,41 @@ cleanup:
     return -1;
 }
 
+// the model of the board is preferred to the model of the CPU, because it's more specific
+int utils_get_cpu_model(char *buffer, int len)
+{
+    const char *keys[] = { "Model", "model name", "Hardware" };
+    int found = ARRAY_SIZE(keys);
+    char line[MAX_STRING];
+
+    FILE *fstream = fopen("/proc/cpuinfo", "r");
+    if (fstream == NULL) {
+        CALL_MESSAGE(fopen("/proc/cpuinfo", "r"));
+        return -1;
+    }
+
+    strncpy(buffer, "Unknown", len - 1);
+    buffer[len - 1] = '\0';
+    while (fgets(line, sizeof(line), fstream)) {
+        for (int i = 0; i < found; i++) {
+            int key_len = strlen(keys[i]);
+            if (strncmp(line, keys[i], key_len) != 0 || strchr(" \t:", line[key_len]) == NULL)
+                continue;
+            char *value = strchr(line, ':');
+            if (value == NULL)
+                continue;
+            value += strspn(value + 1, " \t") + 1;
+            value[strcspn(value, "\r\n")] = '\0';
+            strncpy(buffer, value, len - 1);
+            buffer[len - 1] = '\0';
+            found = i;
+            break;
+        }
+    }
+    fclose(fstream);
+    return 0;
+}
+
 void utils_get_cpu_load(char * buffer, struct cpu_state_t *cpu)
 {
     utils_fill_buffer("/proc/stat", buffer, MAX_DATA, NULL);
@@ -54,6 +54,7 @@ int utils_fill_buffer(const char *path, char *buffer, int buffer_size, size_t *r
 void *utils_read_file(const char *path, size_t *len);
 int utils_write_file(const char *path, const uint8_t *data, int len);
 
+int utils_get_cpu_model(char *buffer, int len);
 void utils_get_cpu_load(char * buffer, struct cpu_state_t *cpu);
 void utils_get_memory_load(char * buffer, struct memory_state_t *memory);
 void utils_get_temperature(char * buffer, struct temperature_state_t *temperature);
@@ -18,9 +18,11 @@
 
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 #include "v4l.h"
 
 #include "linux/videodev2.h"
+#include "sys/mman.h"
 
 static struct format_mapping_t v4l_formats[] = {
     {
@@ -39,10 +41,11 @@ static struct format_mapping_t *v4l_format = NULL;
 
 struct v4l_state_t v4l = {
     .dev_id = -1,
-    .v4l_buf = NULL,
-    .v4l_buf_len = -1,
-    .buffer = NULL,
-    .buffer_len = -1,
+    .bufs = { REP(0, 0, 10, { MAP_FAILED, -1 }) },
+    .bufs_count = 0,
+    .bytesperline = 0,
+    .pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .frame = NULL
 };
 
 extern struct app_state_t app;
@@ -75,21 +78,68 @@ static int ioctl_enum(int fd, int request, void *arg)
     return res;
 }
 
+// the buffer is still read by the consumer of the frame, e.g. the socket of the client
+static int v4l_is_referenced(int index)
+{
+    if (index >= v4l.pool.frames_count)
+        return 0;
+    struct frame_t *frame = v4l.pool.frames + index;
+    return frame != v4l.frame && __atomic_load_n(&frame->refs, __ATOMIC_ACQUIRE) > 0;
+}
+
+static void v4l_clean_memory()
+{
+    // the driver doesn't accept buffers after this point
+    v4l.pool.release = NULL;
+    if (v4l.frame) {
+        CALL(frame_unref(v4l.frame));
+        v4l.frame = NULL;
+    }
+    // the buffer which is still referenced stays mapped, so its consumer doesn't read
+    // unmapped memory
+    int is_referenced[V4L_MAX_BUFS];
+    for (int i = 0; i < V4L_MAX_BUFS; i++)
+        is_referenced[i] = v4l_is_referenced(i);
+    frame_pool_cleanup(&v4l.pool);
+    for (int i = 0; i < V4L_MAX_BUFS; i++) {
+        if (is_referenced[i]) {
+            ERROR("buffer[%d] is still referenced, it isn't unmapped", i);
+            v4l.bufs[i].buf = MAP_FAILED;
+            v4l.bufs[i].length = -1;
+        }
+        else if (v4l.bufs[i].buf != MAP_FAILED) {
+            CALL(munmap(v4l.bufs[i].buf, v4l.bufs[i].length));
+            v4l.bufs[i].buf = MAP_FAILED;
+            v4l.bufs[i].length = -1;
+        }
+    }
+    v4l.bufs_count = 0;
+}
+
+// returns the buffer to the driver when the last consumer releases the frame
+static int v4l_release_frame(struct frame_t *frame)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = frame->index;
+    CALL(ioctl_wait(v4l.dev_id, VIDIOC_QBUF, &buf), cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
 static void v4l_cleanup()
 {
-    
+    v4l_clean_memory();
     if (v4l.dev_id != -1) {
         CALL(close(v4l.dev_id));
         v4l.dev_id = -1;
     }
-    if (v4l.buffer) {
-        free(v4l.buffer);
-        v4l.buffer = NULL;
-    }
-    if (v4l.v4l_buf) {
-        free(v4l.v4l_buf);
-        v4l.v4l_buf = NULL;
-    }
 }
 
 static int v4l_is_supported_resolution(int format)
@@ -160,25 +210,6 @@ static int v4l_init()
     int res = 0;
     sprintf(v4l.dev_name, V4L_CAMERA"%d", app.camera_num);
 
-    int len = app.video_width * app.video_height * 2;
-    uint8_t *data = malloc(len);
-    if (data == NULL) {
-        errno = ENOMEM;
-        CALL_MESSAGE(malloc);
-        goto cleanup;
-    }
-    v4l.v4l_buf = data;
-    v4l.v4l_buf_len = len;
-
-    data = malloc(len);
-    if (data == NULL) {
-        errno = ENOMEM;
-        CALL_MESSAGE(malloc);
-        goto cleanup;
-    }
-    v4l.buffer = data;
-    v4l.buffer_len = len;
-
     struct stat st = {
         .st_mode = 1
     };
@@ -266,22 +297,51 @@ static int v4l_start(int format)
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
     fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
     CALL(ioctl_enum(v4l.dev_id, VIDIOC_S_FMT, &fmt), cleanup);
+    v4l.bytesperline = fmt.fmt.pix.bytesperline;
 
     struct v4l2_requestbuffers req;
     memset(&req, 0, sizeof(req));
-    req.count = 1;
+    req.count = MIN(MAX(app.video_buffers, 2), V4L_MAX_BUFS);
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_USERPTR;
+    req.memory = V4L2_MEMORY_MMAP;
     CALL(ioctl_wait(v4l.dev_id, VIDIOC_REQBUFS, &req), cleanup);
+    ASSERT_INT(req.count, <=, V4L_MAX_BUFS, cleanup);
+    ASSERT_INT(req.count, >, 0, cleanup);
+    DEBUG("v4l.bufs_count: %d", req.count);
+    v4l.bufs_count = req.count;
+    CALL(frame_pool_init(&v4l.pool, v4l.bufs_count, 0), cleanup);
 
     struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_USERPTR;
-    buf.index = 0;
-    buf.m.userptr = (unsigned long)v4l.v4l_buf;
-    buf.length = v4l.v4l_buf_len;
-    CALL(ioctl_wait(v4l.dev_id, VIDIOC_QBUF, &buf), cleanup);
+    for (int i = 0; i < v4l.bufs_count; i++) {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        CALL(ioctl_wait(v4l.dev_id, VIDIOC_QUERYBUF, &buf), cleanup);
+
+        v4l.bufs[i].buf = mmap(NULL,
+            buf.length,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            v4l.dev_id,
+            buf.m.offset
+        );
+        if (v4l.bufs[i].buf == MAP_FAILED) {
+            CALL_MESSAGE(mmap);
+            goto cleanup;
+        }
+        v4l.bufs[i].length = buf.length;
+
+        struct frame_t *frame = v4l.pool.frames + i;
+        frame->planes[0] = v4l.bufs[i].buf;
+        frame_set_planes(frame, v4l_format->format, app.video_width, app.video_height);
+        if (v4l.bytesperline > 0 && frame->planes_count == 1)
+            frame->strides[0] = v4l.bytesperline;
+
+        CALL(ioctl_wait(v4l.dev_id, VIDIOC_QBUF, &buf), cleanup);
+    }
+
+    v4l.pool.release = v4l_release_frame;
 
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     CALL(ioctl_wait(v4l.dev_id, VIDIOC_STREAMON, &type), cleanup);
@@ -290,6 +350,7 @@ static int v4l_start(int format)
 
     return 0;
 cleanup:
+    v4l_clean_memory();
     v4l_format = NULL;
     if (errno == 0)
         errno = EAGAIN;
@@ -323,16 +384,26 @@ static int v4l_process_frame()
     struct v4l2_buffer buf;
     memset(&buf, 0, sizeof(buf));
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_USERPTR;
+    buf.memory = V4L2_MEMORY_MMAP;
     CALL(ioctl_wait(v4l.dev_id, VIDIOC_DQBUF, &buf), cleanup);
+    ASSERT_INT((int)buf.index, <, v4l.bufs_count, cleanup);
 
-    memcpy(v4l.buffer, v4l.v4l_buf, v4l.v4l_buf_len);
-    v4l.buffer_len = v4l.v4l_buf_len;
+    // the frame which hasn't been taken by the consumer goes back to the driver
+    if (v4l.frame) {
+        CALL(frame_unref(v4l.frame), cleanup);
+        v4l.frame = NULL;
+    }
 
-    buf.index = 0;
-    buf.m.userptr = (unsigned long)v4l.v4l_buf;
-    buf.length = v4l.v4l_buf_len;
-    CALL(ioctl_wait(v4l.dev_id, VIDIOC_QBUF, &buf), cleanup);
+    struct frame_t *frame = frame_pool_get_index(&v4l.pool, buf.index);
+    if (frame == NULL) {
+        CALL_MESSAGE(frame_pool_get_index(&v4l.pool, buf.index));
+        goto cleanup;
+    }
+    frame->sequence = buf.sequence;
+    frame->timestamp = buf.timestamp;
+    if (buf.bytesused)
+        frame->length = buf.bytesused;
+    v4l.frame = frame;
     return 0;
 
 cleanup:
@@ -341,11 +412,30 @@ cleanup:
     return -1;
 }
 
+// the capture goes on while consumers hold frames, e.g. the pipeline still processes
+// the frame, so the caller stops the input again later
 static int v4l_stop()
 {
     ASSERT_PTR(v4l_format, !=, NULL, cleanup);
+    for (int i = 0; i < v4l.bufs_count; i++) {
+        if (v4l_is_referenced(i)) {
+            DEBUG("input[%s] can't be stopped, frame[%d] is still referenced", input.name, i);
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     CALL(ioctl_wait(v4l.dev_id, VIDIOC_STREAMOFF, &type), cleanup);
+    v4l_clean_memory();
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    CALL(ioctl_wait(v4l.dev_id, VIDIOC_REQBUFS, &req), cleanup);
+
     v4l_format = NULL;
     DEBUG("input[%s] has been stopped!!!", input.name);
     return 0;
@@ -356,19 +446,20 @@ cleanup:
     return -1;
 }
 
-static uint8_t *v4l_get_buffer(int *format, int *length)
+static int v4l_get_frame(struct frame_t **frame)
 {
     ASSERT_PTR(v4l_format, !=, NULL, cleanup);
-    if (format)
-        *format = v4l_format->format;
-    if (length)
-        *length = v4l.buffer_len;
-    return v4l.buffer;
+    ASSERT_PTR(v4l.frame, !=, NULL, cleanup);
+
+    // the reference of the input is passed to the caller
+    *frame = v4l.frame;
+    v4l.frame = NULL;
+    return 0;
 
 cleanup:
     if (errno == 0)
         errno = EOPNOTSUPP;
-    return (uint8_t *)-1;
+    return -1;
 }
 
 static int v4l_get_formats(const struct format_mapping_t *formats[])
@@ -389,7 +480,7 @@ void v4l_construct(struct app_state_t *app)
     input.stop = v4l_stop;
     input.process_frame = v4l_process_frame;
 
-    input.get_buffer = v4l_get_buffer;
+    input.get_frame = v4l_get_frame;
     input.get_formats = v4l_get_formats;
 }
 
@@ -2,16 +2,25 @@
 #define v4l_h
 
 #define V4L_CAMERA "/dev/video"
+#define V4L_MAX_BUFS 10
+
+struct v4l_buffer_t {
+    uint8_t *buf;
+    int length;
+};
 
 struct v4l_state_t {
     char dev_name[20];
     int dev_id;
 
-    uint8_t *v4l_buf;
-    int v4l_buf_len;
+    // ring of mmaped buffers, all buffers which aren't referenced stay in the driver queue
+    struct v4l_buffer_t bufs[V4L_MAX_BUFS];
+    int bufs_count;
+    int bytesperline;
 
-    uint8_t *buffer;
-    int buffer_len;
+    // descriptors of mmaped buffers, the last reference returns the buffer to the driver
+    struct frame_pool_t pool;
+    struct frame_t *frame;
 };
 
 void v4l_construct();
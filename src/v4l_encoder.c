@@ -1,5 +1,7 @@
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
+#include "yuv_kernels.h"
 
 #include "v4l_encoder.h"
 
@@ -8,8 +10,14 @@
 
 static struct format_mapping_t v4l_input_formats[] = {
     {
-        .format = VIDEO_FORMAT_YUV422,
-        .internal_format = V4L2_PIX_FMT_YUV444M,
+        // YUYV is converted to I420 by CPU, so the encoder reads half of chroma
+        .format = VIDEO_FORMAT_YUYV,
+        .internal_format = V4L2_PIX_FMT_YUV420M,
+        .is_supported = 0
+    },
+    {
+        .format = VIDEO_FORMAT_I420,
+        .internal_format = V4L2_PIX_FMT_YUV420M,
         .is_supported = 0
     }
 };
@@ -28,16 +36,26 @@ static struct v4l_encoder_state_t v4l = {
     .in_bufs = {
         REP(0, 0, 10, { {MAP_FAILED, -1}, {MAP_FAILED, -1}, {MAP_FAILED, -1} })
     },
-    .out_bufs = { REP(0, 0, 3, { MAP_FAILED, -1 }) },
+    .out_bufs = { REP(0, 0, 6, { MAP_FAILED, -1 }) },
     .in_bufs_count = V4L_MAX_IN_BUFS,
     .out_bufs_count = V4L_MAX_OUT_BUFS,
     .in_curr_buf = 0,
-    .out_buf = NULL,
-    .out_buf_used = 0
+    .pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .aus_head = 0,
+    .aus_count = 0,
+    .props_index = 0,
+    .thread_res = -1,
+    .thread_errno = 0,
+    .is_running = 0,
+    .in_pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .in_free_count = 0,
+    .is_mutex = 0
 };
 
+static struct filter_t v4l_filter;
+
 extern struct app_state_t app;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 
 static int ioctl_enum(int fd, int request, void *arg)
 {
@@ -64,12 +82,13 @@ static int ioctl_again(int fd, int request, void *arg)
 }
 
 static void v4l2_clean_memory() {
-    if (v4l.out_bufs[0].buf != MAP_FAILED) {
-        CALL(munmap(v4l.out_bufs[0].buf, v4l.out_lengths[0]));
-        v4l.out_bufs[0].buf = MAP_FAILED;
-    }
+    for (int i = 0; i < V4L_MAX_OUT_BUFS; i++)
+        if (v4l.out_bufs[i].buf != MAP_FAILED) {
+            CALL(munmap(v4l.out_bufs[i].buf, v4l.out_lengths[0]));
+            v4l.out_bufs[i].buf = MAP_FAILED;
+        }
     for (int i = 0; i < V4L_MAX_IN_BUFS; i++)
-        for (int j = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
             if (v4l.in_bufs[i][j].buf != MAP_FAILED) {
                 CALL(munmap(v4l.in_bufs[i][j].buf, v4l.in_lengths[j]));
                 v4l.in_bufs[i][j].buf = MAP_FAILED;
@@ -77,8 +96,45 @@ static void v4l2_clean_memory() {
         }
 }
 
+// drops encoded frames which haven't been taken by the consumer
+static void v4l_clean_aus()
+{
+    for (int i = 0; i < v4l.aus_count; i++) {
+        struct frame_t *au = v4l.aus[(v4l.aus_head + i) % V4L_MAX_AUS];
+        CALL(frame_unref(au));
+    }
+    v4l.aus_head = 0;
+    v4l.aus_count = 0;
+}
+
+static int v4l_stop_thread()
+{
+    if (v4l.thread_res)
+        return 0;
+
+    __atomic_store_n(&v4l.is_running, 0, __ATOMIC_RELEASE);
+    // the blocked VIDIOC_DQBUF returns when the capture plane is stopped
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_STREAMOFF, &type), cleanup);
+
+    int res = pthread_join(v4l.thread, NULL);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_join(v4l.thread), res);
+        goto cleanup;
+    }
+    v4l.thread_res = -1;
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
 static int v4l_stop()
 {
+    CALL(v4l_stop_thread(), cleanup);
+
     enum v4l2_buf_type type;
     type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_STREAMOFF, &type), cleanup);
@@ -89,6 +145,9 @@ static int v4l_stop()
     v4l_input_format = NULL;
     v4l_output_format = NULL;
 
+    memset(v4l.in_held, 0, sizeof(v4l.in_held));
+    v4l.in_free_count = 0;
+    v4l_clean_aus();
     v4l2_clean_memory();
 
     return 0;
@@ -108,8 +167,17 @@ static void v4l_cleanup()
         v4l.dev_id = -1;
     }
 
-    if (v4l.out_buf) {
-        free(v4l.out_buf);
+    v4l_clean_aus();
+    frame_pool_cleanup(&v4l.pool);
+    frame_pool_cleanup(&v4l.in_pool);
+
+    if (v4l.is_mutex) {
+        int res = pthread_mutex_destroy(&v4l.mutex);
+        if (res) {
+            errno = res;
+            CALL_MESSAGE(pthread_mutex_destroy(&v4l.mutex));
+        }
+        v4l.is_mutex = 0;
     }
 
     v4l2_clean_memory();
@@ -176,6 +244,182 @@ cleanup:
     return -1;
 }
 
+// returns the input buffer which can be filled, the buffer which has never been queued
+// is taken first, then the buffer which has been dequeued but isn't used, otherwise
+// waits until the encoder finishes one of queued buffers
+static int v4l_acquire_in_buf(int *index)
+{
+    int res = pthread_mutex_lock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    *index = -1;
+    if (v4l.in_free_count > 0)
+        *index = v4l.in_free[--v4l.in_free_count];
+    else if (v4l.in_curr_buf < v4l.in_bufs_count)
+        *index = v4l.in_curr_buf++;
+    res = pthread_mutex_unlock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    if (*index >= 0)
+        return 0;
+
+    struct v4l2_buffer in_buf;
+    struct v4l2_plane in_planes[3];
+    memset(&in_buf, 0, sizeof(in_buf));
+    memset(in_planes, 0, sizeof(in_planes));
+    in_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    in_buf.memory = V4L2_MEMORY_MMAP;
+    in_buf.length = 3;
+    in_buf.m.planes = in_planes;
+    DEBUG("dqueue input frame");
+    GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_DQBUF, &in_buf), cleanup);
+    *index = in_buf.index;
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// keeps the buffer which hasn't been queued for the next frame
+static int v4l_release_in_buf(int index)
+{
+    int res = pthread_mutex_lock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    v4l.in_free[v4l.in_free_count++] = index;
+    res = pthread_mutex_unlock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// returns the buffer to the encoder if the previous filter hasn't sent the frame
+static int v4l_release_in_frame(struct frame_t *frame)
+{
+    if (__atomic_exchange_n(&v4l.in_held[frame->index], 0, __ATOMIC_ACQ_REL))
+        return v4l_release_in_buf(frame->index);
+    return 0;
+}
+
+// returns the buffer to the capture plane when the last consumer releases the frame
+static int v4l_release_au_frame(struct frame_t *frame)
+{
+    // the capture plane is stopped and the buffer is queued by the next start
+    if (!__atomic_load_n(&v4l.is_running, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct v4l2_buffer out_buf;
+    struct v4l2_plane out_plane;
+    memset(&out_buf, 0, sizeof(out_buf));
+    memset(&out_plane, 0, sizeof(out_plane));
+    out_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    out_buf.memory = V4L2_MEMORY_MMAP;
+    out_buf.index = frame->index;
+    out_buf.length = 1;
+    out_buf.m.planes = &out_plane;
+    GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_QBUF, &out_buf), cleanup);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// puts the frame which wraps the encoded buffer to the queue
+static int v4l_push_au(struct v4l2_buffer *out_buf)
+{
+    struct frame_t *out = frame_pool_get_index(&v4l.pool, out_buf->index);
+    if (out == NULL) {
+        CALL_MESSAGE(frame_pool_get_index(&v4l.pool, out_buf->index));
+        goto cleanup;
+    }
+    frame_set_planes(out, v4l_output_format->format, app.video_width, app.video_height);
+    // the encoder copies the timestamp of the input buffer to the capture buffer
+    int slot = out_buf->timestamp.tv_usec % V4L_MAX_PROPS;
+    frame_copy_props(out, v4l.props + slot);
+    out->planes[0] = v4l.out_bufs[out_buf->index].buf;
+    out->strides[0] = out_buf->m.planes[0].bytesused;
+    out->length = out_buf->m.planes[0].bytesused;
+
+    int res = pthread_mutex_lock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&v4l.mutex), res);
+        goto release;
+    }
+    // the queue is as long as the amount of buffers, so it can't be full
+    v4l.aus[(v4l.aus_head + v4l.aus_count) % V4L_MAX_AUS] = out;
+    v4l.aus_count++;
+    res = pthread_mutex_unlock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    return 0;
+
+release:
+    frame_unref(out);
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+// dequeues encoded frames, so all input buffers can be encoded while the caller prepares
+// next frames
+static void *v4l_dequeue_function(void *data)
+{
+    struct v4l2_buffer out_buf;
+    struct v4l2_plane out_plane;
+    while (__atomic_load_n(&v4l.is_running, __ATOMIC_ACQUIRE)) {
+        memset(&out_buf, 0, sizeof(out_buf));
+        memset(&out_plane, 0, sizeof(out_plane));
+        out_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        out_buf.memory = V4L2_MEMORY_MMAP;
+        out_buf.length = 1;
+        out_buf.m.planes = &out_plane;
+
+        if (v4l2_ioctl(v4l.dev_id, VIDIOC_DQBUF, &out_buf) == -1) {
+            if (!__atomic_load_n(&v4l.is_running, __ATOMIC_ACQUIRE))
+                break;
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            CALL_MESSAGE(v4l2_ioctl(v4l.dev_id, VIDIOC_DQBUF));
+            goto cleanup;
+        }
+        DEBUG("output buffer has been dqueued");
+
+        ASSERT_INT(out_buf.m.planes[0].bytesused, !=, 0, cleanup);
+        CALL(NvBufferMemSyncForDevice(
+            v4l.out_bufs[out_buf.index].fd,
+            0,
+            (void **)&v4l.out_bufs[out_buf.index].buf
+        ), cleanup);
+        // the buffer is queued again when the last consumer releases the frame
+        CALL(v4l_push_au(&out_buf), cleanup);
+    }
+    return NULL;
+
+cleanup:
+    __atomic_store_n(&v4l.thread_errno, errno? errno: EAGAIN, __ATOMIC_RELEASE);
+    return NULL;
+}
+
 static int v4l_init()
 {
     ASSERT_INT(v4l.dev_id, ==, -1, cleanup);
@@ -223,7 +467,6 @@ static int v4l_init()
                         app.video_height);
                     is_found = 1;
                 }
-                break;
             }
         }
 
@@ -267,17 +510,28 @@ static int v4l_init()
 
         fmt.index++;
         CALL(res = ioctl_enum(v4l.dev_id, VIDIOC_ENUM_FMT, &fmt), cleanup);
-
-        v4l.out_buf = malloc(V4L_OUT_BUFFER_SIZE);
-        if (!v4l.out_buf) {
-            CALL_MESSAGE(malloc(V4L_OUT_BUFFER_SIZE));
-            goto cleanup;
-        }
     }
     if (!is_found) {
         errno = EOPNOTSUPP;
         return -1;
     }
+
+    CALL(frame_pool_init(&v4l.pool, V4L_MAX_OUT_BUFS, 0), cleanup);
+    v4l.pool.release = v4l_release_au_frame;
+    // frames of the input pool wrap mmaped buffers of the encoder, the index of the frame
+    // is the index of the buffer
+    CALL(frame_pool_init(&v4l.in_pool, V4L_MAX_IN_BUFS, 0), cleanup);
+    v4l.in_pool.release = v4l_release_in_frame;
+
+    ASSERT_INT(v4l.is_mutex, ==, 0, cleanup);
+    res = pthread_mutex_init(&v4l.mutex, NULL);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_init(&v4l.mutex), res);
+        goto cleanup;
+    }
+    v4l.is_mutex = 1;
+
+    CALL(yuv_kernels_init(), cleanup);
     return 0;
 
 cleanup:
@@ -331,6 +585,33 @@ static int v4l_start(int input_format, int output_format)
     v4l.out_sizeimages[0] = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
     v4l.out_strides[0] = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
 
+    if (app.h264_bitrate > 0) {
+        struct v4l2_control control;
+        memset(&control, 0, sizeof(control));
+        control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+        control.value = app.h264_bitrate * 1000;
+        GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_S_CTRL, &control), cleanup);
+    }
+
+    // slices are limited by macroblocks, so the decoder starts on the top of the frame
+    // before the bottom is received
+    if (app.h264_slices > 1) {
+        int mb_rows = (app.video_height + 15) >> 4;
+        struct v4l2_ext_control controls[2];
+        memset(controls, 0, sizeof(controls));
+        controls[0].id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE;
+        controls[0].value = V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB;
+        controls[1].id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB;
+        controls[1].value = ((app.video_width + 15) >> 4) *
+            ((mb_rows + app.h264_slices - 1) / app.h264_slices);
+        struct v4l2_ext_controls ctrls;
+        memset(&ctrls, 0, sizeof(ctrls));
+        ctrls.ctrl_class = V4L2_CTRL_CLASS_MPEG;
+        ctrls.count = ARRAY_SIZE(controls);
+        ctrls.controls = controls;
+        GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_S_EXT_CTRLS, &ctrls), cleanup);
+    }
+
     memset(&fmt, 0, sizeof(fmt));
     fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
     fmt.fmt.pix_mp.width = app.video_width;
@@ -485,6 +766,16 @@ static int v4l_start(int input_format, int output_format)
     }
 
     v4l.in_curr_buf = 0;
+    v4l.in_free_count = 0;
+    v4l.props_index = 0;
+
+    v4l.thread_errno = 0;
+    __atomic_store_n(&v4l.is_running, 1, __ATOMIC_RELEASE);
+    v4l.thread_res = pthread_create(&v4l.thread, NULL, v4l_dequeue_function, NULL);
+    if (v4l.thread_res) {
+        CALL_CUSTOM_MESSAGE(pthread_create, v4l.thread_res);
+        goto cleanup;
+    }
 
     return 0;
 
@@ -504,12 +795,55 @@ static int v4l_is_started()
     return v4l_input_format != NULL && v4l_output_format != NULL? 1: 0;
 }
 
-static int v4l_process_frame(uint8_t *buffer)
+// describes mmaped I420 planes of the input buffer of the encoder
+static void v4l_set_planes(struct frame_t *planes, int index)
+{
+    memset(planes, 0, sizeof(*planes));
+    planes->format = VIDEO_FORMAT_I420;
+    planes->width = app.video_width;
+    planes->height = app.video_height;
+    planes->planes_count = 3;
+    for (int i = 0; i < 3; i++) {
+        planes->planes[i] = v4l.in_bufs[index][i].buf;
+        planes->strides[i] = v4l.in_strides[i];
+        planes->length += v4l.in_strides[i] * frame_get_plane_rows(planes, i);
+    }
+}
+
+// hands out the next input buffer of the encoder, so the previous filter writes the frame
+// right there, YUYV is converted by the encoder itself, so the buffer isn't provided
+static int v4l_get_in_frame(int format, struct frame_t **frame)
+{
+    ASSERT_PTR(v4l_input_format, !=, NULL, cleanup);
+    *frame = NULL;
+    if (format != VIDEO_FORMAT_I420 || format != v4l_input_format->format)
+        return 0;
+
+    int cb = -1;
+    CALL(v4l_acquire_in_buf(&cb), cleanup);
+    // the frame which wraps the buffer can still be referenced by consumers of the previous
+    // frame, then the buffer is kept for the next frame
+    struct frame_t *in = frame_pool_get_index(&v4l.in_pool, cb);
+    if (in == NULL) {
+        CALL(v4l_release_in_buf(cb), cleanup);
+        return 0;
+    }
+    v4l_set_planes(in, cb);
+    __atomic_store_n(&v4l.in_held[cb], 1, __ATOMIC_RELEASE);
+    *frame = in;
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EAGAIN;
+    return -1;
+}
+
+static int v4l_process_frame(struct frame_t *frame)
 {
     ASSERT_PTR(v4l_input_format, !=, NULL, cleanup);
     ASSERT_PTR(v4l_output_format, !=, NULL, cleanup);
 
-    int res = 0;
     struct v4l2_buffer in_buf;
     struct v4l2_plane in_planes[3];
     memset(&in_buf, 0, sizeof(in_buf));
@@ -519,117 +853,92 @@ static int v4l_process_frame(uint8_t *buffer)
     in_buf.length = 3;
     in_buf.m.planes = in_planes;
 
-    struct v4l2_buffer out_buf;
-    struct v4l2_plane out_plane;
-    memset(&out_buf, 0, sizeof(out_buf));
-    memset(&out_plane, 0, sizeof(out_plane));
-    out_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    out_buf.memory = V4L2_MEMORY_MMAP;
-    out_buf.length = 1;
-    out_buf.m.planes = &out_plane;
-
-    int cb = v4l.in_curr_buf + 1;
-    if (cb >= v4l.in_bufs_count) {
-        DEBUG("dqueue input frame, cb %d", cb);
-        GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_DQBUF, &in_buf), cleanup);
-        cb = in_buf.index;
+    // the thread has stopped on error, so encoded frames aren't dequeued anymore
+    int thread_errno = __atomic_load_n(&v4l.thread_errno, __ATOMIC_ACQUIRE);
+    if (thread_errno) {
+        errno = thread_errno;
+        CALL_MESSAGE(v4l_dequeue_function);
+        goto cleanup;
     }
-    else
-        v4l.in_curr_buf++;
 
-    DEBUG("queue input frame, current buf %d", cb);
-    uint8_t *yi = v4l.in_bufs[cb][0].buf;
-    uint8_t *ui = v4l.in_bufs[cb][1].buf;
-    uint8_t *vi = v4l.in_bufs[cb][2].buf;
-    for (int i = 0, y = 0; y < app.video_height; y++) {
-        for (int x = 0; x < app.video_width; x += 2, i += 4) {
-            uint8_t y0 = buffer[i];
-            uint8_t u01 = buffer[i + 1];
-            uint8_t y1 = buffer[i + 2];
-            uint8_t v01 = buffer[i + 3];
-            yi[x] = y0;
-            ui[x] = u01 & 0xF;
-            vi[x] = v01 & 0xF;
-            yi[x + 1] = y1;
-            ui[x + 1] = (u01 & 0xF0) >> 4;
-            vi[x + 1] = (v01 & 0xF0) >> 4;
+    int cb = -1;
+    struct frame_t planes;
+    if (frame->pool == &v4l.in_pool) {
+        // the previous filter has already written the frame to the mmaped buffers of the encoder
+        int is_held = __atomic_exchange_n(&v4l.in_held[frame->index], 0, __ATOMIC_ACQ_REL);
+        ASSERT_INT(is_held, !=, 0, cleanup);
+        cb = frame->index;
+        v4l_set_planes(&planes, cb);
+    }
+    else {
+        // the frame is converted or copied right to the mmaped buffers of the encoder
+        CALL(v4l_acquire_in_buf(&cb), cleanup);
+        v4l_set_planes(&planes, cb);
+        if (frame->format == VIDEO_FORMAT_YUYV) {
+            CALL(yuv_kernels_convert(frame, &planes), release);
+        }
+        else {
+            CALL(frame_copy_planes(&planes, frame), release);
         }
-        yi = v4l.in_bufs[cb][0].buf + v4l.in_strides[0] * y;
-        ui = v4l.in_bufs[cb][1].buf + v4l.in_strides[1] * y;
-        vi = v4l.in_bufs[cb][2].buf + v4l.in_strides[2] * y;
     }
+    DEBUG("queue input frame, current buf %d", cb);
 
     in_buf.index = cb;
-    in_buf.m.planes[0].bytesused = v4l.in_strides[0] * app.video_height;
-    in_buf.m.planes[1].bytesused = v4l.in_strides[1] * app.video_height;
-    in_buf.m.planes[2].bytesused = v4l.in_strides[2] * app.video_height;
+    for (int i = 0; i < 3; i++)
+        in_buf.m.planes[i].bytesused = v4l.in_strides[i] * frame_get_plane_rows(&planes, i);
     for (int i = 0; i < 3; i++) {
         CALL(NvBufferMemSyncForDevice(v4l.in_bufs[cb][i].fd, i, (void **)&v4l.in_bufs[cb][i].buf),
             cleanup);
     }
 
+    // the slot of properties is found by the timestamp of the encoded buffer
+    int slot = v4l.props_index++ % V4L_MAX_PROPS;
+    frame_copy_props(v4l.props + slot, frame);
+    in_buf.timestamp.tv_sec = 0;
+    in_buf.timestamp.tv_usec = slot;
+    in_buf.flags |= V4L2_BUF_FLAG_TIMESTAMP_COPY;
+
     DEBUG("input buffer about to queued");
     GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_QBUF, &in_buf), cleanup);
     DEBUG("input buffer has been queued");
-   
-    CALL(res = ioctl_again(v4l.dev_id, VIDIOC_DQBUF, &out_buf), cleanup);
-    DEBUG("output buffer has been dqueued");
-    if (res != -2) {
-        ASSERT_INT(out_buf.m.planes[0].bytesused, !=, 0, cleanup);
-        CALL(NvBufferMemSyncForDevice(
-            v4l.out_bufs[out_buf.index].fd,
-            0,
-            (void **)&v4l.out_bufs[out_buf.index].buf
-        ), cleanup);
-
-        ASSERT_INT(v4l.out_buf_used + out_buf.m.planes[0].bytesused,
-            <,
-            V4L_OUT_BUFFER_SIZE,
-            cleanup);
-        
-        memcpy(v4l.out_buf, v4l.out_bufs[out_buf.index].buf, out_buf.m.planes[0].bytesused);
-        v4l.out_buf_used += out_buf.m.planes[0].bytesused;
-
-        DEBUG("Encoder buffer received: %d, %x %x %x %x ...",
-            v4l.out_buf_used,
-            v4l.out_buf[0],
-            v4l.out_buf[1],
-            v4l.out_buf[2],
-            v4l.out_buf[3]);
-
-        /*char buffer[MAX_STRING];
-        static int index = 0;
-        sprintf(buffer, "data%d", index++);
-        utils_write_file(buffer, v4l.out_bufs[out_buf.index].buf, out_buf.m.planes[0].bytesused);*/
-
-        out_buf.m.planes[0].bytesused = 0;
-        //DEBUG("q out buf: %d", out_buf.index);
-        GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_QBUF, &out_buf), cleanup);
-    }
-    DEBUG("encoder frame has been processed!!!");
     return 0;
 
+release:
+    v4l_release_in_buf(cb);
 cleanup:
     if (errno == 0)
         errno = EAGAIN;
     return -1;
 }
 
-static uint8_t *v4l_get_buffer(int *out_format, int *length)
+static int v4l_get_frame(struct frame_t **frame)
 {
     ASSERT_PTR(v4l_input_format, !=, NULL, cleanup);
     ASSERT_PTR(v4l_output_format, !=, NULL, cleanup);
-    if (out_format)
-        *out_format = v4l_output_format->format;
-    if (length)
-        *length = v4l.out_buf_used;
-    v4l.out_buf_used = 0;
-    return v4l.out_buf;
+
+    int res = pthread_mutex_lock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_lock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    // the reference of the queue is passed to the caller, the oldest frame goes first
+    *frame = NULL;
+    if (v4l.aus_count > 0) {
+        *frame = v4l.aus[v4l.aus_head];
+        v4l.aus_head = (v4l.aus_head + 1) % V4L_MAX_AUS;
+        v4l.aus_count--;
+    }
+    res = pthread_mutex_unlock(&v4l.mutex);
+    if (res) {
+        CALL_CUSTOM_MESSAGE(pthread_mutex_unlock(&v4l.mutex), res);
+        goto cleanup;
+    }
+    return 0;
 
 cleanup:
     if (errno == 0)
         errno = EOPNOTSUPP;
-    return (uint8_t *)-1;
+    return -1;
 }
 
 static int v4l_get_in_formats(const struct format_mapping_t *formats[])
@@ -646,25 +955,67 @@ static int v4l_get_out_formats(const struct format_mapping_t *formats[])
     return ARRAY_SIZE(v4l_output_formats);
 }
 
+static int v4l_get_cost(int in_format, int out_format)
+{
+    // the frame is encoded by hardware, CPU converts YUYV to I420 in mmaped planes of
+    // the encoder or copies I420 planes there, bytes are counted by halves
+    int bytes = in_format == VIDEO_FORMAT_YUYV? 4 + 3: 3 + 3;
+    return app.video_width * app.video_height * bytes / 2 * FILTER_COST_BYTE;
+}
+
+static int v4l_request_key_frame()
+{
+    // the stream starts from the key frame anyway
+    if (!v4l_is_started())
+        return 0;
+
+    struct v4l2_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    control.value = 1;
+    GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_S_CTRL, &control), cleanup);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
+static int v4l_set_bitrate(int bitrate)
+{
+    if (!v4l_is_started())
+        return 0;
+
+    struct v4l2_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+    control.value = bitrate * 1000;
+    GEN_CALL(v4l2_ioctl(v4l.dev_id, VIDIOC_S_CTRL, &control), cleanup);
+    return 0;
+
+cleanup:
+    errno = EAGAIN;
+    return -1;
+}
+
 void v4l_encoder_construct()
 {
-    int i = 0;
-    while (i < MAX_FILTERS && filters[i].context != NULL)
-        i++;
-
-    if (i != MAX_FILTERS) {
-        filters[i].name = "v4l_encoder";
-        filters[i].context = &v4l;
-        filters[i].stop = v4l_stop;
-        filters[i].cleanup = v4l_cleanup;
-        filters[i].init = v4l_init;
-        filters[i].start = v4l_start;
-        filters[i].is_started = v4l_is_started;
-        filters[i].process_frame = v4l_process_frame;
-
-        filters[i].get_buffer = v4l_get_buffer;
-        filters[i].get_in_formats = v4l_get_in_formats;
-        filters[i].get_out_formats = v4l_get_out_formats;
-    }
+    struct filter_t *filter = &v4l_filter;
+    filter->name = "v4l_encoder";
+    filter->context = &v4l;
+    filter->stop = v4l_stop;
+    filter->cleanup = v4l_cleanup;
+    filter->init = v4l_init;
+    filter->start = v4l_start;
+    filter->is_started = v4l_is_started;
+    filter->process_frame = v4l_process_frame;
+    filter->get_frame = v4l_get_frame;
+    filter->get_in_formats = v4l_get_in_formats;
+    filter->get_out_formats = v4l_get_out_formats;
+    filter->get_cost = v4l_get_cost;
+    filter->get_in_frame = v4l_get_in_frame;
+    filter->request_key_frame = v4l_request_key_frame;
+    filter->set_bitrate = v4l_set_bitrate;
+    kv_push(struct filter_t *, filters, filter);
 }
 
@@ -3,8 +3,10 @@
 
 #define V4L_H264_ENCODER "/dev/nvhost-msenc"
 #define V4L_MAX_IN_BUFS 10
-#define V4L_MAX_OUT_BUFS 3 //3 is the minimum nubmer of buffers
-#define V4L_OUT_BUFFER_SIZE 51200
+// 3 is the minimum nubmer of buffers, encoded frames keep buffers until consumers release them
+#define V4L_MAX_OUT_BUFS 6
+#define V4L_MAX_AUS V4L_MAX_OUT_BUFS // encoded frames which wait for the consumer
+#define V4L_MAX_PROPS 32 // properties of frames which are being encoded
 
 struct v4l_encoder_plane_t {
     uint8_t *buf;
@@ -28,10 +30,33 @@ struct v4l_encoder_state_t {
     struct v4l_encoder_plane_t out_bufs[V4L_MAX_OUT_BUFS];
     int in_bufs_count;
     int out_bufs_count;
-    int in_curr_buf;
+    int in_curr_buf;            // the next buffer which has never been queued
 
-    uint8_t *out_buf;
-    int out_buf_used;
+    // encoded frames wrap mmaped buffers of the capture plane, the index of the frame is
+    // the index of the buffer
+    struct frame_pool_t pool;
+    // encoded frames in order of dequeuing
+    struct frame_t *aus[V4L_MAX_AUS];
+    int aus_head;
+    int aus_count;
+    // sequence and timestamp of queued frames, the buffer refers the slot by own timestamp
+    struct frame_t props[V4L_MAX_PROPS];
+    unsigned props_index;
+
+    // the thread dequeues encoded frames from the capture plane
+    pthread_t thread;
+    int thread_res;
+    int thread_errno;
+    int is_running;
+
+    // input buffers of the encoder handed out to the previous filter
+    struct frame_pool_t in_pool;
+    int in_held[V4L_MAX_IN_BUFS];
+    // dequeued buffers which haven't been filled yet
+    int in_free[V4L_MAX_IN_BUFS];
+    int in_free_count;
+    pthread_mutex_t mutex;
+    int is_mutex;
 };
 
 void v4l_encoder_construct();
@@ -21,7 +21,7 @@
 
 extern struct app_state_t app;
 extern struct input_t input;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 extern struct output_t outputs[MAX_OUTPUTS];
 extern int is_abort;
 
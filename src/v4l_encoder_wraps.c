@@ -19,33 +19,65 @@
 #include "khash.h"
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
 #include "app.h"
 #include "test.h"
 
 #include <stdarg.h> //va_list
 #include <setjmp.h> //jmp_buf
 #include <cmocka.h>
+#include <pthread.h> //pthread_mutex_t
 
 #include "v4l_encoder.h"
 #include "linux/videodev2.h"
 
 #define VIDEO_PATH "./h264_test_video"
 
+extern struct app_state_t app;
 extern int wrap_verbose;
 extern int test_verbose;
 
 static int encoder_width = 0;
 static int encoder_height = 0;
 static int encoder_buffer = -1;
-static void* buffers[V4L_MAX_IN_BUFS + V4L_MAX_OUT_BUFS];
+// every plane of input buffers is mapped by own offset, capture buffers follow them
+#define WRAP_IN_PLANES (V4L_MAX_IN_BUFS * 3)
+static void* buffers[WRAP_IN_PLANES + V4L_MAX_OUT_BUFS];
 static int out_buffers[V4L_MAX_OUT_BUFS];
 char buffer[MAX_STRING];
 
+// the fake encoder encodes queued input buffers in order when the capture plane is dequeued,
+// the encoder and the dequeue thread of the filter call ioctl concurrently
+static pthread_mutex_t encoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct v4l2_buffer in_queued[V4L_MAX_IN_BUFS];
+static int in_queued_head = 0;
+static int in_queued_count = 0;
+static int in_encoded[V4L_MAX_IN_BUFS];
+static int in_encoded_head = 0;
+static int in_encoded_count = 0;
+// controls which the encoder is set to, tests check them
+int v4l_wrap_bitrate = 0;
+int v4l_wrap_key_frames = 0;
+int v4l_wrap_slice_mbs = 0;
+
+static int wrap_wait_buffer()
+{
+    struct timespec wait = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&wait, NULL);
+    errno = EAGAIN;
+    return -1;
+}
+
 int __wrap_v4l2_open(const char * file, int oflag, ...)
 {
     WRAP_DEBUG("v4l2_open, file: %s", file);
     memset(buffers, 0, sizeof(buffers));
     memset(out_buffers, 0, sizeof(out_buffers));
+    in_queued_head = in_queued_count = 0;
+    in_encoded_head = in_encoded_count = 0;
+    v4l_wrap_bitrate = 0;
+    v4l_wrap_key_frames = 0;
+    v4l_wrap_slice_mbs = 0;
     return 1;
 }
 
@@ -62,7 +94,7 @@ int __wrap_v4l2_ioctl(int fd, int request, void * arg)
         WRAP_DEBUG("request: %s", "VIDIOC_ENUM_FMT");
         struct v4l2_fmtdesc *fmt = arg;
         if (fmt->index == 0 && fmt->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
-            fmt->pixelformat = V4L2_PIX_FMT_YUV444M;
+            fmt->pixelformat = V4L2_PIX_FMT_YUV420M;
             return 0;
         }
         if (fmt->index == 0 && fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
@@ -100,8 +132,11 @@ int __wrap_v4l2_ioctl(int fd, int request, void * arg)
             encoder_width = buf->fmt.pix_mp.width;
             encoder_height = buf->fmt.pix_mp.height;
             for (int i = 0; i < buf->fmt.pix_mp.num_planes; i++) {
-                buf->fmt.pix_mp.plane_fmt[i].sizeimage = encoder_width * encoder_height;
-                buf->fmt.pix_mp.plane_fmt[i].bytesperline = encoder_width;
+                // chroma planes of YUV420M have half of width and height
+                int shift = i > 0? 1: 0;
+                buf->fmt.pix_mp.plane_fmt[i].sizeimage =
+                    (encoder_width >> shift) * (encoder_height >> shift);
+                buf->fmt.pix_mp.plane_fmt[i].bytesperline = encoder_width >> shift;
             }
         }
         else 
@@ -156,9 +191,12 @@ int __wrap_v4l2_ioctl(int fd, int request, void * arg)
     else if (request == (int)VIDIOC_QBUF) {
         WRAP_DEBUG("request: %s", "VIDIOC_QBUF");
         struct v4l2_buffer *buf = arg;
+        pthread_mutex_lock(&encoder_mutex);
         if (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
             assert_int_equal(buf->length, 3);
-            assert_in_range(buf->length, 0, V4L_MAX_IN_BUFS);
+            assert_in_range(buf->index, 0, V4L_MAX_IN_BUFS);
+            assert_in_range(in_queued_count, 0, V4L_MAX_IN_BUFS - 1);
+            in_queued[(in_queued_head + in_queued_count++) % V4L_MAX_IN_BUFS] = *buf;
         }
         else
             if (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
@@ -167,9 +205,45 @@ int __wrap_v4l2_ioctl(int fd, int request, void * arg)
                 assert_int_equal(out_buffers[buf->index], 0);
                 out_buffers[buf->index] = 1;
             }
+        pthread_mutex_unlock(&encoder_mutex);
 
         return 0;
     }
+    else if (request == (int)VIDIOC_S_CTRL) {
+        WRAP_DEBUG("request: %s", "VIDIOC_S_CTRL");
+        struct v4l2_control *control = arg;
+        if (control->id == V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME) {
+            // the recording starts from the IDR frame with parameter sets
+            assert_int_equal(control->value, 1);
+            pthread_mutex_lock(&encoder_mutex);
+            encoder_buffer = 1;
+            v4l_wrap_key_frames++;
+            pthread_mutex_unlock(&encoder_mutex);
+            return 0;
+        }
+        // the bitrate in bits per second is lowered by the rate control, it never exceeds
+        // the option
+        assert_int_equal(control->id, V4L2_CID_MPEG_VIDEO_BITRATE);
+        assert_in_range(control->value, 1000, app.h264_bitrate * 1000);
+        assert_int_equal(control->value % 1000, 0);
+        __atomic_store_n(&v4l_wrap_bitrate, control->value, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    else if (request == (int)VIDIOC_S_EXT_CTRLS) {
+        WRAP_DEBUG("request: %s", "VIDIOC_S_EXT_CTRLS");
+        struct v4l2_ext_controls *ctrls = arg;
+        // slices are limited by whole rows of macroblocks
+        assert_int_equal(ctrls->ctrl_class, V4L2_CTRL_CLASS_MPEG);
+        assert_int_equal(ctrls->count, 2);
+        assert_int_equal(ctrls->controls[0].id, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE);
+        assert_int_equal(ctrls->controls[0].value, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB);
+        assert_int_equal(ctrls->controls[1].id, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB);
+        int mbs = ctrls->controls[1].value;
+        assert_true(mbs > 0);
+        assert_int_equal(mbs % ((app.video_width + 15) >> 4), 0);
+        v4l_wrap_slice_mbs = mbs;
+        return 0;
+    }
     else if (request == (int)VIDIOC_STREAMON) {
         WRAP_DEBUG("request: %s", "VIDIOC_STREAMON");
         encoder_buffer = 1;
@@ -177,37 +251,72 @@ int __wrap_v4l2_ioctl(int fd, int request, void * arg)
     }
     else if (request == (int)VIDIOC_STREAMOFF) {
         WRAP_DEBUG("request: %s", "VIDIOC_STREAMOFF");
+        // buffers of the plane are returned to the application, so the next start queues
+        // them again
+        enum v4l2_buf_type *type = arg;
+        pthread_mutex_lock(&encoder_mutex);
+        if (*type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+            in_queued_head = in_queued_count = 0;
+            in_encoded_head = in_encoded_count = 0;
+        }
+        else
+            memset(out_buffers, 0, sizeof(out_buffers));
+        pthread_mutex_unlock(&encoder_mutex);
         return 0;
     }
     else if (request == (int)VIDIOC_DQBUF) {
         WRAP_DEBUG("request: %s", "VIDIOC_DQBUF");
         struct v4l2_buffer *buf = arg;
-        if (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+        if (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
             assert_int_equal(buf->length, 3);
+            // blocks until the fake encoder finishes one of queued buffers
+            pthread_mutex_lock(&encoder_mutex);
+            while (in_encoded_count == 0) {
+                pthread_mutex_unlock(&encoder_mutex);
+                wrap_wait_buffer();
+                pthread_mutex_lock(&encoder_mutex);
+            }
+            buf->index = in_encoded[in_encoded_head];
+            in_encoded_head = (in_encoded_head + 1) % V4L_MAX_IN_BUFS;
+            in_encoded_count--;
+            pthread_mutex_unlock(&encoder_mutex);
+        }
         else
             if (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
                 assert_int_equal(buf->length, 1);
+                pthread_mutex_lock(&encoder_mutex);
                 int index = 0;
                 while (index < V4L_MAX_OUT_BUFS && out_buffers[index] == 0)
                     index++;
-                assert_in_range(index, 0, V4L_MAX_OUT_BUFS);
-                assert_in_range(encoder_buffer, 0, 19);
+                if (index == V4L_MAX_OUT_BUFS || in_queued_count == 0) {
+                    pthread_mutex_unlock(&encoder_mutex);
+                    return wrap_wait_buffer();
+                }
+                struct v4l2_buffer *in_buf = in_queued + in_queued_head;
+                in_queued_head = (in_queued_head + 1) % V4L_MAX_IN_BUFS;
+                in_queued_count--;
+                in_encoded[(in_encoded_head + in_encoded_count++) % V4L_MAX_IN_BUFS] =
+                    in_buf->index;
+                buf->timestamp = in_buf->timestamp;
+                int file = encoder_buffer++;
+                pthread_mutex_unlock(&encoder_mutex);
+                assert_in_range(file, 0, 19);
 
                 size_t read = 0;
                 //CALL(getcwd(buffer, MAX_STRING));
                 //fprintf(stderr, "current directory: %s\n", buffer);
-                sprintf(buffer, VIDEO_PATH"/data%d.bin", encoder_buffer++);
+                sprintf(buffer, VIDEO_PATH"/data%d.bin", file);
                 //fprintf(stderr, "path: %s\n", buffer);
                 CALL(utils_fill_buffer(
                     buffer,
-                    buffers[V4L_MAX_IN_BUFS + index],
+                    buffers[WRAP_IN_PLANES + index],
                     encoder_width * encoder_height,
                     &read
                 ));
 
-                char* t = (char*)buffers[V4L_MAX_IN_BUFS + index];
+                char* t = (char*)buffers[WRAP_IN_PLANES + index];
                 TEST_DEBUG("File has been loaded: %d, %x %x %x %x ...",
-                    V4L_MAX_IN_BUFS + index,
+                    WRAP_IN_PLANES + index,
                     t[0],
                     t[1],
                     t[2],
@@ -226,12 +335,22 @@ int __wrap_v4l2_ioctl(int fd, int request, void * arg)
     return -1;
 }
 
+#if defined(V4L_WRAP)
+void *test_v4l_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int test_v4l_munmap(void *addr, size_t length);
+#endif
+
 void * __wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-    int index = (fd >= 20)? V4L_MAX_IN_BUFS + (fd - 20): (fd - 10);
+#if defined(V4L_WRAP)
+    if (fd == 1)
+        return test_v4l_mmap(addr, length, prot, flags, fd, offset);
+#endif
+    int index = (fd >= 20)? WRAP_IN_PLANES + (fd - 20):
+        (fd - 10) * 3 + offset / (encoder_width * encoder_height);
     WRAP_DEBUG("mmap, index: %d", index);
     assert_int_equal(length, encoder_width * encoder_height);
-    assert_in_range(index, 0, V4L_MAX_IN_BUFS + V4L_MAX_OUT_BUFS);
+    assert_in_range(index, 0, WRAP_IN_PLANES + V4L_MAX_OUT_BUFS - 1);
     if (buffers[index] == NULL)
         buffers[index] = malloc(encoder_width * encoder_height);
     assert_ptr_not_equal(buffers[index], NULL);
@@ -241,8 +360,12 @@ void * __wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t
 void * __wrap_munmap(void *addr, size_t length)
 {
     assert_ptr_not_equal(addr, NULL);
+#if defined(V4L_WRAP)
+    if (test_v4l_munmap(addr, length) == 0)
+        return NULL;
+#endif
     void** buffer = NULL;
-    for (int i = 0; i < V4L_MAX_IN_BUFS + V4L_MAX_OUT_BUFS; i++)
+    for (int i = 0; i < WRAP_IN_PLANES + V4L_MAX_OUT_BUFS; i++)
         if (buffers[i] == addr)
             buffer = buffers + i;
 
@@ -260,8 +383,8 @@ int __wrap_NvBufferMemSyncForDevice(int fd, unsigned int plane, void **addr)
     if (fd >= 10 && fd < 20) // ignores input buffers
         return 0;
 
-    int index = (fd >= 20)? V4L_MAX_IN_BUFS + (fd - 20): (fd - 10);
-    assert_in_range(index, 0, V4L_MAX_IN_BUFS + V4L_MAX_OUT_BUFS);
+    int index = WRAP_IN_PLANES + (fd - 20);
+    assert_in_range(index, WRAP_IN_PLANES, WRAP_IN_PLANES + V4L_MAX_OUT_BUFS - 1);
     assert_ptr_not_equal(buffers[index], NULL);
 
     char* t = (char*)buffers[index];
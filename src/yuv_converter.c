@@ -1,12 +1,14 @@
 #include "main.h"
 #include "utils.h"
+#include "frame.h"
+#include "yuv_kernels.h"
 
 #include "yuv_converter.h"
 
 static struct format_mapping_t yuv_input_formats[] = {
     {
-        .format = VIDEO_FORMAT_YUV422,
-        .internal_format = VIDEO_FORMAT_YUV422,
+        .format = VIDEO_FORMAT_YUYV,
+        .internal_format = VIDEO_FORMAT_YUYV,
         .is_supported = 1
     }
 };
@@ -15,39 +17,59 @@ static struct format_mapping_t yuv_output_formats[] = {
         .format = VIDEO_FORMAT_YUV444,
         .internal_format = VIDEO_FORMAT_YUV444,
         .is_supported = 1
+    },
+    {
+        .format = VIDEO_FORMAT_YUV422,
+        .internal_format = VIDEO_FORMAT_YUV422,
+        .is_supported = 1
+    },
+    {
+        .format = VIDEO_FORMAT_I420,
+        .internal_format = VIDEO_FORMAT_I420,
+        .is_supported = 1
+    },
+    {
+        .format = VIDEO_FORMAT_NV12,
+        .internal_format = VIDEO_FORMAT_NV12,
+        .is_supported = 1
     }
 };
 
 static struct yuv_converter_state_t yuv = {
-    .buffer = NULL,
-    .buffer_length = -1
+    .pool = { .frames = NULL, .frames_count = 0, .data = NULL },
+    .frame = NULL,
+    .out_frame = NULL,
+    .out_format = VIDEO_FORMAT_UNKNOWN
 };
 
+static struct filter_t yuv_filter;
+
 extern struct app_state_t app;
-extern struct filter_t filters[MAX_FILTERS];
+extern filters_t filters;
 
 static void yuv_cleanup()
 {
-    if (yuv.buffer) {
-        free(yuv.buffer);
-        yuv.buffer = NULL;
+    if (yuv.frame) {
+        CALL(frame_unref(yuv.frame));
+        yuv.frame = NULL;
     }
+    if (yuv.out_frame) {
+        CALL(frame_unref(yuv.out_frame));
+        yuv.out_frame = NULL;
+    }
+    frame_pool_cleanup(&yuv.pool);
+    bands_cleanup(&yuv.bands);
 }
 
 static int yuv_init()
 {
-    ASSERT_PTR(yuv.buffer, ==, NULL, cleanup);
+    ASSERT_PTR(yuv.pool.frames, ==, NULL, cleanup);
 
+    // frames can be held by slow consumers, so the pool has as many frames as the input
     int len = app.video_width * app.video_height * 3;
-    uint8_t *data = malloc(len);
-    data = malloc(len);
-    if (data == NULL) {
-        errno = ENOMEM;
-        CALL_MESSAGE(malloc);
-        goto cleanup;
-    }
-    yuv.buffer = data;
-    yuv.buffer_length = len;
+    CALL(frame_pool_init(&yuv.pool, MAX(app.video_buffers, 2), len), cleanup);
+    CALL(yuv_kernels_init(), cleanup);
+    CALL(bands_init(&yuv.bands, app.bands, app.band_threads), cleanup);
     return 0;
 
 cleanup:
@@ -59,32 +81,64 @@ cleanup:
 
 static int yuv_start(int input_format, int output_format)
 {
-    return 0;
+    ASSERT_INT(input_format, ==, VIDEO_FORMAT_YUYV, cleanup);
+    for (int i = 0; i < ARRAY_SIZE(yuv_output_formats); i++) {
+        if (yuv_output_formats[i].format == output_format) {
+            yuv.out_format = output_format;
+            return 0;
+        }
+    }
+
+cleanup:
+    errno = EINVAL;
+    return -1;
 }
 
 static int yuv_is_started()
 {
-    return yuv.buffer != NULL? 1: 0;
+    return yuv.out_format != VIDEO_FORMAT_UNKNOWN? 1: 0;
 }
 
-static int yuv_process_frame(uint8_t *buffer)
+struct yuv_band_t {
+    struct frame_t *in;
+    struct frame_t *out;
+};
+
+static int yuv_process_band(void *data, int y_start, int y_end)
 {
-    ASSERT_PTR(yuv.buffer, !=, NULL, cleanup);
-    int plane = app.video_width * app.video_height;
-    int planes = plane * 2;
-    uint8_t * res = yuv.buffer;
-    for (int i = 0, j = 0; i < planes; i += 4, j += 2) {
-        uint8_t y0 = buffer[i];
-        uint8_t u01 = buffer[i + 1];
-        uint8_t y1 = buffer[i + 2];
-        uint8_t v01 = buffer[i + 3];
-        res[j] = y0;
-        res[j + plane] = u01 & 0xF;
-        res[j + planes] = v01 & 0xF;
-        res[j + 1] = y1;
-        res[j + 1 + plane] = (u01 & 0xF0) >> 4;
-        res[j + 1 + planes] = (v01 & 0xF0) >> 4;
+    struct yuv_band_t *band = data;
+    return yuv_kernels_convert_rows(band->in, band->out, y_start, y_end);
+}
+
+static int yuv_process_frame(struct frame_t *frame)
+{
+    ASSERT_PTR(yuv.pool.frames, !=, NULL, cleanup);
+    if (yuv.frame) {
+        CALL(frame_unref(yuv.frame), cleanup);
+        yuv.frame = NULL;
+    }
+
+    // the buffer of the next filter keeps own layout of planes, e.g. aligned strides
+    struct frame_t *out = yuv.out_frame;
+    yuv.out_frame = NULL;
+    if (out == NULL) {
+        out = frame_pool_get(&yuv.pool);
+        if (out == NULL) {
+            CALL_MESSAGE(frame_pool_get(&yuv.pool));
+            goto cleanup;
+        }
+        frame_set_planes(out, yuv.out_format, frame->width, frame->height);
+    }
+    frame_copy_props(out, frame);
+    // 4:2:0 formats average chroma of pairs of rows
+    int align = yuv.out_format == VIDEO_FORMAT_I420 || yuv.out_format == VIDEO_FORMAT_NV12? 2: 1;
+    struct yuv_band_t band = { .in = frame, .out = out };
+    if (bands_process(&yuv.bands, frame->height, align, yuv_process_band, &band) == -1) {
+        CALL_MESSAGE(bands_process(&yuv.bands, frame->height, align, yuv_process_band, &band));
+        CALL(frame_unref(out));
+        goto cleanup;
     }
+    yuv.frame = out;
     return 0;
 
 cleanup:
@@ -93,16 +147,43 @@ cleanup:
     return -1;
 }
 
+static int yuv_set_out_frame(struct frame_t *frame)
+{
+    ASSERT_INT(frame->format, ==, yuv.out_format, cleanup);
+    ASSERT_INT(frame->width, ==, app.video_width, cleanup);
+    ASSERT_INT(frame->height, ==, app.video_height, cleanup);
+    if (yuv.out_frame)
+        CALL(frame_unref(yuv.out_frame), cleanup);
+    yuv.out_frame = frame_ref(frame);
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EINVAL;
+    return -1;
+}
+
 static int yuv_stop()
 {
+    if (yuv.frame) {
+        CALL(frame_unref(yuv.frame));
+        yuv.frame = NULL;
+    }
+    if (yuv.out_frame) {
+        CALL(frame_unref(yuv.out_frame));
+        yuv.out_frame = NULL;
+    }
+    yuv.out_format = VIDEO_FORMAT_UNKNOWN;
+    bands_print_stats(&yuv.bands, yuv_filter.name);
     return 0;
 }
 
-static uint8_t *yuv_get_buffer(int *out_format, int *length)
+static int yuv_get_frame(struct frame_t **frame)
 {
-    if (out_format)
-        *out_format = yuv_output_formats[0].format;
-    return yuv.buffer;
+    // the reference of the filter is passed to the caller
+    *frame = yuv.frame;
+    yuv.frame = NULL;
+    return 0;
 }
 
 static int yuv_get_in_formats(const struct format_mapping_t *formats[])
@@ -119,25 +200,34 @@ static int yuv_get_out_formats(const struct format_mapping_t *formats[])
     return ARRAY_SIZE(yuv_output_formats);
 }
 
+static int yuv_get_cost(int in_format, int out_format)
+{
+    // reads 2 bytes and writes 3 bytes per pixel for YUV444, 2 bytes for YUV422 and
+    // 1.5 bytes for 4:2:0 formats, bytes are counted by halves
+    int written = 6;
+    if (out_format == VIDEO_FORMAT_YUV422)
+        written = 4;
+    else if (out_format == VIDEO_FORMAT_I420 || out_format == VIDEO_FORMAT_NV12)
+        written = 3;
+    return app.video_width * app.video_height * (4 + written) / 2 * FILTER_COST_BYTE;
+}
+
 void yuv_converter_construct()
 {
-    int i = 0;
-    while (i < MAX_FILTERS && filters[i].context != NULL)
-        i++;
-
-    if (i != MAX_FILTERS) {
-        filters[i].name = "yuv_converter";
-        filters[i].context = &app;
-        filters[i].init = yuv_init;
-        filters[i].cleanup = yuv_cleanup;
-        filters[i].start = yuv_start;
-        filters[i].is_started = yuv_is_started;
-        filters[i].stop = yuv_stop;
-        filters[i].process_frame = yuv_process_frame;
-
-        filters[i].get_buffer = yuv_get_buffer;
-        filters[i].get_in_formats = yuv_get_in_formats;
-        filters[i].get_out_formats = yuv_get_out_formats;
-    }
+    struct filter_t *filter = &yuv_filter;
+    filter->name = "yuv_converter";
+    filter->context = &app;
+    filter->init = yuv_init;
+    filter->cleanup = yuv_cleanup;
+    filter->start = yuv_start;
+    filter->is_started = yuv_is_started;
+    filter->stop = yuv_stop;
+    filter->process_frame = yuv_process_frame;
+    filter->get_frame = yuv_get_frame;
+    filter->get_in_formats = yuv_get_in_formats;
+    filter->get_out_formats = yuv_get_out_formats;
+    filter->get_cost = yuv_get_cost;
+    filter->set_out_frame = yuv_set_out_frame;
+    kv_push(struct filter_t *, filters, filter);
 }
 
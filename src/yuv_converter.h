@@ -1,9 +1,14 @@
 #ifndef yuv_converter_h
 #define yuv_converter_h
 
+#include "bands.h"
+
 struct yuv_converter_state_t {
-    uint8_t *buffer;
-    int buffer_length;
+    struct frame_pool_t pool;
+    struct frame_t *frame;
+    struct frame_t *out_frame;  // the buffer of the next filter for the next frame
+    int out_format;
+    struct bands_t bands;
 };
 
 void yuv_converter_construct();
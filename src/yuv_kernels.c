@@ -0,0 +1,993 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "main.h"
+#include "utils.h"
+#include "frame.h"
+#include "yuv_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    // kernels are compiled with target attributes, so the binary runs on any x86 CPU
+    #define YUV_KERNELS_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define YUV_KERNELS_NEON
+    #if defined(__arm__)
+        #include <sys/auxv.h>
+        #include <asm/hwcap.h>
+    #endif
+#endif
+
+extern struct app_state_t app;
+
+static void yuv_scalar_yuyv_to_yuv422(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    for (int i = 0, j = 0; j < width; i += 4, j += 2) {
+        y[j] = in[i];
+        u[j >> 1] = in[i + 1];
+        y[j + 1] = in[i + 2];
+        v[j >> 1] = in[i + 3];
+    }
+}
+
+static void yuv_scalar_yuyv_to_yuv444(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    for (int i = 0, j = 0; j < width; i += 4, j += 2) {
+        y[j] = in[i];
+        u[j] = u[j + 1] = in[i + 1];
+        y[j + 1] = in[i + 2];
+        v[j] = v[j + 1] = in[i + 3];
+    }
+}
+
+static void yuv_scalar_yuyv_to_i420(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    for (int i = 0, j = 0; j < width; i += 4, j += 2) {
+        y0[j] = in0[i];
+        y0[j + 1] = in0[i + 2];
+        y1[j] = in1[i];
+        y1[j + 1] = in1[i + 2];
+        u[j >> 1] = (in0[i + 1] + in1[i + 1] + 1) >> 1;
+        v[j >> 1] = (in0[i + 3] + in1[i + 3] + 1) >> 1;
+    }
+}
+
+static void yuv_scalar_yuyv_to_nv12(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *uv, uint8_t *v, int width)
+{
+    for (int i = 0, j = 0; j < width; i += 4, j += 2) {
+        y0[j] = in0[i];
+        y0[j + 1] = in0[i + 2];
+        y1[j] = in1[i];
+        y1[j + 1] = in1[i + 2];
+        uv[j] = (in0[i + 1] + in1[i + 1] + 1) >> 1;
+        uv[j + 1] = (in0[i + 3] + in1[i + 3] + 1) >> 1;
+    }
+}
+
+// BT.601 of the limited range by integers which SIMD kernels use too, so all kernels give
+// the same pixels
+static inline void yuv_scalar_to_rgb(int y, int u, int v, int *rgb)
+{
+    int c = 75 * (y - 16) + 32;
+    int d = u - 128;
+    int e = v - 128;
+    rgb[0] = MIN(MAX((c + 102 * e) >> 6, 0), 255);
+    rgb[1] = MIN(MAX((c - 25 * d - 52 * e) >> 6, 0), 255);
+    rgb[2] = MIN(MAX((c + 129 * d) >> 6, 0), 255);
+}
+
+static inline void yuv_scalar_put_pixel(uint8_t *out, const int *rgb,
+    const struct yuv_rgb_format_t *format)
+{
+    uint32_t pixel = ((uint32_t)(rgb[0] * (format->red_max + 1)) >> 8) << format->red_shift |
+        ((uint32_t)(rgb[1] * (format->green_max + 1)) >> 8) << format->green_shift |
+        ((uint32_t)(rgb[2] * (format->blue_max + 1)) >> 8) << format->blue_shift;
+    int bytes = format->bpp >> 3;
+    for (int i = 0; i < bytes; i++)
+        out[i] = pixel >> ((format->is_big_endian? bytes - 1 - i: i) << 3);
+}
+
+static void yuv_scalar_yuyv_to_rgb(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    int bytes = format->bpp >> 3;
+    int rgb[3];
+    for (int i = 0, j = 0; j < width; i += 4, j += 2) {
+        yuv_scalar_to_rgb(in[i], in[i + 1], in[i + 3], rgb);
+        yuv_scalar_put_pixel(out + j * bytes, rgb, format);
+        yuv_scalar_to_rgb(in[i + 2], in[i + 1], in[i + 3], rgb);
+        yuv_scalar_put_pixel(out + (j + 1) * bytes, rgb, format);
+    }
+}
+
+static inline int yuv_scalar_is_changed(const uint8_t *a, const uint8_t *b, int length,
+    int threshold)
+{
+    for (int i = 0; i < length; i++)
+        if (abs(a[i] - b[i]) > threshold)
+            return 1;
+    return 0;
+}
+
+static void yuv_scalar_diff_line(const uint8_t *a, const uint8_t *b, int length,
+    int tile_length, int threshold, uint8_t *tiles)
+{
+    for (int t = 0, i = 0; i < length; t++, i += tile_length)
+        if (!tiles[t])
+            tiles[t] = yuv_scalar_is_changed(a + i, b + i, MIN(tile_length, length - i),
+                threshold);
+}
+
+// continues the run of the first pixel from the given pixel
+static inline int yuv_scalar_continue_run(const uint8_t *pixels, int i, int count, int bytes)
+{
+    while (i < count && memcmp(pixels + i * bytes, pixels, bytes) == 0)
+        i++;
+    return i;
+}
+
+static int yuv_scalar_run_line(const uint8_t *pixels, int count, int bytes)
+{
+    return yuv_scalar_continue_run(pixels, 1, count, bytes);
+}
+
+// the first pixel is repeated to 32 bits, so SIMD kernels compare bytes of whole vectors
+static inline uint32_t yuv_get_run_pattern(const uint8_t *pixels, int bytes)
+{
+    uint32_t pixel = 0;
+    memcpy(&pixel, pixels, bytes);
+    return bytes == 1? pixel * 0x01010101: bytes == 2? pixel * 0x00010001: pixel;
+}
+
+// 32 bit pixels of SIMD kernels are stored in the order of the CPU, which is little endian,
+// so the byte order of the client is the order of shifts
+static inline int yuv_get_rgb32_shift(int shift, const struct yuv_rgb_format_t *format)
+{
+    return format->is_big_endian? 24 - shift: shift;
+}
+
+static int yuv_scalar_is_supported()
+{
+    return 1;
+}
+
+#ifdef YUV_KERNELS_X86
+// splits 16 pixels to Y and words of U | V << 8 for 8 pairs of pixels
+__attribute__((target("sse2")))
+static inline __m128i yuv_sse2_split(const uint8_t *in, __m128i *uv)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i a = _mm_loadu_si128((const __m128i *)in);
+    __m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+    *uv = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    return _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+}
+
+__attribute__((target("sse2")))
+static void yuv_sse2_yuyv_to_yuv422(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i uv;
+        _mm_storeu_si128((__m128i *)(y + x), yuv_sse2_split(in + (x << 1), &uv));
+        __m128i uu = _mm_and_si128(uv, mask);
+        __m128i vv = _mm_srli_epi16(uv, 8);
+        _mm_storel_epi64((__m128i *)(u + (x >> 1)), _mm_packus_epi16(uu, uu));
+        _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_packus_epi16(vv, vv));
+    }
+    yuv_scalar_yuyv_to_yuv422(in + (x << 1), y + x, u + (x >> 1), v + (x >> 1), width - x);
+}
+
+__attribute__((target("sse2")))
+static void yuv_sse2_yuyv_to_yuv444(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i uv;
+        _mm_storeu_si128((__m128i *)(y + x), yuv_sse2_split(in + (x << 1), &uv));
+        __m128i uu = _mm_and_si128(uv, mask);
+        __m128i vv = _mm_srli_epi16(uv, 8);
+        // the byte of the word is copied to its high byte, so both pixels get the chroma
+        _mm_storeu_si128((__m128i *)(u + x), _mm_or_si128(uu, _mm_slli_epi16(uu, 8)));
+        _mm_storeu_si128((__m128i *)(v + x), _mm_or_si128(vv, _mm_slli_epi16(vv, 8)));
+    }
+    yuv_scalar_yuyv_to_yuv444(in + (x << 1), y + x, u + x, v + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void yuv_sse2_yuyv_to_i420(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i uv0, uv1;
+        _mm_storeu_si128((__m128i *)(y0 + x), yuv_sse2_split(in0 + (x << 1), &uv0));
+        _mm_storeu_si128((__m128i *)(y1 + x), yuv_sse2_split(in1 + (x << 1), &uv1));
+        __m128i uv = _mm_avg_epu8(uv0, uv1);
+        __m128i uu = _mm_and_si128(uv, mask);
+        __m128i vv = _mm_srli_epi16(uv, 8);
+        _mm_storel_epi64((__m128i *)(u + (x >> 1)), _mm_packus_epi16(uu, uu));
+        _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_packus_epi16(vv, vv));
+    }
+    yuv_scalar_yuyv_to_i420(in0 + (x << 1), in1 + (x << 1), y0 + x, y1 + x,
+        u + (x >> 1), v + (x >> 1), width - x);
+}
+
+__attribute__((target("sse2")))
+static void yuv_sse2_yuyv_to_nv12(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *uv, uint8_t *v, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i uv0, uv1;
+        _mm_storeu_si128((__m128i *)(y0 + x), yuv_sse2_split(in0 + (x << 1), &uv0));
+        _mm_storeu_si128((__m128i *)(y1 + x), yuv_sse2_split(in1 + (x << 1), &uv1));
+        _mm_storeu_si128((__m128i *)(uv + x), _mm_avg_epu8(uv0, uv1));
+    }
+    yuv_scalar_yuyv_to_nv12(in0 + (x << 1), in1 + (x << 1), y0 + x, y1 + x, uv + x, v,
+        width - x);
+}
+
+// converts 8 pixels to words of components by integers of the scalar kernel, sums saturate
+// only where the component is clamped anyway
+__attribute__((target("sse2")))
+static inline void yuv_sse2_to_rgb(const uint8_t *in, __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    __m128i p = _mm_loadu_si128((const __m128i *)in);
+    __m128i y = _mm_sub_epi16(_mm_and_si128(p, mask), _mm_set1_epi16(16));
+    __m128i uv = _mm_sub_epi16(_mm_srli_epi16(p, 8), _mm_set1_epi16(128));
+    // U and V of the pair are replicated to both pixels
+    __m128i u = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, 0xa0), 0xa0);
+    __m128i v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, 0xf5), 0xf5);
+    __m128i c = _mm_add_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(75)), _mm_set1_epi16(32));
+    __m128i rr = _mm_adds_epi16(c, _mm_mullo_epi16(v, _mm_set1_epi16(102)));
+    __m128i gg = _mm_adds_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(-25))),
+        _mm_mullo_epi16(v, _mm_set1_epi16(-52)));
+    __m128i bb = _mm_adds_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(129)));
+    *r = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(rr, 6), zero), max);
+    *g = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(gg, 6), zero), max);
+    *b = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(bb, 6), zero), max);
+}
+
+__attribute__((target("sse2")))
+static void yuv_sse2_yuyv_to_rgb565(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i r, g, b;
+        yuv_sse2_to_rgb(in + (x << 1), &r, &g, &b);
+        __m128i w = _mm_or_si128(_mm_or_si128(
+            _mm_slli_epi16(_mm_srli_epi16(r, 3), 11),
+            _mm_slli_epi16(_mm_srli_epi16(g, 2), 5)),
+            _mm_srli_epi16(b, 3));
+        if (format->is_big_endian)
+            w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+        _mm_storeu_si128((__m128i *)(out + (x << 1)), w);
+    }
+    yuv_scalar_yuyv_to_rgb(in + (x << 1), out + (x << 1), width - x, format);
+}
+
+__attribute__((target("sse2")))
+static void yuv_sse2_yuyv_to_rgb32(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i rs = _mm_cvtsi32_si128(yuv_get_rgb32_shift(format->red_shift, format));
+    __m128i gs = _mm_cvtsi32_si128(yuv_get_rgb32_shift(format->green_shift, format));
+    __m128i bs = _mm_cvtsi32_si128(yuv_get_rgb32_shift(format->blue_shift, format));
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i r, g, b;
+        yuv_sse2_to_rgb(in + (x << 1), &r, &g, &b);
+        __m128i lo = _mm_or_si128(_mm_or_si128(
+            _mm_sll_epi32(_mm_unpacklo_epi16(r, zero), rs),
+            _mm_sll_epi32(_mm_unpacklo_epi16(g, zero), gs)),
+            _mm_sll_epi32(_mm_unpacklo_epi16(b, zero), bs));
+        __m128i hi = _mm_or_si128(_mm_or_si128(
+            _mm_sll_epi32(_mm_unpackhi_epi16(r, zero), rs),
+            _mm_sll_epi32(_mm_unpackhi_epi16(g, zero), gs)),
+            _mm_sll_epi32(_mm_unpackhi_epi16(b, zero), bs));
+        _mm_storeu_si128((__m128i *)(out + (x << 2)), lo);
+        _mm_storeu_si128((__m128i *)(out + (x << 2) + 16), hi);
+    }
+    yuv_scalar_yuyv_to_rgb(in + (x << 1), out + (x << 2), width - x, format);
+}
+
+// the sample differs if the absolute difference stays above zero after the threshold is
+// subtracted
+__attribute__((target("sse2")))
+static void yuv_sse2_diff_line(const uint8_t *a, const uint8_t *b, int length,
+    int tile_length, int threshold, uint8_t *tiles)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi8((char)threshold);
+    for (int t = 0, i = 0; i < length; t++, i += tile_length) {
+        if (tiles[t])
+            continue;
+        int end = MIN(i + tile_length, length);
+        __m128i changed = zero;
+        int j = i;
+        for (; j + 16 <= end; j += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + j));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + j));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+            changed = _mm_or_si128(changed, _mm_subs_epu8(d, limit));
+        }
+        tiles[t] = _mm_movemask_epi8(_mm_cmpeq_epi8(changed, zero)) != 0xffff ||
+            yuv_scalar_is_changed(a + j, b + j, end - j, threshold);
+    }
+}
+
+// the first byte which differs from the pattern ends the run
+__attribute__((target("sse2")))
+static int yuv_sse2_run_line(const uint8_t *pixels, int count, int bytes)
+{
+    const __m128i pattern = _mm_set1_epi32((int)yuv_get_run_pattern(pixels, bytes));
+    int length = count * bytes;
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(pixels + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, pattern)) ^ 0xffff;
+        if (mask)
+            return (i + __builtin_ctz(mask)) / bytes;
+    }
+    return yuv_scalar_continue_run(pixels, i / bytes, count, bytes);
+}
+
+static int yuv_sse2_is_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+// splits 32 pixels to Y and words of U | V << 8 for 16 pairs of pixels, packing works inside
+// 128 bit lanes, so quadwords are reordered
+__attribute__((target("avx2")))
+static inline __m256i yuv_avx2_split(const uint8_t *in, __m256i *uv)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    __m256i a = _mm256_loadu_si256((const __m256i *)in);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(in + 32));
+    *uv = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xd8);
+    return _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask)), 0xd8);
+}
+
+// packs low bytes of 16 words to 16 bytes
+__attribute__((target("avx2")))
+static inline __m128i yuv_avx2_pack(__m256i words)
+{
+    return _mm256_castsi256_si128(
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0xd8));
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2_yuyv_to_yuv422(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i uv;
+        _mm256_storeu_si256((__m256i *)(y + x), yuv_avx2_split(in + (x << 1), &uv));
+        _mm_storeu_si128((__m128i *)(u + (x >> 1)), yuv_avx2_pack(_mm256_and_si256(uv, mask)));
+        _mm_storeu_si128((__m128i *)(v + (x >> 1)), yuv_avx2_pack(_mm256_srli_epi16(uv, 8)));
+    }
+    yuv_scalar_yuyv_to_yuv422(in + (x << 1), y + x, u + (x >> 1), v + (x >> 1), width - x);
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2_yuyv_to_yuv444(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i uv;
+        _mm256_storeu_si256((__m256i *)(y + x), yuv_avx2_split(in + (x << 1), &uv));
+        __m256i uu = _mm256_and_si256(uv, mask);
+        __m256i vv = _mm256_srli_epi16(uv, 8);
+        _mm256_storeu_si256((__m256i *)(u + x), _mm256_or_si256(uu, _mm256_slli_epi16(uu, 8)));
+        _mm256_storeu_si256((__m256i *)(v + x), _mm256_or_si256(vv, _mm256_slli_epi16(vv, 8)));
+    }
+    yuv_scalar_yuyv_to_yuv444(in + (x << 1), y + x, u + x, v + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2_yuyv_to_i420(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i uv0, uv1;
+        _mm256_storeu_si256((__m256i *)(y0 + x), yuv_avx2_split(in0 + (x << 1), &uv0));
+        _mm256_storeu_si256((__m256i *)(y1 + x), yuv_avx2_split(in1 + (x << 1), &uv1));
+        __m256i uv = _mm256_avg_epu8(uv0, uv1);
+        _mm_storeu_si128((__m128i *)(u + (x >> 1)), yuv_avx2_pack(_mm256_and_si256(uv, mask)));
+        _mm_storeu_si128((__m128i *)(v + (x >> 1)), yuv_avx2_pack(_mm256_srli_epi16(uv, 8)));
+    }
+    yuv_scalar_yuyv_to_i420(in0 + (x << 1), in1 + (x << 1), y0 + x, y1 + x,
+        u + (x >> 1), v + (x >> 1), width - x);
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2_yuyv_to_nv12(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *uv, uint8_t *v, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i uv0, uv1;
+        _mm256_storeu_si256((__m256i *)(y0 + x), yuv_avx2_split(in0 + (x << 1), &uv0));
+        _mm256_storeu_si256((__m256i *)(y1 + x), yuv_avx2_split(in1 + (x << 1), &uv1));
+        _mm256_storeu_si256((__m256i *)(uv + x), _mm256_avg_epu8(uv0, uv1));
+    }
+    yuv_scalar_yuyv_to_nv12(in0 + (x << 1), in1 + (x << 1), y0 + x, y1 + x, uv + x, v,
+        width - x);
+}
+
+// converts 16 pixels to words of components, shuffles of words work inside 128 bit lanes,
+// which have whole pairs of pixels
+__attribute__((target("avx2")))
+static inline void yuv_avx2_to_rgb(const uint8_t *in, __m256i *r, __m256i *g, __m256i *b)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    __m256i p = _mm256_loadu_si256((const __m256i *)in);
+    __m256i y = _mm256_sub_epi16(_mm256_and_si256(p, mask), _mm256_set1_epi16(16));
+    __m256i uv = _mm256_sub_epi16(_mm256_srli_epi16(p, 8), _mm256_set1_epi16(128));
+    __m256i u = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, 0xa0), 0xa0);
+    __m256i v = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, 0xf5), 0xf5);
+    __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(y, _mm256_set1_epi16(75)),
+        _mm256_set1_epi16(32));
+    __m256i rr = _mm256_adds_epi16(c, _mm256_mullo_epi16(v, _mm256_set1_epi16(102)));
+    __m256i gg = _mm256_adds_epi16(
+        _mm256_adds_epi16(c, _mm256_mullo_epi16(u, _mm256_set1_epi16(-25))),
+        _mm256_mullo_epi16(v, _mm256_set1_epi16(-52)));
+    __m256i bb = _mm256_adds_epi16(c, _mm256_mullo_epi16(u, _mm256_set1_epi16(129)));
+    *r = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(rr, 6), zero), max);
+    *g = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(gg, 6), zero), max);
+    *b = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(bb, 6), zero), max);
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2_yuyv_to_rgb565(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i r, g, b;
+        yuv_avx2_to_rgb(in + (x << 1), &r, &g, &b);
+        __m256i w = _mm256_or_si256(_mm256_or_si256(
+            _mm256_slli_epi16(_mm256_srli_epi16(r, 3), 11),
+            _mm256_slli_epi16(_mm256_srli_epi16(g, 2), 5)),
+            _mm256_srli_epi16(b, 3));
+        if (format->is_big_endian)
+            w = _mm256_or_si256(_mm256_slli_epi16(w, 8), _mm256_srli_epi16(w, 8));
+        _mm256_storeu_si256((__m256i *)(out + (x << 1)), w);
+    }
+    yuv_scalar_yuyv_to_rgb(in + (x << 1), out + (x << 1), width - x, format);
+}
+
+// unpacking works inside 128 bit lanes too, so halves of lanes are reordered
+__attribute__((target("avx2")))
+static void yuv_avx2_yuyv_to_rgb32(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m128i rs = _mm_cvtsi32_si128(yuv_get_rgb32_shift(format->red_shift, format));
+    __m128i gs = _mm_cvtsi32_si128(yuv_get_rgb32_shift(format->green_shift, format));
+    __m128i bs = _mm_cvtsi32_si128(yuv_get_rgb32_shift(format->blue_shift, format));
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i r, g, b;
+        yuv_avx2_to_rgb(in + (x << 1), &r, &g, &b);
+        __m256i lo = _mm256_or_si256(_mm256_or_si256(
+            _mm256_sll_epi32(_mm256_unpacklo_epi16(r, zero), rs),
+            _mm256_sll_epi32(_mm256_unpacklo_epi16(g, zero), gs)),
+            _mm256_sll_epi32(_mm256_unpacklo_epi16(b, zero), bs));
+        __m256i hi = _mm256_or_si256(_mm256_or_si256(
+            _mm256_sll_epi32(_mm256_unpackhi_epi16(r, zero), rs),
+            _mm256_sll_epi32(_mm256_unpackhi_epi16(g, zero), gs)),
+            _mm256_sll_epi32(_mm256_unpackhi_epi16(b, zero), bs));
+        _mm256_storeu_si256((__m256i *)(out + (x << 2)),
+            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + (x << 2) + 32),
+            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    yuv_scalar_yuyv_to_rgb(in + (x << 1), out + (x << 2), width - x, format);
+}
+
+__attribute__((target("avx2")))
+static void yuv_avx2_diff_line(const uint8_t *a, const uint8_t *b, int length,
+    int tile_length, int threshold, uint8_t *tiles)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i limit = _mm256_set1_epi8((char)threshold);
+    for (int t = 0, i = 0; i < length; t++, i += tile_length) {
+        if (tiles[t])
+            continue;
+        int end = MIN(i + tile_length, length);
+        __m256i changed = zero;
+        int j = i;
+        for (; j + 32 <= end; j += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(a + j));
+            __m256i y = _mm256_loadu_si256((const __m256i *)(b + j));
+            __m256i d = _mm256_or_si256(_mm256_subs_epu8(x, y), _mm256_subs_epu8(y, x));
+            changed = _mm256_or_si256(changed, _mm256_subs_epu8(d, limit));
+        }
+        tiles[t] = !_mm256_testz_si256(changed, changed) ||
+            yuv_scalar_is_changed(a + j, b + j, end - j, threshold);
+    }
+}
+
+__attribute__((target("avx2")))
+static int yuv_avx2_run_line(const uint8_t *pixels, int count, int bytes)
+{
+    const __m256i pattern = _mm256_set1_epi32((int)yuv_get_run_pattern(pixels, bytes));
+    int length = count * bytes;
+    int i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(pixels + i));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, pattern));
+        if (mask)
+            return (i + __builtin_ctz(mask)) / bytes;
+    }
+    return yuv_scalar_continue_run(pixels, i / bytes, count, bytes);
+}
+
+static int yuv_avx2_is_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif //YUV_KERNELS_X86
+
+#ifdef YUV_KERNELS_NEON
+// 32 pixels per iteration, the structured load splits Y0, U, Y1 and V into registers
+static void yuv_neon_yuyv_to_yuv422(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t p = vld4q_u8(in + (x << 1));
+        uint8x16x2_t yy = { { p.val[0], p.val[2] } };
+        vst2q_u8(y + x, yy);
+        vst1q_u8(u + (x >> 1), p.val[1]);
+        vst1q_u8(v + (x >> 1), p.val[3]);
+    }
+    yuv_scalar_yuyv_to_yuv422(in + (x << 1), y + x, u + (x >> 1), v + (x >> 1), width - x);
+}
+
+static void yuv_neon_yuyv_to_yuv444(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v,
+    int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t p = vld4q_u8(in + (x << 1));
+        uint8x16x2_t yy = { { p.val[0], p.val[2] } };
+        uint8x16x2_t uu = { { p.val[1], p.val[1] } };
+        uint8x16x2_t vv = { { p.val[3], p.val[3] } };
+        vst2q_u8(y + x, yy);
+        vst2q_u8(u + x, uu);
+        vst2q_u8(v + x, vv);
+    }
+    yuv_scalar_yuyv_to_yuv444(in + (x << 1), y + x, u + x, v + x, width - x);
+}
+
+static void yuv_neon_yuyv_to_i420(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *u, uint8_t *v, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t p0 = vld4q_u8(in0 + (x << 1));
+        uint8x16x4_t p1 = vld4q_u8(in1 + (x << 1));
+        uint8x16x2_t yy0 = { { p0.val[0], p0.val[2] } };
+        uint8x16x2_t yy1 = { { p1.val[0], p1.val[2] } };
+        vst2q_u8(y0 + x, yy0);
+        vst2q_u8(y1 + x, yy1);
+        vst1q_u8(u + (x >> 1), vrhaddq_u8(p0.val[1], p1.val[1]));
+        vst1q_u8(v + (x >> 1), vrhaddq_u8(p0.val[3], p1.val[3]));
+    }
+    yuv_scalar_yuyv_to_i420(in0 + (x << 1), in1 + (x << 1), y0 + x, y1 + x,
+        u + (x >> 1), v + (x >> 1), width - x);
+}
+
+static void yuv_neon_yuyv_to_nv12(const uint8_t *in0, const uint8_t *in1, uint8_t *y0,
+    uint8_t *y1, uint8_t *uv, uint8_t *v, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x4_t p0 = vld4q_u8(in0 + (x << 1));
+        uint8x16x4_t p1 = vld4q_u8(in1 + (x << 1));
+        uint8x16x2_t yy0 = { { p0.val[0], p0.val[2] } };
+        uint8x16x2_t yy1 = { { p1.val[0], p1.val[2] } };
+        uint8x16x2_t uuvv = { {
+            vrhaddq_u8(p0.val[1], p1.val[1]),
+            vrhaddq_u8(p0.val[3], p1.val[3])
+        } };
+        vst2q_u8(y0 + x, yy0);
+        vst2q_u8(y1 + x, yy1);
+        vst2q_u8(uv + x, uuvv);
+    }
+    yuv_scalar_yuyv_to_nv12(in0 + (x << 1), in1 + (x << 1), y0 + x, y1 + x, uv + x, v,
+        width - x);
+}
+
+// converts 8 pixels to bytes of components, the transposition replicates U and V of the pair
+// to both pixels, the narrowing shift clamps components
+static inline void yuv_neon_to_rgb(const uint8_t *in, uint8x8_t *r, uint8x8_t *g, uint8x8_t *b)
+{
+    uint8x8x2_t p = vld2_u8(in);
+    int16x8_t y = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[0])), vdupq_n_s16(16));
+    int16x8_t uv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[1])), vdupq_n_s16(128));
+    int16x8x2_t t = vtrnq_s16(uv, uv);
+    int16x8_t c = vmlaq_n_s16(vdupq_n_s16(32), y, 75);
+    *r = vqshrun_n_s16(vqaddq_s16(c, vmulq_n_s16(t.val[1], 102)), 6);
+    *g = vqshrun_n_s16(vqaddq_s16(vqaddq_s16(c, vmulq_n_s16(t.val[0], -25)),
+        vmulq_n_s16(t.val[1], -52)), 6);
+    *b = vqshrun_n_s16(vqaddq_s16(c, vmulq_n_s16(t.val[0], 129)), 6);
+}
+
+static void yuv_neon_yuyv_to_rgb565(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8_t r, g, b;
+        yuv_neon_to_rgb(in + (x << 1), &r, &g, &b);
+        uint16x8_t w = vorrq_u16(vorrq_u16(
+            vshlq_n_u16(vmovl_u8(vshr_n_u8(r, 3)), 11),
+            vshlq_n_u16(vmovl_u8(vshr_n_u8(g, 2)), 5)),
+            vmovl_u8(vshr_n_u8(b, 3)));
+        uint8x16_t bytes = vreinterpretq_u8_u16(w);
+        if (format->is_big_endian)
+            bytes = vrev16q_u8(bytes);
+        vst1q_u8(out + (x << 1), bytes);
+    }
+    yuv_scalar_yuyv_to_rgb(in + (x << 1), out + (x << 1), width - x, format);
+}
+
+static void yuv_neon_yuyv_to_rgb32(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format)
+{
+    int32x4_t rs = vdupq_n_s32(yuv_get_rgb32_shift(format->red_shift, format));
+    int32x4_t gs = vdupq_n_s32(yuv_get_rgb32_shift(format->green_shift, format));
+    int32x4_t bs = vdupq_n_s32(yuv_get_rgb32_shift(format->blue_shift, format));
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8_t r, g, b;
+        yuv_neon_to_rgb(in + (x << 1), &r, &g, &b);
+        uint16x8_t rw = vmovl_u8(r);
+        uint16x8_t gw = vmovl_u8(g);
+        uint16x8_t bw = vmovl_u8(b);
+        uint32x4_t lo = vorrq_u32(vorrq_u32(
+            vshlq_u32(vmovl_u16(vget_low_u16(rw)), rs),
+            vshlq_u32(vmovl_u16(vget_low_u16(gw)), gs)),
+            vshlq_u32(vmovl_u16(vget_low_u16(bw)), bs));
+        uint32x4_t hi = vorrq_u32(vorrq_u32(
+            vshlq_u32(vmovl_u16(vget_high_u16(rw)), rs),
+            vshlq_u32(vmovl_u16(vget_high_u16(gw)), gs)),
+            vshlq_u32(vmovl_u16(vget_high_u16(bw)), bs));
+        vst1q_u8(out + (x << 2), vreinterpretq_u8_u32(lo));
+        vst1q_u8(out + (x << 2) + 16, vreinterpretq_u8_u32(hi));
+    }
+    yuv_scalar_yuyv_to_rgb(in + (x << 1), out + (x << 2), width - x, format);
+}
+
+static void yuv_neon_diff_line(const uint8_t *a, const uint8_t *b, int length,
+    int tile_length, int threshold, uint8_t *tiles)
+{
+    const uint8x16_t limit = vdupq_n_u8(threshold);
+    for (int t = 0, i = 0; i < length; t++, i += tile_length) {
+        if (tiles[t])
+            continue;
+        int end = MIN(i + tile_length, length);
+        uint8x16_t changed = vdupq_n_u8(0);
+        int j = i;
+        for (; j + 16 <= end; j += 16)
+            changed = vorrq_u8(changed, vcgtq_u8(vabdq_u8(vld1q_u8(a + j), vld1q_u8(b + j)),
+                limit));
+        uint64x2_t mask = vreinterpretq_u64_u8(changed);
+        tiles[t] = (vgetq_lane_u64(mask, 0) | vgetq_lane_u64(mask, 1)) != 0 ||
+            yuv_scalar_is_changed(a + j, b + j, end - j, threshold);
+    }
+}
+
+// the vector which differs from the pattern is left to the scalar loop
+static int yuv_neon_run_line(const uint8_t *pixels, int count, int bytes)
+{
+    const uint8x16_t pattern = vreinterpretq_u8_u32(
+        vdupq_n_u32(yuv_get_run_pattern(pixels, bytes)));
+    int length = count * bytes;
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint64x2_t equal = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(pixels + i), pattern));
+        if ((vgetq_lane_u64(equal, 0) & vgetq_lane_u64(equal, 1)) != UINT64_MAX)
+            break;
+    }
+    return yuv_scalar_continue_run(pixels, i / bytes, count, bytes);
+}
+
+static int yuv_neon_is_supported()
+{
+#if defined(__arm__)
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+    return 1; // NEON is mandatory on aarch64
+#endif
+}
+#endif //YUV_KERNELS_NEON
+
+// the fastest kernels go first
+static struct yuv_kernels_t yuv_kernels[] = {
+#ifdef YUV_KERNELS_X86
+    {
+        .name = "avx2",
+        .is_supported = yuv_avx2_is_supported,
+        .yuyv_to_yuv422 = yuv_avx2_yuyv_to_yuv422,
+        .yuyv_to_yuv444 = yuv_avx2_yuyv_to_yuv444,
+        .yuyv_to_i420 = yuv_avx2_yuyv_to_i420,
+        .yuyv_to_nv12 = yuv_avx2_yuyv_to_nv12,
+        .yuyv_to_rgb565 = yuv_avx2_yuyv_to_rgb565,
+        .yuyv_to_rgb32 = yuv_avx2_yuyv_to_rgb32,
+        .diff_line = yuv_avx2_diff_line,
+        .run_line = yuv_avx2_run_line
+    },
+    {
+        .name = "sse2",
+        .is_supported = yuv_sse2_is_supported,
+        .yuyv_to_yuv422 = yuv_sse2_yuyv_to_yuv422,
+        .yuyv_to_yuv444 = yuv_sse2_yuyv_to_yuv444,
+        .yuyv_to_i420 = yuv_sse2_yuyv_to_i420,
+        .yuyv_to_nv12 = yuv_sse2_yuyv_to_nv12,
+        .yuyv_to_rgb565 = yuv_sse2_yuyv_to_rgb565,
+        .yuyv_to_rgb32 = yuv_sse2_yuyv_to_rgb32,
+        .diff_line = yuv_sse2_diff_line,
+        .run_line = yuv_sse2_run_line
+    },
+#endif
+#ifdef YUV_KERNELS_NEON
+    {
+        .name = "neon",
+        .is_supported = yuv_neon_is_supported,
+        .yuyv_to_yuv422 = yuv_neon_yuyv_to_yuv422,
+        .yuyv_to_yuv444 = yuv_neon_yuyv_to_yuv444,
+        .yuyv_to_i420 = yuv_neon_yuyv_to_i420,
+        .yuyv_to_nv12 = yuv_neon_yuyv_to_nv12,
+        .yuyv_to_rgb565 = yuv_neon_yuyv_to_rgb565,
+        .yuyv_to_rgb32 = yuv_neon_yuyv_to_rgb32,
+        .diff_line = yuv_neon_diff_line,
+        .run_line = yuv_neon_run_line
+    },
+#endif
+    {
+        .name = "scalar",
+        .is_supported = yuv_scalar_is_supported,
+        .yuyv_to_yuv422 = yuv_scalar_yuyv_to_yuv422,
+        .yuyv_to_yuv444 = yuv_scalar_yuyv_to_yuv444,
+        .yuyv_to_i420 = yuv_scalar_yuyv_to_i420,
+        .yuyv_to_nv12 = yuv_scalar_yuyv_to_nv12,
+        .yuyv_to_rgb565 = yuv_scalar_yuyv_to_rgb,
+        .yuyv_to_rgb32 = yuv_scalar_yuyv_to_rgb,
+        .diff_line = yuv_scalar_diff_line,
+        .run_line = yuv_scalar_run_line
+    }
+};
+
+static struct yuv_kernels_t *yuv_current = NULL;
+
+// chooses the fastest kernels which are supported by the CPU
+int yuv_kernels_init()
+{
+    if (yuv_current)
+        return 0;
+
+    for (int i = 0; i < ARRAY_SIZE(yuv_kernels); i++) {
+        if (yuv_kernels[i].is_supported()) {
+            yuv_current = yuv_kernels + i;
+            DEBUG("yuv kernels: %s", yuv_current->name);
+            return 0;
+        }
+    }
+    errno = ENOTSUP;
+    return -1;
+}
+
+int yuv_kernels_set(const char *name)
+{
+    for (int i = 0; i < ARRAY_SIZE(yuv_kernels); i++) {
+        if (strcmp(yuv_kernels[i].name, name) == 0 && yuv_kernels[i].is_supported()) {
+            yuv_current = yuv_kernels + i;
+            return 0;
+        }
+    }
+    errno = ENOTSUP;
+    return -1;
+}
+
+const char *yuv_kernels_get_name()
+{
+    return yuv_current? yuv_current->name: NULL;
+}
+
+// converts rows of the YUYV frame to planes of the frame with the same size, rows of
+// 4:2:0 formats are converted by pairs, so the first row is even
+int yuv_kernels_convert_rows(struct frame_t *in, struct frame_t *out, int y_start, int y_end)
+{
+    ASSERT_INT(in->format, ==, VIDEO_FORMAT_YUYV, cleanup);
+    ASSERT_INT(in->width, ==, out->width, cleanup);
+    ASSERT_INT(in->height, ==, out->height, cleanup);
+    ASSERT_INT(y_start, >=, 0, cleanup);
+    ASSERT_INT(y_end, <=, in->height, cleanup);
+    if (!yuv_current)
+        CALL(yuv_kernels_init(), cleanup);
+
+    yuv_line_t line = NULL;
+    yuv_lines_t lines = NULL;
+    if (out->format == VIDEO_FORMAT_YUV444)
+        line = yuv_current->yuyv_to_yuv444;
+    else if (out->format == VIDEO_FORMAT_YUV422)
+        line = yuv_current->yuyv_to_yuv422;
+    else if (out->format == VIDEO_FORMAT_I420)
+        lines = yuv_current->yuyv_to_i420;
+    else if (out->format == VIDEO_FORMAT_NV12)
+        lines = yuv_current->yuyv_to_nv12;
+
+    if (line) {
+        for (int y = y_start; y < y_end; y++) {
+            line(in->planes[0] + in->strides[0] * y,
+                out->planes[0] + out->strides[0] * y,
+                out->planes[1] + out->strides[1] * y,
+                out->planes[2] + out->strides[2] * y,
+                in->width);
+        }
+    }
+    else {
+        ASSERT_PTR(lines, !=, NULL, cleanup);
+        ASSERT_INT(((y_start | y_end) & 1), ==, 0, cleanup);
+        for (int y = y_start; y < y_end; y += 2) {
+            int c = y >> 1;
+            lines(in->planes[0] + in->strides[0] * y,
+                in->planes[0] + in->strides[0] * (y + 1),
+                out->planes[0] + out->strides[0] * y,
+                out->planes[0] + out->strides[0] * (y + 1),
+                out->planes[1] + out->strides[1] * c,
+                out->planes_count > 2? out->planes[2] + out->strides[2] * c: NULL,
+                in->width);
+        }
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EINVAL;
+    return -1;
+}
+
+int yuv_kernels_convert(struct frame_t *in, struct frame_t *out)
+{
+    return yuv_kernels_convert_rows(in, out, 0, in->height);
+}
+
+static int yuv_is_rgb565(const struct yuv_rgb_format_t *format)
+{
+    return format->bpp == 16 && format->red_max == 31 && format->green_max == 63 &&
+        format->blue_max == 31 && format->red_shift == 11 && format->green_shift == 5 &&
+        format->blue_shift == 0;
+}
+
+// components take whole bytes of the pixel
+static int yuv_is_rgb32(const struct yuv_rgb_format_t *format)
+{
+    int shifts = (1 << format->red_shift) | (1 << format->green_shift) |
+        (1 << format->blue_shift);
+    return format->bpp == 32 && format->red_max == 255 && format->green_max == 255 &&
+        format->blue_max == 255 && (shifts & ~0x01010101) == 0 &&
+        __builtin_popcount(shifts) == 3;
+}
+
+// converts the rectangle of the YUYV frame to pixels of the format, rows of pixels follow
+// each other in the output, the rectangle starts at the pair of pixels
+int yuv_kernels_convert_rgb(struct frame_t *in, int x, int y, int width, int height,
+    const struct yuv_rgb_format_t *format, uint8_t *out)
+{
+    ASSERT_INT(in->format, ==, VIDEO_FORMAT_YUYV, cleanup);
+    ASSERT_INT(((x | width) & 1), ==, 0, cleanup);
+    ASSERT_INT(x + width, <=, in->width, cleanup);
+    ASSERT_INT(y + height, <=, in->height, cleanup);
+    ASSERT_INT((format->bpp == 8 || format->bpp == 16 || format->bpp == 32), ==, 1, cleanup);
+    if (!yuv_current)
+        CALL(yuv_kernels_init(), cleanup);
+
+    rgb_line_t line = yuv_scalar_yuyv_to_rgb;
+    if (yuv_is_rgb565(format))
+        line = yuv_current->yuyv_to_rgb565;
+    else if (yuv_is_rgb32(format))
+        line = yuv_current->yuyv_to_rgb32;
+
+    int stride = width * (format->bpp >> 3);
+    for (int row = y; row < y + height; row++) {
+        line(in->planes[0] + in->strides[0] * row + (x << 1), out, width, format);
+        out += stride;
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EINVAL;
+    return -1;
+}
+
+// marks tiles of frames of the same size which differ, tiles have the given size in pixels,
+// the last ones of rows and columns can be smaller
+int yuv_kernels_compare(struct frame_t *a, struct frame_t *b, int tile_size, int threshold,
+    uint8_t *tiles)
+{
+    ASSERT_INT(a->format, ==, VIDEO_FORMAT_YUYV, cleanup);
+    ASSERT_INT(b->format, ==, VIDEO_FORMAT_YUYV, cleanup);
+    ASSERT_INT(a->width, ==, b->width, cleanup);
+    ASSERT_INT(a->height, ==, b->height, cleanup);
+    if (!yuv_current)
+        CALL(yuv_kernels_init(), cleanup);
+
+    int tiles_x = (a->width + tile_size - 1) / tile_size;
+    int tiles_y = (a->height + tile_size - 1) / tile_size;
+    memset(tiles, 0, tiles_x * tiles_y);
+    for (int row = 0; row < a->height; row++) {
+        yuv_current->diff_line(a->planes[0] + a->strides[0] * row,
+            b->planes[0] + b->strides[0] * row,
+            a->width << 1,
+            tile_size << 1,
+            threshold,
+            tiles + row / tile_size * tiles_x);
+    }
+    return 0;
+
+cleanup:
+    if (errno == 0)
+        errno = EINVAL;
+    return -1;
+}
+
+// counts pixels which repeat the first one, the run has one pixel at least
+int yuv_kernels_run_line(const uint8_t *pixels, int count, int bytes)
+{
+    if (!yuv_current)
+        CALL(yuv_kernels_init(), cleanup);
+    return yuv_current->run_line(pixels, count, bytes);
+
+cleanup:
+    return -1;
+}
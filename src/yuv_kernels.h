@@ -0,0 +1,85 @@
+// Raspidetect
+
+// Copyright (C) 2021 Andrei Klimchuk <andrew.klimchuk@gmail.com>
+
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef yuv_kernels_h
+#define yuv_kernels_h
+
+// converts one line of YUYV to lines of Y, U and V planes, the width is even
+typedef void (*yuv_line_t)(const uint8_t *in, uint8_t *y, uint8_t *u, uint8_t *v, int width);
+
+// converts two lines of YUYV to two lines of Y and one line of chroma which is averaged
+// between the lines, NV12 has interleaved U and V in the line of U
+typedef void (*yuv_lines_t)(const uint8_t *in0, const uint8_t *in1, uint8_t *y0, uint8_t *y1,
+    uint8_t *u, uint8_t *v, int width);
+
+// the true colour pixel of bpp bits in the given byte order, components are scaled to
+// their maximums and shifted
+struct yuv_rgb_format_t {
+    int bpp;
+    int is_big_endian;
+    int red_max;
+    int green_max;
+    int blue_max;
+    int red_shift;
+    int green_shift;
+    int blue_shift;
+};
+
+// converts one line of YUYV to pixels of the format by BT.601 of the limited range, the width
+// is even
+typedef void (*rgb_line_t)(const uint8_t *in, uint8_t *out, int width,
+    const struct yuv_rgb_format_t *format);
+
+// marks tiles of the line which have samples that differ by more than the threshold, the line
+// is split to tiles of the given length, marked tiles aren't compared again
+typedef void (*diff_line_t)(const uint8_t *a, const uint8_t *b, int length, int tile_length,
+    int threshold, uint8_t *tiles);
+
+// counts pixels from the start of the line which repeat the first one, pixels have 1, 2 or 4
+// bytes
+typedef int (*run_line_t)(const uint8_t *pixels, int count, int bytes);
+
+struct yuv_kernels_t {
+    const char *name;
+    int (*is_supported)();
+    // the chroma of a pair of pixels is kept once
+    yuv_line_t yuyv_to_yuv422;
+    // the chroma of a pair of pixels is replicated to both of them
+    yuv_line_t yuyv_to_yuv444;
+    yuv_lines_t yuyv_to_i420;
+    yuv_lines_t yuyv_to_nv12;
+    // RGB565 and 32 bit pixels with 8 bit components, other formats are packed by the scalar
+    // kernel
+    rgb_line_t yuyv_to_rgb565;
+    rgb_line_t yuyv_to_rgb32;
+    diff_line_t diff_line;
+    run_line_t run_line;
+};
+
+int yuv_kernels_init();
+int yuv_kernels_set(const char *name);
+const char *yuv_kernels_get_name();
+int yuv_kernels_convert_rows(struct frame_t *in, struct frame_t *out, int y_start, int y_end);
+int yuv_kernels_convert(struct frame_t *in, struct frame_t *out);
+int yuv_kernels_convert_rgb(struct frame_t *in, int x, int y, int width, int height,
+    const struct yuv_rgb_format_t *format, uint8_t *out);
+int yuv_kernels_compare(struct frame_t *a, struct frame_t *b, int tile_size, int threshold,
+    uint8_t *tiles);
+int yuv_kernels_run_line(const uint8_t *pixels, int count, int bytes);
+
+#endif //yuv_kernels_h